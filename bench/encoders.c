@@ -0,0 +1,517 @@
+// Sweeps every grim encoder setting over live frames and reports size against time.
+//
+// Usage: gripper-bench-encoders [--json] [--runs <n>] [-o <output> | -g <region>]
+//        gripper-bench-encoders [--json] [--runs <n>] --corpus <file.ppm>...
+//
+// grim only encodes what it captures itself, so the frames come from the running compositor.
+// Each setting is captured `--runs` times and the median is reported. The cost of capturing is
+// measured with `-t ppm` (no encoding at all) and subtracted to estimate the encode time.
+// The encoders built into gripper (qoi, png-fast) encode the raw frame in process instead.
+//
+// With `--corpus`, only the encoders built into gripper run, over the given PPM files, so their
+// results can be compared between machines and commits without a compositor.
+
+#define _POSIX_C_SOURCE 200809L
+#define _DEFAULT_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MEMPLUS_IMPLEMENTATION
+#include "memplus.h"
+
+#include "encode.h"
+#include "utils.h"
+
+#define MAX_RUNS 64
+
+// The encoders gripper has built in, they take the raw frame. png-fast is swept over the deflate
+// levels `--budget` picks from.
+static const struct {
+    Imgtype     imgtype;
+    const char *name;
+    uint32_t    level;    // Deflate level, ignored by qoi
+} in_tree_types[] = {
+    { IMGTYPE_QOI, "qoi", 0 },
+    { IMGTYPE_PNG_FAST, "png-fast", 1 },
+    { IMGTYPE_PNG_FAST, "png-fast", 2 },
+    { IMGTYPE_PNG_FAST, "png-fast", 3 },
+    { IMGTYPE_PNG_FAST, "png-fast", 4 },
+};
+
+typedef struct {
+    const char *type;
+    const char *flag;     // Either "-l" or "-q", NULL for none
+    int         level;    // The value passed with `flag`
+} Setting;
+
+typedef struct {
+    size_t   bytes;
+    uint64_t ns;
+    long     max_rss_kb;
+} Sample;
+
+typedef struct {
+    Setting setting;
+    size_t  bytes;
+    double  total_ms;
+    double  encode_ms;
+    double  ratio;         // Raw frame size / encoded size
+    double  mpix_per_s;    // Encode throughput in megapixels per second
+    long    max_rss_kb;
+    bool    pareto;
+} Result;
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+// Runs grim with `setting` and counts the bytes it writes to stdout.
+// If `keep` is not NULL the output is appended to it.
+static bool run_grim(const Setting    *setting,
+                     const char       *target_flag,
+                     const char       *target,
+                     Sample           *sample,
+                     mp_StringBuilder *keep) {
+    char level[16];
+    snprintf(level, sizeof(level), "%d", setting->level);
+
+    const char *argv[16];
+    size_t      argc = 0;
+    argv[argc++]     = "grim";
+    argv[argc++]     = "-t";
+    argv[argc++]     = setting->type;
+    if (setting->flag != NULL) {
+        argv[argc++] = setting->flag;
+        argv[argc++] = level;
+    }
+    if (target != NULL) {
+        argv[argc++] = target_flag;
+        argv[argc++] = target;
+    }
+    argv[argc++] = "-";
+    argv[argc]   = NULL;
+
+    int pipe_fd[2];
+    if (pipe(pipe_fd) == -1) {
+        eprintf("Failed to create pipes: %s\n", strerror(errno));
+        return false;
+    }
+
+    uint64_t begin = now_ns();
+    pid_t    pid   = fork();
+    if (pid == -1) {
+        eprintf("Failed to fork child process: %s\n", strerror(errno));
+        close(pipe_fd[0]);
+        close(pipe_fd[1]);
+        return false;
+    } else if (pid == 0) {
+        close(pipe_fd[0]);
+        dup2(pipe_fd[1], STDOUT_FILENO);
+        close(pipe_fd[1]);
+        execvp(argv[0], (char *const *)argv);
+        eprintf("Failed to run grim: %s\n", strerror(errno));
+        _exit(EXIT_FAILURE);
+    }
+    close(pipe_fd[1]);
+
+    char    buf[64 * 1024];
+    size_t  total = 0;
+    ssize_t n;
+    while ((n = read(pipe_fd[0], buf, sizeof(buf))) > 0) {
+        if (keep != NULL) mp_string_builder_append_n(keep, buf, (size_t)n);
+        total += (size_t)n;
+    }
+    close(pipe_fd[0]);
+
+    int           status;
+    struct rusage usage;
+    if (wait4(pid, &status, 0, &usage) == -1) {
+        eprintf("grim could not terminate: %s\n", strerror(errno));
+        return false;
+    }
+    uint64_t end = now_ns();
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        eprintf("grim failed with -t %s\n", setting->type);
+        return false;
+    }
+
+    sample->bytes      = total;
+    sample->ns         = end - begin;
+    sample->max_rss_kb = usage.ru_maxrss;
+    return true;
+}
+
+static int cmp_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a;
+    uint64_t y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+// Runs `setting` `runs` times and returns the median time, the last size and the peak RSS
+static bool measure(const Setting *setting,
+                    const char    *target_flag,
+                    const char    *target,
+                    size_t         runs,
+                    Sample        *median) {
+    uint64_t times[MAX_RUNS];
+    Sample   sample = { 0 };
+    long     rss    = 0;
+    for (size_t i = 0; i < runs; ++i) {
+        if (!run_grim(setting, target_flag, target, &sample, NULL)) return false;
+        times[i] = sample.ns;
+        if (sample.max_rss_kb > rss) rss = sample.max_rss_kb;
+    }
+    qsort(times, runs, sizeof(times[0]), cmp_u64);
+    median->bytes      = sample.bytes;
+    median->ns         = times[runs / 2];
+    median->max_rss_kb = rss;
+    return true;
+}
+
+// Encodes `frame` with the in-tree `imgtype` at `level` `runs` times, the median time is the
+// encode time. The image is streamed to /dev/null like gripper streams it to the output file.
+static bool encode_runs(const PixelBuffer *frame,
+                        Imgtype            imgtype,
+                        uint32_t           level,
+                        size_t             runs,
+                        Sample            *median) {
+    uint64_t     times[MAX_RUNS];
+    bool         ok       = true;
+    mp_Arena     arena    = mp_arena_new();
+    mp_Allocator alloc    = mp_arena_new_allocator(&arena);
+    int          dev_null = open("/dev/null", O_WRONLY);
+    for (size_t i = 0; i < runs && ok; ++i) {
+        mp_ArenaMark mark  = mp_arena_save(&arena);
+        EncodeOutput out   = encode_output_new(&alloc, dev_null);
+        uint64_t     begin = now_ns();
+        ok                 = encode_frame(frame, imgtype, level, &out);
+        times[i]           = now_ns() - begin;
+        median->bytes      = out.written;
+        mp_arena_restore(&arena, mark);
+    }
+    close(dev_null);
+    mp_arena_free(&arena);
+
+    qsort(times, runs, sizeof(times[0]), cmp_u64);
+    median->ns = times[runs / 2];
+    return ok;
+}
+
+// Runs `encode_runs()` in a child process, so the peak RSS is the one of this setting and not the
+// one of the biggest setting measured before it. Returns false if the frame could not be encoded.
+static bool measure_in_tree(const PixelBuffer *frame,
+                            Imgtype            imgtype,
+                            uint32_t           level,
+                            size_t             runs,
+                            Sample            *median) {
+    int pipe_fd[2];
+    if (pipe(pipe_fd) == -1) {
+        eprintf("Failed to create pipes: %s\n", strerror(errno));
+        return false;
+    }
+
+    pid_t pid = fork();
+    if (pid == -1) {
+        eprintf("Failed to fork child process: %s\n", strerror(errno));
+        close(pipe_fd[0]);
+        close(pipe_fd[1]);
+        return false;
+    } else if (pid == 0) {
+        close(pipe_fd[0]);
+        Sample sample = { 0 };
+        bool   ok     = encode_runs(frame, imgtype, level, runs, &sample) &&
+                  write(pipe_fd[1], &sample, sizeof(sample)) == sizeof(sample);
+        _exit(ok ? EXIT_SUCCESS : EXIT_FAILURE);
+    }
+    close(pipe_fd[1]);
+    Sample  sample;
+    ssize_t n = read(pipe_fd[0], &sample, sizeof(sample));
+    close(pipe_fd[0]);
+
+    int           status;
+    struct rusage usage;
+    if (wait4(pid, &status, 0, &usage) == -1) {
+        eprintf("The encoder could not terminate: %s\n", strerror(errno));
+        return false;
+    }
+    if (n != sizeof(sample) || !WIFEXITED(status) || WEXITSTATUS(status) != 0) return false;
+    *median            = sample;
+    median->max_rss_kb = usage.ru_maxrss;
+    return true;
+}
+
+// Fills `results` with the in-tree encoders over `frame`, `capture_ns` is added to their time.
+// A setting that fails to encode is left out, it would look like a tiny and fast winner otherwise.
+static size_t run_in_tree(const PixelBuffer *frame, size_t runs, uint64_t capture_ns,
+                          size_t raw_bytes, Result *results) {
+    double pixels = (double)frame->width * (double)frame->height;
+    size_t count  = 0;
+    for (size_t i = 0; i < array_len(in_tree_types); ++i) {
+        Sample s;
+        if (!measure_in_tree(frame, in_tree_types[i].imgtype, in_tree_types[i].level, runs, &s)) {
+            eprintf("Failed to encode with %s level %u, it is left out\n",
+                    in_tree_types[i].name,
+                    in_tree_types[i].level);
+            continue;
+        }
+        double encode_ms = (double)s.ns / 1e6;
+        results[count++] = (Result){
+            .setting    = { in_tree_types[i].name, NULL, (int)in_tree_types[i].level },
+            .bytes      = s.bytes,
+            .total_ms   = (double)capture_ns / 1e6 + encode_ms,
+            .encode_ms  = encode_ms,
+            .ratio      = (double)raw_bytes / (double)s.bytes,
+            .mpix_per_s = encode_ms > 0 ? pixels / 1e6 / (encode_ms / 1e3) : 0,
+            .max_rss_kb = s.max_rss_kb,
+        };
+    }
+    return count;
+}
+
+// A result is on the Pareto front if nothing else is both smaller and faster
+static void mark_pareto(Result *results, size_t count) {
+    for (size_t i = 0; i < count; ++i) {
+        results[i].pareto = true;
+        for (size_t j = 0; j < count; ++j) {
+            if (i == j) continue;
+            bool smaller = results[j].bytes <= results[i].bytes;
+            bool faster  = results[j].total_ms <= results[i].total_ms;
+            bool better  = results[j].bytes < results[i].bytes ||
+                          results[j].total_ms < results[i].total_ms;
+            if (smaller && faster && better) {
+                results[i].pareto = false;
+                break;
+            }
+        }
+    }
+}
+
+static void print_results(const Result *results, size_t count, bool json) {
+    if (json) {
+        printf("\"results\":[");
+    } else {
+        printf("%-8s %5s %12s %8s %10s %10s %10s %10s %6s\n",
+               "type",
+               "level",
+               "bytes",
+               "ratio",
+               "total ms",
+               "encode ms",
+               "Mpix/s",
+               "rss KiB",
+               "pareto");
+    }
+
+    for (size_t i = 0; i < count; ++i) {
+        const Result *r = &results[i];
+        if (json) {
+            printf("%s{\"type\":\"%s\",\"level\":%d,\"bytes\":%zu,\"ratio\":%.3f,"
+                   "\"total_ms\":%.3f,\"encode_ms\":%.3f,\"mpix_per_s\":%.2f,"
+                   "\"max_rss_kb\":%ld,\"pareto\":%s}",
+                   i == 0 ? "" : ",",
+                   r->setting.type,
+                   r->setting.level,
+                   r->bytes,
+                   r->ratio,
+                   r->total_ms,
+                   r->encode_ms,
+                   r->mpix_per_s,
+                   r->max_rss_kb,
+                   r->pareto ? "true" : "false");
+        } else {
+            printf("%-8s %5d %12zu %8.2f %10.2f %10.2f %10.1f %10ld %6s\n",
+                   r->setting.type,
+                   r->setting.level,
+                   r->bytes,
+                   r->ratio,
+                   r->total_ms,
+                   r->encode_ms,
+                   r->mpix_per_s,
+                   r->max_rss_kb,
+                   r->pareto ? "*" : "");
+        }
+    }
+
+    if (json) printf("]");
+}
+
+// Prints `str` quoted and escaped as a JSON string
+static void print_json_string(const char *str) {
+    putchar('"');
+    for (const unsigned char *p = (const unsigned char *)str; *p != '\0'; ++p) {
+        if (*p == '"' || *p == '\\') {
+            printf("\\%c", *p);
+        } else if (*p < 0x20) {
+            printf("\\u%04x", *p);
+        } else {
+            putchar(*p);
+        }
+    }
+    putchar('"');
+}
+
+static bool read_file(const char *path, mp_StringBuilder *out) {
+    FILE *file = fopen(path, "rb");
+    if (file == NULL) {
+        eprintf("Failed to open %s: %s\n", path, strerror(errno));
+        return false;
+    }
+    size_t n;
+    do {
+        mp_string_builder_reserve(out, 64 * 1024);
+        n = fread(out->data + out->size, 1, out->capacity - out->size - 1, file);
+        out->size += n;
+    } while (n > 0);
+    bool ok = !ferror(file);
+    fclose(file);
+    if (!ok) eprintf("Failed to read %s\n", path);
+    return ok;
+}
+
+static int run_corpus(char **files, size_t file_count, size_t runs, bool json) {
+    mp_Arena     arena = mp_arena_new();
+    mp_Allocator alloc = mp_arena_new_allocator(&arena);
+
+    if (json) printf("{\"runs\":%zu,\"files\":[", runs);
+    for (size_t f = 0; f < file_count; ++f) {
+        mp_StringBuilder data = mp_string_builder_new(&alloc);
+        PixelBuffer      frame;
+        if (!read_file(files[f], &data)) return EXIT_FAILURE;
+        if (!ppm_parse(data.data, data.size, &frame)) {
+            eprintf("%s is not a binary PPM image\n", files[f]);
+            return EXIT_FAILURE;
+        }
+
+        Result results[array_len(in_tree_types)];
+        size_t count = run_in_tree(&frame, runs, 0, data.size, results);
+        mark_pareto(results, count);
+
+        if (json) {
+            printf("%s{\"path\":", f == 0 ? "" : ",");
+            print_json_string(files[f]);
+            printf(",\"width\":%u,\"height\":%u,", frame.width, frame.height);
+        } else {
+            printf("%sFile: %s (%ux%u), median of %zu runs\n",
+                   f == 0 ? "" : "\n",
+                   files[f],
+                   frame.width,
+                   frame.height,
+                   runs);
+        }
+        print_results(results, count, json);
+        if (json) printf("}");
+        mp_arena_free(&arena);
+    }
+    if (json) printf("]}\n");
+    return EXIT_SUCCESS;
+}
+
+static void bench_usage(const char *prog) {
+    printf("Usage: %s [--json] [--runs <n>] [-o <output> | -g <region>]\n", prog);
+    printf("       %s [--json] [--runs <n>] --corpus <file.ppm>...\n", prog);
+}
+
+int main(int argc, char *argv[]) {
+    bool        json        = false;
+    size_t      runs        = 5;
+    const char *target_flag = NULL;
+    const char *target      = NULL;
+
+    for (int i = 1; i < argc; ++i) {
+        if (streq(argv[i], "--json")) {
+            json = true;
+        } else if (streq(argv[i], "--runs") && i + 1 < argc) {
+            runs = (size_t)strtoul(argv[++i], NULL, 10);
+            if (runs == 0 || runs > MAX_RUNS) {
+                eprintf("--runs: Input a number between 1-%d\n", MAX_RUNS);
+                return EXIT_FAILURE;
+            }
+        } else if ((streq(argv[i], "-o") || streq(argv[i], "-g")) && i + 1 < argc) {
+            target_flag = argv[i];
+            target      = argv[++i];
+        } else if (streq(argv[i], "--corpus") && i + 1 < argc) {
+            return run_corpus(argv + i + 1, (size_t)(argc - i - 1), runs, json);
+        } else {
+            bench_usage(argv[0]);
+            return streq(argv[i], "--help") ? EXIT_SUCCESS : EXIT_FAILURE;
+        }
+    }
+
+    // The raw frame tells us the dimensions and how long capturing alone takes, and it is what
+    // the in-tree encoders encode
+    mp_Arena         arena       = mp_arena_new();
+    mp_Allocator     alloc       = mp_arena_new_allocator(&arena);
+    mp_StringBuilder raw_frame   = mp_string_builder_new(&alloc);
+    Setting          raw_setting = { "ppm", NULL, 0 };
+    Sample           raw         = { 0 };
+    PixelBuffer      frame;
+    if (!run_grim(&raw_setting, target_flag, target, &raw, &raw_frame)) return EXIT_FAILURE;
+    if (!ppm_parse(raw_frame.data, raw_frame.size, &frame)) {
+        eprintf("Failed to read the frame from grim\n");
+        return EXIT_FAILURE;
+    }
+    if (!measure(&raw_setting, target_flag, target, runs, &raw)) return EXIT_FAILURE;
+    double pixels = (double)frame.width * (double)frame.height;
+
+    Setting settings[10 + 9 + 1];
+    size_t  setting_count = 0;
+    for (int level = 0; level <= 9; ++level)
+        settings[setting_count++] = (Setting){ "png", "-l", level };
+    static const int qualities[] = { 10, 30, 50, 60, 70, 80, 90, 95, 100 };
+    for (size_t i = 0; i < array_len(qualities); ++i)
+        settings[setting_count++] = (Setting){ "jpeg", "-q", qualities[i] };
+    settings[setting_count++] = raw_setting;
+
+    Result results[array_len(settings) + array_len(in_tree_types)];
+    for (size_t i = 0; i < setting_count; ++i) {
+        Sample s;
+        if (!measure(&settings[i], target_flag, target, runs, &s)) return EXIT_FAILURE;
+        double total_ms  = (double)s.ns / 1e6;
+        double encode_ms = total_ms - (double)raw.ns / 1e6;
+        if (encode_ms < 0) encode_ms = 0;
+        results[i] = (Result){
+            .setting    = settings[i],
+            .bytes      = s.bytes,
+            .total_ms   = total_ms,
+            .encode_ms  = encode_ms,
+            .ratio      = (double)raw.bytes / (double)s.bytes,
+            .mpix_per_s = encode_ms > 0 ? pixels / 1e6 / (encode_ms / 1e3) : 0,
+            .max_rss_kb = s.max_rss_kb,
+        };
+    }
+    size_t count = setting_count;
+    count += run_in_tree(&frame, runs, raw.ns, raw.bytes, results + count);
+    mark_pareto(results, count);
+
+    if (json) {
+        printf("{\"width\":%u,\"height\":%u,\"runs\":%zu,\"capture_ms\":%.3f,",
+               frame.width,
+               frame.height,
+               runs,
+               (double)raw.ns / 1e6);
+    } else {
+        printf("Frame: %ux%u, capture alone: %.2f ms, median of %zu runs\n",
+               frame.width,
+               frame.height,
+               (double)raw.ns / 1e6,
+               runs);
+    }
+    print_results(results, count, json);
+    if (json) printf("}\n");
+
+    mp_arena_free(&arena);
+    return EXIT_SUCCESS;
+}
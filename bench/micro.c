@@ -0,0 +1,397 @@
+// Micro-benchmarks for memplus.h and the hot helpers in utils.c.
+//
+// Usage: gripper-bench-micro [--json] [--filter <substr>] [--scale <factor>]
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define HAVE_CYCLES 1
+#else
+#define HAVE_CYCLES 0
+#endif
+
+#include "compositors.h"
+#include "memplus.h"
+#include "prog.h"
+#include "snap.h"
+#include "utils.h"
+
+/***********
+ * COUNTING ALLOCATOR
+ ***********/
+
+// Wraps another allocator and counts every call that goes through it
+typedef struct {
+    mp_Allocator *inner;
+    size_t        allocs;
+    size_t        bytes;
+} Counter;
+
+static void *counter_alloc(Counter *self, size_t size) {
+    ++self->allocs;
+    self->bytes += size;
+    return mp_allocator_alloc(self->inner, size);
+}
+
+static void *counter_realloc(Counter *self, void *old_ptr, size_t old_size, size_t new_size) {
+    ++self->allocs;
+    self->bytes += new_size;
+    return mp_allocator_realloc(self->inner, old_ptr, old_size, new_size);
+}
+
+static void *counter_dup(Counter *self, void *data, size_t size) {
+    ++self->allocs;
+    self->bytes += size;
+    return mp_allocator_dup(self->inner, data, size);
+}
+
+/***********
+ * HARNESS
+ ***********/
+
+typedef struct {
+    mp_Arena     arena;
+    mp_Allocator arena_alloc;
+    Counter      counter;
+    mp_Allocator alloc;    // `counter` wrapped as an allocator, this is what `g_alloc` points to
+    uint64_t     rng;
+} Bench;
+
+typedef struct {
+    const char *name;
+    void (*fn)(Bench *bench);
+    size_t iters;    // Iterations at --scale 1
+} BenchCase;
+
+typedef struct {
+    double ns;
+    double cycles;
+    double allocs;
+    double bytes;
+} BenchResult;
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+static uint64_t now_cycles(void) {
+#if HAVE_CYCLES
+    return __rdtsc();
+#else
+    return 0;
+#endif
+}
+
+// xorshift64*, good enough for picking allocation sizes
+static uint64_t rng_next(Bench *bench) {
+    bench->rng ^= bench->rng >> 12;
+    bench->rng ^= bench->rng << 25;
+    bench->rng ^= bench->rng >> 27;
+    return bench->rng * 2685821657736338717u;
+}
+
+// Drops everything allocated so far without touching the counters, the regions stay mapped so
+// the timed loop measures the allocations and not an munmap/mmap per iteration
+static void bench_reset_arena(Bench *bench) {
+    mp_arena_restore(&bench->arena, (mp_ArenaMark){ NULL, 0 });
+}
+
+static BenchResult bench_run(const BenchCase *c, size_t iters) {
+    Bench bench       = { 0 };
+    bench.arena       = mp_arena_new();
+    bench.arena_alloc = mp_arena_new_allocator(&bench.arena);
+    bench.counter     = (Counter){ .inner = &bench.arena_alloc };
+    bench.alloc = mp_allocator_new(&bench.counter, counter_alloc, counter_realloc, counter_dup);
+    bench.rng   = 0x9E3779B97F4A7C15u;
+    g_alloc     = &bench.alloc;
+
+    // Warm up caches and the arena before measuring
+    for (size_t i = 0; i < iters / 10 + 1; ++i)
+        c->fn(&bench);
+    bench_reset_arena(&bench);
+    bench.counter.allocs = 0;
+    bench.counter.bytes  = 0;
+
+    uint64_t ns_begin     = now_ns();
+    uint64_t cycles_begin = now_cycles();
+    for (size_t i = 0; i < iters; ++i)
+        c->fn(&bench);
+    uint64_t cycles_end = now_cycles();
+    uint64_t ns_end     = now_ns();
+
+    BenchResult result = {
+        .ns     = (double)(ns_end - ns_begin) / (double)iters,
+        .cycles = (double)(cycles_end - cycles_begin) / (double)iters,
+        .allocs = (double)bench.counter.allocs / (double)iters,
+        .bytes  = (double)bench.counter.bytes / (double)iters,
+    };
+
+    mp_arena_free(&bench.arena);
+    g_alloc = NULL;
+    return result;
+}
+
+/***********
+ * CASES
+ ***********/
+
+#define ARENA_BATCH 4096
+
+static void bench_arena_alloc_small(Bench *bench) {
+    for (size_t i = 0; i < ARENA_BATCH; ++i) {
+        char *p = mp_allocator_alloc(g_alloc, 16);
+        p[0]    = (char)i;
+    }
+    bench_reset_arena(bench);
+}
+
+static void bench_arena_alloc_uniform(Bench *bench) {
+    for (size_t i = 0; i < ARENA_BATCH; ++i) {
+        size_t size = (size_t)(rng_next(bench) % 256) + 1;
+        char  *p    = mp_allocator_alloc(g_alloc, size);
+        p[0]        = (char)i;
+    }
+    bench_reset_arena(bench);
+}
+
+// Mostly small allocations with the occasional big buffer, like a screenshot run
+static void bench_arena_alloc_mixed(Bench *bench) {
+    for (size_t i = 0; i < ARENA_BATCH; ++i) {
+        uint64_t r    = rng_next(bench);
+        size_t   size = (r % 64 == 0) ? (size_t)(r % (64 * 1024)) + 1 : (size_t)(r % 128) + 1;
+        char    *p    = mp_allocator_alloc(g_alloc, size);
+        p[0]          = (char)i;
+    }
+    bench_reset_arena(bench);
+}
+
+static void bench_arena_realloc_double(Bench *bench) {
+    size_t size = 16;
+    char  *p    = mp_allocator_alloc(g_alloc, size);
+    while (size < 64 * 1024) {
+        p = mp_allocator_realloc(g_alloc, p, size, size * 2);
+        size *= 2;
+    }
+    p[size - 1] = 0;
+    bench_reset_arena(bench);
+}
+
+// Grows a buffer a few bytes at a time, like appending to a string
+static void bench_arena_realloc_append(Bench *bench) {
+    size_t size = 16;
+    char  *p    = mp_allocator_alloc(g_alloc, size);
+    while (size < 4 * 1024) {
+        p = mp_allocator_realloc(g_alloc, p, size, size + 24);
+        size += 24;
+    }
+    p[size - 1] = 0;
+    bench_reset_arena(bench);
+}
+
+// The same chain `grim()` uses to build the grim command line
+static void bench_string_newf_chain(Bench *bench) {
+    mp_String options = mp_string_newf(g_alloc, "-t %s", "png");
+    options           = alloc_strf("%s -s %f", options.cstr, 1.5);
+    options           = alloc_strf("%s -l %d", options.cstr, 9);
+    options           = alloc_strf("%s -c", options.cstr);
+    options           = alloc_strf("%s -o %s", options.cstr, "DP-1");
+    options           = alloc_strf("%s -g \"%s\"", options.cstr, "1920,0 2560x1440");
+    mp_String cmd =
+        alloc_strf("grim %s - > '%s'", options.cstr, "/home/user/Pictures/Screenshots/a.png");
+    if (cmd.size == 0) abort();
+    bench_reset_arena(bench);
+}
+
+// The same command line built with `mp_StringBuilder`
+static void bench_string_builder_chain(Bench *bench) {
+    mp_StringBuilder builder = mp_string_builder_new(g_alloc);
+    mp_string_builder_appendf(&builder, "grim -t %s", "png");
+    mp_string_builder_appendf(&builder, " -s %f", 1.5);
+    mp_string_builder_appendf(&builder, " -l %d", 9);
+    mp_string_builder_append(&builder, " -c");
+    mp_string_builder_appendf(&builder, " -o %s", "DP-1");
+    mp_string_builder_appendf(&builder, " -g \"%s\"", "1920,0 2560x1440");
+    mp_string_builder_appendf(&builder, " - > '%s'", "/home/user/Pictures/Screenshots/a.png");
+    if (mp_string_builder_to_string(&builder).size == 0) abort();
+    bench_reset_arena(bench);
+}
+
+// Scoped scratch memory: the arena is rolled back instead of freed
+static void bench_arena_mark_scoped(Bench *bench) {
+    mp_ArenaMark mark = mp_arena_save(&bench->arena);
+    for (size_t i = 0; i < 64; ++i) {
+        char *p = mp_allocator_alloc(g_alloc, (size_t)(rng_next(bench) % 256) + 1);
+        p[0]    = (char)i;
+    }
+    mp_arena_restore(&bench->arena, mark);
+}
+
+static void bench_parse_output_format(Bench *bench) {
+    Config config         = { 0 };
+    config.screenshot_dir = "/home/user/Pictures/Screenshots";
+    config.output_format  = "Screenshot_%Y%M%d_%h%m%s_%p%%";
+    config.imgtype        = IMGTYPE_PNG;
+    g_config              = &config;
+    if (!parse_output_format(&config)) abort();
+    g_config = NULL;
+    bench_reset_arena(bench);
+}
+
+static void bench_str2imgtype(Bench *bench) {
+    (void)bench;
+    static const char *strs[] = { "png", "ppm", "jpeg", "jpg", "webp" };
+    for (size_t i = 0; i < array_len(strs); ++i) {
+        volatile Imgtype t = str2imgtype(strs[i]);
+        (void)t;
+    }
+}
+
+static void bench_str2compositor(Bench *bench) {
+    (void)bench;
+    static const char *strs[] = { "Hyprland", "sway", "GNOME", "KDE" };
+    for (size_t i = 0; i < array_len(strs); ++i) {
+        volatile Compositor c = str2compositor(strs[i]);
+        (void)c;
+    }
+}
+
+// Windows scattered over three 4K outputs, most of them covered by others
+static void bench_snap_parse(Bench *bench) {
+    static char windows[400 * 32];
+    if (windows[0] == '\0') {
+        uint64_t rng  = 0x9E3779B97F4A7C15u;
+        size_t   size = 0;
+        for (size_t i = 0; i < 400; ++i) {
+            rng ^= rng >> 12;
+            rng ^= rng << 25;
+            rng ^= rng >> 27;
+            uint64_t r = rng * 2685821657736338717u;
+            size += (size_t)snprintf(windows + size,
+                                     sizeof(windows) - size,
+                                     "%d,%d %dx%d\n",
+                                     (int)(r % 11000),
+                                     (int)(r >> 16 & 2047),
+                                     (int)(200 + (r >> 27) % 1500),
+                                     (int)(150 + (r >> 40) % 1000));
+        }
+    }
+    SnapTargets targets;
+    snap_parse(windows, &targets);
+    bench_reset_arena(bench);
+}
+
+static void bench_run_cmd_discard(Bench *bench) {
+    (void)bench;
+    if (run_cmd("true", NULL, 0) == -1) abort();
+}
+
+static void bench_run_cmd_capture(Bench *bench) {
+    (void)bench;
+    char buf[DEFAULT_OUTPUT_SIZE];
+    if (run_cmd("echo DP-1", buf, sizeof(buf)) == -1) abort();
+}
+
+static const BenchCase cases[] = {
+    { "arena_alloc/small_16",      bench_arena_alloc_small,    2000    },
+    { "arena_alloc/uniform_256",   bench_arena_alloc_uniform,  2000    },
+    { "arena_alloc/mixed_64k",     bench_arena_alloc_mixed,    200     },
+    { "arena_realloc/double",      bench_arena_realloc_double, 20000   },
+    { "arena_realloc/append_24",   bench_arena_realloc_append, 2000    },
+    { "arena_mark/scoped_64",      bench_arena_mark_scoped,    100000  },
+    { "string_newf/grim_chain",    bench_string_newf_chain,    100000  },
+    { "string_builder/grim_chain", bench_string_builder_chain, 100000  },
+    { "parse_output_format",       bench_parse_output_format,  100000  },
+    { "str2imgtype",               bench_str2imgtype,          1000000 },
+    { "str2compositor",            bench_str2compositor,       1000000 },
+    { "snap_parse/400_windows",    bench_snap_parse,           2000    },
+    { "run_cmd/discard",           bench_run_cmd_discard,      200     },
+    { "run_cmd/capture",           bench_run_cmd_capture,      200     },
+};
+
+/***********
+ * MAIN
+ ***********/
+
+static void bench_usage(const char *prog) {
+    printf("Usage: %s [--json] [--filter <substr>] [--scale <factor>]\n", prog);
+}
+
+int main(int argc, char *argv[]) {
+    bool        json   = false;
+    const char *filter = NULL;
+    double      scale  = 1.0;
+
+    for (int i = 1; i < argc; ++i) {
+        if (streq(argv[i], "--json")) {
+            json = true;
+        } else if (streq(argv[i], "--filter") && i + 1 < argc) {
+            filter = argv[++i];
+        } else if (streq(argv[i], "--scale") && i + 1 < argc) {
+            scale = strtod(argv[++i], NULL);
+            if (scale <= 0) {
+                eprintf("--scale: Input a number greater than 0\n");
+                return EXIT_FAILURE;
+            }
+        } else {
+            bench_usage(argv[0]);
+            return streq(argv[i], "--help") ? EXIT_SUCCESS : EXIT_FAILURE;
+        }
+    }
+
+    if (json) {
+        printf("{\"cycles\":%s,\"results\":[", HAVE_CYCLES ? "true" : "false");
+    } else {
+        printf("%-26s %10s %12s %12s %10s %12s\n",
+               "benchmark",
+               "iters",
+               "ns/op",
+               "cycles/op",
+               "allocs/op",
+               "bytes/op");
+    }
+
+    bool first = true;
+    for (size_t i = 0; i < array_len(cases); ++i) {
+        const BenchCase *c = &cases[i];
+        if (filter != NULL && strstr(c->name, filter) == NULL) continue;
+
+        size_t iters = (size_t)((double)c->iters * scale);
+        if (iters == 0) iters = 1;
+        BenchResult r = bench_run(c, iters);
+
+        if (json) {
+            printf("%s{\"name\":\"%s\",\"iters\":%zu,\"ns_per_op\":%.2f,\"cycles_per_op\":%.2f,"
+                   "\"allocs_per_op\":%.2f,\"bytes_per_op\":%.2f}",
+                   first ? "" : ",",
+                   c->name,
+                   iters,
+                   r.ns,
+                   r.cycles,
+                   r.allocs,
+                   r.bytes);
+        } else {
+            printf("%-26s %10zu %12.1f %12.1f %10.2f %12.1f\n",
+                   c->name,
+                   iters,
+                   r.ns,
+                   r.cycles,
+                   r.allocs,
+                   r.bytes);
+        }
+        fflush(stdout);
+        first = false;
+    }
+
+    if (json) printf("]}\n");
+    return EXIT_SUCCESS;
+}
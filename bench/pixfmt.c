@@ -0,0 +1,249 @@
+// Checks every SIMD conversion kernel against the scalar one, then measures their throughput.
+//
+// Usage: gripper-bench-pixfmt [--json] [--verify-only] [--size <W>x<H>]
+//
+// The check covers every source format, both destination formats, both row orders, every row
+// width up to a few SIMD blocks and every (colour, alpha) pair of the premultiplied formats.
+// It exits with a failure on the first mismatch, so a broken kernel fails `meson test --benchmark`.
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "pixfmt.h"
+
+#define VERIFY_MAX_WIDTH 80    // Several blocks of the widest kernel plus every tail length
+#define VERIFY_HEIGHT    3
+
+#define streq(str1, str2) (strcmp(str1, str2) == 0)
+#define eprintf(...)                                                                               \
+    do {                                                                                           \
+        fprintf(stderr, __VA_ARGS__);                                                              \
+    } while (0)
+
+static const PixelFormat dst_formats[] = { PIXFMT_RGB, PIXFMT_RGBA };
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+// xorshift64, good enough to fill test images
+static uint64_t rng_state = 0x9E3779B97F4A7C15u;
+static uint8_t  rng_byte(void) {
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 7;
+    rng_state ^= rng_state << 17;
+    return (uint8_t)(rng_state >> 56);
+}
+
+// Fills `buf` so that roughly half of the 4-pixel blocks are opaque, which takes the fast path of
+// the premultiplied formats, and the rest have random alpha
+static void fill(uint8_t *buf, size_t size, PixelFormat format) {
+    for (size_t i = 0; i < size; ++i) buf[i] = rng_byte();
+    if (pixfmt_bpp(format) != 4) return;
+    for (size_t i = 0; i + 16 <= size; i += 32) {
+        for (size_t j = 3; j < 16; j += 4) buf[i + j] = 255;
+    }
+}
+
+static bool convert_with(PixfmtIsa          isa,
+                         const PixelBuffer *src,
+                         uint8_t           *dst,
+                         size_t             dst_stride,
+                         PixelFormat        dst_format) {
+    if (!pixfmt_set_isa(isa)) return false;
+    pixfmt_convert_rows(src, 0, src->height, dst, dst_stride, dst_format);
+    return true;
+}
+
+static bool compare(PixfmtIsa          isa,
+                    const PixelBuffer *src,
+                    PixelFormat        dst_format,
+                    uint8_t           *expected,
+                    uint8_t           *actual) {
+    size_t dst_stride = src->width * pixfmt_bpp(dst_format);
+    size_t size       = dst_stride * src->height;
+    memset(expected, 0xAA, size);
+    memset(actual, 0x55, size);
+    convert_with(PIXFMT_ISA_SCALAR, src, expected, dst_stride, dst_format);
+    convert_with(isa, src, actual, dst_stride, dst_format);
+    if (memcmp(expected, actual, size) == 0) return true;
+
+    size_t i = 0;
+    while (expected[i] == actual[i]) ++i;
+    eprintf("%s: %s -> %s, %ux%u%s differs at byte %zu: %u instead of %u\n",
+            pixfmt_isa_name(isa),
+            pixfmt_name(src->format),
+            pixfmt_name(dst_format),
+            src->width,
+            src->height,
+            src->y_invert ? " y-inverted" : "",
+            i,
+            actual[i],
+            expected[i]);
+    return false;
+}
+
+static bool verify(PixfmtIsa isa) {
+    static uint8_t src_data[VERIFY_MAX_WIDTH * VERIFY_HEIGHT * 4];
+    static uint8_t expected[VERIFY_MAX_WIDTH * VERIFY_HEIGHT * 4];
+    static uint8_t actual[VERIFY_MAX_WIDTH * VERIFY_HEIGHT * 4];
+
+    for (int format = 0; format < PIXFMT_COUNT; ++format) {
+        for (uint32_t width = 1; width <= VERIFY_MAX_WIDTH; ++width) {
+            size_t stride = width * pixfmt_bpp((PixelFormat)format);
+            fill(src_data, stride * VERIFY_HEIGHT, (PixelFormat)format);
+            for (int y_invert = 0; y_invert <= 1; ++y_invert) {
+                PixelBuffer src = {
+                    .data     = src_data,
+                    .width    = width,
+                    .height   = VERIFY_HEIGHT,
+                    .stride   = stride,
+                    .format   = (PixelFormat)format,
+                    .y_invert = y_invert,
+                };
+                for (size_t d = 0; d < sizeof(dst_formats) / sizeof(dst_formats[0]); ++d) {
+                    if (!compare(isa, &src, dst_formats[d], expected, actual)) return false;
+                }
+            }
+        }
+    }
+
+    // Every colour with every alpha, in both byte orders of the premultiplied formats
+    static uint8_t all_pairs[256 * 256 * 4];
+    static uint8_t all_expected[256 * 256 * 4];
+    static uint8_t all_actual[256 * 256 * 4];
+    static const PixelFormat premultiplied[] = { PIXFMT_ARGB8888, PIXFMT_ABGR8888 };
+    for (size_t i = 0; i < 256 * 256; ++i) {
+        uint8_t c = (uint8_t)(i & 0xFF);
+        uint8_t a = (uint8_t)(i >> 8);
+        // Premultiplied colours are never brighter than alpha, but buggy clients send them anyway
+        all_pairs[i * 4 + 0] = c;
+        all_pairs[i * 4 + 1] = (uint8_t)(255 - c);
+        all_pairs[i * 4 + 2] = c;
+        all_pairs[i * 4 + 3] = a;
+    }
+    for (size_t f = 0; f < 2; ++f) {
+        PixelBuffer src = {
+            .data   = all_pairs,
+            .width  = 256 * 256,
+            .height = 1,
+            .stride = 256 * 256 * 4,
+            .format = premultiplied[f],
+        };
+        if (!compare(isa, &src, PIXFMT_RGBA, all_expected, all_actual)) return false;
+    }
+    return true;
+}
+
+static void bench_usage(const char *prog) {
+    printf("Usage: %s [--json] [--verify-only] [--size <W>x<H>]\n", prog);
+}
+
+int main(int argc, char *argv[]) {
+    bool     json        = false;
+    bool     verify_only = false;
+    uint32_t width       = 3840;
+    uint32_t height      = 2160;
+
+    for (int i = 1; i < argc; ++i) {
+        if (streq(argv[i], "--json")) {
+            json = true;
+        } else if (streq(argv[i], "--verify-only")) {
+            verify_only = true;
+        } else if (streq(argv[i], "--size") && i + 1 < argc) {
+            if (sscanf(argv[++i], "%ux%u", &width, &height) != 2 || width == 0 || height == 0) {
+                eprintf("--size: Expected <W>x<H>\n");
+                return EXIT_FAILURE;
+            }
+        } else {
+            bench_usage(argv[0]);
+            return streq(argv[i], "--help") ? EXIT_SUCCESS : EXIT_FAILURE;
+        }
+    }
+
+    PixfmtIsa best = pixfmt_isa();
+    for (int isa = PIXFMT_ISA_SCALAR + 1; isa < PIXFMT_ISA_COUNT; ++isa) {
+        if (!pixfmt_set_isa((PixfmtIsa)isa)) continue;
+        if (!verify((PixfmtIsa)isa)) return EXIT_FAILURE;
+        if (!json) printf("%s matches scalar\n", pixfmt_isa_name((PixfmtIsa)isa));
+    }
+    if (verify_only) return EXIT_SUCCESS;
+
+    size_t   pixels = (size_t)width * height;
+    uint8_t *src    = malloc(pixels * 4);
+    uint8_t *dst    = malloc(pixels * 4);
+    if (src == NULL || dst == NULL) {
+        eprintf("Failed to allocate a %ux%u frame\n", width, height);
+        return EXIT_FAILURE;
+    }
+
+    if (json) {
+        printf("{\"width\":%u,\"height\":%u,\"best\":\"%s\",\"results\":[",
+               width,
+               height,
+               pixfmt_isa_name(best));
+    } else {
+        printf("Frame: %ux%u, best kernel: %s\n", width, height, pixfmt_isa_name(best));
+        printf("%-12s %-5s %-7s %10s %10s\n", "from", "to", "kernel", "ms", "Mpix/s");
+    }
+
+    bool first = true;
+    for (int format = 0; format < PIXFMT_COUNT; ++format) {
+        fill(src, pixels * pixfmt_bpp((PixelFormat)format), (PixelFormat)format);
+        PixelBuffer buf = {
+            .data   = src,
+            .width  = width,
+            .height = height,
+            .stride = width * pixfmt_bpp((PixelFormat)format),
+            .format = (PixelFormat)format,
+        };
+        for (size_t d = 0; d < sizeof(dst_formats) / sizeof(dst_formats[0]); ++d) {
+            if ((int)dst_formats[d] == format) continue;
+            size_t dst_stride = width * pixfmt_bpp(dst_formats[d]);
+            for (int isa = 0; isa < PIXFMT_ISA_COUNT; ++isa) {
+                if (!pixfmt_set_isa((PixfmtIsa)isa)) continue;
+                // Best of a few runs, the first one also faults the pages in
+                uint64_t best_ns = UINT64_MAX;
+                for (int run = 0; run < 5; ++run) {
+                    uint64_t begin = now_ns();
+                    pixfmt_convert_rows(&buf, 0, height, dst, dst_stride, dst_formats[d]);
+                    uint64_t ns = now_ns() - begin;
+                    if (ns < best_ns) best_ns = ns;
+                }
+                double ms   = (double)best_ns / 1e6;
+                double mpix = (double)pixels / 1e6 / (ms / 1e3);
+                if (json) {
+                    printf("%s{\"from\":\"%s\",\"to\":\"%s\",\"kernel\":\"%s\",\"ms\":%.3f,"
+                           "\"mpix_per_s\":%.1f}",
+                           first ? "" : ",",
+                           pixfmt_name((PixelFormat)format),
+                           pixfmt_name(dst_formats[d]),
+                           pixfmt_isa_name((PixfmtIsa)isa),
+                           ms,
+                           mpix);
+                } else {
+                    printf("%-12s %-5s %-7s %10.3f %10.1f\n",
+                           pixfmt_name((PixelFormat)format),
+                           pixfmt_name(dst_formats[d]),
+                           pixfmt_isa_name((PixfmtIsa)isa),
+                           ms,
+                           mpix);
+                }
+                first = false;
+            }
+        }
+    }
+    if (json) printf("]}\n");
+
+    free(src);
+    free(dst);
+    return EXIT_SUCCESS;
+}
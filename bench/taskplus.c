@@ -0,0 +1,315 @@
+// Checks the scheduler of taskplus.h, then measures what its tasks cost and how a row pass scales.
+//
+// Usage: gripper-bench-taskplus [--json] [--verify-only] [--threads <N>]
+//
+// The check runs every item of many `tp_parallel_for` shapes exactly once, spawns more tasks than
+// a deque holds, and runs a tree of tasks that wait for the tasks they spawn, with and without a
+// pool. It exits with a failure on the first mismatch, so a broken scheduler fails
+// `meson test --benchmark`.
+
+#define _DEFAULT_SOURCE
+
+#define TASKPLUS_IMPLEMENTATION
+#include "taskplus.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define FIB_CHECK   20
+#define FIB_CUTOFF  12    // Subtrees smaller than this are computed in the task itself
+#define SPAWN_TASKS (4 * TP_DEQUE_SIZE)
+#define ROW_WIDTH   3840
+#define ROW_COUNT   2160
+
+#define streq(str1, str2) (strcmp(str1, str2) == 0)
+#define eprintf(...)                                                                               \
+    do {                                                                                           \
+        fprintf(stderr, __VA_ARGS__);                                                              \
+    } while (0)
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+/***********
+ * CHECKS
+ ***********/
+
+typedef struct {
+    _Atomic uint32_t *hits;
+    size_t            grain;
+    _Atomic bool      oversized;    // A range was longer than `grain`
+} Cover;
+
+static void cover_range(void *ctx, size_t begin, size_t end) {
+    Cover *cover = ctx;
+    if (end - begin > cover->grain && cover->grain > 0) atomic_store(&cover->oversized, true);
+    for (size_t i = begin; i < end; ++i) atomic_fetch_add(&cover->hits[i], 1);
+}
+
+// Every item of [begin, end) is run once, and no other
+static bool check_cover(tp_Pool *pool, size_t begin, size_t end, size_t grain) {
+    size_t            size = end + 1;
+    _Atomic uint32_t *hits = calloc(size, sizeof(*hits));
+    Cover             cover = { .hits = hits, .grain = grain };
+    tp_parallel_for(pool, begin, end, grain, cover_range, &cover);
+
+    bool ok = !atomic_load(&cover.oversized);
+    for (size_t i = 0; i < size && ok; ++i) {
+        uint32_t expected = i >= begin && i < end;
+        if (atomic_load(&hits[i]) != expected) {
+            eprintf("parallel_for [%zu, %zu) grain %zu: item %zu run %u times instead of %u\n",
+                    begin,
+                    end,
+                    grain,
+                    i,
+                    atomic_load(&hits[i]),
+                    expected);
+            ok = false;
+        }
+    }
+    if (atomic_load(&cover.oversized)) {
+        eprintf("parallel_for [%zu, %zu): a range is longer than grain %zu\n", begin, end, grain);
+    }
+    free(hits);
+    return ok;
+}
+
+typedef struct {
+    tp_Pool *pool;
+    uint32_t n;
+    uint64_t result;
+} Fib;
+
+static uint64_t fib_serial(uint32_t n) {
+    return n < 2 ? n : fib_serial(n - 1) + fib_serial(n - 2);
+}
+
+// Spawns one half and computes the other, then waits for the half it spawned
+static void fib_task(void *arg) {
+    Fib *fib = arg;
+    if (fib->n < FIB_CUTOFF) {
+        fib->result = fib_serial(fib->n);
+        return;
+    }
+    Fib      left  = { fib->pool, fib->n - 1, 0 };
+    Fib      right = { fib->pool, fib->n - 2, 0 };
+    tp_Group group = tp_group_new();
+    tp_spawn(fib->pool, &group, fib_task, &left);
+    fib_task(&right);
+    tp_group_wait(fib->pool, &group);
+    fib->result = left.result + right.result;
+}
+
+static bool check_fib(tp_Pool *pool, uint32_t n) {
+    Fib fib = { pool, n, 0 };
+    fib_task(&fib);
+    if (fib.result != fib_serial(n)) {
+        eprintf("fib(%u) of the tasks is %lu instead of %lu\n",
+                n,
+                (unsigned long)fib.result,
+                (unsigned long)fib_serial(n));
+        return false;
+    }
+    return true;
+}
+
+typedef struct {
+    tp_Pool          *pool;
+    _Atomic uint32_t *hits;
+} Spawner;
+
+static void hit(void *arg) {
+    atomic_fetch_add((_Atomic uint32_t *)arg, 1);
+}
+
+// Spawns more tasks than the deque of a worker holds, the ones that don't fit are run right away
+static void spawn_many(void *arg) {
+    Spawner *spawner = arg;
+    tp_Group group   = tp_group_new();
+    for (size_t i = 0; i < SPAWN_TASKS; ++i) {
+        tp_spawn_on(spawner->pool, &group, i, hit, &spawner->hits[i]);
+    }
+    tp_group_wait(spawner->pool, &group);
+}
+
+static bool check_spawn(tp_Pool *pool) {
+    _Atomic uint32_t *hits    = calloc(SPAWN_TASKS, sizeof(*hits));
+    Spawner           spawner = { pool, hits };
+    tp_Group          group   = tp_group_new();
+    // Once from a worker, once from this thread
+    tp_spawn(pool, &group, spawn_many, &spawner);
+    tp_group_wait(pool, &group);
+    spawn_many(&spawner);
+
+    bool ok = true;
+    for (size_t i = 0; i < SPAWN_TASKS && ok; ++i) {
+        if (atomic_load(&hits[i]) != 2) {
+            eprintf("spawn: task %zu run %u times instead of 2\n", i, atomic_load(&hits[i]));
+            ok = false;
+        }
+    }
+    free(hits);
+    return ok;
+}
+
+static bool verify(tp_Pool *pool) {
+    static const size_t grains[] = { 0, 1, 3, 64, 1000 };
+    for (size_t g = 0; g < sizeof(grains) / sizeof(grains[0]); ++g) {
+        for (size_t end = 0; end <= 130; ++end) {
+            if (!check_cover(pool, end / 2, end, grains[g])) return false;
+        }
+        if (!check_cover(pool, 7, 100007, grains[g])) return false;
+    }
+    return check_fib(pool, FIB_CHECK) && check_spawn(pool);
+}
+
+/***********
+ * BENCHMARKS
+ ***********/
+
+typedef struct {
+    uint8_t *rows;
+    uint64_t sums[ROW_COUNT];
+} RowPass;
+
+// A filter and a sum per row, roughly what the PNG encoder and the redaction do to a frame
+static void row_pass(void *ctx, size_t begin, size_t end) {
+    RowPass *pass = ctx;
+    for (size_t y = begin; y < end; ++y) {
+        uint8_t *row = pass->rows + y * ROW_WIDTH * 3;
+        uint64_t sum = 0;
+        for (size_t x = ROW_WIDTH * 3 - 1; x >= 3; --x) {
+            row[x] = (uint8_t)(row[x] - row[x - 3]);
+            sum += row[x];
+        }
+        pass->sums[y] = sum;
+    }
+}
+
+static void noop(void *arg) {
+    (void)arg;
+}
+
+typedef struct {
+    const char *name;
+    double      ms;
+} Result;
+
+// The best of a few runs of `fn(pool)`, in ms
+static double best_ms(void (*fn)(tp_Pool *pool, void *ctx), tp_Pool *pool, void *ctx) {
+    uint64_t best = UINT64_MAX;
+    for (int run = 0; run < 5; ++run) {
+        uint64_t begin = now_ns();
+        fn(pool, ctx);
+        uint64_t ns = now_ns() - begin;
+        if (ns < best) best = ns;
+    }
+    return (double)best / 1e6;
+}
+
+static void run_rows(tp_Pool *pool, void *ctx) {
+    tp_parallel_for(pool, 0, ROW_COUNT, 0, row_pass, ctx);
+}
+
+static void run_rows_grain(tp_Pool *pool, void *ctx) {
+    tp_parallel_for(pool, 0, ROW_COUNT, 1, row_pass, ctx);
+}
+
+static void run_spawn(tp_Pool *pool, void *ctx) {
+    (void)ctx;
+    tp_Group group = tp_group_new();
+    for (size_t i = 0; i < 100000; ++i) tp_spawn(pool, &group, noop, NULL);
+    tp_group_wait(pool, &group);
+}
+
+static void run_fib(tp_Pool *pool, void *ctx) {
+    (void)ctx;
+    Fib fib = { pool, 30, 0 };
+    fib_task(&fib);
+}
+
+static void bench_usage(const char *prog) {
+    printf("Usage: %s [--json] [--verify-only] [--threads <N>]\n", prog);
+}
+
+int main(int argc, char *argv[]) {
+    bool   json        = false;
+    bool   verify_only = false;
+    size_t threads     = 0;
+
+    for (int i = 1; i < argc; ++i) {
+        if (streq(argv[i], "--json")) {
+            json = true;
+        } else if (streq(argv[i], "--verify-only")) {
+            verify_only = true;
+        } else if (streq(argv[i], "--threads") && i + 1 < argc) {
+            if (sscanf(argv[++i], "%zu", &threads) != 1 || threads == 0) {
+                eprintf("--threads: Expected a number of threads\n");
+                return EXIT_FAILURE;
+            }
+        } else {
+            bench_usage(argv[0]);
+            return streq(argv[i], "--help") ? EXIT_SUCCESS : EXIT_FAILURE;
+        }
+    }
+
+    tp_Pool *pool = tp_pool_new(&(tp_PoolDesc){ .threads = threads });
+    if (pool == NULL) {
+        eprintf("Failed to start the pool\n");
+        return EXIT_FAILURE;
+    }
+    if (!verify(NULL) || !verify(pool)) return EXIT_FAILURE;
+    if (!json) printf("Scheduler checks pass with %zu threads\n", tp_pool_threads(pool));
+    if (verify_only) {
+        tp_pool_free(pool);
+        return EXIT_SUCCESS;
+    }
+
+    RowPass *pass = malloc(sizeof(*pass));
+    pass->rows    = malloc((size_t)ROW_WIDTH * 3 * ROW_COUNT);
+    if (pass->rows == NULL) {
+        eprintf("Failed to allocate a %ux%u frame\n", ROW_WIDTH, ROW_COUNT);
+        return EXIT_FAILURE;
+    }
+    for (size_t i = 0; i < (size_t)ROW_WIDTH * 3 * ROW_COUNT; ++i) pass->rows[i] = (uint8_t)i;
+
+    // Each one alone, then on the pool
+    Result results[] = {
+        { "rows/serial", best_ms(run_rows, NULL, pass) },
+        { "rows/pool", best_ms(run_rows, pool, pass) },
+        { "rows/pool_grain_1", best_ms(run_rows_grain, pool, pass) },
+        { "spawn_100k/serial", best_ms(run_spawn, NULL, NULL) },
+        { "spawn_100k/pool", best_ms(run_spawn, pool, NULL) },
+        { "fib_30/serial", best_ms(run_fib, NULL, NULL) },
+        { "fib_30/pool", best_ms(run_fib, pool, NULL) },
+    };
+
+    if (json) {
+        printf("{\"threads\":%zu,\"results\":[", tp_pool_threads(pool));
+    } else {
+        printf("%-20s %10s\n", "case", "ms");
+    }
+    for (size_t i = 0; i < sizeof(results) / sizeof(results[0]); ++i) {
+        if (json) {
+            printf("%s{\"name\":\"%s\",\"ms\":%.3f}",
+                   i == 0 ? "" : ",",
+                   results[i].name,
+                   results[i].ms);
+        } else {
+            printf("%-20s %10.3f\n", results[i].name, results[i].ms);
+        }
+    }
+    if (json) printf("]}\n");
+
+    free(pass->rows);
+    free(pass);
+    tp_pool_free(pool);
+    return EXIT_SUCCESS;
+}
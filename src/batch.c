@@ -0,0 +1,529 @@
+#define _DEFAULT_SOURCE
+
+#include "batch.h"
+#include "compositors.h"
+#include "encode.h"
+#include "grim.h"
+#include "prog.h"
+#include "redact.h"
+#include "regions.h"
+#include "taskplus.h"
+#include "trace.h"
+#include "utils.h"
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/param.h>
+#include <time.h>
+#include <unistd.h>
+
+typedef enum {
+    BATCH_DEST_FILE,
+    BATCH_DEST_CLIPBOARD,
+    BATCH_DEST_STDOUT,
+} BatchDest;
+
+typedef struct {
+    size_t      line;           // Where it was read, for the error messages
+    Mode        mode;           // MODE_FULL or MODE_CUSTOM
+    const char *output;         // The output `full` captures, NULL for every output
+    const char *geometry;       // The region `custom` captures
+    Region      region;         // What is captured, in layout coordinates
+    Imgtype     imgtype;
+    const char *path;           // Where BATCH_DEST_FILE saves the image
+    BatchDest   destination;
+    uint32_t    at_ms;          // When the frame is captured, from the start of the batch
+
+    // Set once the frame of the request is captured
+    PixelBuffer      frame;    // Points into the frame of every request taken at `at_ms`
+    int              fd;       // The file of BATCH_DEST_FILE, -1 for the other destinations
+    mp_StringBuilder image;    // The image for the other destinations
+    bool             ok;
+} BatchRequest;
+
+// The requests of one frame, encoded by the threads of the pool. Each thread allocates from its
+// own arena, `g_alloc` is only usable in the main thread.
+typedef struct {
+    BatchRequest **requests;
+    mp_Arena     **arenas;    // The arena of each thread of the pool that encoded an image
+} BatchJob;
+
+// Reads all of `path`, or stdin if it is NULL, as a string
+static char *read_input(const char *path) {
+    int fd = path == NULL ? STDIN_FILENO : open(path, O_RDONLY);
+    if (fd == -1) {
+        eprintf("batch: Failed to open %s: %s\n", path, strerror(errno));
+        return NULL;
+    }
+    mp_StringBuilder input = mp_string_builder_new(g_alloc);
+    ssize_t          bytes = 0;
+    while (true) {
+        mp_string_builder_reserve(&input, 4096);
+        bytes = read(fd, input.data + input.size, input.capacity - input.size - 1);
+        if (bytes > 0) {
+            input.size += (size_t)bytes;
+        } else if (bytes == 0 || errno != EINTR) {
+            break;
+        }
+    }
+    if (fd != STDIN_FILENO) close(fd);
+    if (bytes != 0) {
+        eprintf("batch: Failed to read %s: %s\n", path == NULL ? "stdin" : path, strerror(errno));
+        return NULL;
+    }
+    input.data[input.size] = '\0';
+    return input.data;
+}
+
+// Sets the field `key` of `request`. Both forms of requests go through here.
+static bool request_set(BatchRequest *request, const char *key, const char *value) {
+    if (streq(key, "mode")) {
+        if (streq(value, "full")) {
+            request->mode = MODE_FULL;
+        } else if (streq(value, "custom")) {
+            request->mode = MODE_CUSTOM;
+        } else {
+            eprintf("batch: Line %zu: Mode `%s` can't be batched, use `full` or `custom`\n",
+                    request->line,
+                    value);
+            return false;
+        }
+    } else if (streq(key, "region")) {
+        request->geometry = value;
+    } else if (streq(key, "output")) {
+        request->output = value;
+    } else if (streq(key, "format")) {
+        if ((request->imgtype = str2imgtype(value)) == IMGTYPE_NONE) {
+            eprintf("batch: Line %zu: Invalid format `%s`\n", request->line, value);
+            return false;
+        }
+    } else if (streq(key, "path")) {
+        request->path = value;
+    } else if (streq(key, "destination")) {
+        if (streq(value, "file")) {
+            request->destination = BATCH_DEST_FILE;
+        } else if (streq(value, "clipboard")) {
+            request->destination = BATCH_DEST_CLIPBOARD;
+        } else if (streq(value, "stdout")) {
+            request->destination = BATCH_DEST_STDOUT;
+        } else {
+            eprintf("batch: Line %zu: Destination `%s` is not file, clipboard or stdout\n",
+                    request->line,
+                    value);
+            return false;
+        }
+    } else if (streq(key, "at")) {
+        char         *end = NULL;
+        unsigned long at  = strtoul(value, &end, 10);
+        if (!isdigit((unsigned char)value[0]) || *end != '\0' || at > UINT32_MAX) {
+            eprintf("batch: Line %zu: `at` is not a number of milliseconds\n", request->line);
+            return false;
+        }
+        request->at_ms = (uint32_t)at;
+    } else {
+        eprintf("batch: Line %zu: Unknown field `%s`\n", request->line, key);
+        return false;
+    }
+    return true;
+}
+
+// Reads a JSON string at `*p` and unescapes it in place. Only ASCII `\u` escapes are supported.
+static char *json_string(char **p) {
+    if (**p != '"') return NULL;
+    char *str = ++*p;
+    char *out = str;
+    while (**p != '"') {
+        char c = *(*p)++;
+        if (c == '\0') return NULL;
+        if (c == '\\') {
+            c = *(*p)++;
+            switch (c) {
+                case '"' :
+                case '\\' :
+                case '/' :  break;
+                case 'n' :  c = '\n'; break;
+                case 't' :  c = '\t'; break;
+                case 'u' : {
+                    char *end   = NULL;
+                    char  hex[] = { (*p)[0], (*p)[1], (*p)[2], (*p)[3], '\0' };
+                    long  code  = strtol(hex, &end, 16);
+                    if (end != hex + 4 || code <= 0 || code > 0x7F) return NULL;
+                    c = (char)code;
+                    *p += 4;
+                } break;
+                default : return NULL;
+            }
+        }
+        *out++ = c;
+    }
+    ++*p;
+    *out = '\0';
+    return str;
+}
+
+static void skip_space(char **p) {
+    while (isspace((unsigned char)**p)) ++*p;
+}
+
+// Parses `line`, a flat JSON object of strings, and `at` as a number
+static bool parse_json(char *line, BatchRequest *request) {
+    char *p = line + 1;    // After the '{'
+    skip_space(&p);
+    if (*p == '}') return true;
+    while (true) {
+        char *key = json_string(&p);
+        skip_space(&p);
+        if (key == NULL || *p++ != ':') break;
+        skip_space(&p);
+
+        char *value = NULL;
+        if (isdigit((unsigned char)*p)) {
+            // The number is ended in place after its separator is read, nothing else keeps it
+            value = p;
+            while (isdigit((unsigned char)*p)) ++p;
+            char *end = p;
+            skip_space(&p);
+            char separator = *p++;
+            *end           = '\0';
+            if (!streq(key, "at")) {
+                eprintf("batch: Line %zu: `%s` must be a string\n", request->line, key);
+                return false;
+            }
+            if (!request_set(request, key, value)) return false;
+            if (separator == '}') return true;
+            if (separator != ',') break;
+        } else {
+            if ((value = json_string(&p)) == NULL) break;
+            if (!request_set(request, key, value)) return false;
+            skip_space(&p);
+            char separator = *p++;
+            if (separator == '}') return true;
+            if (separator != ',') break;
+        }
+        skip_space(&p);
+    }
+    eprintf("batch: Line %zu: Invalid JSON, requests are flat objects of strings\n", request->line);
+    return false;
+}
+
+// Returns the next word of `*p`, or the text between a pair of single or double quotes
+static char *next_word(char **p) {
+    while (**p == ' ' || **p == '\t') ++*p;
+    if (**p == '\0') return NULL;
+    char  quote = **p == '"' || **p == '\'' ? *(*p)++ : '\0';
+    char *word  = *p;
+    while (**p != '\0' && (quote ? **p != quote : (**p != ' ' && **p != '\t'))) ++*p;
+    if (**p != '\0') *(*p)++ = '\0';
+    return word;
+}
+
+// Parses `line`, a capture like on the command line: `full` or `custom <region>`, then flags
+static bool parse_words(char *line, BatchRequest *request) {
+    char       *p    = line;
+    const char *mode = next_word(&p);
+    if (!request_set(request, "mode", mode)) return false;
+    if (request->mode == MODE_CUSTOM && (request->geometry = next_word(&p)) == NULL) {
+        eprintf("batch: Line %zu: Unspecified region\n", request->line);
+        return false;
+    }
+
+    for (const char *flag = next_word(&p); flag != NULL; flag = next_word(&p)) {
+        const char *key = NULL;
+        if (streq(flag, "--copy")) {
+            request->destination = BATCH_DEST_CLIPBOARD;
+            continue;
+        } else if (streq(flag, "--stdout")) {
+            request->destination = BATCH_DEST_STDOUT;
+            continue;
+        } else if (streq(flag, "-o")) {
+            key = "output";
+        } else if (streq(flag, "-t")) {
+            key = "format";
+        } else if (streq(flag, "-f")) {
+            key = "path";
+        } else if (streq(flag, "--at")) {
+            key = "at";
+        } else {
+            eprintf("batch: Line %zu: Unknown argument `%s`\n", request->line, flag);
+            return false;
+        }
+        const char *value = next_word(&p);
+        if (value == NULL) {
+            eprintf("batch: Line %zu: %s needs a value\n", request->line, flag);
+            return false;
+        }
+        if (!request_set(request, key, value)) return false;
+    }
+    return true;
+}
+
+// Checks what `request` was given and fills in what it was not
+static bool request_finish(BatchRequest *request) {
+    size_t line = request->line;
+    if (request->mode == MODE_CUSTOM) {
+        if (request->geometry == NULL || !region_parse(request->geometry, &request->region)) {
+            eprintf("batch: Line %zu: Invalid region `%s`\n",
+                    line,
+                    request->geometry == NULL ? "" : request->geometry);
+            return false;
+        }
+    } else if (request->mode == MODE_FULL) {
+        if (request->geometry != NULL) {
+            eprintf("batch: Line %zu: Mode `full` takes no region\n", line);
+            return false;
+        }
+    } else {
+        eprintf("batch: Line %zu: Unspecified mode\n", line);
+        return false;
+    }
+
+    if (request->destination == BATCH_DEST_FILE) {
+        if (request->path == NULL) {
+            eprintf("batch: Line %zu: Unspecified path\n", line);
+            return false;
+        }
+        // Like -f, the extension gives the type unless a profile that shares it was asked for
+        Imgtype type = ext2imgtype(file_ext(request->path));
+        if (request->imgtype == IMGTYPE_NONE ||
+            !streq(imgtype2ext(request->imgtype), file_ext(request->path))) {
+            request->imgtype = type;
+        }
+    }
+    if (request->imgtype == IMGTYPE_NONE) request->imgtype = IMGTYPE_PNG;
+    // The requests are cropped from a raw frame, so only the types gripper encodes can be saved
+    if (request->imgtype == IMGTYPE_PNG) request->imgtype = IMGTYPE_PNG_FAST;
+    if (!encode_in_tree(request->imgtype) && request->imgtype != IMGTYPE_PPM) {
+        eprintf("batch: Line %zu: Type %s can't be batched, use png, qoi or ppm\n",
+                line,
+                imgtype2str(request->imgtype));
+        return false;
+    }
+    return true;
+}
+
+// Parses every request of `input`, one per line. Blank lines and lines starting with '#' are
+// skipped. `requests` has room for a request per line.
+static bool parse_requests(char *input, BatchRequest *requests, size_t *count) {
+    *count             = 0;
+    char  *save        = NULL;
+    size_t line_number = 0;
+    for (char *line = input; line != NULL; line = save) {
+        ++line_number;
+        char *end = strchr(line, '\n');
+        save      = end == NULL ? NULL : end + 1;
+        if (end != NULL) *end = '\0';
+        if (end != NULL && end > line && end[-1] == '\r') end[-1] = '\0';
+
+        while (isspace((unsigned char)*line)) ++line;
+        if (*line == '\0' || *line == '#') continue;
+
+        BatchRequest *request = &requests[*count];
+        *request              = (BatchRequest){
+                         .line    = line_number,
+                         .mode    = MODE_COUNT,
+                         .imgtype = IMGTYPE_NONE,
+                         .fd      = -1,
+        };
+        bool ok = *line == '{' ? parse_json(line, request) : parse_words(line, request);
+        if (!ok || !request_finish(request)) return false;
+        ++*count;
+    }
+    return true;
+}
+
+static int compare_at(const void *a, const void *b) {
+    const BatchRequest *ra = *(const BatchRequest *const *)a;
+    const BatchRequest *rb = *(const BatchRequest *const *)b;
+    if (ra->at_ms != rb->at_ms) return ra->at_ms < rb->at_ms ? -1 : 1;
+    // Keeps the order of the input between the requests taken at the same time
+    return ra->line < rb->line ? -1 : ra->line > rb->line;
+}
+
+static void encode_range(void *ctx, size_t begin, size_t end) {
+    BatchJob *job = ctx;
+    // The images stay in the thread's arena until every image of the frame is saved
+    mp_Arena *arena                             = mp_thread_arena();
+    job->arenas[tp_worker_index(thread_pool())] = arena;
+    mp_Allocator alloc                          = mp_arena_new_allocator(arena);
+    for (size_t i = begin; i < end; ++i) {
+        BatchRequest *request = job->requests[i];
+        if (!request->ok) continue;
+        EncodeOutput output = encode_output_new(&alloc, request->fd);
+        request->ok = encode_frame(&request->frame, request->imgtype, DEFLATE_LEVEL_FAST, &output);
+        request->image = output.buffer;
+    }
+}
+
+// Captures the frame of the `count` requests taken at the same time, crops and saves each one.
+// Returns false if the frame could not be captured.
+static bool batch_group(BatchRequest **requests, size_t count, mp_Arena **arenas, FILE *log) {
+    // Only what the requests cover is captured
+    Region area = requests[0]->region;
+    for (size_t i = 1; i < count; ++i) {
+        const Region *region = &requests[i]->region;
+        int32_t       x1     = MAX(area.x + area.width, region->x + region->width);
+        int32_t       y1     = MAX(area.y + area.height, region->y + region->height);
+        area.x               = MIN(area.x, region->x);
+        area.y               = MIN(area.y, region->y);
+        area.width           = x1 - area.x;
+        area.height          = y1 - area.y;
+    }
+    char *geometry = region_format(&area);
+
+    RedactQuery redaction;
+    bool        redacted = redact_enabled();
+    if (redacted && !redact_start(&redaction, geometry)) return false;
+    mp_StringBuilder ppm = mp_string_builder_new(g_alloc);
+    PixelBuffer      frame;
+    bool             ok = grim_frame(geometry, NULL, &ppm) && ppm_parse(ppm.data, ppm.size, &frame);
+    // Nothing is saved unless it is redacted
+    if (redacted && !redact_finish(&redaction, ok ? &frame : NULL)) return false;
+    if (!ok) return false;
+
+    for (size_t i = 0; i < count; ++i) {
+        BatchRequest *request = requests[i];
+        Rect          rect;
+        region_rect(&request->region, &area, &frame, &rect);    // `area` covers every request
+        rect_crop(&frame, &rect, &request->frame);
+        request->ok = true;
+        if (request->destination != BATCH_DEST_FILE) continue;
+        request->fd = make_parent_dirs(request->path)
+                          ? open(request->path, O_WRONLY | O_CREAT | O_TRUNC, 0666)
+                          : -1;
+        if (request->fd == -1) {
+            eprintf("Failed to open %s: %s\n", request->path, strerror(errno));
+            request->ok = false;
+        }
+    }
+
+    size_t   span_encode = trace_begin("encode");
+    BatchJob job         = { .requests = requests, .arenas = arenas };
+    tp_parallel_for(thread_pool(), 0, count, 1, encode_range, &job);
+    trace_end(span_encode);
+
+    // The images that don't go to a file are written in the order of the input
+    for (size_t i = 0; i < count; ++i) {
+        BatchRequest *request = requests[i];
+        switch (request->destination) {
+            case BATCH_DEST_FILE : {
+                if (request->fd == -1) break;
+                if (close(request->fd) != 0) request->ok = false;
+                if (!request->ok) eprintf("Failed to write to %s\n", request->path);
+            } break;
+            case BATCH_DEST_CLIPBOARD : {
+                request->ok = request->ok &&
+                              run_cmd_input("wl-copy", request->image.data, request->image.size);
+                if (!request->ok) eprintf("Failed to copy the image to the clipboard\n");
+            } break;
+            case BATCH_DEST_STDOUT : {
+                request->ok = request->ok &&
+                              write_all(STDOUT_FILENO, request->image.data, request->image.size);
+                if (!request->ok) eprintf("Failed to write the image to stdout\n");
+            } break;
+        }
+        if (!request->ok) continue;
+        if (request->destination == BATCH_DEST_FILE) {
+            fprintf(log, "Saved to \"%s\"\n", request->path);
+        } else {
+            fprintf(log, "Saved to %s\n",
+                    request->destination == BATCH_DEST_CLIPBOARD ? "clipboard" : "stdout");
+        }
+    }
+    return true;
+}
+
+// Sleeps until `at_us` on the clock of `trace_now_us()`
+static void sleep_until(uint64_t at_us) {
+    uint64_t now = trace_now_us();
+    if (now >= at_us) return;
+    uint64_t        left = at_us - now;
+    struct timespec ts   = {
+          .tv_sec  = (time_t)(left / 1000000),
+          .tv_nsec = (long)(left % 1000000) * 1000,
+    };
+    while (nanosleep(&ts, &ts) == -1 && errno == EINTR) {}
+}
+
+bool batch_run(void) {
+    int result = true;
+
+    size_t span_parse = trace_begin("batch_parse");
+    char  *input      = read_input(g_config->batch_file);
+    if (input == NULL) return false;
+    size_t lines = 1;
+    for (const char *c = input; *c != '\0'; ++c) lines += *c == '\n';
+    BatchRequest *requests = mp_allocator_alloc(g_alloc, lines * sizeof(*requests));
+    size_t        count    = 0;
+    if (!parse_requests(input, requests, &count)) return false;
+    trace_end(span_parse);
+    if (count == 0) {
+        eprintf("batch: No requests\n");
+        return false;
+    }
+
+    // `full` captures the area of its output, which the compositor tells
+    bool full = false;
+    for (size_t i = 0; i < count; ++i) full = full || requests[i].mode == MODE_FULL;
+    if (full) {
+        comp_check_support(g_config->compositor, false);
+        size_t           span_outputs = trace_begin("compositor_query");
+        mp_StringBuilder outputs      = mp_string_builder_new(g_alloc);
+        if (!run_cmd_capture(comp_output_list_cmds[g_config->compositor], &outputs)) {
+            eprintf("Failed to list the outputs\n");
+            return false;
+        }
+        trace_end(span_outputs);
+        for (size_t i = 0; i < count; ++i) {
+            if (requests[i].mode != MODE_FULL) continue;
+            if (!outputs_area(outputs.data, requests[i].output, &requests[i].region)) return false;
+        }
+    }
+
+    // The images are printed instead of the messages if any of them goes to stdout
+    FILE *log = stdout;
+    for (size_t i = 0; i < count; ++i) {
+        if (requests[i].destination == BATCH_DEST_STDOUT) log = stderr;
+    }
+
+    BatchRequest **order = mp_allocator_alloc(g_alloc, count * sizeof(*order));
+    for (size_t i = 0; i < count; ++i) order[i] = &requests[i];
+    qsort(order, count, sizeof(*order), compare_at);
+
+    // Each frame is dropped once its images are saved, only the biggest one is allocated
+    mp_Arena      arena       = mp_arena_new();
+    mp_Allocator  alloc       = mp_arena_new_allocator(&arena);
+    mp_ArenaMark  empty       = mp_arena_save(&arena);
+    mp_Allocator *saved_alloc = g_alloc;
+    size_t        threads     = tp_pool_threads(thread_pool());
+    mp_Arena    **arenas      = mp_allocator_alloc(g_alloc, threads * sizeof(*arenas));
+    memset(arenas, 0, threads * sizeof(*arenas));
+
+    uint64_t begin_us = trace_now_us();
+    g_alloc           = &alloc;
+    for (size_t first = 0; first < count;) {
+        size_t last = first + 1;
+        while (last < count && order[last]->at_ms == order[first]->at_ms) ++last;
+
+        sleep_until(begin_us + (uint64_t)order[first]->at_ms * 1000);
+        if (!batch_group(order + first, last - first, arenas, log)) return_defer(false);
+        for (size_t i = first; i < last; ++i) result = result && order[i]->ok;
+
+        mp_arena_restore(&arena, empty);
+        // The workers wait for the next tasks, their arenas are not in use
+        for (size_t i = 0; i < threads; ++i) {
+            if (arenas[i] != NULL) mp_arena_restore(arenas[i], (mp_ArenaMark){ NULL, 0 });
+        }
+        first = last;
+    }
+
+defer:
+    g_alloc = saved_alloc;
+    for (size_t i = 0; i < threads; ++i) {
+        if (arenas[i] != NULL) mp_arena_free(arenas[i]);
+    }
+    mp_arena_free(&arena);
+    return result;
+}
@@ -0,0 +1,11 @@
+#ifndef BATCH_H
+#define BATCH_H
+
+#include <stdbool.h>
+
+// Runs the requests of mode `batch`, read from `batch_file` or stdin. The requests taken at the
+// same time are cropped from one frame, and their images are encoded in parallel.
+// Returns false if a request could not be read, or if one of them failed.
+bool batch_run(void);
+
+#endif /* ifndef BATCH_H */
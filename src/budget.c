@@ -0,0 +1,143 @@
+#define _DEFAULT_SOURCE
+
+#include "budget.h"
+#include "deflate.h"
+#include "prog.h"
+#include "utils.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#define BUDGET_FNAME   "budget"
+#define BUDGET_MAGIC   0x42505247u    // "GRPB"
+#define BUDGET_VERSION 1u
+
+#define SAMPLE_ROWS 64
+// Only this much of the time left is planned for, encoding takes longer now and then
+#define BUDGET_MARGIN 0.8
+// The weight of the last encode in the cost of its level
+#define BUDGET_ALPHA  0.3
+
+// Frames with few colours, like a terminal or a document, compress differently from photos and
+// gradients even with the same entropy, so they have costs of their own
+enum {
+    CLASS_FEW_COLOURS,
+    CLASS_MANY_COLOURS,
+    CLASS_COUNT,
+};
+
+// The time an encode takes is modelled as `ns * pixels * (1 + entropy)`
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    double   ns[CLASS_COUNT][DEFLATE_LEVEL_MAX + 1];
+    uint32_t count[CLASS_COUNT][DEFLATE_LEVEL_MAX + 1];    // Encodes `ns` is based on
+} BudgetFile;
+
+// Until a level was timed, roughly what it takes on a laptop from the last few years
+static const double default_ns[DEFLATE_LEVEL_MAX + 1] = { 0, 2.5, 3.5, 5.0, 7.0 };
+
+void budget_sample(const PixelBuffer *frame, FrameStats *stats) {
+    uint32_t counts[256]   = { 0 };
+    uint32_t colours[1024] = { 0 };    // Open addressing, a colour is stored plus one
+    uint32_t colour_count  = 0;
+    uint64_t total         = 0;
+    size_t   stride        = (size_t)frame->width * 3;
+    uint32_t rows          = frame->height < SAMPLE_ROWS + 1 ? frame->height : SAMPLE_ROWS + 1;
+
+    // Each sampled row is filtered with the one above, like gripper's PNG encoder does
+    for (uint32_t i = 1; i < rows; ++i) {
+        uint32_t       y     = (uint32_t)((uint64_t)i * (frame->height - 1) / (rows - 1));
+        const uint8_t *row   = frame->data + y * frame->stride;
+        const uint8_t *above = row - frame->stride;
+        for (size_t x = 0; x < stride; ++x) ++counts[(uint8_t)(row[x] - above[x])];
+        total += stride;
+
+        for (size_t x = 0; x < stride && colour_count <= BUDGET_COLOURS; x += 3) {
+            uint32_t colour = (uint32_t)row[x] << 16 | (uint32_t)row[x + 1] << 8 | row[x + 2];
+            uint32_t slot   = (colour * 2654435761u) >> 22;
+            while (colours[slot] != 0 && colours[slot] != colour + 1) slot = (slot + 1) & 1023;
+            if (colours[slot] == 0) {
+                colours[slot] = colour + 1;
+                ++colour_count;
+            }
+        }
+    }
+
+    stats->entropy = 0;
+    for (size_t i = 0; i < 256 && total > 0; ++i) {
+        if (counts[i] == 0) continue;
+        double p = (double)counts[i] / (double)total;
+        stats->entropy -= p * log2(p);
+    }
+    stats->colours = colour_count;
+}
+
+static size_t stats_class(const FrameStats *stats) {
+    return stats->colours <= BUDGET_COLOURS ? CLASS_FEW_COLOURS : CLASS_MANY_COLOURS;
+}
+
+// Reads the timings, or starts from the defaults if there are none yet
+static void budget_load(BudgetFile *file) {
+    *file = (BudgetFile){ .magic = BUDGET_MAGIC, .version = BUDGET_VERSION };
+    for (size_t c = 0; c < CLASS_COUNT; ++c) {
+        memcpy(file->ns[c], default_ns, sizeof(default_ns));
+    }
+
+    const char *path = state_path(BUDGET_FNAME);
+    if (path == NULL) return;
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) return;
+    BudgetFile saved;
+    bool       ok = read(fd, &saved, sizeof(saved)) == sizeof(saved);
+    close(fd);
+    // A file from another version is started over
+    if (ok && saved.magic == BUDGET_MAGIC && saved.version == BUDGET_VERSION) *file = saved;
+}
+
+uint32_t budget_pick(const PixelBuffer *frame, const FrameStats *stats, uint64_t elapsed_us) {
+    BudgetFile file;
+    budget_load(&file);
+
+    double pixels  = (double)frame->width * frame->height;
+    double left_ms = (double)g_config->budget_ms - (double)elapsed_us / 1000.0;
+    size_t class   = stats_class(stats);
+    for (uint32_t level = DEFLATE_LEVEL_MAX; level > DEFLATE_LEVEL_FAST; --level) {
+        double cost_ms = file.ns[class][level] * pixels * (1.0 + stats->entropy) / 1e6;
+        if (cost_ms <= left_ms * BUDGET_MARGIN) {
+            if (g_config->verbose) {
+                printf("Budget: deflate level %u, about %.0f ms of the %.0f ms left\n",
+                       level,
+                       cost_ms,
+                       left_ms);
+            }
+            return level;
+        }
+    }
+    if (g_config->verbose) {
+        printf("Budget: deflate level %u, %.0f ms left\n", DEFLATE_LEVEL_FAST, left_ms);
+    }
+    return DEFLATE_LEVEL_FAST;
+}
+
+bool budget_record(const PixelBuffer *frame,
+                   const FrameStats  *stats,
+                   uint32_t           level,
+                   uint64_t           encode_us) {
+    BudgetFile file;
+    budget_load(&file);
+
+    double  pixels = (double)frame->width * frame->height;
+    size_t  class  = stats_class(stats);
+    double  ns     = (double)encode_us * 1000.0 / (pixels * (1.0 + stats->entropy));
+    double *cost   = &file.ns[class][level];
+    *cost          = file.count[class][level] == 0 ? ns : *cost + BUDGET_ALPHA * (ns - *cost);
+    ++file.count[class][level];
+
+    const char *path = state_path(BUDGET_FNAME);
+    if (path == NULL || !make_parent_dirs(path)) return false;
+    return write_file(path, &file, sizeof(file));
+}
@@ -0,0 +1,31 @@
+#ifndef BUDGET_H
+#define BUDGET_H
+
+#include "pixfmt.h"
+#include <stdbool.h>
+#include <stdint.h>
+
+// Distinct colours are counted up to this many, a frame with more has "many" colours
+#define BUDGET_COLOURS 256
+
+// What a quick look at a sample of the rows of a frame tells about how it compresses
+typedef struct {
+    double   entropy;    // Bits per byte of the rows filtered with Up, 8 for noise
+    uint32_t colours;    // Distinct colours, BUDGET_COLOURS + 1 if there are more
+} FrameStats;
+
+// Samples up to 64 rows of `frame`, a PIXFMT_RGB frame
+void budget_sample(const PixelBuffer *frame, FrameStats *stats);
+
+// Picks the highest deflate level a PNG of `frame` can be encoded at before `--budget` runs out,
+// given that `elapsed_us` are already spent. The cost of each level is estimated from the size
+// and `stats` of the frame, with the timings of the previous encodes.
+uint32_t budget_pick(const PixelBuffer *frame, const FrameStats *stats, uint64_t elapsed_us);
+
+// Adds how long encoding `frame` at `level` took to the timings the next picks are based on
+bool budget_record(const PixelBuffer *frame,
+                   const FrameStats  *stats,
+                   uint32_t           level,
+                   uint64_t           encode_us);
+
+#endif /* ifndef BUDGET_H */
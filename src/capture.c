@@ -1,8 +1,16 @@
 #include "capture.h"
+#include "batch.h"
 #include "compositors.h"
+#include "diff.h"
+#include "encode.h"
 #include "grim.h"
 #include "memplus.h"
 #include "prog.h"
+#include "recompress.h"
+#include "redact.h"
+#include "regions.h"
+#include "snap.h"
+#include "trace.h"
 #include "unistd.h"
 #include "utils.h"
 #include <assert.h>
@@ -12,32 +20,26 @@
 #include <stdlib.h>
 #include <string.h>
 #include <sys/types.h>
+#include <time.h>
 
-// NOTE: replaces last character of `region` into newline
-bool cache_region(char *region, ssize_t nbytes) {
-    if (g_config->no_cache_region) return true;
+bool cache_region(const char *geometry) {
+    if (g_config->no_cache_region && g_config->slot == NULL) return true;
 
-    bool  result            = true;
-    FILE *region_cache_file = NULL;
-
-    if (!make_dir(g_config->cache_dir)) return_defer(false);
-
-    region_cache_file = fopen(g_config->last_region_file, "w+");
-    if (region_cache_file == NULL) {
-        eprintf("Failed to open %s: %s\n", g_config->last_region_file, strerror(errno));
-        return_defer(false);
-    }
-    // bring back the newline before writing the region to the file
-    // because some editors automatically insert newline to the file when you save it
-    region[nbytes - 1] = '\n';
-    if (fputs(region, region_cache_file) < 0) {
-        eprintf("Failed to write to %s\n", g_config->last_region_file);
-        return_defer(false);
+    Region region;
+    if (!region_parse(geometry, &region)) {
+        eprintf("Invalid region format `%s`\n", geometry);
+        return false;
     }
+    region.scale     = g_config->scale;
+    region.timestamp = (int64_t)time(NULL);
+    if (g_config->output_name != NULL)
+        snprintf(region.output, sizeof(region.output), "%s", g_config->output_name);
 
-defer:
-    if (region_cache_file != NULL) fclose(region_cache_file);
-    return result;
+    size_t span_dir = trace_begin("make_dir");
+    if (!make_dir(g_config->cache_dir)) return false;
+    trace_end(span_dir);
+
+    return regions_push(&region, g_config->slot, !g_config->no_cache_region);
 }
 
 bool capture_full(void) {
@@ -46,14 +48,15 @@ bool capture_full(void) {
     return true;
 }
 
-bool capture_region(void) {
-    if (g_config->verbose) printf("*Capturing region*\n");
-
+// Lets the user select a region with slurp, snapping the selection to `targets`
+static char *slurp_select(const SnapTargets *targets) {
     char *region = mp_allocator_alloc(g_alloc, DEFAULT_OUTPUT_SIZE);
 
     if (g_config->verbose) {
         if (comp_supported(g_config->compositor)) {
-            printf("Snap selection to windows is enabled\n");
+            printf("Snap selection to %zu windows, %zu are hidden\n",
+                   targets->count,
+                   targets->hidden);
         } else {
             printf("Snap selection to windows is disabled\n");
         }
@@ -61,28 +64,113 @@ bool capture_region(void) {
 
     const char *slurp_cmd = "slurp -d -b '" SLURP_BG_COLOUR "' -c '" SLURP_BORDER_COLOUR
                             "' -B '" SLURP_OPTION_BOX_COLOUR "' -s '" SLURP_SELECTION_COLOUR "'";
+
+    // slurp reads the windows from a memfd, gripper's stdin is never taken for them
+    char *windows = snap_format(targets);
+    int   memfd   = targets->count > 0 ? memfd_input(windows, strlen(windows)) : -1;
+    if (targets->count > 0 && memfd == -1) {
+        eprintf("Failed to pass the windows to slurp: %s\n", strerror(errno));
+    }
+    const char *cmd = memfd != -1 ? alloc_strf("%s <&%d", slurp_cmd, memfd).cstr
+                                  : alloc_strf("%s </dev/null", slurp_cmd).cstr;
+
+    size_t  span_select = trace_begin("selection");
+    ssize_t bytes       = run_cmd_fd(cmd, region, DEFAULT_OUTPUT_SIZE, memfd);
+    trace_end(span_select);
+    if (memfd != -1) close(memfd);
+    if (bytes <= 0 || region == NULL) {
+        eprintf("Selection cancelled\n");
+        return NULL;
+    }
+    region[bytes - 1] = '\0';    // trim the final newline
+
+    if (g_config->verbose) printf("Selected region: %s\n", region);
+    return region;
+}
+
+char *select_region(void) {
     assert(g_config->compositor != COMP_COUNT);
-    const char *windows_cmd = mp_string_new(g_alloc, comp_windows_cmds[g_config->compositor]).cstr;
+    const char *windows_cmd = comp_windows_cmds[g_config->compositor];
 
-    const char *cmd;
+    // Without them, the selection just doesn't snap
+    SnapTargets      targets = { 0 };
+    mp_StringBuilder windows = mp_string_builder_new(g_alloc);
     if (windows_cmd != NULL) {
-        cmd = mp_string_newf(g_alloc, "%s | %s", windows_cmd, slurp_cmd).cstr;
-    } else {
-        cmd = mp_string_newf(g_alloc, "%s", slurp_cmd).cstr;
+        size_t span_windows = trace_begin("compositor_query");
+        if (run_cmd_capture(windows_cmd, &windows)) snap_parse(windows.data, &targets);
+        trace_end(span_windows);
     }
+    return slurp_select(&targets);
+}
 
-    ssize_t bytes = run_cmd(cmd, region, DEFAULT_OUTPUT_SIZE);
-    if (bytes == -1 || region == NULL) {
-        eprintf("Selection cancelled\n");
+// Captures every output before the selection is made, then saves the selected part of that frame,
+// so what was on screen when the selection started is captured, menus and tooltips included.
+// slurp still draws over the live outputs.
+static bool capture_region_frozen(void) {
+    Compositor compositor = g_config->compositor;
+
+    // The outputs and windows are listed while grim captures, so they match the frame
+    CmdPipe outputs, windows;
+    if (!cmd_pipe_open(&outputs, comp_output_list_cmds[compositor], CMD_PIPE_STDOUT)) return false;
+    if (!cmd_pipe_open(&windows, comp_windows_cmds[compositor], CMD_PIPE_STDOUT)) {
+        cmd_pipe_close(&outputs);
+        return false;
+    }
+    RedactQuery redaction;
+    bool        redacted = redact_enabled();
+    if (redacted && !redact_start(&redaction, NULL)) {
+        cmd_pipe_close(&windows);
+        cmd_pipe_close(&outputs);
         return false;
     }
-    region[bytes - 1] = '\0';    // trim the final newline
 
-    if (g_config->verbose) printf("Selected region: %s\n", region);
+    size_t           span_freeze = trace_begin("freeze");
+    mp_StringBuilder ppm         = mp_string_builder_new(g_alloc);
+    PixelBuffer      frame;
+    bool captured = grim_frame(NULL, NULL, &ppm) && ppm_parse(ppm.data, ppm.size, &frame);
+    // Nothing is selected from the frame before it is redacted
+    bool safe = !redacted || redact_finish(&redaction, captured ? &frame : NULL);
+    mp_StringBuilder windows_list = mp_string_builder_new(g_alloc);
+    mp_StringBuilder outputs_list = mp_string_builder_new(g_alloc);
+    bool             listed       = cmd_pipe_read(&windows, &windows_list);
+    listed                        = cmd_pipe_read(&outputs, &outputs_list) && listed;
+    trace_end(span_freeze);
+    if (!captured || !safe) return false;
+    if (!listed) {
+        eprintf("Failed to get the outputs and windows from the compositor\n");
+        return false;
+    }
+
+    Region area;
+    if (!outputs_area(outputs_list.data, g_config->output_name, &area)) return false;
+    SnapTargets targets;
+    snap_parse(windows_list.data, &targets);
+
+    char  *geometry = slurp_select(&targets);
+    Region selected;
+    Rect   rect;
+    if (geometry == NULL) return false;
+    if (!region_parse(geometry, &selected) || !region_rect(&selected, &area, &frame, &rect)) {
+        eprintf("The selection `%s` is outside of the outputs\n", geometry);
+        return false;
+    }
+    PixelBuffer crop;
+    rect_crop(&frame, &rect, &crop);
+    if (!grim_save(geometry, &crop)) return false;
+
+    return cache_region(geometry);
+}
+
+bool capture_region(void) {
+    if (g_config->verbose) printf("*Capturing region*\n");
+    if (g_config->freeze) return capture_region_frozen();
+
+    char *region = select_region();
+    if (region == NULL) return false;
 
     if (!grim(region)) return false;
 
-    if (!cache_region(region, bytes)) return false;
+    if (!cache_region(region)) return false;
 
     return true;
 }
@@ -90,59 +178,106 @@ bool capture_region(void) {
 bool capture_last_region(void) {
     if (g_config->verbose) printf("*Capturing last region*\n");
 
-    bool  result            = true;
-    FILE *region_cache_file = NULL;
-    char *region            = mp_allocator_alloc(g_alloc, DEFAULT_OUTPUT_SIZE);
-
-    region_cache_file = fopen(g_config->last_region_file, "r");
-    if (region_cache_file == NULL) {
-        if (errno == ENOENT) {
+    // The regions were validated when they were saved, so they are used as they are
+    Region region;
+    if (g_config->slot != NULL) {
+        if (!regions_slot(g_config->slot, &region)) {
+            eprintf("No region is saved in slot `%s`\n", g_config->slot);
+            eprintf("Save one with `%s region --slot %s`\n", g_config->prog_name, g_config->slot);
+            return false;
+        }
+    } else if (!regions_last(g_config->history_index, &region)) {
+        if (g_config->history_index == 0) {
             eprintf("Run `%s region` to set the region used for this mode\n", g_config->prog_name);
-            return_defer(false);
         } else {
-            eprintf("Failed to open %s: %s\n", g_config->last_region_file, strerror(errno));
-            return_defer(false);
+            eprintf("Less than %u regions have been captured\n", g_config->history_index + 1);
         }
+        return false;
     }
 
-    size_t bytes = fread(region, 1, DEFAULT_OUTPUT_SIZE, region_cache_file);
-    if (ferror(region_cache_file) != 0) {
-        eprintf("Failed to read %s\n", g_config->last_region_file);
-        eprintf("Remove it and run `%s region` to set the region\n", g_config->prog_name);
-        return_defer(false);
+    char *geometry = region_format(&region);
+    if (g_config->verbose) {
+        printf("Selected region: %s\n", geometry);
+        if (region.output[0] != '\0') printf("Captured on output: %s\n", region.output);
     }
-    region[bytes - 1] = '\0';    // trim the final newline
-
-    if (!verify_geometry(region)) return_defer(false);
+    if (!grim(geometry)) return false;
 
-    if (g_config->verbose) printf("Selected region: %s\n", region);
-    if (!grim(region)) return_defer(false);
-
-defer:
-    if (region_cache_file != NULL) fclose(region_cache_file);
-    return result;
+    return true;
 }
 
-bool capture_active_window(void) {
-    comp_check_support(g_config->compositor, false);
+char *toplevel_find(const char *match) {
+    if (!command_found("lswt")) return NULL;
 
-    if (g_config->verbose) printf("*Capturing active window*\n");
+    const char *cmd;
+    if (match == NULL) {
+        cmd = "lswt -j | jq -r 'first(.toplevels[] | select(.activated) | .identifier // empty)'";
+    } else {
+        cmd = alloc_strf("lswt -j | jq -r --arg m %s"
+                         " 'first(.toplevels[] | select(.\"app-id\" == $m or"
+                         " ((.title // \"\") | contains($m))) | .identifier // empty)'",
+                         shell_quote(match))
+                  .cstr;
+    }
+
+    char   *identifier = mp_allocator_alloc(g_alloc, DEFAULT_OUTPUT_SIZE);
+    size_t  span_query = trace_begin("compositor_query");
+    ssize_t bytes      = run_cmd(cmd, identifier, DEFAULT_OUTPUT_SIZE);
+    trace_end(span_query);
+    if (bytes <= 1 || identifier == NULL) return NULL;
+    identifier[bytes - 1] = '\0';    // trim the final newline
+    return identifier;
+}
 
+char *active_window_region(void) {
     char *region = mp_allocator_alloc(g_alloc, DEFAULT_OUTPUT_SIZE);
 
     assert(!(g_config->compositor == COMP_NONE || g_config->compositor == COMP_COUNT));
-    const char *cmd   = comp_active_window_cmds[g_config->compositor];
-    ssize_t     bytes = run_cmd(cmd, region, DEFAULT_OUTPUT_SIZE);
+    const char *cmd        = comp_active_window_cmds[g_config->compositor];
+    size_t      span_query = trace_begin("compositor_query");
+    ssize_t     bytes      = run_cmd(cmd, region, DEFAULT_OUTPUT_SIZE);
+    trace_end(span_query);
     // NOTE: If no active window, the output will probably be "null,null nullxnull"
     // which will fail the third check
     if (bytes == -1 || region == NULL || !isdigit((int)region[0])) {
         eprintf("Failed to get information about window position\n");
-        return false;
+        return NULL;
     }
     region[bytes - 1] = '\0';    // trim the final newline
+    return region;
+}
+
+bool capture_window(void) {
+    if (g_config->verbose) printf("*Capturing window `%s`*\n", g_config->window);
+
+    char *toplevel = toplevel_find(g_config->window);
+    if (toplevel == NULL) {
+        eprintf("No window matches `%s`\n", g_config->window);
+        if (!command_found("lswt")) eprintf("Listing windows needs lswt\n");
+        return false;
+    }
+    if (g_config->verbose) printf("Selected window: %s\n", toplevel);
+
+    return grim_toplevel(toplevel);
+}
+
+bool capture_active_window(void) {
+    if (g_config->toplevel) {
+        if (g_config->verbose) printf("*Capturing active window directly*\n");
+        char *toplevel = toplevel_find(NULL);
+        if (toplevel != NULL) return grim_toplevel(toplevel);
+        // Not every compositor lists its windows, their region is captured instead
+        if (g_config->verbose) printf("The active window is not listed, capturing its region\n");
+    }
+
+    comp_check_support(g_config->compositor, false);
+
+    if (g_config->verbose) printf("*Capturing active window*\n");
+
+    char *region = active_window_region();
+    if (region == NULL) return false;
 
     if (!grim(region)) return false;
-    if (!cache_region(region, bytes)) return false;
+    if (!cache_region(region)) return false;
 
     return true;
 }
@@ -151,23 +286,112 @@ bool capture_custom(void) {
     if (g_config->verbose) printf("*Capturing custom region*\n");
 
     if (!grim(g_config->region)) return false;
-    if (!cache_region(mp_string_newf(g_alloc, "%s\0", g_config->region).cstr,
-                      (ssize_t)strlen(g_config->region) + 1))
-        return false;
+    if (!cache_region(g_config->region)) return false;
 
     return true;
 }
 
+bool capture_diff(void) {
+    // A slot's region is captured, the output is otherwise
+    char *geometry = NULL;
+    if (g_config->slot != NULL) {
+        Region region;
+        if (!regions_slot(g_config->slot, &region)) {
+            eprintf("No region is saved in slot `%s`\n", g_config->slot);
+            eprintf("Save one with `%s region --slot %s`\n", g_config->prog_name, g_config->slot);
+            return false;
+        }
+        geometry = region_format(&region);
+    }
+    if (g_config->verbose) {
+        printf("*Comparing %s*\n", geometry == NULL ? "fullscreen" : geometry);
+        if (g_config->diff_reference != NULL) printf("Reference: %s\n", g_config->diff_reference);
+    }
+
+    // Parts of the screen that always change, like a clock, can be redacted in both captures
+    RedactQuery redaction;
+    bool        redacted = redact_enabled();
+    if (redacted && !redact_start(&redaction, geometry)) return false;
+
+    mp_StringBuilder ppm = mp_string_builder_new(g_alloc);
+    PixelBuffer      frame;
+    if (!grim_frame(geometry, NULL, &ppm) || !ppm_parse(ppm.data, ppm.size, &frame)) {
+        if (redacted) redact_finish(&redaction, NULL);
+        return false;
+    }
+    if (redacted && !redact_finish(&redaction, &frame)) return false;
+
+    return diff_against(&frame);
+}
+
 bool capture(void) {
     if (g_config->region != NULL)
         if (!verify_geometry(g_config->region)) return false;
 
-    if (g_config->mode != MODE_FULL && (g_config->output_name != NULL || g_config->all_outputs)) {
+    bool whole_output = g_config->mode == MODE_FULL ||
+                        (g_config->mode == MODE_DIFF && g_config->slot == NULL);
+    if (!whole_output && (g_config->output_name != NULL || g_config->all_outputs)) {
+        eprintf("\033[1;33m");
+        eprintf("Warning: Flag -o and --all are ignored outside of modes `full` and `diff`\n");
+        eprintf("\033[0m");
+    }
+
+    bool recompress = g_config->recompress && (g_config->save_mode & SAVEMODE_DISK);
+    if (recompress) {
+        const char *warning = NULL;
+        if (g_config->imgtype != IMGTYPE_PNG && g_config->imgtype != IMGTYPE_PNG_FAST) {
+            warning = "Warning: Flag --recompress is ignored for types other than PNG\n";
+        } else if (recompress_tool() == NULL) {
+            warning = "Warning: Flag --recompress needs oxipng or optipng, it is ignored\n";
+        }
+        if (warning != NULL) {
+            eprintf("\033[1;33m");
+            eprintf("%s", warning);
+            eprintf("\033[0m");
+            recompress = false;
+        }
+    }
+
+    // The thumbnails are made from the raw frame, which grim doesn't give for the types it encodes
+    bool thumbnails = g_config->thumbnails && (g_config->save_mode & SAVEMODE_DISK);
+    if (thumbnails && !encode_in_tree(g_config->imgtype) && g_config->imgtype != IMGTYPE_PPM) {
         eprintf("\033[1;33m");
-        eprintf("Warning: Flag -o and --all are ignored outside of mode `full`\n");
+        eprintf("Warning: Flag --thumbnails only works with -t png-fast, qoi and ppm\n");
         eprintf("\033[0m");
     }
 
+    // `post_parse_args()` made -t png a PNG gripper encodes, the other types have no deflate level
+    if (g_config->budget_ms > 0 && g_config->imgtype != IMGTYPE_PNG_FAST) {
+        eprintf("\033[1;33m");
+        eprintf("Warning: Flag --budget only works with -t png and png-fast, it is ignored\n");
+        eprintf("\033[0m");
+    }
+
+    if (g_config->freeze && g_config->mode != MODE_REGION) {
+        eprintf("\033[1;33m");
+        eprintf("Warning: Flag --freeze is ignored outside of mode `region`\n");
+        eprintf("\033[0m");
+    } else if (g_config->freeze) {
+        // The frozen frame is placed in the layout from the outputs the compositor lists
+        comp_check_support(g_config->compositor, false);
+        // `post_parse_args()` made -t png a PNG gripper encodes
+        if (!encode_in_tree(g_config->imgtype) && g_config->imgtype != IMGTYPE_PPM) {
+            eprintf("--freeze: Only works with -t png, png-fast, qoi and ppm\n");
+            return false;
+        }
+        if (g_config->raw_socket != -1) {
+            eprintf("--freeze: Frames sent with --raw can't be frozen\n");
+            return false;
+        }
+        if (g_config->wait_time > 0) {
+            eprintf("\033[1;33m");
+            eprintf("Warning: Flag -w is ignored with --freeze\n");
+            eprintf("\033[0m");
+        }
+    }
+
+    if (!redact_check()) return false;
+
     if (g_config->verbose) {
         printf("====================\n");
         if (g_config->mode == MODE_FULL) {
@@ -181,13 +405,23 @@ bool capture(void) {
             printf("Screenshot directory    : %s\n", g_config->screenshot_dir);
             printf("Output path             : %s\n", g_config->output_path);
         }
-        printf("Last region cache       : %s\n", g_config->last_region_file);
+        printf("Region store            : %s\n", g_config->regions_file);
+        if (g_config->slot != NULL) printf("Region slot             : %s\n", g_config->slot);
+        if (g_config->budget_ms > 0) {
+            printf("Budget                  : %u ms\n", g_config->budget_ms);
+        }
         printf("Compositor              : %s\n", compositor2str(g_config->compositor));
         printf("Mode                    : %s\n", mode2str(g_config->mode));
         printf("Cursor                  : %s\n", g_config->cursor ? "Shown" : "Hidden");
         printf("Save to                 : %s\n", savemode2str(g_config->save_mode));
         printf("Scale                   : %.1f\n", g_config->scale);
         printf("Image type              : %s\n", imgtype2str(g_config->imgtype));
+        if (redact_enabled()) {
+            printf("Redact                  : %u regions, %u windows (%s)\n",
+                   g_config->redact_count,
+                   g_config->redact_window_count,
+                   redactstyle2str(g_config->redact_style));
+        }
         switch (g_config->imgtype) {
             case IMGTYPE_PNG : {
                 printf("PNG compression level   : %d\n", g_config->png_level);
@@ -196,7 +430,9 @@ bool capture(void) {
             case IMGTYPE_JPEG : {
                 printf("JPEG quality:           : %d\n", g_config->jpeg_quality);
             } break;
-            case IMGTYPE_PPM :   break;
+            case IMGTYPE_PPM :
+            case IMGTYPE_QOI :
+            case IMGTYPE_PNG_FAST : break;
             case IMGTYPE_NONE :
             case IMGTYPE_COUNT : {
                 unreachable();
@@ -213,7 +449,8 @@ bool capture(void) {
         case MODE_REGION : {
             ok = capture_region();
         } break;
-        case MODE_LAST_REGION : {
+        case MODE_LAST_REGION :
+        case MODE_HISTORY : {
             ok = capture_last_region();
         } break;
         case MODE_ACTIVE_WINDOW : {
@@ -222,24 +459,32 @@ bool capture(void) {
         case MODE_CUSTOM : {
             ok = capture_custom();
         } break;
+        case MODE_WINDOW : {
+            ok = capture_window();
+        } break;
+        case MODE_DIFF : {
+            ok = capture_diff();
+        } break;
+        case MODE_BATCH : {
+            ok = batch_run();
+        } break;
         case MODE_TEST : {
             eprintf("There's nothing here yet :)\n");
             return true;
         } break;
+        case MODE_COUNT : {
+            unreachable();
+        }
     }
 
     if (!ok) return false;
 
+    if (recompress) {
+        if (recompress_enqueue(g_config->output_path)) recompress_spawn();
+    }
+
     if (g_config->save_mode == SAVEMODE_NONE) return true;
-    const char *name = NULL;
-    if (g_config->save_mode == SAVEMODE_DISK) {
-        name = alloc_strf("\"%s\"", g_config->output_path).cstr;
-    } else if (g_config->save_mode == SAVEMODE_CLIPBOARD) {
-        name = "clipboard";
-    } else if (g_config->save_mode == (SAVEMODE_DISK | SAVEMODE_CLIPBOARD)) {
-        name = alloc_strf("\"%s\" and clipboard", g_config->output_path).cstr;
-    }
-    printf("Saved to %s\n", name);
+    printf("Saved to %s\n", save_destination(true));
 
     return true;
 }
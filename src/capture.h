@@ -11,4 +11,13 @@
 
 bool capture(void);
 
+// Lets the user select a region with slurp. Returns its geometry, or NULL if it was cancelled.
+char *select_region(void);
+// Returns the geometry of the active window, which the compositor must support
+char *active_window_region(void);
+// Finds the identifier of a window in ext-foreign-toplevel-list, which grim captures with `-T`.
+// `match` is an app ID or a part of a title, NULL for the active window.
+// Returns NULL if there is no such window, or if the compositor doesn't list them.
+char *toplevel_find(const char *match);
+
 #endif /* ifndef CAPTURE_H */
@@ -19,27 +19,60 @@ const char *comp_active_window_cmds[COMP_COUNT] = {
         " | jq -r '.rect | \"\\(.x),\\(.y) \\(.width)x\\(.height)\"'",
 };
 
-// Commands to get the region of all visible windows
+// Commands to get the region of all visible windows, from the bottom one to the top one. Windows
+// hidden behind others are still listed, `snap_parse()` drops them.
 const char *comp_windows_cmds[COMP_COUNT] = {
     [COMP_NONE] = NULL,
-    // FIXME: this includes windows hidden by a fullscreen window
     [COMP_HYPRLAND] =
         /**/
     // lists windows in Hyprland
     "hyprctl clients -j"
     // filters window outside of the current workspace
     " | jq -r --argjson workspaces \"$(hyprctl monitors -j | jq -r 'map(.activeWorkspace.id)')\""
-    "   'map(select([.workspace.id] | inside($workspaces)))'"
+    "   'map(select(([.workspace.id] | inside($workspaces)) and (.hidden | not)))'"
+    // stacks them: tiled windows, floating ones, then fullscreen ones, the last focused on top.
+    // `fullscreen` is a boolean before Hyprland 0.41 and a mode after
+    " | jq -r 'sort_by((.fullscreen | if type == \"boolean\" then (if . then 2 else 0 end)"
+    "   else . end) > 0, .floating, -.focusHistoryID)'"
     // gets the position and size of each window and turn it into format slurp can read
     " | jq -r '.[] | \"\\(.at[0]),\\(.at[1]) \\(.size[0])x\\(.size[1])\"'"
     // and those informations will be used by slurp to automatically snap selection of
     // region to the windows
     ,
+    // The tree lists the tiled windows of a workspace before the floating ones, which are stacked
     [COMP_SWAY] =
         "swaymsg -t get_tree"
         " | jq -r '.. | select(.pid? and .visible?) | .rect | \"\\(.x),\\(.y) \\(.width)x\\(.height)\"'",
 };
 
+// Commands to list the visible windows, one per line as "X,Y WxH<tab>app ID<tab>title"
+const char *comp_window_list_cmds[COMP_COUNT] = {
+    [COMP_NONE] = NULL,
+    [COMP_HYPRLAND] =
+        "hyprctl clients -j"
+        " | jq -r --argjson workspaces \"$(hyprctl monitors -j | jq -r 'map(.activeWorkspace.id)')\""
+        "   'map(select([.workspace.id] | inside($workspaces)))'"
+        " | jq -r '.[] | \"\\(.at[0]),\\(.at[1]) \\(.size[0])x\\(.size[1])\\t\\(.class)\\t\""
+        "   + (.title | gsub(\"[\\t\\n]\"; \" \"))'",
+    [COMP_SWAY] =
+        "swaymsg -t get_tree"
+        " | jq -r '.. | select(.pid? and .visible?)"
+        "   | \"\\(.rect.x),\\(.rect.y) \\(.rect.width)x\\(.rect.height)\\t\""
+        "   + (.app_id // .window_properties.class // \"\") + \"\\t\""
+        "   + (.name // \"\" | gsub(\"[\\t\\n]\"; \" \"))'",
+};
+
+// Commands to list the active outputs, one per line as "name<tab>X,Y WxH" in layout coordinates
+const char *comp_output_list_cmds[COMP_COUNT] = {
+    [COMP_NONE] = NULL,
+    [COMP_HYPRLAND] =
+        "hyprctl monitors -j | jq -r '.[] | \"\\(.name)\\t\\(.x),\\(.y) \""
+        "   + \"\\(.width / .scale | round)x\\(.height / .scale | round)\"'",
+    [COMP_SWAY] =
+        "swaymsg -t get_outputs | jq -r '.[] | select(.active)"
+        " | \"\\(.name)\\t\\(.rect.x),\\(.rect.y) \\(.rect.width)x\\(.rect.height)\"'",
+};
+
 void _comp_print_support(Compositor compositor, FILE *stream) {
     fprintf(stream, "Your compositor is ");
     fprintf(stream, comp_supported(compositor) ? "supported.\n" : "not supported.\n");
@@ -14,6 +14,8 @@ typedef enum {
 extern const char *comp_active_monitor_cmds[COMP_COUNT];
 extern const char *comp_active_window_cmds[COMP_COUNT];
 extern const char *comp_windows_cmds[COMP_COUNT];
+extern const char *comp_window_list_cmds[COMP_COUNT];
+extern const char *comp_output_list_cmds[COMP_COUNT];
 
 // TODO: check if compositor supports needed wayland protocols
 #define comp_supported(comp)     (comp != COMP_NONE)
@@ -0,0 +1,160 @@
+#define _DEFAULT_SOURCE
+
+#include "dedup.h"
+#include "prog.h"
+#include "utils.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define DEDUP_FNAME   "screenshots"
+#define DEDUP_MAGIC   0x44505247u    // "GRPD"
+#define DEDUP_VERSION 3u
+
+// The hashes are kept apart from the entries so a lookup only scans DEDUP_ENTRIES * 8 bytes.
+// A hash of 0 marks an unused entry.
+typedef struct {
+    uint32_t   magic;
+    uint32_t   version;
+    uint64_t   pushed;    // Amount of entries ever inserted
+    uint64_t   hashes[DEDUP_ENTRIES];
+    DedupEntry entries[DEDUP_ENTRIES];
+} DedupIndex;
+
+// Maps and locks the index, creating it if `writable`.
+// Returns NULL if it doesn't exist yet or could not be opened.
+static DedupIndex *index_map(bool writable, int *fd_out) {
+    bool        result = true;
+    DedupIndex *index  = MAP_FAILED;
+    const char *path   = state_path(DEDUP_FNAME);
+    int         fd     = -1;
+    if (path == NULL) return NULL;
+
+    if (writable && !make_parent_dirs(path)) return NULL;
+    fd = open(path, writable ? O_RDWR | O_CREAT : O_RDONLY, 0644);
+    if (fd == -1) {
+        if (errno != ENOENT) eprintf("Failed to open %s: %s\n", path, strerror(errno));
+        return NULL;
+    }
+    if (flock(fd, writable ? LOCK_EX : LOCK_SH) != 0) {
+        eprintf("Failed to lock %s: %s\n", path, strerror(errno));
+        return_defer(false);
+    }
+
+    struct stat s;
+    if (fstat(fd, &s) != 0) return_defer(false);
+    bool fresh = (size_t)s.st_size != sizeof(DedupIndex);
+    if (fresh && !writable) return_defer(false);
+    if (fresh && (ftruncate(fd, 0) != 0 || ftruncate(fd, sizeof(DedupIndex)) != 0)) {
+        eprintf("Failed to initialise %s: %s\n", path, strerror(errno));
+        return_defer(false);
+    }
+
+    int prot = writable ? PROT_READ | PROT_WRITE : PROT_READ;
+    index    = mmap(NULL, sizeof(DedupIndex), prot, MAP_SHARED, fd, 0);
+    if (index == MAP_FAILED) {
+        eprintf("Failed to map %s: %s\n", path, strerror(errno));
+        return_defer(false);
+    }
+    if (index->magic != DEDUP_MAGIC || index->version != DEDUP_VERSION) {
+        if (!writable) return_defer(false);
+        memset(index, 0, sizeof(DedupIndex));
+        index->magic   = DEDUP_MAGIC;
+        index->version = DEDUP_VERSION;
+    }
+
+defer:
+    if (!result) {
+        if (index != MAP_FAILED) munmap(index, sizeof(DedupIndex));
+        close(fd);
+        return NULL;
+    }
+    *fd_out = fd;
+    return index;
+}
+
+static void index_unmap(DedupIndex *index, int fd) {
+    munmap(index, sizeof(DedupIndex));
+    close(fd);    // Releases the lock
+}
+
+static size_t index_find(const DedupIndex *index, uint64_t hash, uint32_t imgtype) {
+    for (size_t i = 0; i < DEDUP_ENTRIES; ++i) {
+        if (index->hashes[i] == hash && index->entries[i].imgtype == imgtype) return i;
+    }
+    return DEDUP_ENTRIES;
+}
+
+static int64_t stat_mtime_ns(const struct stat *s) {
+    return (int64_t)s->st_mtim.tv_sec * 1000000000 + s->st_mtim.tv_nsec;
+}
+
+// Reads what tells the file at `entry->path` apart from an edited or replaced one
+static bool entry_stat(DedupEntry *entry) {
+    struct stat s;
+    if (stat(entry->path, &s) != 0 || !S_ISREG(s.st_mode)) return false;
+    entry->size     = (uint64_t)s.st_size;
+    entry->device   = (uint64_t)s.st_dev;
+    entry->inode    = (uint64_t)s.st_ino;
+    entry->mtime_ns = stat_mtime_ns(&s);
+    return true;
+}
+
+bool dedup_lookup(uint64_t hash, uint32_t imgtype, DedupEntry *entry) {
+    if (hash == 0) return false;
+    int         fd;
+    DedupIndex *index = index_map(false, &fd);
+    if (index == NULL) return false;
+
+    size_t i = index_find(index, hash, imgtype);
+    if (i < DEDUP_ENTRIES) memcpy(entry, &index->entries[i], sizeof(DedupEntry));
+    index_unmap(index, fd);
+    if (i == DEDUP_ENTRIES) return false;
+
+    // The file may have been deleted, replaced or edited since, the index is only a hint
+    DedupEntry now = *entry;
+    if (!entry_stat(&now)) return false;
+    return now.size == entry->size && now.device == entry->device && now.inode == entry->inode &&
+           now.mtime_ns == entry->mtime_ns;
+}
+
+bool dedup_insert(DedupEntry *entry) {
+    if (entry->hash == 0 || !entry_stat(entry)) return true;
+    int         fd;
+    DedupIndex *index = index_map(true, &fd);
+    if (index == NULL) return false;
+
+    size_t i = index_find(index, entry->hash, entry->imgtype);
+    if (i == DEDUP_ENTRIES) i = index->pushed++ % DEDUP_ENTRIES;
+    memcpy(&index->entries[i], entry, sizeof(DedupEntry));
+    index->hashes[i] = entry->hash;
+
+    index_unmap(index, fd);
+    return true;
+}
+
+bool dedup_update(const char *path) {
+    DedupEntry now;
+    snprintf(now.path, sizeof(now.path), "%s", path);
+    if (!entry_stat(&now)) return false;
+    int         fd;
+    DedupIndex *index = index_map(true, &fd);
+    if (index == NULL) return false;
+
+    for (size_t i = 0; i < DEDUP_ENTRIES; ++i) {
+        DedupEntry *entry = &index->entries[i];
+        if (index->hashes[i] == 0 || !streq(entry->path, path)) continue;
+        entry->size     = now.size;
+        entry->device   = now.device;
+        entry->inode    = now.inode;
+        entry->mtime_ns = now.mtime_ns;
+    }
+
+    index_unmap(index, fd);
+    return true;
+}
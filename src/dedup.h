@@ -0,0 +1,35 @@
+#ifndef DEDUP_H
+#define DEDUP_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Amount of screenshots remembered, the oldest one is forgotten first
+#define DEDUP_ENTRIES   4096
+#define DEDUP_PATH_SIZE 256
+
+// A screenshot saved to disk
+typedef struct {
+    uint64_t hash;                     // `hash64()` of the pixels, or of the file grim encoded
+    uint64_t size;                     // Size of the file when it was saved
+    uint64_t device;                   // The device and inode of the file, and when it was last
+    uint64_t inode;                    // modified: a PPM edited in place keeps its size
+    int64_t  mtime_ns;
+    int64_t  timestamp;                // Unix time of the capture
+    uint32_t mode;                     // The `Mode` it was captured with
+    uint32_t imgtype;                  // The `Imgtype` it was saved as
+    char     geometry[32];             // 'X,Y WxH', empty for full screenshots
+    char     path[DEDUP_PATH_SIZE];    // Absolute path of the file
+} DedupEntry;
+
+// Looks up a screenshot with `hash` saved as `imgtype` that still exists unmodified on disk
+bool dedup_lookup(uint64_t hash, uint32_t imgtype, DedupEntry *entry);
+// Remembers `entry` with the file at its path as it is now, replacing any screenshot with the same
+// hash and type
+bool dedup_insert(DedupEntry *entry);
+
+// Remembers the file at `path` as it is now, after it was rewritten with the same pixels
+bool dedup_update(const char *path);
+
+#endif /* ifndef DEDUP_H */
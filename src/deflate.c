@@ -0,0 +1,829 @@
+#include "deflate.h"
+#include <pthread.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define WINDOW_SIZE 32768
+#define MIN_MATCH   4    // Deflate allows 3, but 4-byte matches are cheaper to find
+#define MAX_MATCH   258
+#define HASH_BITS   15
+// Literals and matches of a dynamic block are buffered until there are this many
+#define BLOCK_SYMBOLS (1 << 15)
+#define STORED_MAX    65535    // Bytes in a stored block
+
+/***********
+ * CHECKSUMS
+ ***********/
+
+// Slicing-by-8: eight tables let the loop consume 8 bytes per step instead of one
+static uint32_t       crc_table[8][256];
+static pthread_once_t crc_once = PTHREAD_ONCE_INIT;
+
+static void crc_init(void) {
+    for (uint32_t i = 0; i < 256; ++i) {
+        uint32_t c = i;
+        for (int k = 0; k < 8; ++k) c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+        crc_table[0][i] = c;
+    }
+    for (uint32_t i = 0; i < 256; ++i) {
+        for (size_t t = 1; t < 8; ++t) {
+            uint32_t c      = crc_table[t - 1][i];
+            crc_table[t][i] = crc_table[0][c & 0xFF] ^ (c >> 8);
+        }
+    }
+}
+
+uint32_t crc32_update(uint32_t crc, const void *data, size_t size) {
+    pthread_once(&crc_once, crc_init);
+    const uint8_t *p = data;
+    crc              = ~crc;
+    for (; size >= 8; size -= 8, p += 8) {
+        uint32_t lo = crc ^ ((uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 |
+                             (uint32_t)p[3] << 24);
+        uint32_t hi = (uint32_t)p[4] | (uint32_t)p[5] << 8 | (uint32_t)p[6] << 16 |
+                      (uint32_t)p[7] << 24;
+        crc = crc_table[7][lo & 0xFF] ^ crc_table[6][(lo >> 8) & 0xFF] ^
+              crc_table[5][(lo >> 16) & 0xFF] ^ crc_table[4][lo >> 24] ^
+              crc_table[3][hi & 0xFF] ^ crc_table[2][(hi >> 8) & 0xFF] ^
+              crc_table[1][(hi >> 16) & 0xFF] ^ crc_table[0][hi >> 24];
+    }
+    for (; size > 0; --size, ++p) crc = crc_table[0][(crc ^ *p) & 0xFF] ^ (crc >> 8);
+    return ~crc;
+}
+
+uint32_t adler32_update(uint32_t adler, const void *data, size_t size) {
+    // The sums can go this many bytes before they have to be reduced to avoid overflowing
+    const size_t   nmax = 5552;
+    const uint8_t *p    = data;
+    uint32_t       a    = adler & 0xFFFF;
+    uint32_t       b    = adler >> 16;
+    while (size > 0) {
+        size_t n = size < nmax ? size : nmax;
+        size -= n;
+        for (; n > 0; --n) {
+            a += *p++;
+            b += a;
+        }
+        a %= 65521;
+        b %= 65521;
+    }
+    return b << 16 | a;
+}
+
+/***********
+ * FIXED HUFFMAN CODES
+ ***********/
+
+typedef struct {
+    uint32_t bits;    // Already bit-reversed, deflate sends Huffman codes from the top bit
+    uint32_t len;
+} Code;
+
+static Code           literal_codes[288];
+// Length symbol and extra bits of every match length, merged into one code
+static Code           length_codes[MAX_MATCH + 1];
+static uint8_t        length_symbol[MAX_MATCH + 1];    // From 0, for symbol 257
+static Code           distance_codes[30];
+static uint8_t        distance_extra[30];
+static uint16_t       distance_base[30];
+static pthread_once_t codes_once = PTHREAD_ONCE_INIT;
+
+static const uint16_t length_base[29] = {
+    3,  4,  5,  6,  7,  8,  9,  10, 11,  13,  15,  17,  19,  23, 27,
+    31, 35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258,
+};
+static const uint8_t length_extra[29] = {
+    0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0,
+};
+
+static uint32_t reverse_bits(uint32_t code, uint32_t len) {
+    uint32_t result = 0;
+    for (uint32_t i = 0; i < len; ++i, code >>= 1) result = (result << 1) | (code & 1);
+    return result;
+}
+
+static void codes_init(void) {
+    for (uint32_t sym = 0; sym < 288; ++sym) {
+        uint32_t code, len;
+        if (sym < 144) {
+            code = 0x30 + sym, len = 8;
+        } else if (sym < 256) {
+            code = 0x190 + sym - 144, len = 9;
+        } else if (sym < 280) {
+            code = sym - 256, len = 7;
+        } else {
+            code = 0xC0 + sym - 280, len = 8;
+        }
+        literal_codes[sym] = (Code){ reverse_bits(code, len), len };
+    }
+
+    for (uint32_t i = 0; i < 29; ++i) {
+        uint32_t end = i + 1 < 29 ? length_base[i + 1] : MAX_MATCH + 1;
+        for (uint32_t len = length_base[i]; len < end && len <= MAX_MATCH; ++len) {
+            Code sym           = literal_codes[257 + i];
+            length_symbol[len] = (uint8_t)i;
+            length_codes[len]  = (Code){
+                sym.bits | (len - length_base[i]) << sym.len,
+                sym.len + length_extra[i],
+            };
+        }
+    }
+
+    uint32_t base = 1;
+    for (uint32_t i = 0; i < 30; ++i) {
+        distance_extra[i] = (uint8_t)(i < 4 ? 0 : i / 2 - 1);
+        distance_base[i]  = (uint16_t)base;
+        distance_codes[i] = (Code){ reverse_bits(i, 5), 5 };
+        base += 1u << distance_extra[i];
+    }
+}
+
+static uint32_t distance_symbol(uint32_t distance) {
+    if (distance <= 4) return distance - 1;
+    // Every two symbols cover the next power of two
+    uint32_t log = 31 - (uint32_t)__builtin_clz(distance - 1);
+    return 2 * log + (((distance - 1) >> (log - 1)) & 1);
+}
+
+/***********
+ * BIT WRITER
+ ***********/
+
+typedef struct {
+    uint8_t *out;
+    uint64_t bits;
+    uint32_t count;
+} BitWriter;
+
+static inline void put_bits(BitWriter *w, uint32_t bits, uint32_t len) {
+    w->bits |= (uint64_t)bits << w->count;
+    w->count += len;
+    if (w->count >= 32) {
+        uint32_t word = (uint32_t)w->bits;
+        memcpy(w->out, &word, sizeof(word));    // Little-endian, like deflate's bit order
+        w->out += 4;
+        w->bits >>= 32;
+        w->count -= 32;
+    }
+}
+
+static void flush_bits(BitWriter *w) {
+    while (w->count > 0) {
+        *w->out++ = (uint8_t)w->bits;
+        w->bits >>= 8;
+        w->count = w->count > 8 ? w->count - 8 : 0;
+    }
+}
+
+// Bits written since `start`
+static uint64_t written_bits(const BitWriter *start, const BitWriter *w) {
+    return (uint64_t)(w->out - start->out) * 8 + w->count - start->count;
+}
+
+/***********
+ * STORED BLOCKS
+ ***********/
+
+// The most `size` bytes can take as stored blocks: each has a header, up to 7 bits to reach a
+// byte, and its length twice
+static uint64_t stored_bits(size_t size) {
+    size_t blocks = size == 0 ? 1 : (size + STORED_MAX - 1) / STORED_MAX;
+    return (uint64_t)blocks * (3 + 7 + 32) + (uint64_t)size * 8;
+}
+
+// Writes `size` bytes of `data` as they are, for input that the codes would only make bigger
+static void put_stored(BitWriter *w, const uint8_t *data, size_t size, bool final) {
+    do {
+        size_t len = size < STORED_MAX ? size : STORED_MAX;
+        put_bits(w, final && len == size, 1);
+        put_bits(w, 0, 2);    // Stored
+        flush_bits(w);
+        w->bits   = 0;
+        *w->out++ = (uint8_t)len;
+        *w->out++ = (uint8_t)(len >> 8);
+        *w->out++ = (uint8_t)~len;
+        *w->out++ = (uint8_t)(~len >> 8);
+        memcpy(w->out, data, len);
+        w->out += len;
+        data += len;
+        size -= len;
+    } while (size > 0);
+}
+
+/***********
+ * COMPRESSION
+ ***********/
+
+// How hard each level looks for matches
+static const struct {
+    uint32_t depth;      // Earlier positions with the same hash tried for each match
+    uint32_t insert;     // The positions inside matches up to this long are hashed too
+    bool     dynamic;    // Each block gets its own Huffman codes
+    bool     lazy;       // A match is dropped if the next byte starts a longer one
+} levels[DEFLATE_LEVEL_MAX + 1] = {
+    [1] = { 1, 0, false, false },
+    [2] = { 1, 0, true, false },
+    [3] = { 8, 16, true, false },
+    [4] = { 32, MAX_MATCH, true, true },
+};
+
+// Matches at least this long are taken without looking for a longer one at the next byte
+#define LAZY_NICE 32
+
+static inline uint32_t read32(const uint8_t *p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint32_t hash4(uint32_t v) {
+    return (v * 2654435761u) >> (32 - HASH_BITS);
+}
+
+static inline size_t match_length(const uint8_t *a, const uint8_t *b, size_t max) {
+    size_t len = 0;
+    while (len + 8 <= max) {
+        uint64_t x, y;
+        memcpy(&x, a + len, sizeof(x));
+        memcpy(&y, b + len, sizeof(y));
+        if (x != y) return len + (size_t)__builtin_ctzll(x ^ y) / 8;
+        len += 8;
+    }
+    while (len < max && a[len] == b[len]) ++len;
+    return len;
+}
+
+static inline void put_literal(BitWriter *w, uint8_t byte) {
+    put_bits(w, literal_codes[byte].bits, literal_codes[byte].len);
+}
+
+static inline void put_match(BitWriter *w, size_t length, size_t distance) {
+    put_bits(w, length_codes[length].bits, length_codes[length].len);
+    uint32_t sym = distance_symbol((uint32_t)distance);
+    put_bits(w,
+             distance_codes[sym].bits | ((uint32_t)distance - distance_base[sym]) << 5,
+             5 + distance_extra[sym]);
+}
+
+// Compresses `src[pos..end)`, with up to a window of the bytes before `pos` as history. Unless
+// `final`, it stops where a match could need bytes past `end`. Returns where it stopped.
+static size_t compress(BitWriter     *w,
+                       uint32_t      *table,
+                       const uint8_t *src,
+                       size_t         pos,
+                       size_t         end,
+                       bool           final) {
+    size_t limit = final ? end : (end > MAX_MATCH ? end - MAX_MATCH : 0);
+    while (pos < limit && pos + MIN_MATCH <= end) {
+        uint32_t v   = read32(src + pos);
+        size_t   max = end - pos < MAX_MATCH ? end - pos : MAX_MATCH;
+
+        // Runs of one byte are by far the most common match in filtered screenshots
+        if (pos > 0 && v == src[pos - 1] * 0x01010101u) {
+            size_t len = MIN_MATCH + match_length(src + pos + MIN_MATCH,
+                                                  src + pos + MIN_MATCH - 1,
+                                                  max - MIN_MATCH);
+            put_match(w, len, 1);
+            pos += len;
+            continue;
+        }
+
+        uint32_t h    = hash4(v);
+        size_t   cand = table[h];    // Positions are stored plus one, 0 is empty
+        table[h]      = (uint32_t)(pos + 1);
+        if (cand != 0 && pos - (cand - 1) <= WINDOW_SIZE && read32(src + cand - 1) == v) {
+            cand -= 1;
+            size_t len = MIN_MATCH + match_length(src + pos + MIN_MATCH,
+                                                  src + cand + MIN_MATCH,
+                                                  max - MIN_MATCH);
+            put_match(w, len, pos - cand);
+            pos += len;
+            continue;
+        }
+
+        put_literal(w, src[pos++]);
+    }
+    if (final) {
+        while (pos < end) put_literal(w, src[pos++]);
+    }
+    return pos;
+}
+
+// `compress()` as one block with the fixed codes, which is stored instead if that is smaller.
+// Nothing is written unless some input was compressed or it is the final block.
+static size_t fixed_block(BitWriter     *w,
+                          uint32_t      *table,
+                          const uint8_t *src,
+                          size_t         pos,
+                          size_t         end,
+                          bool           final) {
+    BitWriter start = *w;
+    put_bits(w, final, 1);
+    put_bits(w, 1, 2);    // Fixed Huffman codes
+    size_t stop = compress(w, table, src, pos, end, final);
+    put_bits(w, literal_codes[256].bits, literal_codes[256].len);    // End of block
+    if (stop == pos && !final) {
+        *w = start;
+    } else if (written_bits(&start, w) > stored_bits(stop - pos)) {
+        *w = start;
+        put_stored(w, src + pos, stop - pos, final);
+    }
+    return stop;
+}
+
+static void block_write(ZlibStream *self, BitWriter *w, bool final);
+
+// From level 2, the symbols of a block are buffered until its codes are known. A literal is kept
+// as itself and a match as its distance in the high 16 bits and its length in the others.
+static inline void add_literal(ZlibStream *self, BitWriter *w, uint8_t byte) {
+    self->symbols[self->symbol_count++] = byte;
+    if (self->symbol_count == BLOCK_SYMBOLS) block_write(self, w, false);
+}
+
+static inline void add_match(ZlibStream *self, BitWriter *w, size_t length, size_t distance) {
+    self->symbols[self->symbol_count++] = (uint32_t)distance << 16 | (uint32_t)length;
+    if (self->symbol_count == BLOCK_SYMBOLS) block_write(self, w, false);
+}
+
+// Hashes `pos` without looking for a match there
+static inline void insert(ZlibStream *self, const uint8_t *src, size_t pos) {
+    uint32_t h                           = hash4(read32(src + pos));
+    self->chain[pos & (WINDOW_SIZE - 1)] = self->table[h];
+    self->table[h]                       = (uint32_t)(pos + 1);
+}
+
+// Looks for the longest match of at most `max` bytes at `pos` among the earlier positions with the
+// same hash, then hashes `pos`. Returns its length, 0 if there is none.
+static inline size_t find_match(ZlibStream    *self,
+                                const uint8_t *src,
+                                size_t         pos,
+                                size_t         max,
+                                size_t        *distance) {
+    uint32_t v     = read32(src + pos);
+    uint32_t h     = hash4(v);
+    size_t   cand  = self->table[h];    // Positions are stored plus one, 0 is empty
+    self->table[h] = (uint32_t)(pos + 1);
+
+    if (self->chain == NULL) {
+        if (cand == 0 || pos - (cand - 1) > WINDOW_SIZE || read32(src + cand - 1) != v) return 0;
+        cand -= 1;
+        *distance = pos - cand;
+        return MIN_MATCH +
+               match_length(src + pos + MIN_MATCH, src + cand + MIN_MATCH, max - MIN_MATCH);
+    }
+
+    self->chain[pos & (WINDOW_SIZE - 1)] = (uint32_t)cand;
+    size_t best                          = 0;
+    for (uint32_t depth = levels[self->level].depth; cand != 0 && depth > 0; --depth) {
+        size_t c = cand - 1;
+        // The slot of a position a whole window back was just reused for `pos`
+        if (pos - c >= WINDOW_SIZE) break;
+        if (src[c + best] == src[pos + best] && read32(src + c) == v) {
+            size_t len = MIN_MATCH + match_length(src + pos + MIN_MATCH,
+                                                  src + c + MIN_MATCH,
+                                                  max - MIN_MATCH);
+            if (len > best) {
+                best      = len;
+                *distance = pos - c;
+                if (len == max) break;
+            }
+        }
+        size_t next = self->chain[c & (WINDOW_SIZE - 1)];
+        if (next >= cand) break;    // Overwritten by a newer position
+        cand = next;
+    }
+    return best;
+}
+
+// `compress()` for the levels that buffer blocks
+static size_t compress_blocks(ZlibStream    *self,
+                              BitWriter     *w,
+                              const uint8_t *src,
+                              size_t         pos,
+                              size_t         end,
+                              bool           final) {
+    size_t limit      = final ? end : (end > MAX_MATCH ? end - MAX_MATCH : 0);
+    bool   lazy       = levels[self->level].lazy;
+    size_t insert_max = levels[self->level].insert;
+    while (pos < limit && pos + MIN_MATCH <= end) {
+        uint32_t v   = read32(src + pos);
+        size_t   max = end - pos < MAX_MATCH ? end - pos : MAX_MATCH;
+
+        // Runs of one byte are by far the most common match in filtered screenshots
+        if (pos > 0 && v == src[pos - 1] * 0x01010101u) {
+            size_t len = MIN_MATCH + match_length(src + pos + MIN_MATCH,
+                                                  src + pos + MIN_MATCH - 1,
+                                                  max - MIN_MATCH);
+            add_match(self, w, len, 1);
+            pos += len;
+            continue;
+        }
+
+        size_t distance;
+        size_t len = find_match(self, src, pos, max, &distance);
+        if (len == 0) {
+            add_literal(self, w, src[pos++]);
+            continue;
+        }
+
+        size_t hashed = pos + 1;    // The first position that was not hashed yet
+        if (lazy && len < LAZY_NICE && pos + 1 + MIN_MATCH <= end) {
+            size_t next_distance;
+            size_t next_max = max < end - pos - 1 ? max : end - pos - 1;
+            size_t next_len = find_match(self, src, pos + 1, next_max, &next_distance);
+            hashed          = pos + 2;
+            if (next_len > len) {
+                add_literal(self, w, src[pos++]);
+                len      = next_len;
+                distance = next_distance;
+            }
+        }
+        add_match(self, w, len, distance);
+        if (len <= insert_max) {
+            for (size_t p = hashed; p < pos + len && p + MIN_MATCH <= end; ++p) {
+                insert(self, src, p);
+            }
+        }
+        pos += len;
+    }
+    if (final) {
+        while (pos < end) add_literal(self, w, src[pos++]);
+    }
+    return pos;
+}
+
+/***********
+ * DYNAMIC HUFFMAN CODES
+ ***********/
+
+// The order the lengths of the code length codes are sent in
+static const uint8_t code_length_order[19] = {
+    16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15,
+};
+
+typedef struct {
+    uint32_t freq;
+    uint32_t sym;
+} Leaf;
+
+static int leaf_cmp(const void *a, const void *b) {
+    const Leaf *x = a, *y = b;
+    return x->freq < y->freq ? -1 : x->freq > y->freq;
+}
+
+// Computes the lengths of a Huffman code for the `count` frequencies of `freqs`, none of them
+// longer than `max_len`. Symbols that never appear get no code. At least two symbols must appear.
+static void huffman_lengths(const uint32_t *freqs, size_t count, uint32_t max_len, uint8_t *lens) {
+    Leaf   leaves[288];
+    size_t n = 0;
+    for (size_t i = 0; i < count; ++i) {
+        lens[i] = 0;
+        if (freqs[i] > 0) leaves[n++] = (Leaf){ freqs[i], (uint32_t)i };
+    }
+    qsort(leaves, n, sizeof(*leaves), leaf_cmp);
+
+    // Moffat and Katajainen's in-place algorithm turns the sorted frequencies into the depths of
+    // the leaves, without building the tree
+    uint32_t a[288];
+    for (size_t i = 0; i < n; ++i) a[i] = leaves[i].freq;
+    a[0] += a[1];
+    size_t root = 0, leaf = 2;
+    for (size_t next = 1; next < n - 1; ++next) {
+        if (leaf >= n || a[root] < a[leaf]) {
+            a[next]   = a[root];
+            a[root++] = (uint32_t)next;
+        } else {
+            a[next] = a[leaf++];
+        }
+        if (leaf >= n || (root < next && a[root] < a[leaf])) {
+            a[next] += a[root];
+            a[root++] = (uint32_t)next;
+        } else {
+            a[next] += a[leaf++];
+        }
+    }
+    a[n - 2] = 0;
+    for (size_t next = n - 2; next-- > 0;) a[next] = a[a[next]] + 1;
+    uint32_t  available = 1, used = 0, depth = 0;
+    ptrdiff_t node = (ptrdiff_t)n - 2, next = (ptrdiff_t)n - 1;
+    while (available > 0) {
+        while (node >= 0 && a[node] == depth) {
+            ++used;
+            --node;
+        }
+        while (available > used) {
+            a[next--] = depth;
+            --available;
+        }
+        available = 2 * used;
+        ++depth;
+        used = 0;
+    }
+
+    // The codes that are too long are cut to `max_len`, then others get longer until the code is
+    // complete again
+    uint32_t counts[33] = { 0 };
+    for (size_t i = 0; i < n; ++i) ++counts[a[i] < 32 ? a[i] : 32];
+    for (uint32_t len = max_len + 1; len <= 32; ++len) counts[max_len] += counts[len];
+    uint32_t total = 0;
+    for (uint32_t len = max_len; len > 0; --len) total += counts[len] << (max_len - len);
+    for (; total != 1u << max_len; --total) {
+        --counts[max_len];
+        for (uint32_t len = max_len - 1; len > 0; --len) {
+            if (counts[len] != 0) {
+                --counts[len];
+                counts[len + 1] += 2;
+                break;
+            }
+        }
+    }
+
+    // The most frequent symbols get the shortest codes
+    for (uint32_t len = 1; len <= max_len; ++len) {
+        for (uint32_t k = counts[len]; k > 0; --k) lens[leaves[--n].sym] = (uint8_t)len;
+    }
+}
+
+// Makes sure at least two of the `count` frequencies of `freqs` are not 0
+static void huffman_pad(uint32_t *freqs, size_t count) {
+    size_t used = 0;
+    for (size_t i = 0; i < count; ++i) used += freqs[i] > 0;
+    for (size_t i = 0; used < 2; ++i) {
+        if (freqs[i] == 0) {
+            freqs[i] = 1;
+            ++used;
+        }
+    }
+}
+
+// The canonical codes of the lengths `lens`
+static void huffman_codes(const uint8_t *lens, size_t count, Code *codes) {
+    uint32_t len_count[16] = { 0 }, next_code[16];
+    for (size_t i = 0; i < count; ++i) ++len_count[lens[i]];
+    len_count[0] = 0;
+    uint32_t code = 0;
+    for (uint32_t len = 1; len < 16; ++len) {
+        code           = (code + len_count[len - 1]) << 1;
+        next_code[len] = code;
+    }
+    for (size_t i = 0; i < count; ++i) {
+        codes[i] = (Code){ lens[i] > 0 ? reverse_bits(next_code[lens[i]]++, lens[i]) : 0, lens[i] };
+    }
+}
+
+// Writes the buffered symbols as a block, with codes made for them unless the fixed codes are
+// smaller. If the bytes they stand for are smaller still, those are stored instead.
+static void block_write(ZlibStream *self, BitWriter *w, bool final) {
+    uint32_t lit_freqs[286] = { 0 }, dist_freqs[30] = { 0 };
+    size_t   bytes          = 0;
+    for (size_t i = 0; i < self->symbol_count; ++i) {
+        uint32_t sym = self->symbols[i];
+        if (sym < 256) {
+            ++lit_freqs[sym];
+            ++bytes;
+        } else {
+            ++lit_freqs[257 + length_symbol[sym & 0xFFFF]];
+            ++dist_freqs[distance_symbol(sym >> 16)];
+            bytes += sym & 0xFFFF;
+        }
+    }
+    lit_freqs[256] = 1;
+    // Decoders only take complete codes, which need two symbols
+    huffman_pad(lit_freqs, 286);
+    huffman_pad(dist_freqs, 30);
+
+    uint8_t lens[286 + 30];
+    uint8_t dist_lens[30];
+    huffman_lengths(lit_freqs, 286, 15, lens);
+    huffman_lengths(dist_freqs, 30, 15, dist_lens);
+    size_t lit_count = 286, dist_count = 30;
+    while (lit_count > 257 && lens[lit_count - 1] == 0) --lit_count;
+    while (dist_count > 1 && dist_lens[dist_count - 1] == 0) --dist_count;
+    memcpy(lens + lit_count, dist_lens, dist_count);
+
+    // The lengths are sent run-length encoded, with codes of their own
+    static const uint8_t repeat_bits[3] = { 2, 3, 7 };
+    uint8_t              runs[286 + 30], run_extra[286 + 30];
+    size_t               run_count = 0;
+    uint32_t             cl_freqs[19] = { 0 };
+    for (size_t i = 0; i < lit_count + dist_count;) {
+        size_t run = 1;
+        while (i + run < lit_count + dist_count && lens[i + run] == lens[i]) ++run;
+        if (lens[i] == 0 && run >= 3) {
+            run                    = run < 138 ? run : 138;
+            runs[run_count]        = run >= 11 ? 18 : 17;
+            run_extra[run_count++] = (uint8_t)(run - (run >= 11 ? 11 : 3));
+            i += run;
+        } else if (lens[i] != 0 && run >= 4) {
+            run                    = run - 1 < 6 ? run - 1 : 6;
+            runs[run_count++]      = lens[i];
+            runs[run_count]        = 16;
+            run_extra[run_count++] = (uint8_t)(run - 3);
+            i += 1 + run;
+        } else {
+            runs[run_count++] = lens[i++];
+        }
+    }
+    for (size_t i = 0; i < run_count; ++i) ++cl_freqs[runs[i]];
+    huffman_pad(cl_freqs, 19);
+    uint8_t cl_lens[19];
+    huffman_lengths(cl_freqs, 19, 7, cl_lens);
+    size_t cl_count = 19;
+    while (cl_count > 4 && cl_lens[code_length_order[cl_count - 1]] == 0) --cl_count;
+
+    // The extra bits are the same with both codes
+    uint64_t dynamic_bits = 3 + 5 + 5 + 4 + 3 * cl_count;
+    uint64_t fixed_bits   = 3;
+    for (size_t i = 0; i < run_count; ++i) {
+        dynamic_bits += cl_lens[runs[i]];
+        if (runs[i] >= 16) dynamic_bits += repeat_bits[runs[i] - 16];
+    }
+    for (size_t i = 0; i < 286; ++i) {
+        dynamic_bits += (uint64_t)lit_freqs[i] * (i < lit_count ? lens[i] : 0);
+        fixed_bits += (uint64_t)lit_freqs[i] * literal_codes[i].len;
+    }
+    for (size_t i = 0; i < 30; ++i) {
+        dynamic_bits += (uint64_t)dist_freqs[i] * dist_lens[i];
+        fixed_bits += (uint64_t)dist_freqs[i] * 5;
+    }
+
+    const uint8_t *block = self->window + self->block_start;
+    self->block_start += bytes;
+    if (stored_bits(bytes) < (fixed_bits < dynamic_bits ? fixed_bits : dynamic_bits)) {
+        put_stored(w, block, bytes, final);
+        self->symbol_count = 0;
+        return;
+    }
+
+    if (fixed_bits <= dynamic_bits) {
+        put_bits(w, final, 1);
+        put_bits(w, 1, 2);    // Fixed Huffman codes
+        for (size_t i = 0; i < self->symbol_count; ++i) {
+            uint32_t sym = self->symbols[i];
+            if (sym < 256) {
+                put_literal(w, (uint8_t)sym);
+            } else {
+                put_match(w, sym & 0xFFFF, sym >> 16);
+            }
+        }
+        put_bits(w, literal_codes[256].bits, literal_codes[256].len);
+        self->symbol_count = 0;
+        return;
+    }
+
+    Code lit_codes[286], dist_codes[30], cl_codes[19];
+    huffman_codes(lens, lit_count, lit_codes);
+    huffman_codes(dist_lens, dist_count, dist_codes);
+    huffman_codes(cl_lens, 19, cl_codes);
+
+    put_bits(w, final, 1);
+    put_bits(w, 2, 2);    // Dynamic Huffman codes
+    put_bits(w, (uint32_t)lit_count - 257, 5);
+    put_bits(w, (uint32_t)dist_count - 1, 5);
+    put_bits(w, (uint32_t)cl_count - 4, 4);
+    for (size_t i = 0; i < cl_count; ++i) put_bits(w, cl_lens[code_length_order[i]], 3);
+    for (size_t i = 0; i < run_count; ++i) {
+        put_bits(w, cl_codes[runs[i]].bits, cl_codes[runs[i]].len);
+        if (runs[i] >= 16) put_bits(w, run_extra[i], repeat_bits[runs[i] - 16]);
+    }
+
+    for (size_t i = 0; i < self->symbol_count; ++i) {
+        uint32_t sym = self->symbols[i];
+        if (sym < 256) {
+            put_bits(w, lit_codes[sym].bits, lit_codes[sym].len);
+            continue;
+        }
+        uint32_t length   = sym & 0xFFFF, distance = sym >> 16;
+        uint32_t len_sym  = length_symbol[length];
+        Code     len_code = lit_codes[257 + len_sym];
+        put_bits(w,
+                 len_code.bits | (length - length_base[len_sym]) << len_code.len,
+                 len_code.len + length_extra[len_sym]);
+        uint32_t dist_sym  = distance_symbol(distance);
+        Code     dist_code = dist_codes[dist_sym];
+        put_bits(w,
+                 dist_code.bits | (distance - distance_base[dist_sym]) << dist_code.len,
+                 dist_code.len + distance_extra[dist_sym]);
+    }
+    put_bits(w, lit_codes[256].bits, lit_codes[256].len);
+    self->symbol_count = 0;
+}
+
+/***********
+ * STREAMS
+ ***********/
+
+// Fixed Huffman codes are at most 9 bits per literal, matches are always shorter than that. A
+// block never takes more than with the fixed codes, plus its header and end. It is written before
+// it is known whether a stored block is smaller, so that is what the output has room for.
+static size_t compressed_bound(size_t size) {
+    return 2 + size + size / 8 + 16 + 4 + (size / BLOCK_SYMBOLS + 2) * 4;
+}
+
+static void put_zlib_header(ZlibStream *self, BitWriter *w) {
+    // The level the header advertises, deflate doesn't need it
+    static const uint8_t flevel[DEFLATE_LEVEL_MAX + 1] = { 0, 0x01, 0x5E, 0x5E, 0x9C };
+    *w->out++ = 0x78;    // 32K window, deflate
+    *w->out++ = flevel[self->level];
+}
+
+static void put_zlib_trailer(ZlibStream *self, BitWriter *w) {
+    if (self->symbols != NULL) block_write(self, w, true);
+    flush_bits(w);
+    for (int shift = 24; shift >= 0; shift -= 8) *w->out++ = (uint8_t)(self->adler >> shift);
+}
+
+void zlib_compress_fast(const void *data, size_t size, mp_StringBuilder *out) {
+    pthread_once(&codes_once, codes_init);
+
+    mp_string_builder_reserve(out, compressed_bound(size));
+    BitWriter w = { .out = (uint8_t *)out->data + out->size };
+
+    ZlibStream stream = {
+        .level = DEFLATE_LEVEL_FAST,
+        .table = mp_allocator_alloc(out->alloc, sizeof(uint32_t) << HASH_BITS),
+        .adler = adler32_update(1, data, size),
+    };
+    memset(stream.table, 0, sizeof(uint32_t) << HASH_BITS);
+
+    put_zlib_header(&stream, &w);
+    fixed_block(&w, stream.table, data, 0, size, true);
+    put_zlib_trailer(&stream, &w);
+
+    out->size = (size_t)((char *)w.out - out->data);
+}
+
+ZlibStream zlib_stream_new(mp_Allocator *alloc, uint32_t level) {
+    if (level < DEFLATE_LEVEL_FAST) level = DEFLATE_LEVEL_FAST;
+    if (level > DEFLATE_LEVEL_MAX) level = DEFLATE_LEVEL_MAX;
+    return (ZlibStream){ .alloc = alloc, .level = level, .adler = 1 };
+}
+
+void zlib_stream_write(ZlibStream       *self,
+                       const void       *data,
+                       size_t            size,
+                       bool              final,
+                       mp_StringBuilder *out) {
+    pthread_once(&codes_once, codes_init);
+
+    bool first = self->table == NULL;
+    if (first) {
+        self->table = mp_allocator_alloc(self->alloc, sizeof(uint32_t) << HASH_BITS);
+        memset(self->table, 0, sizeof(uint32_t) << HASH_BITS);
+        if (levels[self->level].depth > 1) {
+            self->chain = mp_allocator_alloc(self->alloc, sizeof(uint32_t) * WINDOW_SIZE);
+            memset(self->chain, 0, sizeof(uint32_t) * WINDOW_SIZE);
+        }
+        if (levels[self->level].dynamic) {
+            self->symbols = mp_allocator_alloc(self->alloc, sizeof(uint32_t) * BLOCK_SYMBOLS);
+        }
+    }
+    // Up to two windows of history are kept, see below
+    if (self->size + size > self->capacity) {
+        size_t capacity = 2 * WINDOW_SIZE + MAX_MATCH + size;
+        self->window    = mp_allocator_realloc(self->alloc, self->window, self->capacity, capacity);
+        self->capacity  = capacity;
+    }
+    memcpy(self->window + self->size, data, size);
+    self->size += size;
+    self->adler = adler32_update(self->adler, data, size);
+
+    mp_string_builder_reserve(out, compressed_bound(self->size - self->pos));
+    BitWriter w = {
+        .out   = (uint8_t *)out->data + out->size,
+        .bits  = self->bits,
+        .count = self->count,
+    };
+    if (first) put_zlib_header(self, &w);
+    if (self->symbols == NULL) {
+        // Each write is a block of its own, so one that doesn't compress can be stored
+        self->pos = fixed_block(&w, self->table, self->window, self->pos, self->size, final);
+    } else {
+        self->pos = compress_blocks(self, &w, self->window, self->pos, self->size, final);
+    }
+    if (final) {
+        put_zlib_trailer(self, &w);
+    } else if (self->symbol_count > 0) {
+        block_write(self, &w, false);
+    }
+    self->bits  = w.bits;
+    self->count = w.count;
+    out->size   = (size_t)((char *)w.out - out->data);
+
+    // Keep only a window of history, the positions in the tables move with it. It moves by whole
+    // windows so every position keeps its slot in `chain`.
+    if (self->pos > 2 * WINDOW_SIZE) {
+        size_t shift = (self->pos - WINDOW_SIZE) & ~(size_t)(WINDOW_SIZE - 1);
+        memmove(self->window, self->window + shift, self->size - shift);
+        self->size -= shift;
+        self->pos -= shift;
+        self->block_start -= shift;
+        for (size_t i = 0; i < (size_t)1 << HASH_BITS; ++i) {
+            self->table[i] = self->table[i] > shift ? self->table[i] - (uint32_t)shift : 0;
+        }
+        for (size_t i = 0; self->chain != NULL && i < WINDOW_SIZE; ++i) {
+            self->chain[i] = self->chain[i] > shift ? self->chain[i] - (uint32_t)shift : 0;
+        }
+    }
+}
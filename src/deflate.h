@@ -0,0 +1,58 @@
+#ifndef DEFLATE_H
+#define DEFLATE_H
+
+#include "memplus.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// CRC-32 as used by PNG, `crc` is 0 for the first call
+uint32_t crc32_update(uint32_t crc, const void *data, size_t size);
+// Adler-32 as used by zlib, `adler` is 1 for the first call
+uint32_t adler32_update(uint32_t adler, const void *data, size_t size);
+
+// Appends a zlib stream of `data` to `out`, compressed for speed rather than size: one
+// fixed-Huffman block, run-lengths and a single-probe hash table for other matches. Data that
+// doesn't compress is stored as it is instead, so the output never grows by more than the framing.
+// Screen content is mostly flat, so this gets close to zlib's level 1 in a fraction of the time.
+void zlib_compress_fast(const void *data, size_t size, mp_StringBuilder *out);
+
+// The levels of a stream, from the fastest to the smallest output:
+// 1. `zlib_compress_fast()`
+// 2. Each block gets its own Huffman codes
+// 3. Up to 8 earlier positions are tried for each match
+// 4. Up to 32, and a match is dropped if the next byte starts a longer one
+#define DEFLATE_LEVEL_FAST 1
+#define DEFLATE_LEVEL_MAX  4
+
+// The same compression over input that arrives in pieces. Only the last 32K to 64K of input, the
+// hash tables and a block of symbols are kept, so the memory used does not depend on the size of
+// the whole stream.
+typedef struct {
+    mp_Allocator *alloc;
+    uint32_t      level;
+    uint8_t      *window;         // The last 32K of compressed input followed by the pending input
+    size_t        size;           // Bytes in `window`
+    size_t        capacity;       // Size of `window`
+    size_t        pos;            // The next byte of `window` to compress
+    uint32_t     *table;
+    uint32_t     *chain;          // The previous position with the same hash, from level 3
+    uint32_t     *symbols;        // Literals and matches of the current block, from level 2
+    size_t        symbol_count;
+    size_t        block_start;    // Where the input of the buffered symbols starts in `window`
+    uint64_t      bits;           // Bits that did not fill a whole word yet
+    uint32_t      count;
+    uint32_t      adler;
+} ZlibStream;
+
+// `level` is clamped between DEFLATE_LEVEL_FAST and DEFLATE_LEVEL_MAX
+ZlibStream zlib_stream_new(mp_Allocator *alloc, uint32_t level);
+// Appends to `out` as much of the stream as can be compressed so far. The last call sets `final`,
+// which flushes everything and ends the stream.
+void zlib_stream_write(ZlibStream       *self,
+                       const void       *data,
+                       size_t            size,
+                       bool              final,
+                       mp_StringBuilder *out);
+
+#endif /* ifndef DEFLATE_H */
@@ -0,0 +1,300 @@
+#define _DEFAULT_SOURCE
+
+#include "diff.h"
+#include "encode.h"
+#include "prog.h"
+#include "qoi.h"
+#include "trace.h"
+#include "utils.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/param.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
+// Pixels are compared 16 at a time, and only the chunks with a change are looked at one by one
+#define CHUNK_PIXELS 16
+// The changed pixels are grouped by tiles, the changed tiles that touch share a box
+#define TILE_SIZE    32
+
+// Whether a channel of the `CHUNK_PIXELS` pixels at `a` and `b` differs by more than `tolerance`
+static bool chunk_changed(const uint8_t *a, const uint8_t *b, uint8_t tolerance) {
+#if defined(__SSE2__)
+    __m128i zero = _mm_setzero_si128();
+    __m128i tol  = _mm_set1_epi8((char)tolerance);
+    __m128i over = zero;
+    for (size_t i = 0; i < CHUNK_PIXELS * 3; i += 16) {
+        __m128i va = _mm_loadu_si128((const __m128i *)(a + i));
+        __m128i vb = _mm_loadu_si128((const __m128i *)(b + i));
+        // |a - b| of unsigned bytes, then what is left of it above the tolerance
+        __m128i d  = _mm_or_si128(_mm_subs_epu8(va, vb), _mm_subs_epu8(vb, va));
+        over       = _mm_or_si128(over, _mm_subs_epu8(d, tol));
+    }
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(over, zero)) != 0xFFFF;
+#elif defined(__aarch64__)
+    uint8x16_t tol  = vdupq_n_u8(tolerance);
+    uint8x16_t over = vdupq_n_u8(0);
+    for (size_t i = 0; i < CHUNK_PIXELS * 3; i += 16) {
+        uint8x16_t d = vabdq_u8(vld1q_u8(a + i), vld1q_u8(b + i));
+        over         = vorrq_u8(over, vqsubq_u8(d, tol));
+    }
+    return vmaxvq_u8(over) != 0;
+#else
+    for (size_t i = 0; i < CHUNK_PIXELS * 3; ++i) {
+        if ((a[i] > b[i] ? a[i] - b[i] : b[i] - a[i]) > tolerance) return true;
+    }
+    return false;
+#endif
+}
+
+static bool pixel_changed(const uint8_t *a, const uint8_t *b, uint8_t tolerance) {
+    for (size_t c = 0; c < 3; ++c) {
+        if ((a[c] > b[c] ? a[c] - b[c] : b[c] - a[c]) > tolerance) return true;
+    }
+    return false;
+}
+
+static void box_add(DiffBox *box, uint32_t x, uint32_t y) {
+    if (box->x0 >= box->x1) {
+        *box = (DiffBox){ x, y, x + 1, y + 1 };
+        return;
+    }
+    box->x0 = MIN(box->x0, x);
+    box->y0 = MIN(box->y0, y);
+    box->x1 = MAX(box->x1, x + 1);
+    box->y1 = MAX(box->y1, y + 1);
+}
+
+static void box_merge(DiffBox *box, const DiffBox *other) {
+    box->x0 = MIN(box->x0, other->x0);
+    box->y0 = MIN(box->y0, other->y0);
+    box->x1 = MAX(box->x1, other->x1);
+    box->y1 = MAX(box->y1, other->y1);
+}
+
+// Merges the tiles with changes that touch, diagonals included, into one box each
+static void boxes_from_tiles(DiffBox *tiles, uint32_t columns, uint32_t rows, DiffResult *result) {
+    size_t    count = (size_t)columns * rows;
+    uint32_t *stack = mp_allocator_alloc(g_alloc, count * sizeof(*stack));
+    result->boxes   = mp_allocator_alloc(g_alloc, count * sizeof(*result->boxes));
+
+    for (size_t i = 0; i < count; ++i) {
+        if (tiles[i].x0 >= tiles[i].x1) continue;
+        DiffBox box  = tiles[i];
+        size_t  top  = 0;
+        stack[top++] = (uint32_t)i;
+        tiles[i]     = (DiffBox){ 0 };    // An empty tile is never visited again
+        while (top > 0) {
+            uint32_t tile = stack[--top];
+            uint32_t tx = tile % columns, ty = tile / columns;
+            for (uint32_t ny = ty == 0 ? 0 : ty - 1; ny <= MIN(ty + 1, rows - 1); ++ny) {
+                for (uint32_t nx = tx == 0 ? 0 : tx - 1; nx <= MIN(tx + 1, columns - 1); ++nx) {
+                    DiffBox *next = &tiles[(size_t)ny * columns + nx];
+                    if (next->x0 >= next->x1) continue;
+                    box_merge(&box, next);
+                    *next        = (DiffBox){ 0 };
+                    stack[top++] = ny * columns + nx;
+                }
+            }
+        }
+        result->boxes[result->box_count++] = box;
+    }
+}
+
+void diff_frames(const PixelBuffer *frame,
+                 const PixelBuffer *reference,
+                 uint32_t           tolerance,
+                 uint64_t           threshold,
+                 PixelBuffer       *image,
+                 DiffResult        *result) {
+    uint32_t width = frame->width, height = frame->height;
+    uint32_t columns = (width + TILE_SIZE - 1) / TILE_SIZE;
+    uint32_t rows    = (height + TILE_SIZE - 1) / TILE_SIZE;
+    DiffBox *tiles   = mp_allocator_alloc(g_alloc, (size_t)columns * rows * sizeof(*tiles));
+    memset(tiles, 0, (size_t)columns * rows * sizeof(*tiles));
+    uint8_t tol = (uint8_t)MIN(tolerance, 255);
+    *result     = (DiffResult){ .complete = true };
+
+    // The unchanged pixels of the image are faded so the changed ones stand out
+    if (image != NULL) {
+        for (uint32_t y = 0; y < height; ++y) {
+            const uint8_t *src = frame->data + y * frame->stride;
+            uint8_t       *dst = image->data + y * image->stride;
+            for (size_t i = 0; i < (size_t)width * 3; ++i) dst[i] = (uint8_t)(src[i] / 3 + 170);
+        }
+    }
+
+    for (uint32_t y = 0; y < height && result->complete; ++y) {
+        const uint8_t *a   = frame->data + y * frame->stride;
+        const uint8_t *b   = reference->data + y * reference->stride;
+        DiffBox       *row = tiles + (size_t)(y / TILE_SIZE) * columns;
+        for (uint32_t x = 0; x < width;) {
+            uint32_t n = MIN(CHUNK_PIXELS, width - x);
+            if (n == CHUNK_PIXELS && !chunk_changed(a + (size_t)x * 3, b + (size_t)x * 3, tol)) {
+                x += n;
+                continue;
+            }
+            for (uint32_t end = x + n; x < end; ++x) {
+                if (!pixel_changed(a + (size_t)x * 3, b + (size_t)x * 3, tol)) continue;
+                ++result->changed;
+                box_add(&row[x / TILE_SIZE], x, y);
+                if (image == NULL) continue;
+                memcpy(image->data + y * image->stride + (size_t)x * 3, "\xff\0\0", 3);
+            }
+            // Once the threshold is exceeded, the rest can't change the verdict
+            if (image == NULL && result->changed > threshold) {
+                result->complete = y == height - 1 && x == width;
+                break;
+            }
+        }
+    }
+    result->exceeded = result->changed > threshold;
+
+    size_t span_boxes = trace_begin("diff_boxes");
+    boxes_from_tiles(tiles, columns, rows, result);
+    trace_end(span_boxes);
+}
+
+// Maps the reference at `path` and points `frame` at its pixels, decoding it if it is a QOI image.
+// `*map` and `*map_size` must be unmapped once the frame is not used anymore.
+static bool reference_load(const char *path, PixelBuffer *frame, void **map, size_t *map_size) {
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        eprintf("Failed to open %s: %s\n", path, strerror(errno));
+        return false;
+    }
+    struct stat s;
+    if (fstat(fd, &s) != 0 || s.st_size == 0) {
+        eprintf("Failed to read %s\n", path);
+        close(fd);
+        return false;
+    }
+    *map_size = (size_t)s.st_size;
+    *map      = mmap(NULL, *map_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (*map == MAP_FAILED) {
+        eprintf("Failed to read %s: %s\n", path, strerror(errno));
+        *map = NULL;
+        return false;
+    }
+
+    // A PPM is used where it is mapped, nothing is copied
+    bool ok = ext2imgtype(file_ext(path)) == IMGTYPE_QOI
+                  ? qoi_decode(*map, *map_size, g_alloc, frame)
+                  : ppm_parse(*map, *map_size, frame);
+    if (!ok) eprintf("Failed to load the reference %s\n", path);
+    return ok;
+}
+
+// Writes `frame` encoded as `imgtype` to `path`
+static bool frame_write(const PixelBuffer *frame, Imgtype imgtype, const char *path) {
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1) {
+        eprintf("Failed to open %s: %s\n", path, strerror(errno));
+        return false;
+    }
+    EncodeOutput output = encode_output_new(g_alloc, fd);
+    bool         ok     = encode_frame(frame, imgtype, DEFLATE_LEVEL_FAST, &output);
+    ok                  = close(fd) == 0 && ok;
+    if (!ok) eprintf("Failed to write %s: %s\n", path, strerror(errno));
+    return ok;
+}
+
+// The image type `--diff-image` and the references are written as
+static Imgtype diff_imgtype(const char *path) {
+    Imgtype imgtype = ext2imgtype(file_ext(path));
+    return imgtype == IMGTYPE_PNG ? IMGTYPE_PNG_FAST : imgtype;
+}
+
+static void result_print(const PixelBuffer *frame, const DiffResult *result, bool created) {
+    printf("{\"width\":%u,\"height\":%u,\"changed\":%llu,\"threshold\":%u,\"exceeded\":%s,"
+           "\"complete\":%s,\"created\":%s,\"boxes\":[",
+           frame->width,
+           frame->height,
+           (unsigned long long)result->changed,
+           g_config->diff_threshold,
+           result->exceeded ? "true" : "false",
+           result->complete ? "true" : "false",
+           created ? "true" : "false");
+    for (size_t i = 0; i < result->box_count; ++i) {
+        const DiffBox *box = &result->boxes[i];
+        printf("%s{\"x\":%u,\"y\":%u,\"width\":%u,\"height\":%u}",
+               i == 0 ? "" : ",",
+               box->x0,
+               box->y0,
+               box->x1 - box->x0,
+               box->y1 - box->y0);
+    }
+    printf("]}\n");
+}
+
+bool diff_against(const PixelBuffer *frame) {
+    int         result   = true;
+    void       *map      = NULL;
+    size_t      map_size = 0;
+    DiffResult  diff     = { .complete = true };
+    bool        created  = false;
+    const char *path     = g_config->diff_reference;
+
+    // The reference of a slot is kept with gripper's state, the first capture becomes it
+    if (path == NULL) {
+        path = state_path(alloc_strf("references/%s.qoi", g_config->slot).cstr);
+        if (path == NULL) return false;
+        if (access(path, F_OK) != 0) {
+            if (!make_parent_dirs(path) || !frame_write(frame, IMGTYPE_QOI, path)) return false;
+            if (g_config->verbose) printf("Saved the reference of slot `%s`\n", g_config->slot);
+            created = true;
+        }
+    }
+
+    PixelBuffer reference = *frame;
+    if (!created) {
+        size_t span_reference = trace_begin("reference");
+        bool   ok             = reference_load(path, &reference, &map, &map_size);
+        trace_end(span_reference);
+        if (!ok) return_defer(false);
+    }
+    if (reference.width != frame->width || reference.height != frame->height) {
+        eprintf("The capture is %ux%u but the reference is %ux%u\n",
+                frame->width,
+                frame->height,
+                reference.width,
+                reference.height);
+        return_defer(false);
+    }
+
+    PixelBuffer image = *frame, *image_ptr = NULL;
+    if (g_config->diff_image != NULL) {
+        image.stride = (size_t)frame->width * 3;
+        image.data   = mp_allocator_alloc(g_alloc, image.stride * frame->height);
+        image_ptr    = &image;
+    }
+    size_t span_compare = trace_begin("compare");
+    diff_frames(frame,
+                &reference,
+                g_config->diff_tolerance,
+                g_config->diff_threshold,
+                image_ptr,
+                &diff);
+    trace_end(span_compare);
+
+    if (image_ptr != NULL &&
+        !frame_write(&image, diff_imgtype(g_config->diff_image), g_config->diff_image)) {
+        return_defer(false);
+    }
+    result_print(frame, &diff, created);
+    if (diff.exceeded) return_defer(false);
+
+defer:
+    if (map != NULL) munmap(map, map_size);
+    return result;
+}
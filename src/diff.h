@@ -0,0 +1,38 @@
+#ifndef DIFF_H
+#define DIFF_H
+
+#include "pixfmt.h"
+#include <stdbool.h>
+#include <stdint.h>
+
+// The bounding box of a group of changed pixels, `x1` and `y1` excluded
+typedef struct {
+    uint32_t x0, y0;
+    uint32_t x1, y1;
+} DiffBox;
+
+typedef struct {
+    uint64_t changed;      // Changed pixels, only those found before stopping if not `complete`
+    bool     exceeded;     // More pixels changed than the threshold allows
+    bool     complete;     // Every pixel was compared
+    DiffBox *boxes;        // Changed pixels that touch each other, roughly, share a box
+    size_t   box_count;
+} DiffResult;
+
+// Compares `frame` with `reference`, PIXFMT_RGB frames of the same size. A pixel has changed if
+// one of its channels differs by more than `tolerance`. The comparison stops as soon as more than
+// `threshold` pixels changed, unless `image` is not NULL: every pixel is compared then, and
+// `image`, which must be the size of `frame`, shows the changed pixels in red over the others.
+void diff_frames(const PixelBuffer *frame,
+                 const PixelBuffer *reference,
+                 uint32_t           tolerance,
+                 uint64_t           threshold,
+                 PixelBuffer       *image,
+                 DiffResult        *result);
+
+// Compares `frame` with the reference of mode `diff` and prints the result as JSON. The reference
+// of a slot is created from `frame` if there is none yet.
+// Returns false if the comparison failed or if more than `diff_threshold` pixels changed.
+bool diff_against(const PixelBuffer *frame);
+
+#endif /* ifndef DIFF_H */
@@ -0,0 +1,195 @@
+#include "encode.h"
+#include "png.h"
+#include "qoi.h"
+#include "utils.h"
+#include <assert.h>
+#include <ctype.h>
+#include <errno.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+EncodeOutput encode_output_new(mp_Allocator *alloc, int fd) {
+    return (EncodeOutput){ .buffer = mp_string_builder_new(alloc), .fd = fd };
+}
+
+// Writes every buffer of `iov`, which is modified on short writes
+static bool writev_all(int fd, struct iovec *iov, int count) {
+    while (count > 0) {
+        ssize_t written = writev(fd, iov, count);
+        if (written == -1) {
+            if (errno == EINTR) continue;
+            return false;
+        }
+        size_t left = (size_t)written;
+        for (; count > 0 && left >= iov->iov_len; ++iov, --count) left -= iov->iov_len;
+        if (count > 0) {
+            iov->iov_base = (char *)iov->iov_base + left;
+            iov->iov_len -= left;
+        }
+    }
+    return true;
+}
+
+void encode_output_write(EncodeOutput *self, const void *data, size_t size) {
+    if (self->fd == -1) {
+        mp_string_builder_append_n(&self->buffer, data, size);
+        return;
+    }
+    if (self->failed) return;
+    struct iovec iov[2] = {
+        { .iov_base = self->buffer.data, .iov_len = self->buffer.size },
+        { .iov_base = (void *)data, .iov_len = size },
+    };
+    self->failed = !writev_all(self->fd, iov, 2);
+    self->written += self->buffer.size + size;
+    self->buffer.size = 0;
+}
+
+void encode_output_flush(EncodeOutput *self, bool all) {
+    if (self->fd == -1 || (!all && self->buffer.size < ENCODE_BATCH_SIZE)) return;
+    encode_output_write(self, NULL, 0);
+}
+
+uint32_t encode_batch_rows(size_t stride) {
+    size_t rows = ENCODE_BATCH_SIZE / (stride == 0 ? 1 : stride);
+    return rows == 0 ? 1 : (uint32_t)(rows < UINT32_MAX ? rows : UINT32_MAX);
+}
+
+bool encode_in_tree(Imgtype imgtype) {
+    return imgtype == IMGTYPE_QOI || imgtype == IMGTYPE_PNG_FAST;
+}
+
+// Reads the next number of a PPM header, skipping whitespace and comments
+static bool ppm_number(const uint8_t **p, const uint8_t *end, uint32_t *value) {
+    while (*p < end && (isspace(**p) || **p == '#')) {
+        if (**p == '#') {
+            while (*p < end && **p != '\n') ++*p;
+        } else {
+            ++*p;
+        }
+    }
+    if (*p == end || !isdigit(**p)) return false;
+    uint64_t v = 0;
+    while (*p < end && isdigit(**p) && v <= UINT32_MAX) v = v * 10 + (uint64_t)(*(*p)++ - '0');
+    if (v > UINT32_MAX) return false;
+    *value = (uint32_t)v;
+    return true;
+}
+
+// Parses the header at the start of `data`, returns false if it is invalid or not all there yet
+static bool ppm_header(const uint8_t *data,
+                       size_t         size,
+                       uint32_t      *width,
+                       uint32_t      *height,
+                       uint32_t      *maxval,
+                       size_t        *header_size) {
+    const uint8_t *p   = data;
+    const uint8_t *end = p + size;
+    if (size < 2 || p[0] != 'P' || p[1] != '6') return false;
+    p += 2;
+    if (!ppm_number(&p, end, width) || !ppm_number(&p, end, height) ||
+        !ppm_number(&p, end, maxval) || p == end || !isspace(*p)) {
+        return false;
+    }
+    *header_size = (size_t)(p - data) + 1;    // A single whitespace separates it from the pixels
+    return true;
+}
+
+bool ppm_read(int fd, mp_StringBuilder *out) {
+    bool   sized = false;
+    size_t start = out->size;
+    for (;;) {
+        if (out->size + 1 >= out->capacity) mp_string_builder_reserve(out, 64 * 1024);
+        ssize_t bytes = read(fd, out->data + out->size, out->capacity - out->size - 1);
+        if (bytes == -1 && errno == EINTR) continue;
+        if (bytes == -1) return false;
+        if (bytes == 0) break;
+        out->size += (size_t)bytes;
+
+        uint32_t       width, height, maxval;
+        size_t         header;
+        const uint8_t *image = (const uint8_t *)out->data + start;
+        if (sized || !ppm_header(image, out->size - start, &width, &height, &maxval, &header))
+            continue;
+        sized       = true;
+        size_t want = start + header + (size_t)width * height * (maxval < 256 ? 3 : 6) + 1;
+        if (want > out->capacity) {
+            out->data     = mp_allocator_realloc(out->alloc, out->data, out->capacity, want);
+            out->capacity = want;
+        }
+    }
+    out->data[out->size] = '\0';
+    return true;
+}
+
+bool ppm_parse(const void *data, size_t size, PixelBuffer *frame) {
+    uint32_t width, height, maxval;
+    size_t   header;
+    if (size < 2 || ((const char *)data)[0] != 'P' || ((const char *)data)[1] != '6') {
+        eprintf("Expected a binary PPM image\n");
+        return false;
+    }
+    if (!ppm_header(data, size, &width, &height, &maxval, &header)) {
+        eprintf("Invalid PPM header\n");
+        return false;
+    }
+    if (maxval != 255) {
+        eprintf("Only 8-bit PPM images are supported\n");
+        return false;
+    }
+    if ((size - header) / 3 / (width == 0 ? 1 : width) < height) {
+        eprintf("Truncated PPM image\n");
+        return false;
+    }
+
+    *frame = (PixelBuffer){
+        .data   = (uint8_t *)data + header,
+        .width  = width,
+        .height = height,
+        .stride = (size_t)width * 3,
+        .format = PIXFMT_RGB,
+    };
+    return true;
+}
+
+void ppm_encode(const PixelBuffer *frame, EncodeOutput *out) {
+    mp_string_builder_appendf(&out->buffer, "P6\n%u %u\n255\n", frame->width, frame->height);
+    size_t stride = (size_t)frame->width * 3;
+
+    // Rows that are already laid out like PPM go out as they are
+    if (frame->format == PIXFMT_RGB && !frame->y_invert && frame->stride == stride) {
+        encode_output_write(out, frame->data, stride * frame->height);
+        return;
+    }
+
+    uint32_t batch = encode_batch_rows(stride);
+    uint8_t *rows  = mp_allocator_alloc(out->buffer.alloc, stride * batch);
+    for (uint32_t y = 0; y < frame->height; y += batch) {
+        uint32_t count = frame->height - y < batch ? frame->height - y : batch;
+        pixfmt_convert_rows(frame, y, count, rows, stride, PIXFMT_RGB);
+        encode_output_write(out, rows, stride * count);
+    }
+}
+
+bool encode_frame(const PixelBuffer *frame, Imgtype imgtype, uint32_t level, EncodeOutput *out) {
+    switch (imgtype) {
+        case IMGTYPE_QOI : {
+            qoi_encode(frame, out);
+        } break;
+        case IMGTYPE_PNG_FAST : {
+            png_encode_fast(frame, level, NULL, 0, out);
+        } break;
+        case IMGTYPE_PPM : {
+            ppm_encode(frame, out);
+        } break;
+        case IMGTYPE_PNG :
+        case IMGTYPE_JPEG :
+        case IMGTYPE_JPG :
+        case IMGTYPE_NONE :
+        case IMGTYPE_COUNT : {
+            unreachable();
+        }
+    }
+    encode_output_flush(out, true);
+    return !out->failed;
+}
@@ -0,0 +1,50 @@
+#ifndef ENCODE_H
+#define ENCODE_H
+
+#include "deflate.h"
+#include "memplus.h"
+#include "pixfmt.h"
+#include "prog.h"
+#include <stdbool.h>
+
+// Rows are converted, filtered and compressed about this many bytes at a time, which stays in
+// the cache between the steps
+#define ENCODE_BATCH_SIZE (256 * 1024)
+
+// Where an encoder appends the image. With a file descriptor, whatever is buffered is written out
+// after each batch of rows, so the encoded image is never held in memory as a whole.
+typedef struct {
+    mp_StringBuilder buffer;
+    int              fd;         // -1 keeps the whole image in `buffer`
+    size_t           written;    // Bytes written to `fd` so far
+    bool             failed;     // A write to `fd` failed, `errno` tells why
+} EncodeOutput;
+
+EncodeOutput encode_output_new(mp_Allocator *alloc, int fd);
+// Writes out the buffer once it holds a batch, or whatever it holds if `all`
+void         encode_output_flush(EncodeOutput *self, bool all);
+// Appends `size` bytes of `data`. With a file descriptor, they are written along with the buffer
+// in one `writev()` instead of being copied into it.
+void         encode_output_write(EncodeOutput *self, const void *data, size_t size);
+// How many rows of `stride` bytes make a batch, at least one
+uint32_t     encode_batch_rows(size_t stride);
+
+// Whether gripper encodes `imgtype` itself from a raw frame instead of letting grim do it
+bool encode_in_tree(Imgtype imgtype);
+
+// Reads a whole binary PPM from `fd` into `out`. Once the header is in, the buffer is grown to the
+// exact size of the image, so a large frame is neither copied nor over-allocated.
+bool ppm_read(int fd, mp_StringBuilder *out);
+
+// Points `frame` at the pixels of the binary PPM in `data`, nothing is copied
+bool ppm_parse(const void *data, size_t size, PixelBuffer *frame);
+
+// Writes `frame` as a binary PPM
+void ppm_encode(const PixelBuffer *frame, EncodeOutput *out);
+
+// Writes `frame` encoded as `imgtype` to `out` and flushes it. `imgtype` must be encoded in tree,
+// or PPM. PNGs are compressed at the deflate `level`, the other types ignore it.
+// Returns false if writing failed.
+bool encode_frame(const PixelBuffer *frame, Imgtype imgtype, uint32_t level, EncodeOutput *out);
+
+#endif /* ifndef ENCODE_H */
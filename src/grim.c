@@ -1,24 +1,31 @@
+#define _DEFAULT_SOURCE
+
 #include "grim.h"
+#include "budget.h"
+#include "dedup.h"
+#include "encode.h"
+#include "hash.h"
 #include "memplus.h"
 #include "prog.h"
+#include "rawframe.h"
+#include "redact.h"
+#include "thumbnail.h"
 #include "sys/stat.h"
+#include "trace.h"
 #include "unistd.h"
 #include "utils.h"
 #include <assert.h>
 #include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
 
 bool notify(void) {
     if (!command_found("notify-send") || g_config->save_mode == SAVEMODE_NONE) return false;
-    const char *name = NULL;
-    if (g_config->save_mode == SAVEMODE_DISK) {
-        name = g_config->output_path;
-    } else if (g_config->save_mode == SAVEMODE_CLIPBOARD) {
-        name = "clipboard";
-    } else if (g_config->save_mode == (SAVEMODE_DISK | SAVEMODE_CLIPBOARD)) {
-        name = alloc_strf("%s and clipboard", g_config->output_path).cstr;
-    }
+    const char *name = save_destination(false);
 
     // TODO: maybe print the region?
     // TODO: add an action to the notification that maybe brings an option to view/edit the image
@@ -35,88 +42,462 @@ bool notify(void) {
     return true;
 }
 
-bool grim(const char *region) {
-    char *cmd = NULL;
+// Links the output path to an identical screenshot taken before.
+// Returns false if there is none, or if it could not be linked.
+static bool dedup_link(uint64_t hash) {
+    DedupEntry entry;
+    if (!dedup_lookup(hash, g_config->imgtype, &entry)) return false;
 
-    mp_String options =
-        mp_string_newf(g_alloc, "-t %s", g_config->scale, imgtype2str(g_config->imgtype));
-    // NOTE: too many allocs, but it may be just fine
-    if (g_config->scale != 1.0) options = alloc_strf("%s -s %f", options.cstr, g_config->scale);
+    char *output_path = realpath(g_config->output_path, NULL);
+    bool  same_file   = output_path != NULL && streq(entry.path, output_path);
+    free(output_path);
+    if (same_file) {
+        if (g_config->verbose) printf("Identical to the existing file, nothing to write\n");
+        return true;
+    }
+
+    // `link()` doesn't replace, the user has already agreed to override the file
+    if (unlink(g_config->output_path) != 0 && errno != ENOENT) {
+        eprintf("Failed to remove %s: %s\n", g_config->output_path, strerror(errno));
+        return false;
+    }
+    if (link(entry.path, g_config->output_path) != 0) {
+        // Most likely on another filesystem, the caller writes a copy
+        if (g_config->verbose) printf("Failed to link to %s: %s\n", entry.path, strerror(errno));
+        return false;
+    }
+    if (g_config->verbose) printf("Identical to %s, linked to it\n", entry.path);
+    return true;
+}
+
+// Remembers the file just written to the output path
+static bool dedup_remember(uint64_t hash, const char *region) {
+    char *output_path = realpath(g_config->output_path, NULL);
+    if (output_path == NULL || strlen(output_path) >= DEDUP_PATH_SIZE) {
+        free(output_path);
+        return true;
+    }
+    DedupEntry entry = {
+        .hash      = hash,
+        .timestamp = (int64_t)time(NULL),
+        .mode      = g_config->mode,
+        .imgtype   = g_config->imgtype,
+    };
+    snprintf(entry.path, sizeof(entry.path), "%s", output_path);
+    if (region != NULL) snprintf(entry.geometry, sizeof(entry.geometry), "%s", region);
+    free(output_path);
+
+    return dedup_insert(&entry);
+}
+
+// Hashes the pixels of `frame`. A frame cropped from a bigger one is packed first, so it hashes the
+// same as a capture of its region alone.
+static uint64_t frame_hash(const PixelBuffer *frame) {
+    size_t row = (size_t)frame->width * pixfmt_bpp(frame->format);
+    if (frame->stride == row) return hash64(frame->data, row * frame->height);
+    uint8_t *packed = mp_allocator_alloc(g_alloc, row * frame->height);
+    for (uint32_t y = 0; y < frame->height; ++y) {
+        memcpy(packed + y * row, frame->data + y * frame->stride, row);
+    }
+    return hash64(packed, row * frame->height);
+}
+
+// Encodes `frame` straight into `fd`, one batch of rows at a time
+static bool encode_to(const PixelBuffer *frame, uint32_t level, int fd, size_t *size) {
+    size_t       span_encode = trace_begin("encode");
+    EncodeOutput output      = encode_output_new(g_alloc, fd);
+    bool         ok          = encode_frame(frame, g_config->imgtype, level, &output);
+    trace_end(span_encode);
+    *size = output.written;
+    return ok;
+}
+
+// Saves `frame`, the parsed raw frame, or the image grim encoded if it is NULL. A PNG of `frame`
+// is deflated at `level`.
+static bool save_frame(const char             *region,
+                       const mp_StringBuilder *captured,
+                       const PixelBuffer      *frame,
+                       uint32_t                level) {
+    bool raw   = frame != NULL;
+    bool dedup = g_config->dedup && (g_config->save_mode & SAVEMODE_DISK);
+
+    // Gripper hashes the pixels of the frames it encodes, so a duplicate is not even encoded
+    uint64_t hash = 0;
+    if (dedup) {
+        size_t span_dedup = trace_begin("dedup");
+        hash              = raw ? frame_hash(frame) : hash64(captured->data, captured->size);
+        bool linked       = dedup_link(hash);
+        trace_end(span_dedup);
+        if (linked) return true;
+    }
+
+    // With a file, the clipboard and the file descriptor get a copy of it afterwards
+    bool disk      = g_config->save_mode & SAVEMODE_DISK;
+    bool clipboard = !disk && (g_config->save_mode & SAVEMODE_CLIPBOARD);
+    bool to_fd     = !disk && (g_config->save_mode & SAVEMODE_FD);
+
+    // A frame that goes to both the clipboard and the file descriptor is only encoded once
+    const void *image = captured->data;
+    size_t      size  = captured->size;
+    if (raw && clipboard && to_fd) {
+        size_t       span_encode = trace_begin("encode");
+        EncodeOutput output      = encode_output_new(g_alloc, -1);
+        bool         ok          = encode_frame(frame, g_config->imgtype, level, &output);
+        trace_end(span_encode);
+        if (!ok) {
+            eprintf("Failed to encode the image\n");
+            return false;
+        }
+        image = output.buffer.data;
+        size  = output.buffer.size;
+        raw   = false;
+    }
+
+    if (disk) {
+        if (raw) {
+            int fd = open(g_config->output_path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+            if (fd == -1) {
+                eprintf("Failed to open %s: %s\n", g_config->output_path, strerror(errno));
+                return false;
+            }
+            bool ok = encode_to(frame, level, fd, &size);
+            if (!ok) eprintf("Failed to write to %s: %s\n", g_config->output_path, strerror(errno));
+            if (close(fd) != 0 && ok) {
+                eprintf("Failed to write to %s: %s\n", g_config->output_path, strerror(errno));
+                ok = false;
+            }
+            if (!ok) return false;
+        } else if (!write_file(g_config->output_path, image, size)) {
+            return false;
+        }
+        if (dedup && !dedup_remember(hash, region)) return false;
+    }
+    if (to_fd) {
+        bool ok = raw ? encode_to(frame, level, g_config->output_fd, &size)
+                      : write_all(g_config->output_fd, image, size);
+        if (!ok) {
+            eprintf("Failed to write the image to the file descriptor: %s\n", strerror(errno));
+            return false;
+        }
+    }
+    if (clipboard) {
+        size_t  span_clipboard = trace_begin("clipboard");
+        CmdPipe wl_copy;
+        bool    ok = cmd_pipe_open(&wl_copy, "wl-copy", CMD_PIPE_STDIN);
+        if (ok) {
+            ok = raw ? encode_to(frame, level, wl_copy.fd, &size)
+                     : write_all(wl_copy.fd, image, size);
+            ok = cmd_pipe_close(&wl_copy) && ok;
+        }
+        if (!ok) {
+            eprintf("Failed to copy the image to the clipboard\n");
+            return false;
+        }
+        trace_end(span_clipboard);
+    }
+    return true;
+}
+
+static bool save_parsed(const char             *region,
+                        const mp_StringBuilder *captured,
+                        const PixelBuffer      *frame,
+                        uint64_t                begin_us);
+
+// Saves what grim wrote to its stdout: a raw frame for the types encoded in tree, or the image.
+// `redaction` is NULL if nothing is redacted. The capture began at `begin_us`, `--budget` counts
+// from there.
+static bool save_captured(const char             *region,
+                          const mp_StringBuilder *captured,
+                          RedactQuery            *redaction,
+                          uint64_t                begin_us) {
+    // A PPM is the raw frame already, it is written from the parsed frame like the other types
+    bool        raw = encode_in_tree(g_config->imgtype) || g_config->imgtype == IMGTYPE_PPM;
+    PixelBuffer frame;
+    if (raw && !ppm_parse(captured->data, captured->size, &frame)) {
+        if (redaction != NULL) redact_finish(redaction, NULL);
+        return false;
+    }
+    // Before anything reads the frame, so no copy of it is saved unredacted. `redact_check()` made
+    // sure the frame is raw.
+    if (redaction != NULL && !redact_finish(redaction, &frame)) return false;
+    return save_parsed(region, captured, raw ? &frame : NULL, begin_us);
+}
+
+// Saves `frame`, or the image in `captured` if it is NULL, with its thumbnails and at the deflate
+// level `--budget` leaves time for
+static bool save_parsed(const char             *region,
+                        const mp_StringBuilder *captured,
+                        const PixelBuffer      *frame,
+                        uint64_t                begin_us) {
+    bool raw = frame != NULL;
+
+    // The thumbnails are downscaled by the pool while the image is encoded and written
+    ThumbnailJob thumbnails;
+    bool thumbnail = raw && g_config->thumbnails && (g_config->save_mode & SAVEMODE_DISK);
+    if (thumbnail) thumbnail_start(&thumbnails, frame);
+
+    // The deflate level is picked from what is left of the budget once the frame is here
+    uint32_t   level  = DEFLATE_LEVEL_FAST;
+    bool       budget = raw && g_config->budget_ms > 0 && g_config->imgtype == IMGTYPE_PNG_FAST;
+    FrameStats stats;
+    if (budget) {
+        size_t span_budget = trace_begin("budget");
+        budget_sample(frame, &stats);
+        level = budget_pick(frame, &stats, trace_now_us() - begin_us);
+        trace_end(span_budget);
+    }
+
+    uint64_t save_us = trace_now_us();
+    bool     ok      = save_frame(region, captured, frame, level);
+    if (budget && ok && !budget_record(frame, &stats, level, trace_now_us() - save_us)) {
+        if (g_config->verbose) eprintf("Failed to record how long encoding took\n");
+    }
+    // A screenshot without thumbnails is still saved, file managers make them as they used to
+    if (thumbnail && !thumbnail_finish(&thumbnails, ok ? g_config->output_path : NULL)) {
+        if (g_config->verbose) eprintf("Failed to write the thumbnails\n");
+    }
+    return ok;
+}
+
+// Appends the grim command that captures `region`, or the toplevel `toplevel`, or the whole output
+// if both are NULL, as `imgtype`. Where the image goes is left to the caller.
+static void grim_command(mp_StringBuilder *builder,
+                         const char       *region,
+                         const char       *toplevel,
+                         Imgtype           imgtype) {
+    mp_string_builder_appendf(builder, "grim -t %s", imgtype2str(imgtype));
+    if (g_config->scale != 1.0) mp_string_builder_appendf(builder, " -s %f", g_config->scale);
     if (g_config->jpeg_quality != DEFAULT_JPEG_QUALITY ||
         g_config->png_level != DEFAULT_PNG_LEVEL) {
-        switch (g_config->imgtype) {
+        switch (imgtype) {
             case IMGTYPE_PNG : {
-                options = alloc_strf("%s -l %d", options.cstr, g_config->png_level);
+                mp_string_builder_appendf(builder, " -l %d", g_config->png_level);
             } break;
             case IMGTYPE_JPG :
             case IMGTYPE_JPEG : {
-                options = alloc_strf("%s -q %d", options.cstr, g_config->jpeg_quality);
+                mp_string_builder_appendf(builder, " -q %d", g_config->jpeg_quality);
             } break;
-            case IMGTYPE_PPM :   break;
+            case IMGTYPE_PPM :
+            case IMGTYPE_QOI :
+            case IMGTYPE_PNG_FAST : break;
             case IMGTYPE_NONE :
             case IMGTYPE_COUNT : {
                 unreachable();
             }
         }
     }
-    if (g_config->cursor) options = alloc_strf("%s -c", options.cstr);
-    if (g_config->output_name != NULL && region == NULL)
-        options = alloc_strf("%s -o %s", options.cstr, g_config->output_name);
-    if (region != NULL) options = alloc_strf("%s -g \"%s\"", options.cstr, region);
+    if (g_config->cursor) mp_string_builder_append(builder, " -c");
+    if (g_config->output_name != NULL && region == NULL && toplevel == NULL)
+        mp_string_builder_appendf(builder, " -o %s", shell_quote(g_config->output_name));
+    if (region != NULL) mp_string_builder_appendf(builder, " -g \"%s\"", region);
+    if (toplevel != NULL) mp_string_builder_appendf(builder, " -T %s", shell_quote(toplevel));
+}
 
-    if (g_config->save_mode & SAVEMODE_DISK) {
-        if (access(g_config->output_path, F_OK) == 0) {
-            struct stat s;
-            if (stat(g_config->output_path, &s) != 0) {
-                eprintf("Failed to stat %s\n", g_config->output_path);
-                return false;
-            }
-            if (!S_ISREG(s.st_mode)) {
-                eprintf("%s already exists and it is not a regular file\n", g_config->output_path);
-                return false;
-            }
-            printf("Overriding %s, are you sure? [y/N] ", g_config->output_path);
+// Runs `cmd`, a grim command that writes a PPM to its stdout, and reads the frame into `out`.
+// The buffer is sized from the header of the PPM, so the frame is never copied.
+static bool read_frame(const char *cmd, mp_StringBuilder *out) {
+    CmdPipe pipe;
+    if (!cmd_pipe_open(&pipe, cmd, CMD_PIPE_STDOUT)) return false;
+    bool ok = ppm_read(pipe.fd, out);
+    return cmd_pipe_close(&pipe) && ok;
+}
+
+// Asks before an existing file is overridden. Returns false if it must not be.
+static bool confirm_override(void) {
+    if (!(g_config->save_mode & SAVEMODE_DISK) || access(g_config->output_path, F_OK) != 0) {
+        return true;
+    }
+    struct stat s;
+    if (stat(g_config->output_path, &s) != 0) {
+        eprintf("Failed to stat %s\n", g_config->output_path);
+        return false;
+    }
+    if (!S_ISREG(s.st_mode)) {
+        eprintf("%s already exists and it is not a regular file\n", g_config->output_path);
+        return false;
+    }
+    printf("Overriding %s, are you sure? [y/N] ", g_config->output_path);
 #define BUFLEN 3    // enough for one character, a newline, and a '\0'
-            char buf[BUFLEN];
-            if (fgets(buf, BUFLEN, stdin) == NULL) {
-                eprintf("Failed to read input\n");
-                return false;
-            }
-            if (tolower(buf[0]) != 'y') return false;
+    char buf[BUFLEN];
+    if (fgets(buf, BUFLEN, stdin) == NULL) {
+        eprintf("Failed to read input\n");
+        return false;
+    }
 #undef BUFLEN
+    return tolower(buf[0]) == 'y';
+}
+
+// Notifies, and copies the saved file to the clipboard and the file descriptor that grim didn't
+// write to
+static bool after_save(void) {
+    uint32_t save_mode   = g_config->save_mode;
+    size_t   span_notify = trace_begin("notify");
+    notify();
+    trace_end(span_notify);
+
+    if ((save_mode & SAVEMODE_DISK) && (save_mode & SAVEMODE_CLIPBOARD)) {
+        char *cmd = alloc_strf("wl-copy < %s", shell_quote(g_config->output_path)).cstr;
+#ifdef DEBUG
+        if (g_config->verbose) printf("$ %s\n", cmd);
+#endif
+        size_t span_clipboard = trace_begin("clipboard");
+        if (run_cmd(cmd, NULL, 0) == -1) {
+            eprintf("Failed to save image to %s\n", g_config->screenshot_dir);
+            return false;
+        }
+        trace_end(span_clipboard);
+    }
+
+    if ((save_mode & SAVEMODE_DISK) && (save_mode & SAVEMODE_FD)) {
+        if (!copy_file_to_fd(g_config->output_path, g_config->output_fd)) return false;
+    }
+    if (g_config->memfd_socket != -1) {
+        if (!memfd_send(g_config->memfd_socket, g_config->output_fd, NULL, 0)) {
+            eprintf("Failed to send the memfd: %s\n", strerror(errno));
+            return false;
         }
-        cmd = alloc_strf("grim %s - > '%s'", options.cstr, g_config->output_path).cstr;
+    }
+
+    return true;
+}
+
+// Runs the capture once while the countdown of -w runs, so the real one finds grim and its
+// libraries in the page cache. The frame is read into `buffer` and dropped: a raw capture reuses
+// it, already allocated at the size of the frame and faulted in.
+static void grim_prewarm(const char *region, const char *toplevel, mp_StringBuilder *buffer) {
+    size_t           span_prewarm = trace_begin("prewarm");
+    mp_StringBuilder builder      = mp_string_builder_new(g_alloc);
+    grim_command(&builder, region, toplevel, IMGTYPE_PPM);
+    // The capture reports what went wrong, if it goes wrong again
+    mp_string_builder_append(&builder, " - 2>/dev/null");
+    read_frame(mp_string_builder_to_string(&builder).cstr, buffer);
+    buffer->size = 0;
+    trace_end(span_prewarm);
+}
+
+// Captures `region`, or the toplevel `toplevel`, or the whole output if both are NULL
+static bool grim_capture(const char *region, const char *toplevel) {
+    char *cmd = NULL;
+
+    // The types gripper encodes itself are captured raw, and any image that is compared with
+    // previous screenshots is kept in memory
+    bool in_tree   = encode_in_tree(g_config->imgtype);
+    // So is an image that goes to both the clipboard and a file descriptor without a file, a PPM
+    // that thumbnails are made from, and any frame that is redacted
+    uint32_t save_mode  = g_config->save_mode;
+    bool     thumbnails = g_config->thumbnails && (save_mode & SAVEMODE_DISK);
+    bool     in_memory  = in_tree || (g_config->dedup && (save_mode & SAVEMODE_DISK)) ||
+                     save_mode == (SAVEMODE_CLIPBOARD | SAVEMODE_FD) ||
+                     (thumbnails && g_config->imgtype == IMGTYPE_PPM) || redact_enabled();
+    bool     raw        = in_memory && (in_tree || g_config->imgtype == IMGTYPE_PPM);
+    // Raw frames are exported without being encoded at all
+    bool     raw_export = g_config->raw_socket != -1;
+
+    // The whole command is built in place, each append only copies the new part
+    mp_StringBuilder builder = mp_string_builder_new(g_alloc);
+    grim_command(&builder,
+                 region,
+                 toplevel,
+                 in_tree || raw_export ? IMGTYPE_PPM : g_config->imgtype);
+
+    if (!confirm_override()) return false;
+    if (raw_export) {
+        // `rawframe_export()` adds the memfd of each frame
+    } else if (in_memory) {
+        mp_string_builder_append(&builder, " -");
+    } else if (g_config->save_mode & SAVEMODE_DISK) {
+        mp_string_builder_appendf(&builder, " - > %s", shell_quote(g_config->output_path));
     } else if (g_config->save_mode == SAVEMODE_CLIPBOARD) {
-        cmd = alloc_strf("grim %s - | wl-copy", options.cstr).cstr;
+        mp_string_builder_append(&builder, " - | wl-copy");
+    } else if (g_config->save_mode == SAVEMODE_FD) {
+        // grim inherits the file descriptor and writes into it itself
+        mp_string_builder_appendf(&builder, " - >&%d", g_config->output_fd);
     } else if (g_config->save_mode == SAVEMODE_NONE) {
-        cmd = alloc_strf("grim %s - >/dev/null", options.cstr).cstr;
+        mp_string_builder_append(&builder, " - >/dev/null");
     }
+    cmd = mp_string_builder_to_string(&builder).cstr;
 
+    // The countdown is timed against a deadline, so the capture starts on time however long
+    // getting ready for it took
+    mp_StringBuilder captured = mp_string_builder_new(g_alloc);
     if (g_config->wait_time > 0) {
         if (g_config->verbose) printf("*Waiting for %d seconds...*\n", g_config->wait_time);
-        sleep(g_config->wait_time);
+        size_t          span_wait = trace_begin("wait");
+        struct timespec deadline;
+        clock_gettime(CLOCK_MONOTONIC, &deadline);
+        deadline.tv_sec += g_config->wait_time;
+        mp_StringBuilder scratch = mp_string_builder_new(g_alloc);
+        grim_prewarm(region, toplevel, raw && !raw_export ? &captured : &scratch);
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline, NULL) == EINTR) {
+            continue;
+        }
+        trace_end(span_wait);
     }
 
+    if (raw_export) return rawframe_export(cmd);
+
 #ifdef DEBUG
     if (g_config->verbose) printf("$ %s\n", cmd);
 #endif
-    if (run_cmd(cmd, NULL, 0) == -1) {
-        eprintf("Failed to run grim\n");
-        return false;
+    RedactQuery redaction;
+    bool        redacted = redact_enabled();
+    if (redacted && !redact_start(&redaction, region)) return false;
+
+    // grim captures, encodes and writes the image in one go
+    size_t   span_capture = trace_begin("capture");
+    uint64_t begin_us     = trace_now_us();
+    if (in_memory) {
+        bool ok = false;
+        if (raw) {
+            ok = read_frame(cmd, &captured);
+        } else {
+            ok = run_cmd_capture(cmd, &captured);
+        }
+        if (!ok) {
+            eprintf("Failed to run grim\n");
+            if (redacted) redact_finish(&redaction, NULL);
+            return false;
+        }
+        trace_end(span_capture);
+        if (!save_captured(region, &captured, redacted ? &redaction : NULL, begin_us)) return false;
+    } else {
+        if (run_cmd_fd(cmd, NULL, 0, g_config->output_fd) == -1) {
+            eprintf("Failed to run grim\n");
+            return false;
+        }
+        trace_end(span_capture);
     }
 
-    notify();
+    return after_save();
+}
+
+bool grim(const char *region) {
+    return grim_capture(region, NULL);
+}
+
+bool grim_toplevel(const char *identifier) {
+    return grim_capture(NULL, identifier);
+}
+
+bool grim_save(const char *region, const PixelBuffer *frame) {
+    if (!confirm_override()) return false;
+    mp_StringBuilder captured = mp_string_builder_new(g_alloc);
+    if (!save_parsed(region, &captured, frame, trace_now_us())) return false;
+    return after_save();
+}
 
-    if (g_config->save_mode == (SAVEMODE_DISK | SAVEMODE_CLIPBOARD)) {
-        cmd = alloc_strf("wl-copy < '%s'", g_config->output_path).cstr;
+bool grim_frame(const char *region, const char *toplevel, mp_StringBuilder *out) {
+    mp_StringBuilder builder = mp_string_builder_new(g_alloc);
+    grim_command(&builder, region, toplevel, IMGTYPE_PPM);
+    mp_string_builder_append(&builder, " -");
+    char *cmd = mp_string_builder_to_string(&builder).cstr;
 #ifdef DEBUG
-        if (g_config->verbose) printf("$ %s\n", cmd);
+    if (g_config->verbose) printf("$ %s\n", cmd);
 #endif
-        if (run_cmd(cmd, NULL, 0) == -1) {
-            eprintf("Failed to save image to %s\n", g_config->screenshot_dir);
-            return false;
-        }
-    }
 
-    return true;
+    size_t span_capture = trace_begin("capture");
+    bool   ok           = read_frame(cmd, out);
+    trace_end(span_capture);
+    if (!ok) eprintf("Failed to run grim\n");
+    return ok;
 }
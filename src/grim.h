@@ -1,8 +1,19 @@
 #ifndef GRIM_H
 #define GRIM_H
 
+#include "memplus.h"
+#include "pixfmt.h"
 #include <stdbool.h>
 
 bool grim(const char *region);
+// Captures only the buffer of a window, by its ext-foreign-toplevel-list identifier. Overlapping
+// and occluding windows are not included.
+bool grim_toplevel(const char *identifier);
+// Saves `frame`, captured beforehand, wherever `grim()` would save its capture of `region`
+bool grim_save(const char *region, const PixelBuffer *frame);
+// Captures `region`, the toplevel `toplevel` or the whole output like `grim()`, but only reads the
+// frame into `out` as a binary PPM.
+// Nothing is saved and nobody is notified.
+bool grim_frame(const char *region, const char *toplevel, mp_StringBuilder *out);
 
 #endif /* ifndef GRIM_H */
@@ -0,0 +1,204 @@
+#define _DEFAULT_SOURCE
+
+#define MEMPLUS_IMPLEMENTATION
+#include "memplus.h"
+#define TASKPLUS_IMPLEMENTATION
+#include "taskplus.h"
+
+#include "gripper.h"
+#include "capture.h"
+#include "compositors.h"
+#include "encode.h"
+#include "grim.h"
+#include "prog.h"
+#include "regions.h"
+#include "trace.h"
+#include "utils.h"
+#include <stdlib.h>
+#include <string.h>
+
+_Thread_local mp_Allocator *g_alloc;
+_Thread_local const Config *g_config;
+
+struct GripperContext {
+    mp_Arena       arena;     // Everything a capture allocates, until the next one
+    mp_ArenaMark   empty;
+    mp_Allocator   alloc;
+    Config         config;
+    const uint8_t *image;     // The image of the last capture, NULL if it failed
+    size_t         size;
+    uint32_t       width, height;
+};
+
+static const char *status_name[GRIPPER_STATUS_COUNT] = {
+    [GRIPPER_OK]              = "OK",
+    [GRIPPER_ERROR_INVALID]   = "Invalid request",
+    [GRIPPER_ERROR_CAPTURE]   = "Capture failed",
+    [GRIPPER_ERROR_CANCELLED] = "Selection cancelled",
+    [GRIPPER_ERROR_BUFFER]    = "Buffer too small",
+    [GRIPPER_ERROR_ENCODE]    = "Encoding failed",
+};
+
+// The defaults of the CLI, before its arguments are parsed, and of every context
+void config_init(Config *config) {
+    config->compositor    = str2compositor(getenv("XDG_CURRENT_DESKTOP"));
+    config->output_format = "Screenshot_%Y%M%d_%h%m%s";
+    config->imgtype       = IMGTYPE_PNG;
+    config->png_level     = DEFAULT_PNG_LEVEL;
+    config->jpeg_quality  = DEFAULT_JPEG_QUALITY;
+    config->save_mode     = SAVEMODE_DISK | SAVEMODE_CLIPBOARD;
+    config->scale         = 1.0;
+    config->wait_time     = 0;
+    config->output_fd     = -1;
+    config->memfd_socket  = -1;
+    config->raw_socket    = -1;
+}
+
+GripperContext *gripper_context_new(void) {
+    GripperContext *ctx = calloc(1, sizeof(*ctx));
+    if (ctx == NULL) return NULL;
+    ctx->arena  = mp_arena_new();
+    ctx->empty  = mp_arena_save(&ctx->arena);
+    ctx->alloc  = mp_arena_new_allocator(&ctx->arena);
+    ctx->config = (Config){ .prog_name = PROG_NAME, .prog_version = PROG_VERSION };
+    config_init(&ctx->config);
+    ctx->config.save_mode = SAVEMODE_NONE;
+    return ctx;
+}
+
+void gripper_context_free(GripperContext *ctx) {
+    if (ctx == NULL) return;
+    mp_arena_free(&ctx->arena);
+    free(ctx);
+}
+
+static bool request_valid(const GripperCaptureRequest *request) {
+    if (request->target >= GRIPPER_TARGET_COUNT || request->format >= GRIPPER_FORMAT_COUNT) {
+        return false;
+    }
+    if (request->scale < 0) return false;
+    // Only the syntax is checked, grim fails on a region outside of the outputs
+    Region region;
+    if (request->target == GRIPPER_TARGET_REGION &&
+        (request->region == NULL || !region_parse(request->region, &region))) {
+        eprintf("Invalid region format `%s`\n", request->region == NULL ? "" : request->region);
+        return false;
+    }
+    return true;
+}
+
+// Captures the target of `request` into `ppm`, with `g_config` set up for it
+static GripperStatus capture_frame(const GripperCaptureRequest *request, mp_StringBuilder *ppm) {
+    const char *region   = NULL;
+    const char *toplevel = NULL;
+    switch (request->target) {
+        case GRIPPER_TARGET_OUTPUT : break;
+        case GRIPPER_TARGET_REGION : {
+            region = request->region;
+        } break;
+        case GRIPPER_TARGET_SELECT : {
+            region = select_region();
+            if (region == NULL) return GRIPPER_ERROR_CANCELLED;
+        } break;
+        case GRIPPER_TARGET_WINDOW : {
+            toplevel = toplevel_find(request->window);
+            // Like `active-window --toplevel`, the region of an unlisted active window is captured
+            if (toplevel == NULL && request->window == NULL &&
+                comp_supported(g_config->compositor)) {
+                region = active_window_region();
+                if (region == NULL) return GRIPPER_ERROR_CAPTURE;
+            } else if (toplevel == NULL) {
+                eprintf("No window matches `%s`\n",
+                        request->window == NULL ? "the active window" : request->window);
+                return GRIPPER_ERROR_CAPTURE;
+            }
+        } break;
+        case GRIPPER_TARGET_COUNT : {
+            unreachable();
+        }
+    }
+    return grim_frame(region, toplevel, ppm) ? GRIPPER_OK : GRIPPER_ERROR_CAPTURE;
+}
+
+// Points `ctx->image` at the frame in `ppm` encoded as `format`
+static GripperStatus image_encode(GripperContext         *ctx,
+                                  const mp_StringBuilder *ppm,
+                                  GripperFormat           format) {
+    PixelBuffer frame;
+    if (!ppm_parse(ppm->data, ppm->size, &frame)) return GRIPPER_ERROR_CAPTURE;
+    ctx->width  = frame.width;
+    ctx->height = frame.height;
+
+    // The raw formats are the frame as grim wrote it
+    if (format == GRIPPER_FORMAT_RGB) {
+        ctx->image = frame.data;
+        ctx->size  = frame.stride * frame.height;
+        return GRIPPER_OK;
+    }
+    if (format == GRIPPER_FORMAT_PPM) {
+        ctx->image = (const uint8_t *)ppm->data;
+        ctx->size  = ppm->size;
+        return GRIPPER_OK;
+    }
+
+    Imgtype      imgtype     = format == GRIPPER_FORMAT_PNG ? IMGTYPE_PNG_FAST : IMGTYPE_QOI;
+    size_t       span_encode = trace_begin("encode");
+    EncodeOutput output      = encode_output_new(g_alloc, -1);
+    bool         ok          = encode_frame(&frame, imgtype, DEFLATE_LEVEL_FAST, &output);
+    trace_end(span_encode);
+    if (!ok) return GRIPPER_ERROR_ENCODE;
+    ctx->image = (const uint8_t *)output.buffer.data;
+    ctx->size  = output.buffer.size;
+    return GRIPPER_OK;
+}
+
+static GripperStatus result_write(const GripperContext *ctx, GripperCaptureResult *result) {
+    result->size   = ctx->size;
+    result->width  = ctx->width;
+    result->height = ctx->height;
+    if (result->data == NULL || result->capacity < ctx->size) return GRIPPER_ERROR_BUFFER;
+    memcpy(result->data, ctx->image, ctx->size);
+    return GRIPPER_OK;
+}
+
+GripperStatus gripper_capture(GripperContext              *ctx,
+                              const GripperCaptureRequest *request,
+                              GripperCaptureResult        *result) {
+    if (ctx == NULL || result == NULL) return GRIPPER_ERROR_INVALID;
+    if (request == NULL) {
+        if (ctx->image == NULL) return GRIPPER_ERROR_INVALID;
+        return result_write(ctx, result);
+    }
+
+    // The regions of the arena are reused, a capture only allocates when its frame is bigger
+    mp_arena_restore(&ctx->arena, ctx->empty);
+    ctx->image = NULL;
+
+    ctx->config.output_name = request->target == GRIPPER_TARGET_OUTPUT ? request->output : NULL;
+    ctx->config.cursor      = request->cursor;
+    ctx->config.scale       = request->scale == 0 ? 1.0 : request->scale;
+
+    // The internals work on `g_alloc` and `g_config`, which are this context for the call
+    mp_Allocator *saved_alloc  = g_alloc;
+    const Config *saved_config = g_config;
+    g_alloc                    = &ctx->alloc;
+    g_config                   = &ctx->config;
+    trace_init();
+
+    GripperStatus status = GRIPPER_ERROR_INVALID;
+    if (request_valid(request)) {
+        mp_StringBuilder ppm = mp_string_builder_new(g_alloc);
+        status               = capture_frame(request, &ppm);
+        if (status == GRIPPER_OK) status = image_encode(ctx, &ppm, request->format);
+    }
+
+    g_alloc  = saved_alloc;
+    g_config = saved_config;
+    if (status != GRIPPER_OK) return status;
+    return result_write(ctx, result);
+}
+
+const char *gripper_status_str(GripperStatus status) {
+    if (status >= GRIPPER_STATUS_COUNT) return "Unknown status";
+    return status_name[status];
+}
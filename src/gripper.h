@@ -0,0 +1,82 @@
+#ifndef GRIPPER_H
+#define GRIPPER_H
+
+// libgripper: the captures of the gripper CLI, without spawning it.
+//
+// All the state lives in a `GripperContext`. A context must only be used by one thread at a time,
+// different contexts can be used from different threads. grim, slurp and the other programs
+// gripper needs are still run for each capture.
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// The rest of libgripper is built with hidden visibility, only these functions are exported
+#if defined(__GNUC__) || defined(__clang__)
+#define GRIPPER_API __attribute__((visibility("default")))
+#else
+#define GRIPPER_API
+#endif
+
+typedef struct GripperContext GripperContext;
+
+typedef enum {
+    GRIPPER_TARGET_OUTPUT,    // The output named `output`, or every output if it is NULL
+    GRIPPER_TARGET_REGION,    // `region`, a geometry like "10,20 300x200"
+    GRIPPER_TARGET_SELECT,    // A region the user selects with slurp
+    GRIPPER_TARGET_WINDOW,    // The window whose app ID or title matches `window`, NULL for the
+                              // active one. Only its own buffer is captured, which needs lswt.
+    GRIPPER_TARGET_COUNT,
+} GripperTarget;
+
+typedef enum {
+    GRIPPER_FORMAT_RGB,    // Top-down rows of `width * 3` bytes, without padding
+    GRIPPER_FORMAT_PPM,
+    GRIPPER_FORMAT_PNG,    // Compressed for speed, like `gripper -t png-fast`
+    GRIPPER_FORMAT_QOI,
+    GRIPPER_FORMAT_COUNT,
+} GripperFormat;
+
+typedef enum {
+    GRIPPER_OK,
+    GRIPPER_ERROR_INVALID,      // The request or the result is invalid
+    GRIPPER_ERROR_CAPTURE,      // Nothing matched the target, or grim failed
+    GRIPPER_ERROR_CANCELLED,    // The user cancelled the selection
+    GRIPPER_ERROR_BUFFER,       // The result buffer is too small, see `gripper_capture()`
+    GRIPPER_ERROR_ENCODE,       // The frame was captured but could not be encoded
+    GRIPPER_STATUS_COUNT,
+} GripperStatus;
+
+typedef struct {
+    GripperTarget target;
+    const char   *output;
+    const char   *region;
+    const char   *window;
+    GripperFormat format;
+    bool          cursor;    // Include the cursor
+    double        scale;     // Scale factor of the image, 0 is the same as 1
+} GripperCaptureRequest;
+
+typedef struct {
+    void    *data;        // Provided by the caller, the image is written here
+    size_t   capacity;    // Size of `data`
+    size_t   size;        // Size of the image, even if it did not fit
+    uint32_t width, height;
+} GripperCaptureResult;
+
+// Returns NULL if it could not be allocated
+GRIPPER_API GripperContext *gripper_context_new(void);
+GRIPPER_API void            gripper_context_free(GripperContext *ctx);
+
+// Captures `request->target` and writes the image into `result->data`.
+// If the image doesn't fit, GRIPPER_ERROR_BUFFER is returned with `result->size` set and the image
+// is kept in `ctx` until the next capture: call again with a NULL `request` and a bigger buffer to
+// get it without capturing again.
+// Error messages are printed to stderr, like the CLI does.
+GRIPPER_API GripperStatus gripper_capture(GripperContext              *ctx,
+                                          const GripperCaptureRequest *request,
+                                          GripperCaptureResult        *result);
+
+GRIPPER_API const char *gripper_status_str(GripperStatus status);
+
+#endif /* ifndef GRIPPER_H */
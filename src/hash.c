@@ -0,0 +1,154 @@
+#include "hash.h"
+#include <string.h>
+
+#define HASH_LANES        8
+#define HASH_STRIPE       (HASH_LANES * sizeof(uint64_t))
+#define HASH_BLOCK_STRIPES 16    // Stripes between two scrambles of the accumulators
+
+#define PRIME32_1 0x9E3779B1u
+#define PRIME32_2 0x85EBCA77u
+#define PRIME64_1 0x9E3779B185EBCA87u
+#define PRIME64_2 0xC2B2AE3D27D4EB4Fu
+#define PRIME64_3 0x165667B19E3779F9u
+
+// Arbitrary keys mixed into the data, one per lane
+static const uint64_t secret[HASH_LANES] = {
+    0xbe4ba423396cfeb8u, 0x1cad21f72c81017cu, 0xdb979083e96dd4deu, 0x1f67b3b7a4a44072u,
+    0x78e5c0cc4ee679cbu, 0x2172ffcc7dd05a82u, 0x8e2443f7744608b8u, 0x4c263a81e69035e0u,
+};
+
+static uint64_t read64(const uint8_t *p) {
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static void accumulate(uint64_t acc[HASH_LANES], const uint8_t *stripe) {
+    for (size_t i = 0; i < HASH_LANES; ++i) {
+        uint64_t data = read64(stripe + i * sizeof(uint64_t));
+        uint64_t key  = data ^ secret[i];
+        acc[i ^ 1] += data;
+        acc[i] += (key & 0xFFFFFFFFu) * (key >> 32);
+    }
+}
+
+static void scramble(uint64_t acc[HASH_LANES]) {
+    for (size_t i = 0; i < HASH_LANES; ++i) {
+        acc[i] ^= acc[i] >> 47;
+        acc[i] ^= secret[(i + 3) % HASH_LANES];
+        acc[i] *= PRIME32_1;
+    }
+}
+
+static uint64_t avalanche(uint64_t h) {
+    h ^= h >> 37;
+    h *= 0x165667919E3779F9u;
+    h ^= h >> 32;
+    return h;
+}
+
+static uint64_t mix2(uint64_t a, uint64_t b) {
+    uint64_t x = (a ^ secret[1]) * PRIME64_1;
+    x ^= b ^ secret[6];
+    x *= PRIME64_2;
+    return x ^ (x >> 29);
+}
+
+uint64_t hash64(const void *data, size_t size) {
+    const uint8_t *p = data;
+    uint64_t       acc[HASH_LANES] = {
+        PRIME32_2, PRIME64_1, PRIME64_2, PRIME64_3, PRIME64_1 ^ PRIME32_1, PRIME64_2, PRIME64_3,
+        PRIME32_1,
+    };
+
+    size_t stripes = size / HASH_STRIPE;
+    for (size_t s = 0; s < stripes; ++s) {
+        accumulate(acc, p + s * HASH_STRIPE);
+        if ((s + 1) % HASH_BLOCK_STRIPES == 0) scramble(acc);
+    }
+
+    // The tail is zero-padded into one more stripe
+    size_t tail = size - stripes * HASH_STRIPE;
+    if (tail > 0) {
+        uint8_t last[HASH_STRIPE] = { 0 };
+        memcpy(last, p + stripes * HASH_STRIPE, tail);
+        accumulate(acc, last);
+    }
+
+    uint64_t h = (uint64_t)size * PRIME64_1;
+    for (size_t i = 0; i < HASH_LANES; i += 2)
+        h += mix2(acc[i], acc[i + 1]);
+    return avalanche(h);
+}
+
+// RFC 1321
+static const uint32_t md5_k[64] = {
+    0xd76aa478, 0xe8c7b756, 0x242070db, 0xc1bdceee, 0xf57c0faf, 0x4787c62a, 0xa8304613, 0xfd469501,
+    0x698098d8, 0x8b44f7af, 0xffff5bb1, 0x895cd7be, 0x6b901122, 0xfd987193, 0xa679438e, 0x49b40821,
+    0xf61e2562, 0xc040b340, 0x265e5a51, 0xe9b6c7aa, 0xd62f105d, 0x02441453, 0xd8a1e681, 0xe7d3fbc8,
+    0x21e1cde6, 0xc33707d6, 0xf4d50d87, 0x455a14ed, 0xa9e3e905, 0xfcefa3f8, 0x676f02d9, 0x8d2a4c8a,
+    0xfffa3942, 0x8771f681, 0x6d9d6122, 0xfde5380c, 0xa4beea44, 0x4bdecfa9, 0xf6bb4b60, 0xbebfbc70,
+    0x289b7ec6, 0xeaa127fa, 0xd4ef3085, 0x04881d05, 0xd9d4d039, 0xe6db99e5, 0x1fa27cf8, 0xc4ac5665,
+    0xf4292244, 0x432aff97, 0xab9423a7, 0xfc93a039, 0x655b59c3, 0x8f0ccc92, 0xffeff47d, 0x85845dd1,
+    0x6fa87e4f, 0xfe2ce6e0, 0xa3014314, 0x4e0811a1, 0xf7537e82, 0xbd3af235, 0x2ad7d2bb, 0xeb86d391,
+};
+static const uint8_t md5_r[64] = {
+    7, 12, 17, 22, 7, 12, 17, 22, 7, 12, 17, 22, 7, 12, 17, 22,
+    5, 9,  14, 20, 5, 9,  14, 20, 5, 9,  14, 20, 5, 9,  14, 20,
+    4, 11, 16, 23, 4, 11, 16, 23, 4, 11, 16, 23, 4, 11, 16, 23,
+    6, 10, 15, 21, 6, 10, 15, 21, 6, 10, 15, 21, 6, 10, 15, 21,
+};
+
+static void md5_block(uint32_t state[4], const uint8_t block[64]) {
+    uint32_t w[16];
+    for (size_t i = 0; i < 16; ++i) {
+        w[i] = (uint32_t)block[i * 4] | (uint32_t)block[i * 4 + 1] << 8 |
+               (uint32_t)block[i * 4 + 2] << 16 | (uint32_t)block[i * 4 + 3] << 24;
+    }
+    uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+    for (uint32_t i = 0; i < 64; ++i) {
+        uint32_t f, g;
+        if (i < 16) {
+            f = (b & c) | (~b & d);
+            g = i;
+        } else if (i < 32) {
+            f = (d & b) | (~d & c);
+            g = (5 * i + 1) % 16;
+        } else if (i < 48) {
+            f = b ^ c ^ d;
+            g = (3 * i + 5) % 16;
+        } else {
+            f = c ^ (b | ~d);
+            g = (7 * i) % 16;
+        }
+        uint32_t t = d;
+        d          = c;
+        c          = b;
+        f += a + md5_k[i] + w[g];
+        b += (f << md5_r[i]) | (f >> (32 - md5_r[i]));
+        a = t;
+    }
+    state[0] += a;
+    state[1] += b;
+    state[2] += c;
+    state[3] += d;
+}
+
+void md5(const void *data, size_t size, uint8_t digest[MD5_SIZE]) {
+    uint32_t       state[4] = { 0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476 };
+    const uint8_t *p        = data;
+    size_t         left     = size;
+    for (; left >= 64; left -= 64, p += 64) md5_block(state, p);
+
+    // The padding and the length in bits take one or two more blocks
+    uint8_t tail[128] = { 0 };
+    memcpy(tail, p, left);
+    tail[left]    = 0x80;
+    size_t   end  = left < 56 ? 64 : 128;
+    uint64_t bits = (uint64_t)size * 8;
+    for (size_t i = 0; i < 8; ++i) tail[end - 8 + i] = (uint8_t)(bits >> (i * 8));
+    md5_block(state, tail);
+    if (end == 128) md5_block(state, tail + 64);
+
+    for (size_t i = 0; i < 16; ++i) digest[i] = (uint8_t)(state[i / 4] >> (i % 4 * 8));
+}
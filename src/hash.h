@@ -0,0 +1,17 @@
+#ifndef HASH_H
+#define HASH_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// 64-bit non-cryptographic hash built like XXH3: eight independent 64-bit lanes consume 64 bytes
+// per step with 32x32->64 multiplies, which compilers turn into SSE2/AVX2/NEON code.
+// The output is not compatible with XXH3.
+uint64_t hash64(const void *data, size_t size);
+
+#define MD5_SIZE 16
+
+// MD5, only for the file names the freedesktop thumbnail spec asks for
+void md5(const void *data, size_t size, uint8_t digest[MD5_SIZE]);
+
+#endif /* ifndef HASH_H */
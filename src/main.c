@@ -1,6 +1,3 @@
-#define MEMPLUS_IMPLEMENTATION
-#include "memplus.h"
-
 #include <assert.h>
 #include <stdbool.h>
 #include <stdio.h>
@@ -13,14 +10,15 @@
 #include <unistd.h>
 
 #include "capture.h"
+#include "memplus.h"
 #include "prog.h"
+#include "stats.h"
+#include "trace.h"
 #include "utils.h"
 
 #define DEFAULT_DIR       "Pictures/Screenshots"
-#define LAST_REGION_FNAME "gripper-last-region"
+#define REGIONS_FNAME     "gripper-regions"
 
-mp_Allocator       *g_alloc;
-const Config       *g_config;
 static mp_Allocator alloc;
 static Config       config;
 
@@ -28,8 +26,12 @@ bool start(int argc, char *argv[]) {
     mp_Arena arena  = mp_arena_new();
     int      result = true;
     // Variables that will be freed after defer must be initialised before any call to return_defer
-    char *alt_dir               = NULL;
-    char *last_region_file_path = NULL;
+    char           *alt_dir           = NULL;
+    char           *regions_file_path = NULL;
+    ParseArgsResult parse_result      = PARSE_ARGS_RESULT_FAILED;
+
+    trace_init();
+    size_t span_start = trace_begin("start");
 
     config              = (Config){ 0 };
     config.prog_name    = PROG_NAME;
@@ -40,13 +42,22 @@ bool start(int argc, char *argv[]) {
     g_alloc = &alloc;
 
     config_init(&config);
-    ParseArgsResult parse_result = parse_args(argc, argv, &config);
+    size_t span_parse = trace_begin("parse_args");
+    parse_result      = parse_args(argc, argv, &config);
+    trace_end(span_parse);
     switch (parse_result) {
         case PARSE_ARGS_RESULT_OK :        break;
         case PARSE_ARGS_RESULT_TERMINATE : return_defer(true);
         case PARSE_ARGS_RESULT_FAILED :    return_defer(false);
     }
 
+    // The image takes over stdout, everything gripper prints goes to stderr instead
+    if (config.output_stdout) {
+        config.output_fd = dup(STDOUT_FILENO);
+        dup2(STDERR_FILENO, STDOUT_FILENO);
+    }
+    if (config.memfd_socket != -1 && (config.output_fd = memfd_output()) == -1) return_defer(false);
+
     const char *home_dir = getenv("HOME");
     assert(home_dir != NULL && "HOME dir is not set");
 
@@ -62,36 +73,49 @@ bool start(int argc, char *argv[]) {
     }
 
     // Create the directory if it didn't exist
+    size_t span_dir = trace_begin("make_dir");
     if (!make_dir(config.screenshot_dir)) return_defer(false);
+    trace_end(span_dir);
 
-    // Assign config.last_region_file
+    // Assign config.regions_file
     config.cache_dir = getenv("XDG_CACHE_HOME");
     if (config.cache_dir == NULL) {
         config.cache_dir = alloc_strf("%s/.cache", home_dir).cstr;
     }
-    last_region_file_path   = alloc_strf("%s/" LAST_REGION_FNAME, config.cache_dir).cstr;
-    config.last_region_file = last_region_file_path;
+    regions_file_path   = alloc_strf("%s/" REGIONS_FNAME, config.cache_dir).cstr;
+    config.regions_file = regions_file_path;
 
     // Set the output (monitor) name
+    size_t span_output = trace_begin("output_detection");
     if (config.output_name != NULL) {
         // Verify if output exists
-        mp_String cmd =
-            mp_string_newf(g_alloc, "grim -t jpeg -q 0 -o %s - >/dev/null", config.output_name);
+        mp_String cmd = mp_string_newf(
+            g_alloc, "grim -t jpeg -q 0 -o %s - >/dev/null", shell_quote(config.output_name));
         if (run_cmd(cmd.cstr, NULL, 0) == -1) {
             eprintf("Unknown output `%s`\n", config.output_name);
             return_defer(false);
         }
-    } else if (config.mode == MODE_FULL && !config.all_outputs) {
+    } else if ((config.mode == MODE_FULL || (config.mode == MODE_DIFF && config.slot == NULL)) &&
+               !config.all_outputs) {
         if (!set_current_output_name(&config)) return_defer(false);
     }
+    trace_end(span_output);
 
     if (config.output_path == NULL && config.save_mode & SAVEMODE_DISK) {
+        size_t span_format = trace_begin("output_format");
         if (!parse_output_format(&config)) return_defer(false);
+        trace_end(span_format);
     }
 
     if (!capture()) return_defer(false);
 
 defer:
+    trace_end(span_start);
+    // Only successful screenshots are recorded so failures don't skew the percentiles
+    if (result && parse_result == PARSE_ARGS_RESULT_OK && config.mode != MODE_TEST) {
+        if (!stats_record() && config.verbose) eprintf("Failed to record stats\n");
+    }
+    if (config.trace_file != NULL && !trace_write(config.trace_file)) result = false;
     mp_arena_free(&arena);
     return result;
 }
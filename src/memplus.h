@@ -33,6 +33,13 @@ CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
 #define _MEMPLUS_ASSERT assert
 #endif
 
+/* Lets the compiler check the arguments of printf-like functions. */
+#if defined(__GNUC__) || defined(__clang__)
+#define _MEMPLUS_PRINTF(fmt_index, args_index) __attribute__((format(printf, fmt_index, args_index)))
+#else
+#define _MEMPLUS_PRINTF(fmt_index, args_index)
+#endif
+
 /***********
  * ALLOCATOR
  ***********/
@@ -52,11 +59,27 @@ struct mp_Region {
     uintptr_t  data[];      // The data (aligned)
 };
 
+/* Counters updated by the arena on every allocation. */
+typedef struct {
+    size_t allocs;               // Calls to alloc and dup, and reallocs that had to move
+    size_t reallocs;             // Calls to realloc that actually grew the allocation
+    size_t reallocs_in_place;    // Reallocs that grew the last allocation without moving it
+    size_t bytes;                // Bytes requested in total
+    size_t regions;              // Regions allocated
+} mp_ArenaStats;
+
 /* Manages regions in a linked list. */
 typedef struct {
-    mp_Region *begin, *end;
+    mp_Region    *begin, *end;
+    mp_ArenaStats stats;
 } mp_Arena;
 
+/* A position in an arena that it can be rolled back to. */
+typedef struct {
+    mp_Region *region;    // NULL if the arena had no regions yet
+    size_t     count;
+} mp_ArenaMark;
+
 /* Interface to wrap functions to allocate memory.
  * The method of allocation can be costumized by the user. */
 typedef struct {
@@ -116,6 +139,16 @@ void mp_region_free(mp_Region *self);
 void mp_arena_free(mp_Arena *self);
 /* Returns an allocator that works with `arena`. */
 mp_Allocator mp_arena_new_allocator(mp_Arena *arena);
+/* Saves the current position of the arena. */
+mp_ArenaMark mp_arena_save(mp_Arena *self);
+/* Frees everything allocated after `mark` was saved. The regions are kept to be reused. */
+void mp_arena_restore(mp_Arena *self, mp_ArenaMark mark);
+
+/* Returns an arena owned by the calling thread, for scratch memory in worker threads.
+ * The arena is not freed when the thread exits, call `mp_thread_arena_free` before that. */
+mp_Arena *mp_thread_arena(void);
+/* Frees the arena owned by the calling thread. */
+void mp_thread_arena_free(void);
 
 /***********
  * END OF ALLOCATOR
@@ -134,10 +167,36 @@ typedef struct {
 /* Allocates a new `mp_String` from a null-terminated string. */
 mp_String mp_string_new(mp_Allocator *allocator, const char *str);
 /* Allocates a new `mp_String` from formatted input. */
-mp_String mp_string_newf(mp_Allocator *allocator, const char *fmt, ...);
+mp_String mp_string_newf(mp_Allocator *allocator, const char *fmt, ...) _MEMPLUS_PRINTF(2, 3);
 /* Allocates duplicate of `str`. */
 mp_String mp_string_dup(mp_Allocator *allocator, mp_String str);
 
+/* Builds a string by appending to it. The buffer grows geometrically so appending is amortised
+ * O(1), and with the arena allocator growing the last allocation does not copy anything. */
+typedef struct {
+    mp_Allocator *alloc;       // The allocator that manages the buffer
+    size_t        size;        // The size of the string (excluding the null-terminator)
+    size_t        capacity;    // The size of the buffer
+    char         *data;        // The string, always null-terminated once something is appended
+} mp_StringBuilder;
+
+/* Creates an empty string builder that allocates with `allocator`. */
+// allocator: mp_Allocator*
+#define mp_string_builder_new(allocator)                                                           \
+    (mp_StringBuilder) {                                                                           \
+        .alloc = (allocator), .size = 0, .capacity = 0, .data = NULL,                              \
+    }
+/* Makes sure `extra` more bytes can be appended without growing the buffer. */
+void mp_string_builder_reserve(mp_StringBuilder *self, size_t extra);
+/* Appends `size` bytes of `str`. */
+void mp_string_builder_append_n(mp_StringBuilder *self, const char *str, size_t size);
+/* Appends a null-terminated string. */
+void mp_string_builder_append(mp_StringBuilder *self, const char *str);
+/* Appends formatted input. */
+void mp_string_builder_appendf(mp_StringBuilder *self, const char *fmt, ...) _MEMPLUS_PRINTF(2, 3);
+/* Returns the string built so far. It shares the buffer of the builder. */
+mp_String mp_string_builder_to_string(mp_StringBuilder *self);
+
 /***********
  * END OF STRING
  ***********/
@@ -196,14 +255,17 @@ mp_String mp_string_dup(mp_Allocator *allocator, mp_String str);
 #define mp_vector_resize(self, offset)                                                             \
     do {                                                                                           \
         if ((self)->size + (offset) > (self)->capacity && (offset) > 0) {                          \
+            size_t _mp_old_capacity = (self)->capacity;                                            \
             if ((self)->capacity == 0) {                                                           \
                 (self)->capacity = MP_VECTOR_INIT_CAPACITY;                                        \
             }                                                                                      \
             while ((self)->size + (offset) > (self)->capacity) {                                   \
                 (self)->capacity *= 2;                                                             \
             }                                                                                      \
-            (self)->data = mp_allocator_realloc(                                                   \
-                (self)->alloc, (self)->data, 0, (self)->capacity * sizeof(*(self)->data));         \
+            (self)->data = mp_allocator_realloc((self)->alloc,                                     \
+                                                (self)->data,                                      \
+                                                _mp_old_capacity * sizeof(*(self)->data),          \
+                                                (self)->capacity * sizeof(*(self)->data));         \
         }                                                                                          \
         (self)->size += (offset);                                                                  \
     } while (0)
@@ -218,8 +280,10 @@ mp_String mp_string_dup(mp_Allocator *allocator, mp_String str);
         if ((new_capacity) < (self)->size) {                                                       \
             mp_vector_resize((self), (new_capacity) - (self)->size);                               \
         } else if ((new_capacity) > (self)->capacity) {                                            \
-            (self)->data = mp_allocator_realloc(                                                   \
-                (self)->alloc, (self)->data, 0, (new_capacity) * sizeof(*(self)->data));           \
+            (self)->data = mp_allocator_realloc((self)->alloc,                                     \
+                                                (self)->data,                                      \
+                                                (self)->capacity * sizeof(*(self)->data),          \
+                                                (new_capacity) * sizeof(*(self)->data));           \
         }                                                                                          \
         (self)->capacity = (new_capacity);                                                         \
     } while (0)
@@ -396,16 +460,51 @@ mp_Allocator mp_arena_new_allocator(mp_Arena *arena) {
     return mp_allocator_new(arena, mp_arena_alloc, mp_arena_realloc, mp_arena_dup);
 }
 
+mp_ArenaMark mp_arena_save(mp_Arena *self) {
+    if (self->end == NULL) return (mp_ArenaMark){ NULL, 0 };
+    return (mp_ArenaMark){ self->end, self->end->count };
+}
+
+void mp_arena_restore(mp_Arena *self, mp_ArenaMark mark) {
+    mp_Region *region = mark.region;
+    if (region == NULL) {
+        region = self->begin;
+        if (region == NULL) return;
+        region->count = 0;
+    } else {
+        _MEMPLUS_ASSERT(mark.count <= region->count && "arena restored to a newer mark");
+        region->count = mark.count;
+    }
+    self->end = region;
+    for (region = region->next; region != NULL; region = region->next) {
+        region->count = 0;
+    }
+}
+
+static _Thread_local mp_Arena mp_thread_arena_;
+
+mp_Arena *mp_thread_arena(void) {
+    return &mp_thread_arena_;
+}
+
+void mp_thread_arena_free(void) {
+    mp_arena_free(&mp_thread_arena_);
+}
+
 static void *mp_arena_alloc(mp_Arena *self, size_t size) {
     // size in word/qword (64 bits)
     size_t size_word = (size + sizeof(uintptr_t) - 1) / sizeof(uintptr_t);
 
+    ++self->stats.allocs;
+    self->stats.bytes += size;
+
     if (self->end == NULL) {
         _MEMPLUS_ASSERT(self->begin == NULL);
         size_t capacity = MP_REGION_DEFAULT_SIZE;
         if (capacity < size_word) capacity = size_word;
         self->end   = mp_region_new(capacity);
         self->begin = self->end;
+        ++self->stats.regions;
     }
 
     while (self->end->count + size_word > self->end->capacity && self->end->next != NULL) {
@@ -418,6 +517,7 @@ static void *mp_arena_alloc(mp_Arena *self, size_t size) {
         if (capacity < size_word) capacity = size_word;
         self->end->next = mp_region_new(capacity);
         self->end       = self->end->next;
+        ++self->stats.regions;
     }
 
     void *result = &self->end->data[self->end->count];
@@ -427,12 +527,25 @@ static void *mp_arena_alloc(mp_Arena *self, size_t size) {
 
 static void *mp_arena_realloc(mp_Arena *self, void *old_ptr, size_t old_size, size_t new_size) {
     if (new_size <= old_size) return old_ptr;
-    void    *new_ptr      = mp_arena_alloc(self, new_size);
-    uint8_t *new_ptr_byte = (uint8_t *)new_ptr;
-    uint8_t *old_ptr_byte = (uint8_t *)old_ptr;
-    for (size_t i = 0; i < old_size; ++i) {
-        new_ptr_byte[i] = old_ptr_byte[i];
+    ++self->stats.reallocs;
+
+    // If `old_ptr` is the last allocation in the current region, grow it where it is
+    mp_Region *end = self->end;
+    if (old_ptr != NULL && end != NULL) {
+        size_t     old_word = (old_size + sizeof(uintptr_t) - 1) / sizeof(uintptr_t);
+        size_t     new_word = (new_size + sizeof(uintptr_t) - 1) / sizeof(uintptr_t);
+        uintptr_t *ptr      = (uintptr_t *)old_ptr;
+        if (old_word <= end->count && ptr == &end->data[end->count - old_word] &&
+            end->count - old_word + new_word <= end->capacity) {
+            end->count += new_word - old_word;
+            ++self->stats.reallocs_in_place;
+            self->stats.bytes += new_size - old_size;
+            return old_ptr;
+        }
     }
+
+    void *new_ptr = mp_arena_alloc(self, new_size);
+    if (old_size > 0) memcpy(new_ptr, old_ptr, old_size);
     return new_ptr;
 }
 
@@ -467,6 +580,53 @@ mp_String mp_string_newf(mp_Allocator *allocator, const char *fmt, ...) {
     return (mp_String){ (size_t)result_size, result };
 }
 
+void mp_string_builder_reserve(mp_StringBuilder *self, size_t extra) {
+    size_t needed = self->size + extra + 1;
+    if (needed <= self->capacity) return;
+    size_t capacity = (self->capacity == 0) ? 64 : self->capacity * 2;
+    while (capacity < needed) capacity *= 2;
+    self->data     = mp_allocator_realloc(self->alloc, self->data, self->capacity, capacity);
+    self->capacity = capacity;
+}
+
+void mp_string_builder_append_n(mp_StringBuilder *self, const char *str, size_t size) {
+    mp_string_builder_reserve(self, size);
+    memcpy(self->data + self->size, str, size);
+    self->size += size;
+    self->data[self->size] = '\0';
+}
+
+void mp_string_builder_append(mp_StringBuilder *self, const char *str) {
+    mp_string_builder_append_n(self, str, strlen(str));
+}
+
+void mp_string_builder_appendf(mp_StringBuilder *self, const char *fmt, ...) {
+    va_list args;
+
+    // Try to format into the space that is left first, most of the time it fits
+    mp_string_builder_reserve(self, 0);
+    size_t available = self->capacity - self->size;
+    va_start(args, fmt);
+    int size = vsnprintf(self->data + self->size, available, fmt, args);
+    va_end(args);
+    _MEMPLUS_ASSERT(size >= 0 && "failed to count string size");
+
+    if ((size_t)size >= available) {
+        mp_string_builder_reserve(self, (size_t)size);
+        va_start(args, fmt);
+        int result_size = vsnprintf(self->data + self->size, (size_t)size + 1, fmt, args);
+        _MEMPLUS_ASSERT(result_size == size);
+        va_end(args);
+    }
+    self->size += (size_t)size;
+}
+
+mp_String mp_string_builder_to_string(mp_StringBuilder *self) {
+    mp_string_builder_reserve(self, 0);
+    self->data[self->size] = '\0';
+    return (mp_String){ self->size, self->data };
+}
+
 mp_String mp_string_dup(mp_Allocator *allocator, mp_String str) {
     int size = snprintf(NULL, 0, "%s", str.cstr);
     _MEMPLUS_ASSERT((size > 0 || (size_t)size != str.size) && "failed to count string size");
@@ -0,0 +1,509 @@
+#include "pixfmt.h"
+#include "utils.h"
+#include <assert.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define PIXFMT_X86 1
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#define PIXFMT_NEON 1
+#endif
+
+typedef struct {
+    const char *name;
+    uint8_t     bpp;
+    uint8_t     r, g, b, a;       // Byte of each channel, the 10-bit channel for `ten_bit`
+    bool        alpha;            // Whether `a` holds alpha, the output is opaque otherwise
+    bool        premultiplied;    // Whether the colours are premultiplied by alpha
+    bool        ten_bit;          // 10 bits per channel in a little-endian 32-bit word
+} FormatInfo;
+
+static const FormatInfo formats[PIXFMT_COUNT] = {
+    [PIXFMT_RGB]         = { "RGB", 3, 0, 1, 2, 0, false, false, false },
+    [PIXFMT_RGBA]        = { "RGBA", 4, 0, 1, 2, 3, true, false, false },
+    [PIXFMT_BGR]         = { "BGR", 3, 2, 1, 0, 0, false, false, false },
+    [PIXFMT_XRGB8888]    = { "XRGB8888", 4, 2, 1, 0, 3, false, false, false },
+    [PIXFMT_XBGR8888]    = { "XBGR8888", 4, 0, 1, 2, 3, false, false, false },
+    [PIXFMT_ARGB8888]    = { "ARGB8888", 4, 2, 1, 0, 3, true, true, false },
+    [PIXFMT_ABGR8888]    = { "ABGR8888", 4, 0, 1, 2, 3, true, true, false },
+    [PIXFMT_XRGB2101010] = { "XRGB2101010", 4, 2, 1, 0, 3, false, false, true },
+    [PIXFMT_XBGR2101010] = { "XBGR2101010", 4, 0, 1, 2, 3, false, false, true },
+};
+
+static const char *isa_names[PIXFMT_ISA_COUNT] = {
+    [PIXFMT_ISA_SCALAR] = "scalar",
+    [PIXFMT_ISA_SSSE3]  = "ssse3",
+    [PIXFMT_ISA_AVX2]   = "avx2",
+    [PIXFMT_ISA_NEON]   = "neon",
+};
+
+// Converts `width` pixels described by `info` into RGB or RGBA depending on `dst_bpp`
+typedef void (*RowKernel)(uint8_t *dst, const uint8_t *src, size_t width, const FormatInfo *info,
+                          size_t dst_bpp);
+
+size_t pixfmt_bpp(PixelFormat format) {
+    assert(format < PIXFMT_COUNT);
+    return formats[format].bpp;
+}
+
+bool pixfmt_has_alpha(PixelFormat format) {
+    assert(format < PIXFMT_COUNT);
+    return formats[format].alpha;
+}
+
+const char *pixfmt_name(PixelFormat format) {
+    assert(format < PIXFMT_COUNT);
+    return formats[format].name;
+}
+
+const char *pixfmt_isa_name(PixfmtIsa isa) {
+    assert(isa < PIXFMT_ISA_COUNT);
+    return isa_names[isa];
+}
+
+/***********
+ * SCALAR
+ ***********/
+
+// Every kernel falls back to these for the pixels they don't handle, so they define the result.
+// Unpremultiplying is c * 255 / a rounded, with the division done by a 16.16 reciprocal.
+static uint32_t       unpremultiply_recip[256];
+static pthread_once_t unpremultiply_once = PTHREAD_ONCE_INIT;
+
+static void unpremultiply_init(void) {
+    for (uint32_t a = 1; a < 256; ++a) unpremultiply_recip[a] = (255u * 65536u + a / 2) / a;
+}
+
+static void unpremultiply(uint8_t px[4]) {
+    uint32_t a = px[3];
+    if (a == 255) return;
+    uint32_t recip = unpremultiply_recip[a];
+    for (size_t i = 0; i < 3; ++i) {
+        uint32_t c = (px[i] * recip + 0x8000u) >> 16;
+        px[i]      = (uint8_t)(c > 255 ? 255 : c);
+    }
+}
+
+static void scalar_row(uint8_t          *dst,
+                       const uint8_t    *src,
+                       size_t            width,
+                       const FormatInfo *info,
+                       size_t            dst_bpp) {
+    const size_t r = info->r, g = info->g, b = info->b, a = info->a, bpp = info->bpp;
+    if (info->ten_bit) {
+        for (size_t x = 0; x < width; ++x, src += bpp, dst += dst_bpp) {
+            uint32_t word = (uint32_t)src[0] | (uint32_t)src[1] << 8 | (uint32_t)src[2] << 16 |
+                            (uint32_t)src[3] << 24;
+            // The top 8 of the 10 bits of each channel
+            dst[0] = (uint8_t)(word >> (10 * r + 2));
+            dst[1] = (uint8_t)(word >> (10 * g + 2));
+            dst[2] = (uint8_t)(word >> (10 * b + 2));
+            if (dst_bpp == 4) dst[3] = 255;
+        }
+    } else if (info->premultiplied && dst_bpp == 4) {
+        for (size_t x = 0; x < width; ++x, src += bpp, dst += dst_bpp) {
+            uint8_t px[4] = { src[r], src[g], src[b], src[a] };
+            unpremultiply(px);
+            memcpy(dst, px, sizeof(px));
+        }
+    } else if (dst_bpp == 4) {
+        for (size_t x = 0; x < width; ++x, src += bpp, dst += 4) {
+            dst[0] = src[r];
+            dst[1] = src[g];
+            dst[2] = src[b];
+            dst[3] = info->alpha ? src[a] : 255;
+        }
+    } else {
+        for (size_t x = 0; x < width; ++x, src += bpp, dst += 3) {
+            dst[0] = src[r];
+            dst[1] = src[g];
+            dst[2] = src[b];
+        }
+    }
+}
+
+/***********
+ * x86
+ ***********/
+
+#ifdef PIXFMT_X86
+// Shuffle masks for 4 pixels of `info` into RGBA or RGB, bytes set to -1 are zeroed
+static void x86_masks(const FormatInfo *info, int8_t to_rgba[16], int8_t to_rgb[16]) {
+    memset(to_rgb, -1, 16);
+    for (int px = 0; px < 4; ++px) {
+        int base             = px * info->bpp;
+        to_rgba[px * 4 + 0]  = (int8_t)(base + info->r);
+        to_rgba[px * 4 + 1]  = (int8_t)(base + info->g);
+        to_rgba[px * 4 + 2]  = (int8_t)(base + info->b);
+        to_rgba[px * 4 + 3]  = info->alpha ? (int8_t)(base + info->a) : -1;
+        to_rgb[px * 3 + 0]   = (int8_t)(base + info->r);
+        to_rgb[px * 3 + 1]   = (int8_t)(base + info->g);
+        to_rgb[px * 3 + 2]   = (int8_t)(base + info->b);
+    }
+}
+
+// Bytes that are not alpha set to 0xFF, so OR-ing it with 4 pixels is all ones if they are opaque
+static void x86_not_alpha(const FormatInfo *info, uint8_t not_alpha[16]) {
+    memset(not_alpha, 0xFF, 16);
+    for (int px = 0; px < 4; ++px) not_alpha[px * 4 + info->a] = 0;
+}
+
+__attribute__((target("ssse3"))) static __m128i ssse3_ten_bit(__m128i v, const FormatInfo *info) {
+    __m128i byte = _mm_set1_epi32(0xFF);
+    __m128i c[3];
+    c[0] = _mm_and_si128(_mm_srli_epi32(v, 2), byte);
+    c[1] = _mm_and_si128(_mm_srli_epi32(v, 12), byte);
+    c[2] = _mm_and_si128(_mm_srli_epi32(v, 22), byte);
+    __m128i rgba = _mm_set1_epi32((int)0xFF000000u);
+    rgba         = _mm_or_si128(rgba, c[info->r]);
+    rgba         = _mm_or_si128(rgba, _mm_slli_epi32(c[info->g], 8));
+    return _mm_or_si128(rgba, _mm_slli_epi32(c[info->b], 16));
+}
+
+// Stores the first 12 bytes of `v`
+__attribute__((target("ssse3"))) static void ssse3_store_rgb(uint8_t *dst, __m128i v) {
+    _mm_storel_epi64((__m128i *)dst, v);
+    int last = _mm_cvtsi128_si32(_mm_srli_si128(v, 8));
+    memcpy(dst + 8, &last, sizeof(last));
+}
+
+__attribute__((target("ssse3"))) static void ssse3_row(uint8_t          *dst,
+                                                       const uint8_t    *src,
+                                                       size_t            width,
+                                                       const FormatInfo *info,
+                                                       size_t            dst_bpp) {
+    int8_t  to_rgba[16], to_rgb[16];
+    uint8_t not_alpha[16];
+    x86_masks(info, to_rgba, to_rgb);
+    x86_not_alpha(info, not_alpha);
+    const __m128i mask_rgba   = _mm_loadu_si128((const __m128i *)to_rgba);
+    const __m128i mask_rgb    = _mm_loadu_si128((const __m128i *)to_rgb);
+    const __m128i mask_opaque = _mm_loadu_si128((const __m128i *)not_alpha);
+    const __m128i ones        = _mm_set1_epi8(-1);
+    const __m128i alpha       = info->alpha ? _mm_setzero_si128()
+                                            : _mm_set1_epi32((int)0xFF000000u);
+    const __m128i compact =
+        _mm_setr_epi8(0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1);
+    const bool    unpremul    = info->premultiplied && dst_bpp == 4;
+
+    size_t x = 0;
+    // 24-bit rows are loaded 16 bytes at a time, so the last 2 pixels are left to the scalar loop
+    size_t end = info->bpp == 3 ? (width >= 6 ? width - 2 : 0) : width;
+    for (; x + 4 <= end; x += 4) {
+        const uint8_t *s = src + x * info->bpp;
+        uint8_t       *d = dst + x * dst_bpp;
+        __m128i        v = _mm_loadu_si128((const __m128i *)s);
+        if (info->ten_bit) {
+            v = ssse3_ten_bit(v, info);
+            if (dst_bpp == 4) {
+                _mm_storeu_si128((__m128i *)d, v);
+            } else {
+                ssse3_store_rgb(d, _mm_shuffle_epi8(v, compact));
+            }
+            continue;
+        }
+        if (unpremul) {
+            __m128i opaque = _mm_cmpeq_epi8(_mm_or_si128(v, mask_opaque), ones);
+            if (_mm_movemask_epi8(opaque) != 0xFFFF) {
+                scalar_row(d, s, 4, info, dst_bpp);
+                continue;
+            }
+        }
+        if (dst_bpp == 4) {
+            _mm_storeu_si128((__m128i *)d, _mm_or_si128(_mm_shuffle_epi8(v, mask_rgba), alpha));
+        } else {
+            ssse3_store_rgb(d, _mm_shuffle_epi8(v, mask_rgb));
+        }
+    }
+    scalar_row(dst + x * dst_bpp, src + x * info->bpp, width - x, info, dst_bpp);
+}
+
+__attribute__((target("avx2"))) static __m256i avx2_ten_bit(__m256i v, const FormatInfo *info) {
+    __m256i byte = _mm256_set1_epi32(0xFF);
+    __m256i c[3];
+    c[0] = _mm256_and_si256(_mm256_srli_epi32(v, 2), byte);
+    c[1] = _mm256_and_si256(_mm256_srli_epi32(v, 12), byte);
+    c[2] = _mm256_and_si256(_mm256_srli_epi32(v, 22), byte);
+    __m256i rgba = _mm256_set1_epi32((int)0xFF000000u);
+    rgba         = _mm256_or_si256(rgba, c[info->r]);
+    rgba         = _mm256_or_si256(rgba, _mm256_slli_epi32(c[info->g], 8));
+    return _mm256_or_si256(rgba, _mm256_slli_epi32(c[info->b], 16));
+}
+
+// Stores the first 12 bytes of each lane of `v` one after the other
+__attribute__((target("avx2"))) static void avx2_store_rgb(uint8_t *dst, __m256i v) {
+    ssse3_store_rgb(dst, _mm256_castsi256_si128(v));
+    ssse3_store_rgb(dst + 12, _mm256_extracti128_si256(v, 1));
+}
+
+__attribute__((target("avx2"))) static void avx2_row(uint8_t          *dst,
+                                                     const uint8_t    *src,
+                                                     size_t            width,
+                                                     const FormatInfo *info,
+                                                     size_t            dst_bpp) {
+    int8_t  to_rgba[16], to_rgb[16];
+    uint8_t not_alpha[16];
+    x86_masks(info, to_rgba, to_rgb);
+    x86_not_alpha(info, not_alpha);
+    // `vpshufb` shuffles each 128-bit lane on its own, so both lanes get the 4-pixel masks
+    const __m256i mask_rgba   = _mm256_broadcastsi128_si256(_mm_loadu_si128((void *)to_rgba));
+    const __m256i mask_rgb    = _mm256_broadcastsi128_si256(_mm_loadu_si128((void *)to_rgb));
+    const __m256i mask_opaque = _mm256_broadcastsi128_si256(_mm_loadu_si128((void *)not_alpha));
+    const __m256i ones        = _mm256_set1_epi8(-1);
+    const __m256i alpha       = info->alpha ? _mm256_setzero_si256()
+                                            : _mm256_set1_epi32((int)0xFF000000u);
+    const __m256i compact     = _mm256_broadcastsi128_si256(
+        _mm_setr_epi8(0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1));
+    const bool    unpremul    = info->premultiplied && dst_bpp == 4;
+
+    size_t x = 0;
+    // 24-bit lanes are loaded from 12 bytes apart, the last load reads 4 bytes past the 8 pixels
+    size_t end = info->bpp == 3 ? (width >= 10 ? width - 2 : 0) : width;
+    for (; x + 8 <= end; x += 8) {
+        const uint8_t *s = src + x * info->bpp;
+        uint8_t       *d = dst + x * dst_bpp;
+        __m256i        v;
+        if (info->bpp == 3) {
+            __m128i lo = _mm_loadu_si128((const __m128i *)s);
+            __m128i hi = _mm_loadu_si128((const __m128i *)(s + 12));
+            v          = _mm256_inserti128_si256(_mm256_castsi128_si256(lo), hi, 1);
+        } else {
+            v = _mm256_loadu_si256((const __m256i *)s);
+        }
+        if (info->ten_bit) {
+            v = avx2_ten_bit(v, info);
+            if (dst_bpp == 4) {
+                _mm256_storeu_si256((__m256i *)d, v);
+            } else {
+                avx2_store_rgb(d, _mm256_shuffle_epi8(v, compact));
+            }
+            continue;
+        }
+        if (unpremul) {
+            __m256i opaque = _mm256_cmpeq_epi8(_mm256_or_si256(v, mask_opaque), ones);
+            if ((uint32_t)_mm256_movemask_epi8(opaque) != 0xFFFFFFFFu) {
+                scalar_row(d, s, 8, info, dst_bpp);
+                continue;
+            }
+        }
+        if (dst_bpp == 4) {
+            v = _mm256_or_si256(_mm256_shuffle_epi8(v, mask_rgba), alpha);
+            _mm256_storeu_si256((__m256i *)d, v);
+        } else {
+            avx2_store_rgb(d, _mm256_shuffle_epi8(v, mask_rgb));
+        }
+    }
+    ssse3_row(dst + x * dst_bpp, src + x * info->bpp, width - x, info, dst_bpp);
+}
+#endif /* ifdef PIXFMT_X86 */
+
+/***********
+ * NEON
+ ***********/
+
+#ifdef PIXFMT_NEON
+static void neon_row(uint8_t          *dst,
+                     const uint8_t    *src,
+                     size_t            width,
+                     const FormatInfo *info,
+                     size_t            dst_bpp) {
+    size_t x = 0;
+    // The 10-bit formats are left to the scalar loop
+    if (!info->ten_bit) {
+        const uint8x16_t opaque   = vdupq_n_u8(255);
+        const bool       unpremul = info->premultiplied && dst_bpp == 4;
+        for (; x + 16 <= width; x += 16) {
+            const uint8_t *s = src + x * info->bpp;
+            uint8_t       *d = dst + x * dst_bpp;
+            // The structured loads split the pixels into one register per byte
+            uint8x16_t     planes[4];
+            if (info->bpp == 4) {
+                uint8x16x4_t v = vld4q_u8(s);
+                planes[0]      = v.val[0];
+                planes[1]      = v.val[1];
+                planes[2]      = v.val[2];
+                planes[3]      = v.val[3];
+            } else {
+                uint8x16x3_t v = vld3q_u8(s);
+                planes[0]      = v.val[0];
+                planes[1]      = v.val[1];
+                planes[2]      = v.val[2];
+                planes[3]      = opaque;
+            }
+            uint8x16_t a = info->alpha ? planes[info->a] : opaque;
+            if (unpremul && vminvq_u8(a) != 255) {
+                scalar_row(d, s, 16, info, dst_bpp);
+                continue;
+            }
+            if (dst_bpp == 4) {
+                uint8x16x4_t out = { { planes[info->r], planes[info->g], planes[info->b], a } };
+                vst4q_u8(d, out);
+            } else {
+                uint8x16x3_t out = { { planes[info->r], planes[info->g], planes[info->b] } };
+                vst3q_u8(d, out);
+            }
+        }
+    }
+    scalar_row(dst + x * dst_bpp, src + x * info->bpp, width - x, info, dst_bpp);
+}
+#endif /* ifdef PIXFMT_NEON */
+
+/***********
+ * DISPATCH
+ ***********/
+
+static const RowKernel kernels[PIXFMT_ISA_COUNT] = {
+    [PIXFMT_ISA_SCALAR] = scalar_row,
+#ifdef PIXFMT_X86
+    [PIXFMT_ISA_SSSE3] = ssse3_row,
+    [PIXFMT_ISA_AVX2]  = avx2_row,
+#endif
+#ifdef PIXFMT_NEON
+    [PIXFMT_ISA_NEON] = neon_row,
+#endif
+};
+
+// -1 until the CPU has been checked
+static _Atomic int current_isa = -1;
+
+static bool isa_supported(PixfmtIsa isa) {
+    if (kernels[isa] == NULL) return false;
+#ifdef PIXFMT_X86
+    if (isa == PIXFMT_ISA_SSSE3) return __builtin_cpu_supports("ssse3");
+    if (isa == PIXFMT_ISA_AVX2) return __builtin_cpu_supports("avx2");
+#endif
+    return true;    // NEON is part of every aarch64 CPU
+}
+
+PixfmtIsa pixfmt_isa(void) {
+    int isa = atomic_load_explicit(&current_isa, memory_order_relaxed);
+    if (isa != -1) return (PixfmtIsa)isa;
+    pthread_once(&unpremultiply_once, unpremultiply_init);
+    isa = PIXFMT_ISA_SCALAR;
+    for (int i = PIXFMT_ISA_COUNT - 1; i > PIXFMT_ISA_SCALAR; --i) {
+        if (isa_supported((PixfmtIsa)i)) {
+            isa = i;
+            break;
+        }
+    }
+    atomic_store_explicit(&current_isa, isa, memory_order_relaxed);
+    return (PixfmtIsa)isa;
+}
+
+bool pixfmt_set_isa(PixfmtIsa isa) {
+    assert(isa < PIXFMT_ISA_COUNT);
+    if (!isa_supported(isa)) return false;
+    pthread_once(&unpremultiply_once, unpremultiply_init);
+    atomic_store_explicit(&current_isa, (int)isa, memory_order_relaxed);
+    return true;
+}
+
+void pixfmt_convert_rows(const PixelBuffer *src,
+                         uint32_t           first_row,
+                         uint32_t           rows,
+                         uint8_t           *dst,
+                         size_t             dst_stride,
+                         PixelFormat        dst_format) {
+    assert(src->format < PIXFMT_COUNT);
+    assert(dst_format == PIXFMT_RGB || dst_format == PIXFMT_RGBA);
+    assert(first_row + rows <= src->height);
+
+    const FormatInfo *info    = &formats[src->format];
+    size_t            dst_bpp = formats[dst_format].bpp;
+    RowKernel         kernel  = kernels[pixfmt_isa()];
+    for (uint32_t i = 0; i < rows; ++i) {
+        uint32_t       y = first_row + i;
+        const uint8_t *s = src->data + (src->y_invert ? src->height - 1 - y : y) * src->stride;
+        uint8_t       *d = dst + i * dst_stride;
+        if (src->format == dst_format) {
+            memcpy(d, s, src->width * dst_bpp);
+        } else {
+            kernel(d, s, src->width, info, dst_bpp);
+        }
+    }
+}
+
+bool pixfmt_convert(const PixelBuffer *src, PixelBuffer *dst) {
+    if (dst->format != PIXFMT_RGB && dst->format != PIXFMT_RGBA) {
+        eprintf("Cannot convert to %s, only to RGB or RGBA\n", pixfmt_name(dst->format));
+        return false;
+    }
+    if (src->width != dst->width || src->height != dst->height || dst->y_invert) {
+        eprintf("Cannot convert a %ux%u image into a %ux%u one\n",
+                src->width,
+                src->height,
+                dst->width,
+                dst->height);
+        return false;
+    }
+    pixfmt_convert_rows(src, 0, src->height, dst->data, dst->stride, dst->format);
+    return true;
+}
+
+// Adds the bytes of `row` to `sums`, the vertical half of the box filter
+static void accumulate_row(uint32_t *sums, const uint8_t *row, size_t size) {
+    size_t i = 0;
+#if defined(__SSE2__)
+    __m128i zero = _mm_setzero_si128();
+    for (; i + 16 <= size; i += 16) {
+        __m128i  v  = _mm_loadu_si128((const __m128i *)(row + i));
+        __m128i  lo = _mm_unpacklo_epi8(v, zero);
+        __m128i  hi = _mm_unpackhi_epi8(v, zero);
+        __m128i *s  = (__m128i *)(sums + i);
+        _mm_storeu_si128(s, _mm_add_epi32(_mm_loadu_si128(s), _mm_unpacklo_epi16(lo, zero)));
+        _mm_storeu_si128(s + 1,
+                         _mm_add_epi32(_mm_loadu_si128(s + 1), _mm_unpackhi_epi16(lo, zero)));
+        _mm_storeu_si128(s + 2,
+                         _mm_add_epi32(_mm_loadu_si128(s + 2), _mm_unpacklo_epi16(hi, zero)));
+        _mm_storeu_si128(s + 3,
+                         _mm_add_epi32(_mm_loadu_si128(s + 3), _mm_unpackhi_epi16(hi, zero)));
+    }
+#elif defined(PIXFMT_NEON)
+    for (; i + 16 <= size; i += 16) {
+        uint8x16_t v  = vld1q_u8(row + i);
+        uint16x8_t lo = vmovl_u8(vget_low_u8(v));
+        uint16x8_t hi = vmovl_u8(vget_high_u8(v));
+        vst1q_u32(sums + i, vaddw_u16(vld1q_u32(sums + i), vget_low_u16(lo)));
+        vst1q_u32(sums + i + 4, vaddw_u16(vld1q_u32(sums + i + 4), vget_high_u16(lo)));
+        vst1q_u32(sums + i + 8, vaddw_u16(vld1q_u32(sums + i + 8), vget_low_u16(hi)));
+        vst1q_u32(sums + i + 12, vaddw_u16(vld1q_u32(sums + i + 12), vget_high_u16(hi)));
+    }
+#endif
+    for (; i < size; ++i) sums[i] += row[i];
+}
+
+void pixfmt_downscale(const PixelBuffer *src, PixelBuffer *dst, uint32_t *sums) {
+    assert(src->format == PIXFMT_RGB && dst->format == PIXFMT_RGB && !src->y_invert);
+    assert(dst->width <= src->width && dst->height <= src->height);
+    size_t row_size = (size_t)src->width * 3;
+
+    for (uint32_t y = 0; y < dst->height; ++y) {
+        uint32_t y0 = (uint32_t)((uint64_t)y * src->height / dst->height);
+        uint32_t y1 = (uint32_t)((uint64_t)(y + 1) * src->height / dst->height);
+        // Whole rows are summed first, which is the bulk of the work and runs on SIMD
+        memset(sums, 0, row_size * sizeof(*sums));
+        for (uint32_t sy = y0; sy < y1; ++sy) {
+            accumulate_row(sums, src->data + sy * src->stride, row_size);
+        }
+
+        uint8_t *out = dst->data + y * dst->stride;
+        for (uint32_t x = 0; x < dst->width; ++x) {
+            uint32_t x0       = (uint32_t)((uint64_t)x * src->width / dst->width);
+            uint32_t x1       = (uint32_t)((uint64_t)(x + 1) * src->width / dst->width);
+            uint64_t total[3] = { 0 };
+            for (uint32_t sx = x0; sx < x1; ++sx) {
+                total[0] += sums[sx * 3];
+                total[1] += sums[sx * 3 + 1];
+                total[2] += sums[sx * 3 + 2];
+            }
+            uint64_t count = (uint64_t)(x1 - x0) * (y1 - y0);
+            for (size_t c = 0; c < 3; ++c) {
+                out[x * 3 + c] = (uint8_t)((total[c] + count / 2) / count);
+            }
+        }
+    }
+}
@@ -0,0 +1,69 @@
+#ifndef PIXFMT_H
+#define PIXFMT_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// The 8-bit formats are named after their bytes in memory. The others are named like wl_shm, after
+// the bits of a little-endian 32-bit word: XRGB8888 is stored as B, G, R, X.
+typedef enum {
+    PIXFMT_RGB,            // R, G, B
+    PIXFMT_RGBA,           // R, G, B, A (straight alpha)
+    PIXFMT_BGR,            // B, G, R
+    PIXFMT_XRGB8888,       // B, G, R, X
+    PIXFMT_XBGR8888,       // R, G, B, X
+    PIXFMT_ARGB8888,       // B, G, R, A (premultiplied alpha)
+    PIXFMT_ABGR8888,       // R, G, B, A (premultiplied alpha)
+    PIXFMT_XRGB2101010,    // 10 bits per channel, blue in the lowest bits
+    PIXFMT_XBGR2101010,    // 10 bits per channel, red in the lowest bits
+    PIXFMT_COUNT,
+} PixelFormat;
+
+// The conversion kernels, from the slowest to the fastest
+typedef enum {
+    PIXFMT_ISA_SCALAR,
+    PIXFMT_ISA_SSSE3,
+    PIXFMT_ISA_AVX2,
+    PIXFMT_ISA_NEON,
+    PIXFMT_ISA_COUNT,
+} PixfmtIsa;
+
+typedef struct {
+    uint8_t    *data;
+    uint32_t    width, height;
+    size_t      stride;      // Bytes from the start of a row to the start of the next one
+    PixelFormat format;
+    bool        y_invert;    // The first row in memory is the bottom row of the image
+} PixelBuffer;
+
+size_t      pixfmt_bpp(PixelFormat format);
+bool        pixfmt_has_alpha(PixelFormat format);
+const char *pixfmt_name(PixelFormat format);
+const char *pixfmt_isa_name(PixfmtIsa isa);
+
+// The kernels in use, the fastest one the CPU supports unless `pixfmt_set_isa()` was called
+PixfmtIsa pixfmt_isa(void);
+// Returns false if `isa` was not compiled in or is not supported by the CPU
+bool      pixfmt_set_isa(PixfmtIsa isa);
+
+// Converts rows `first_row` to `first_row + rows` of `src`, in top-down order, into `dst`.
+// `dst_format` must be PIXFMT_RGB or PIXFMT_RGBA. Swizzling, dropping or unpremultiplying alpha,
+// 10 to 8-bit reduction and the y-flip are done in one pass over every pixel.
+// Dropping premultiplied alpha keeps the colours as they are, which is the image over black.
+void pixfmt_convert_rows(const PixelBuffer *src,
+                         uint32_t           first_row,
+                         uint32_t           rows,
+                         uint8_t           *dst,
+                         size_t             dst_stride,
+                         PixelFormat        dst_format);
+
+// Converts the whole of `src` into `dst`, which must be as big and not y-inverted
+bool pixfmt_convert(const PixelBuffer *src, PixelBuffer *dst);
+
+// Downscales `src` into `dst` with a box filter: each pixel of `dst` is the average of the pixels
+// of `src` it covers. Both must be PIXFMT_RGB and `dst` no bigger than `src`.
+// `sums` is scratch memory for `src->width * 3` counters.
+void pixfmt_downscale(const PixelBuffer *src, PixelBuffer *dst, uint32_t *sums);
+
+#endif /* ifndef PIXFMT_H */
@@ -0,0 +1,351 @@
+#include "png.h"
+#include "deflate.h"
+#include <string.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
+#define PALETTE_MAX   256
+#define PALETTE_SLOTS 1024    // Open addressing, kept at most a quarter full
+
+// The colours of a frame that has few enough of them for an indexed or a greyscale PNG
+typedef struct {
+    uint32_t colours[PALETTE_MAX];    // R, G, B and A from the lowest byte, A is 255 without alpha
+    uint8_t  samples[PALETTE_MAX];    // What each colour is written as, its index or its grey level
+    uint32_t count;
+    int16_t  slots[PALETTE_SLOTS];    // Indices of `colours`, -1 for an empty slot
+    bool     grey;                    // Every colour is an opaque grey
+    uint8_t  grey_depth;              // The smallest bit depth every grey level fits in exactly
+    uint8_t  depth;                   // Bit depth of the image
+} Palette;
+
+static void put_u32_be(uint8_t *p, uint32_t v) {
+    p[0] = (uint8_t)(v >> 24);
+    p[1] = (uint8_t)(v >> 16);
+    p[2] = (uint8_t)(v >> 8);
+    p[3] = (uint8_t)v;
+}
+
+// Reserves the length and the type of a chunk, returns where the chunk starts in `out`
+static size_t chunk_begin(mp_StringBuilder *out, const char type[4]) {
+    size_t start = out->size;
+    mp_string_builder_append_n(out, "\0\0\0\0", 4);
+    mp_string_builder_append_n(out, type, 4);
+    return start;
+}
+
+// Fills in the length of the chunk that starts at `start` and appends its CRC
+static void chunk_end(mp_StringBuilder *out, size_t start) {
+    uint8_t *chunk = (uint8_t *)out->data + start;
+    size_t   size  = out->size - start - 8;
+    put_u32_be(chunk, (uint32_t)size);
+    uint8_t crc[4];
+    put_u32_be(crc, crc32_update(0, chunk + 4, size + 4));
+    mp_string_builder_append_n(out, (const char *)crc, sizeof(crc));
+}
+
+// Filters `count` converted rows, each one preceded by its filter type byte. `prev` is the
+// unfiltered row above the first one, NULL for the first row of the image.
+static void filter_rows(uint8_t       *rows,
+                        uint32_t       count,
+                        size_t         stride,
+                        size_t         bpp,
+                        const uint8_t *prev) {
+    // The rows are filtered from the bottom up so each one is still unfiltered when the row
+    // below it needs it
+    for (size_t y = count; y-- > 0;) {
+        uint8_t       *row   = rows + y * stride;
+        const uint8_t *above = y > 0 ? row - stride : prev;
+        if (above == NULL) {
+            row[0] = 1;    // Sub
+            for (size_t x = stride - 1; x > bpp; --x) row[x] = (uint8_t)(row[x] - row[x - bpp]);
+        } else {
+            row[0] = 2;    // Up
+            for (size_t x = 1; x < stride; ++x) row[x] = (uint8_t)(row[x] - above[x]);
+        }
+    }
+}
+
+// Returns rows `y` to `y + count` of `frame` as `format`, converted into `scratch` unless the frame
+// is stored like that already. `stride` is set to the stride of the rows returned.
+static const uint8_t *source_rows(const PixelBuffer *frame,
+                                  uint32_t           y,
+                                  uint32_t           count,
+                                  PixelFormat        format,
+                                  uint8_t           *scratch,
+                                  size_t            *stride) {
+    if (frame->format == format && !frame->y_invert) {
+        *stride = frame->stride;
+        return frame->data + y * frame->stride;
+    }
+    *stride = frame->width * pixfmt_bpp(format);
+    pixfmt_convert_rows(frame, y, count, scratch, *stride, format);
+    return scratch;
+}
+
+static uint32_t load_colour(const uint8_t *p, size_t bpp) {
+    uint32_t alpha = bpp == 4 ? p[3] : 0xFF;
+    return (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | alpha << 24;
+}
+
+// Whether the 16 bytes at `p` repeat the `bpp` bytes before them, which means the pixels they
+// cover are all the same colour as the one before `p`. Screen content is mostly such runs.
+static bool run16(const uint8_t *p, size_t bpp) {
+#if defined(__SSE2__)
+    __m128i a = _mm_loadu_si128((const __m128i *)p);
+    __m128i b = _mm_loadu_si128((const __m128i *)(p - bpp));
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(a, b)) == 0xFFFF;
+#elif defined(__aarch64__)
+    return vminvq_u8(vceqq_u8(vld1q_u8(p), vld1q_u8(p - bpp))) == 0xFF;
+#else
+    return memcmp(p, p - bpp, 16) == 0;
+#endif
+}
+
+// How far apart the grey levels of `depth` bits are, in 8 bits
+static uint32_t grey_step(uint8_t depth) {
+    return 255 / ((1u << depth) - 1);
+}
+
+static uint32_t palette_hash(uint32_t colour) {
+    return (colour * 2654435761u) >> 22;
+}
+
+// Returns the index of `colour`, adding it if it is new, or -1 if the palette is full
+static int32_t palette_index(Palette *palette, uint32_t colour) {
+    uint32_t slot = palette_hash(colour);
+    while (palette->slots[slot] != -1) {
+        if (palette->colours[palette->slots[slot]] == colour) return palette->slots[slot];
+        slot = (slot + 1) & (PALETTE_SLOTS - 1);
+    }
+    if (palette->count == PALETTE_MAX) return -1;
+
+    palette->slots[slot]             = (int16_t)palette->count;
+    palette->colours[palette->count] = colour;
+    palette->samples[palette->count] = (uint8_t)palette->count;
+
+    uint8_t r     = (uint8_t)colour, g = (uint8_t)(colour >> 8), b = (uint8_t)(colour >> 16);
+    palette->grey = palette->grey && r == g && g == b && colour >> 24 == 0xFF;
+    while (palette->grey && palette->grey_depth < 8 && r % grey_step(palette->grey_depth) != 0) {
+        palette->grey_depth = (uint8_t)(palette->grey_depth * 2);
+    }
+    return (int32_t)palette->count++;
+}
+
+// Collects the colours of `frame` as `format` and puts the index of each pixel in `indices`, which
+// has room for the whole frame. Stops and returns false as soon as there are more than PALETTE_MAX
+// colours. Only the pixels that differ from the one before are looked up.
+static bool palette_build(const PixelBuffer *frame,
+                          PixelFormat        format,
+                          uint8_t           *scratch,
+                          uint32_t           batch,
+                          uint8_t           *indices,
+                          Palette           *palette) {
+    memset(palette->slots, 0xFF, sizeof(palette->slots));
+    palette->count      = 0;
+    palette->grey       = true;
+    palette->grey_depth = 1;
+
+    size_t bpp       = pixfmt_bpp(format);
+    size_t row_bytes = frame->width * bpp;
+    size_t run       = 16 / bpp;    // Whole pixels in 16 bytes
+    for (uint32_t y = 0; y < frame->height; y += batch) {
+        uint32_t       count = frame->height - y < batch ? frame->height - y : batch;
+        size_t         stride;
+        const uint8_t *rows = source_rows(frame, y, count, format, scratch, &stride);
+        for (uint32_t r = 0; r < count; ++r) {
+            const uint8_t *row   = rows + r * stride;
+            uint8_t       *out   = indices + (size_t)(y + r) * frame->width;
+            uint32_t       last  = 0;
+            int32_t        index = 0;
+            for (size_t x = 0, i = 0; x < row_bytes;) {
+                if (x > 0 && x + 16 <= row_bytes && run16(row + x, bpp)) {
+                    for (size_t end = i + run; i < end; ++i) out[i] = (uint8_t)index;
+                    x += run * bpp;
+                    continue;
+                }
+                uint32_t colour = load_colour(row + x, bpp);
+                if (x == 0 || colour != last) {
+                    if ((index = palette_index(palette, colour)) == -1) return false;
+                    last = colour;
+                }
+                out[i++] = (uint8_t)index;
+                x += bpp;
+            }
+        }
+    }
+    if (palette->count == 0) return false;
+
+    // Greyscale needs no PLTE, so it wins a tie
+    uint8_t depth = 8;
+    if (palette->count <= 2) {
+        depth = 1;
+    } else if (palette->count <= 4) {
+        depth = 2;
+    } else if (palette->count <= 16) {
+        depth = 4;
+    }
+    palette->grey = palette->grey && palette->grey_depth <= depth;
+    if (palette->grey) {
+        depth = palette->grey_depth;
+        for (size_t i = 0; i < palette->count; ++i) {
+            palette->samples[i] = (uint8_t)((palette->colours[i] & 0xFF) / grey_step(depth));
+        }
+    }
+    palette->depth = depth;
+    return true;
+}
+
+// Packs the `width` samples of `depth` bits in `samples` into the `size` bytes of `out`, padded
+// with zeros. `samples` must have room for `size * 8 / depth` of them.
+static void pack_samples(uint8_t *samples, size_t width, uint32_t depth, uint8_t *out, size_t size) {
+    memset(samples + width, 0, size * 8 / depth - width);
+    switch (depth) {
+        case 1 : {
+            for (size_t i = 0; i < size; ++i) {
+                const uint8_t *s = samples + i * 8;
+                out[i]           = (uint8_t)(s[0] << 7 | s[1] << 6 | s[2] << 5 | s[3] << 4 |
+                                   s[4] << 3 | s[5] << 2 | s[6] << 1 | s[7]);
+            }
+        } break;
+        case 2 : {
+            for (size_t i = 0; i < size; ++i) {
+                const uint8_t *s = samples + i * 4;
+                out[i]           = (uint8_t)(s[0] << 6 | s[1] << 4 | s[2] << 2 | s[3]);
+            }
+        } break;
+        case 4 : {
+            for (size_t i = 0; i < size; ++i) {
+                out[i] = (uint8_t)(samples[i * 2] << 4 | samples[i * 2 + 1]);
+            }
+        } break;
+    }
+}
+
+// Writes `count` rows of `indices`, starting at `y`, as the samples of `palette` into `rows`, each
+// row preceded by a byte for its filter type. `samples` has room for a row of `width` rounded up
+// to a multiple of 8.
+static void palette_rows(const uint8_t *indices,
+                         uint32_t       width,
+                         uint32_t       y,
+                         uint32_t       count,
+                         const Palette *palette,
+                         uint8_t       *samples,
+                         uint8_t       *rows,
+                         size_t         row_stride) {
+    for (uint32_t r = 0; r < count; ++r) {
+        const uint8_t *row = indices + (size_t)(y + r) * width;
+        uint8_t       *out = rows + r * row_stride + 1;
+        uint8_t       *dst = palette->depth == 8 ? out : samples;
+        // The samples of a palette are its indices
+        if (palette->grey) {
+            for (size_t i = 0; i < width; ++i) dst[i] = palette->samples[row[i]];
+        } else {
+            memcpy(dst, row, width);
+        }
+        if (palette->depth < 8) pack_samples(samples, width, palette->depth, out, row_stride - 1);
+    }
+}
+
+void png_encode_fast(const PixelBuffer *frame,
+                     uint32_t           level,
+                     const PngText     *text,
+                     size_t             text_count,
+                     EncodeOutput      *out) {
+    mp_StringBuilder *buf    = &out->buffer;
+    bool              alpha  = pixfmt_has_alpha(frame->format);
+    PixelFormat       format = alpha ? PIXFMT_RGBA : PIXFMT_RGB;
+    size_t            bpp    = pixfmt_bpp(format);
+    uint32_t          batch  = encode_batch_rows(frame->width * bpp);
+    uint8_t          *pixels = mp_allocator_alloc(buf->alloc, frame->width * bpp * batch);
+
+    // Frames with few colours are written as samples of a palette or as grey levels, a byte or
+    // less per pixel, which leaves a third of the data or less to filter and deflate
+    Palette *palette = mp_allocator_alloc(buf->alloc, sizeof(*palette));
+    uint8_t *indices = mp_allocator_alloc(buf->alloc, (size_t)frame->width * frame->height);
+    bool     indexed = palette_build(frame, format, pixels, batch, indices, palette);
+    size_t   stride  = 1;    // Every row starts with its filter type
+    if (indexed) {
+        stride += ((size_t)frame->width * palette->depth + 7) / 8;
+        bpp = 1;             // What the filters go by below 8 bits per channel
+    } else {
+        stride += frame->width * bpp;
+    }
+
+    mp_string_builder_append_n(buf, "\x89PNG\r\n\x1a\n", 8);
+
+    size_t  ihdr = chunk_begin(buf, "IHDR");
+    uint8_t header[13];
+    put_u32_be(header, frame->width);
+    put_u32_be(header + 4, frame->height);
+    // Colour type, greyscale, RGB, indexed or RGBA
+    uint8_t colour_type = indexed ? (palette->grey ? 0 : 3) : (alpha ? 6 : 2);
+    header[8]           = indexed ? palette->depth : 8;    // Bit depth
+    header[9]           = colour_type;
+    header[10]          = 0;    // Deflate
+    header[11]          = 0;    // Adaptive filtering
+    header[12]          = 0;    // No interlacing
+    mp_string_builder_append_n(buf, (const char *)header, sizeof(header));
+    chunk_end(buf, ihdr);
+
+    if (indexed && !palette->grey) {
+        size_t plte   = chunk_begin(buf, "PLTE");
+        bool   opaque = true;
+        for (size_t i = 0; i < palette->count; ++i) {
+            uint32_t colour = palette->colours[i];
+            uint8_t  rgb[3] = { (uint8_t)colour, (uint8_t)(colour >> 8), (uint8_t)(colour >> 16) };
+            mp_string_builder_append_n(buf, (const char *)rgb, sizeof(rgb));
+            opaque = opaque && colour >> 24 == 0xFF;
+        }
+        chunk_end(buf, plte);
+        if (!opaque) {
+            size_t trns = chunk_begin(buf, "tRNS");
+            for (size_t i = 0; i < palette->count; ++i) {
+                uint8_t a = (uint8_t)(palette->colours[i] >> 24);
+                mp_string_builder_append_n(buf, (const char *)&a, 1);
+            }
+            chunk_end(buf, trns);
+        }
+    }
+
+    for (size_t i = 0; i < text_count; ++i) {
+        size_t text_chunk = chunk_begin(buf, "tEXt");
+        mp_string_builder_append_n(buf, text[i].key, strlen(text[i].key) + 1);    // With its NUL
+        mp_string_builder_append_n(buf, text[i].value, strlen(text[i].value));
+        chunk_end(buf, text_chunk);
+    }
+
+    // The last row of a batch is kept unfiltered in `carry` for the first row of the next one
+    uint8_t   *rows    = mp_allocator_alloc(buf->alloc, stride * batch);
+    uint8_t   *prev    = mp_allocator_alloc(buf->alloc, stride);
+    uint8_t   *carry   = mp_allocator_alloc(buf->alloc, stride);
+    uint8_t   *samples = indexed ? mp_allocator_alloc(buf->alloc, frame->width + 8u) : NULL;
+    ZlibStream zlib    = zlib_stream_new(buf->alloc, level);
+    uint32_t   y       = 0;
+    do {
+        uint32_t count = frame->height - y < batch ? frame->height - y : batch;
+        if (indexed) {
+            palette_rows(indices, frame->width, y, count, palette, samples, rows, stride);
+        } else {
+            pixfmt_convert_rows(frame, y, count, rows + 1, stride, format);
+        }
+        if (count > 0) memcpy(carry, rows + (count - 1) * stride, stride);
+        filter_rows(rows, count, stride, bpp, y > 0 ? prev : NULL);
+
+        size_t idat = chunk_begin(buf, "IDAT");
+        zlib_stream_write(&zlib, rows, stride * count, y + count == frame->height, buf);
+        chunk_end(buf, idat);
+        encode_output_flush(out, false);
+
+        uint8_t *tmp = prev;
+        prev         = carry;
+        carry        = tmp;
+        y += count;
+    } while (y < frame->height);
+
+    size_t iend = chunk_begin(buf, "IEND");
+    chunk_end(buf, iend);
+}
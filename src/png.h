@@ -0,0 +1,25 @@
+#ifndef PNG_H
+#define PNG_H
+
+#include "encode.h"
+#include "pixfmt.h"
+
+// A tEXt chunk, both strings are Latin-1 and the key is 1 to 79 characters long
+typedef struct {
+    const char *key;
+    const char *value;
+} PngText;
+
+// Writes `frame` to `out` as a PNG, tuned for speed like fpng: every row is filtered with Up
+// (the first one with Sub) and compressed at the deflate `level`, DEFLATE_LEVEL_FAST for png-fast.
+// Images with at most 256 colours are saved as greyscale or indexed, with as few bits per pixel as
+// they fit in. Other images with alpha are saved as RGBA, the others as RGB.
+// The rows are converted, filtered and compressed a batch at a time, each batch is an IDAT chunk.
+// `text_count` tEXt chunks of `text` are written before the pixels.
+void png_encode_fast(const PixelBuffer *frame,
+                     uint32_t           level,
+                     const PngText     *text,
+                     size_t             text_count,
+                     EncodeOutput      *out);
+
+#endif /* ifndef PNG_H */
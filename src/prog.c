@@ -1,10 +1,20 @@
+#define _DEFAULT_SOURCE
+
 #include "prog.h"
 #include "compositors.h"
+#include "recompress.h"
+#include "regions.h"
+#include "stats.h"
 #include "utils.h"
+#include <ctype.h>
+#include <fcntl.h>
 #include <math.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 void check_requirements(void) {
     const char *cmds[] = {
@@ -15,6 +25,9 @@ void check_requirements(void) {
     const char *cmds_optional[] = {
         "wl-copy",
         "notify-send",
+        "oxipng",
+        "optipng",
+        "lswt",
     };
 
     printf("Check if needed commands are found:\n");
@@ -46,15 +59,44 @@ void usage(void) {
     printf("    last-region         Capture last selected region.\n");
     printf("    custom <region>     Capture custom region.\n");
     printf("                        The format must be 'X,Y WxH'.\n");
+    printf("    history <n>         Capture the n-th last selected region (1 is the last).\n");
+    printf("    window <match>      Capture the window with this app ID, or whose title\n");
+    printf("                        contains <match>, without the windows above it.\n");
+    printf("    diff --against <file|slot>\n");
+    printf("                        Capture and compare with a reference, then print the\n");
+    printf("                        changed pixels as JSON. The reference is a ppm or qoi\n");
+    printf("                        file, or the region in a slot compared with the\n");
+    printf("                        reference saved on its first comparison. Captures the\n");
+    printf("                        output like `full` otherwise. Exits with 1 if more\n");
+    printf("                        pixels changed than --threshold allows.\n");
+    printf("    batch [<file>]      Take the captures requested in <file>, or stdin, one per\n");
+    printf("                        line: `full` or `custom <region>` with -o, -t, -f,\n");
+    printf("                        --copy, --stdout and --at <ms>, or the same as a JSON\n");
+    printf("                        object. Captures taken at the same time share a frame.\n");
     printf("    --help, -h          Show this help.\n");
     printf("    --version, -v       Show version.\n");
     printf("    --check             Check compositor support and needed commands.\n");
+    printf("    stats               Print how long each step took in previous screenshots.\n");
+    printf("    stats --openmetrics <file>\n");
+    printf("                        Write the same data for node_exporter's textfile collector.\n");
+    printf("    recompress          Recompress the files queued with --recompress.\n");
     printf("Options:\n");
     printf("    -c                  Include cursor in the screenshot.\n");
     printf("    --all               Capture all outputs.\n");
-    printf("                        Ignored outside of mode `full`.\n");
+    printf("                        Ignored outside of modes `full` and `diff`.\n");
     printf("    --save              Save the captured image only to disk.\n");
     printf("    --copy              Save the captured image only to clipboard.\n");
+    printf("    --stdout            Write the captured image only to stdout.\n");
+    printf("    --fd <n>            Write the captured image only to the inherited file\n");
+    printf("                        descriptor <n>.\n");
+    printf("    --memfd <socket>    Write the captured image only to a sealed memfd, which is\n");
+    printf("                        sent over the inherited Unix socket <socket>.\n");
+    printf("                        These can be combined with --save and --copy.\n");
+    printf("    --raw <socket>      Send the unencoded frame in a sealed memfd, with a header\n");
+    printf("                        describing it, over the inherited Unix socket <socket>.\n");
+    printf("                        Nothing is saved anywhere else.\n");
+    printf("    --raw-interval <ms> With --raw, send a frame every <ms> milliseconds until\n");
+    printf("                        the other end of the socket is closed.\n");
     printf("    -d <dir>            Where the screenshot is saved (defaults to environment\n");
     printf("                        variable SCREENSHOT_DIR or ~/Pictures/Screenshots).\n");
     printf("    -f <path>           Where the screenshot is saved to.\n");
@@ -65,21 +107,57 @@ void usage(void) {
     printf("    -t <type>           The image type. Defaults to png.\n");
     printf("                        Valid types: ");
     print_valid_imgtypes(stdout, true);
+    printf("                        qoi and png-fast are encoded by gripper itself, many\n");
+    printf("                        times faster than png. png-fast files are bigger.\n");
     printf("    -o <output>         The output/monitor name to capture.\n");
-    printf("                        Ignored outside of mode `full`.\n");
+    printf("                        Ignored outside of modes `full` and `diff`.\n");
     printf("    -w <sec>            Wait for given seconds before capturing.\n");
     printf("    -s <factor>         Scale the final image.\n");
     printf("    --png-level <n>     PNG compression level from 0 to 9.\n");
     printf("                        Defaults to 6 (for -t png, ignored elsewhere).\n");
     printf("    --jpeg-quality <n>  JPEG quality from 0 to 100.\n");
     printf("                        Defaults to 80 (for -t jpeg, ignored elsewhere).\n");
+    printf("    --budget <ms>       Take about <ms> milliseconds at most from the capture to\n");
+    printf("                        the saved PNG, compressing it as well as that allows.\n");
+    printf("                        -t png is encoded by gripper then, like png-fast.\n");
     printf("    --no-save-region    Don't cache the region that would be captured.\n");
     printf("                        This means it will not override the region that\n");
     printf("                        should be used by last-region.\n");
     printf("                        Used in mode region and active-window.\n");
+    printf("    --slot <name>       Also save the region to a slot called <name>.\n");
+    printf("                        With last-region, capture the region in that slot.\n");
+    printf("    --dedup             Don't store a screenshot identical to a previous one twice,\n");
+    printf("                        hardlink the output file to the previous one instead.\n");
+    printf("    --freeze            With region, capture the outputs before selecting and\n");
+    printf("                        save the selected part of that frame, so menus and\n");
+    printf("                        tooltips are kept. -t png is encoded like png-fast.\n");
+    printf("    --toplevel          Capture only the active window's own buffer, without\n");
+    printf("                        overlapping windows. Needs lswt and grim 1.5.\n");
+    printf("                        The region is not cached.\n");
+    printf("    --recompress        Recompress the saved PNG in the background at idle\n");
+    printf("                        priority with oxipng or optipng, if it gets smaller.\n");
+    printf("    --thumbnails        Write the freedesktop thumbnails of the saved image, so\n");
+    printf("                        file managers don't decode it again (-t png-fast, qoi\n");
+    printf("                        or ppm).\n");
+    printf("    --redact <region>   Pixelate or blur the region 'X,Y WxH' before the image is\n");
+    printf("                        saved. Can be given up to 16 times.\n");
+    printf("    --redact-window <match>\n");
+    printf("                        Also redact the visible windows with this app ID, or\n");
+    printf("                        whose title contains <match>. Can be given up to 16\n");
+    printf("                        times. Redacting needs -t png-fast, qoi or ppm.\n");
+    printf("    --redact-style <style>\n");
+    printf("                        pixelate (the default) or blur.\n");
+    printf("    --tolerance <n>     With diff, how much a channel can change from 0 to 255\n");
+    printf("                        before its pixel counts as changed. Defaults to 0.\n");
+    printf("    --threshold <n>     With diff, how many pixels can change. Defaults to 0.\n");
+    printf("                        The comparison stops once there are more.\n");
+    printf("    --diff-image <path> With diff, draw the changed pixels in red over the\n");
+    printf("                        capture (png, ppm or qoi). Every pixel is compared.\n");
     printf("    --no-save           Don't save the captured image anywhere.\n");
     printf("                        Overrides --save and --copy.\n");
     printf("    --verbose           Print extra output.\n");
+    printf("    --trace <file>      Write the time spent in each step to <file>.\n");
+    printf("                        The file can be opened in Perfetto or chrome://tracing.\n");
 }
 
 void usage_output_format(void) {
@@ -121,6 +199,38 @@ bool parse_mode_args(char ***it, Config *config) {
         }
         config->mode   = MODE_CUSTOM;
         config->region = subarg;
+    } else if (strcmp(arg, "history") == 0) {
+        const char *subarg = next_arg(it);
+        if (subarg == NULL) {
+            eprintf("history: Unspecified number\n");
+            return false;
+        }
+        int nth = atoui(subarg);
+        if (nth < 1 || nth > REGIONS_HISTORY) {
+            eprintf("history: Input a number between 1-%d\n", REGIONS_HISTORY);
+            return false;
+        }
+        config->mode          = MODE_HISTORY;
+        config->history_index = (uint32_t)nth - 1;
+    } else if (strcmp(arg, "window") == 0) {
+        const char *subarg = next_arg(it);
+        if (subarg == NULL) {
+            eprintf("window: Unspecified app ID or title\n");
+            return false;
+        }
+        config->mode     = MODE_WINDOW;
+        config->window   = subarg;
+        config->toplevel = true;
+    } else if (strcmp(arg, "diff") == 0) {
+        config->mode = MODE_DIFF;
+    } else if (strcmp(arg, "batch") == 0) {
+        config->mode = MODE_BATCH;
+        // The file is optional, a flag or nothing at all means stdin
+        const char *subarg = **it;
+        if (subarg != NULL && (streq(subarg, "-") || subarg[0] != '-')) {
+            ++*it;
+            if (!streq(subarg, "-")) config->batch_file = subarg;
+        }
     } else if (strcmp(arg, "test") == 0) {
         config->mode = MODE_TEST;
     } else {
@@ -131,6 +241,31 @@ bool parse_mode_args(char ***it, Config *config) {
     return true;
 }
 
+// The first of --save, --copy and the output flags replaces the default save mode, the others add
+// to it
+static void add_save_mode(Config *config, SaveMode save_mode, bool *specified) {
+    if (!*specified) {
+        config->save_mode = save_mode;
+        *specified        = true;
+    } else {
+        config->save_mode |= save_mode;
+    }
+}
+
+// Parses the file descriptor given to `flag`, which must be open
+static bool parse_fd(const char *flag, const char *arg, int *fd) {
+    if (arg == NULL) {
+        eprintf("%s: Unspecified file descriptor\n", flag);
+        return false;
+    }
+    *fd = atoui(arg);
+    if (*fd < 0 || fcntl(*fd, F_GETFD) == -1) {
+        eprintf("%s: %s is not an open file descriptor\n", flag, arg);
+        return false;
+    }
+    return true;
+}
+
 typedef enum {
     POST_ARG_NONE    = 0,
     POST_ARG_NO_SAVE = 1 << 0,    // Overrides `save_mode`
@@ -140,6 +275,11 @@ void post_parse_args(Config *config, uint32_t post_args) {
     if (post_args & POST_ARG_NO_SAVE) config->save_mode = SAVEMODE_NONE;
 
     imgtype_remap(config);
+    // grim's PNGs are encoded during the capture, only gripper's own can be given a deflate level
+    if (config->budget_ms > 0 && config->imgtype == IMGTYPE_PNG) config->imgtype = IMGTYPE_PNG_FAST;
+    // A frozen frame is cropped by gripper, which encodes it too
+    bool frozen = config->freeze && config->mode == MODE_REGION;
+    if (frozen && config->imgtype == IMGTYPE_PNG) config->imgtype = IMGTYPE_PNG_FAST;
 }
 
 ParseArgsResult parse_args(int argc, char *argv[], Config *config) {
@@ -175,6 +315,21 @@ ParseArgsResult parse_args(int argc, char *argv[], Config *config) {
         comp_print_support(config->compositor);
         check_requirements();
         return TERMINATE;
+    } else if (strcmp(mode, "stats") == 0) {
+        const char *arg = next_arg(&it);
+        if (arg == NULL) return stats_print() ? TERMINATE : FAILED;
+        if (streq(arg, "--openmetrics")) {
+            const char *path = next_arg(&it);
+            if (path == NULL) {
+                eprintf("--openmetrics: Unspecified path\n");
+                return FAILED;
+            }
+            return stats_write_openmetrics(path) ? TERMINATE : FAILED;
+        }
+        eprintf("Unknown argument: %s\n", arg);
+        return FAILED;
+    } else if (strcmp(mode, "recompress") == 0) {
+        return recompress_run() ? TERMINATE : FAILED;
     }
     if (!parse_mode_args(&it, config)) return FAILED;
 
@@ -203,20 +358,176 @@ ParseArgsResult parse_args(int argc, char *argv[], Config *config) {
             config->all_outputs = true;
         } else if (streq(arg, "--no-save-region")) {
             config->no_cache_region = true;
-        } else if (streq(arg, "--save")) {
-            if (!specified_save_mode) {
-                config->save_mode   = SAVEMODE_DISK;
-                specified_save_mode = true;
+        } else if (streq(arg, "--slot")) {
+            if ((config->slot = next_arg(&it)) == NULL) {
+                eprintf("--slot: Unspecified name\n");
+                return FAILED;
+            }
+            if (strlen(config->slot) >= REGIONS_NAME_SIZE) {
+                eprintf("--slot: The name must be shorter than %d characters\n", REGIONS_NAME_SIZE);
+                return FAILED;
+            }
+        } else if (streq(arg, "--dedup")) {
+            config->dedup = true;
+        } else if (streq(arg, "--freeze")) {
+            config->freeze = true;
+        } else if (streq(arg, "--recompress")) {
+            config->recompress = true;
+        } else if (streq(arg, "--thumbnails")) {
+            config->thumbnails = true;
+        } else if (streq(arg, "--redact")) {
+            const char *geometry = next_arg(&it);
+            Region      region;
+            if (geometry == NULL) {
+                eprintf("--redact: Unspecified region\n");
+                return FAILED;
+            }
+            if (!region_parse(geometry, &region)) {
+                eprintf("--redact: Invalid region format `%s`\n", geometry);
+                return FAILED;
+            }
+            if (config->redact_count == REDACT_MAX) {
+                eprintf("--redact: At most %d regions can be redacted\n", REDACT_MAX);
+                return FAILED;
+            }
+            config->redact[config->redact_count++] = geometry;
+        } else if (streq(arg, "--redact-window")) {
+            const char *match = next_arg(&it);
+            if (match == NULL) {
+                eprintf("--redact-window: Unspecified app ID or title\n");
+                return FAILED;
+            }
+            if (config->redact_window_count == REDACT_MAX) {
+                eprintf("--redact-window: At most %d windows can be matched\n", REDACT_MAX);
+                return FAILED;
+            }
+            config->redact_window[config->redact_window_count++] = match;
+        } else if (streq(arg, "--redact-style")) {
+            const char *style = next_arg(&it);
+            if (style == NULL) {
+                eprintf("--redact-style: Unspecified style\n");
+                return FAILED;
+            }
+            if ((config->redact_style = str2redactstyle(style)) == REDACT_COUNT) {
+                eprintf("--redact-style: Invalid style: %s\n", style);
+                eprintf("Valid styles: pixelate, blur\n");
+                return FAILED;
+            }
+        } else if (streq(arg, "--against")) {
+            const char *against = next_arg(&it);
+            if (against == NULL) {
+                eprintf("--against: Unspecified file or slot\n");
+                return FAILED;
+            }
+            // A reference file is a PPM or QOI image, anything else names a slot
+            Imgtype type = ext2imgtype(file_ext(against));
+            if (type == IMGTYPE_PPM || type == IMGTYPE_QOI) {
+                config->diff_reference = against;
+            } else if (type != IMGTYPE_NONE) {
+                eprintf("--against: A reference must be a ppm or qoi image: %s\n", against);
+                return FAILED;
+            } else if (strchr(against, '/') != NULL) {
+                eprintf("--against: Invalid slot name `%s`\n", against);
+                return FAILED;
+            } else if (strlen(against) >= REGIONS_NAME_SIZE) {
+                eprintf("--against: The name must be shorter than %d characters\n",
+                        REGIONS_NAME_SIZE);
+                return FAILED;
             } else {
-                config->save_mode |= SAVEMODE_DISK;
+                config->slot = against;
+            }
+        } else if (streq(arg, "--tolerance")) {
+            const char *tolerance_str = next_arg(&it);
+            if (tolerance_str == NULL) {
+                eprintf("--tolerance: Unspecified tolerance\n");
+                return FAILED;
             }
+            int tolerance = atoui(tolerance_str);
+            if (tolerance < 0 || tolerance > 255) {
+                eprintf("--tolerance: Input a number between 0-255\n");
+                return FAILED;
+            }
+            config->diff_tolerance = (uint32_t)tolerance;
+        } else if (streq(arg, "--threshold")) {
+            const char *threshold_str = next_arg(&it);
+            if (threshold_str == NULL) {
+                eprintf("--threshold: Unspecified number of pixels\n");
+                return FAILED;
+            }
+            int threshold = atoui(threshold_str);
+            if (threshold < 0) {
+                eprintf("--threshold: Input a positive number\n");
+                return FAILED;
+            }
+            config->diff_threshold = (uint32_t)threshold;
+        } else if (streq(arg, "--diff-image")) {
+            if ((config->diff_image = next_arg(&it)) == NULL) {
+                eprintf("--diff-image: Unspecified path\n");
+                return FAILED;
+            }
+            if (!containing_dir_exists(config->diff_image)) return FAILED;
+            Imgtype type = ext2imgtype(file_ext(config->diff_image));
+            if (type != IMGTYPE_PNG && type != IMGTYPE_PPM && type != IMGTYPE_QOI) {
+                eprintf("--diff-image: The image must be a png, ppm or qoi file: %s\n",
+                        config->diff_image);
+                return FAILED;
+            }
+        } else if (streq(arg, "--toplevel")) {
+            config->toplevel = true;
+        } else if (streq(arg, "--save")) {
+            add_save_mode(config, SAVEMODE_DISK, &specified_save_mode);
         } else if (streq(arg, "--copy")) {
-            if (!specified_save_mode) {
-                config->save_mode   = SAVEMODE_CLIPBOARD;
-                specified_save_mode = true;
-            } else {
-                config->save_mode |= SAVEMODE_CLIPBOARD;
+            add_save_mode(config, SAVEMODE_CLIPBOARD, &specified_save_mode);
+        } else if (streq(arg, "--stdout")) {
+            config->output_fd     = STDOUT_FILENO;
+            config->output_stdout = true;
+            add_save_mode(config, SAVEMODE_FD, &specified_save_mode);
+        } else if (streq(arg, "--fd")) {
+            if (!parse_fd(arg, next_arg(&it), &config->output_fd)) return FAILED;
+            config->output_stdout = config->output_fd == STDOUT_FILENO;
+            add_save_mode(config, SAVEMODE_FD, &specified_save_mode);
+        } else if (streq(arg, "--memfd")) {
+            if (!parse_fd(arg, next_arg(&it), &config->memfd_socket)) return FAILED;
+            struct stat s;
+            if (fstat(config->memfd_socket, &s) != 0 || !S_ISSOCK(s.st_mode)) {
+                eprintf("--memfd: File descriptor %d is not a socket\n", config->memfd_socket);
+                return FAILED;
             }
+            add_save_mode(config, SAVEMODE_FD, &specified_save_mode);
+        } else if (streq(arg, "--raw")) {
+            if (!parse_fd(arg, next_arg(&it), &config->raw_socket)) return FAILED;
+            struct stat s;
+            if (fstat(config->raw_socket, &s) != 0 || !S_ISSOCK(s.st_mode)) {
+                eprintf("--raw: File descriptor %d is not a socket\n", config->raw_socket);
+                return FAILED;
+            }
+            post_args |= POST_ARG_NO_SAVE;
+        } else if (streq(arg, "--raw-interval")) {
+            const char *interval_str = next_arg(&it);
+            if (interval_str == NULL) {
+                eprintf("--raw-interval: Unspecified interval\n");
+                return FAILED;
+            }
+            int interval = atoui(interval_str);
+            if (interval <= 0) {
+                eprintf("--raw-interval: Input a positive number of milliseconds\n");
+                return FAILED;
+            }
+            config->raw_interval_ms = (uint32_t)interval;
+        } else if (streq(arg, "--budget")) {
+            const char *budget_str = next_arg(&it);
+            if (budget_str == NULL) {
+                eprintf("--budget: Unspecified budget\n");
+                return FAILED;
+            }
+            char         *end    = NULL;
+            unsigned long budget = strtoul(budget_str, &end, 10);
+            if (!isdigit((unsigned char)budget_str[0]) || budget == 0 || budget > UINT32_MAX ||
+                (*end != '\0' && !streq(end, "ms"))) {
+                eprintf("--budget: Input a positive number of milliseconds, like 150 or 150ms\n");
+                return FAILED;
+            }
+            config->budget_ms = (uint32_t)budget;
         } else if (streq(arg, "--no-save")) {
             post_args |= POST_ARG_NO_SAVE;
         } else if (streq(arg, "-t")) {
@@ -261,16 +572,19 @@ ParseArgsResult parse_args(int argc, char *argv[], Config *config) {
                 return FAILED;
             }
             if (!containing_dir_exists(config->output_path)) return FAILED;
-            const char *type = file_ext(config->output_path);
-            if ((config->imgtype = str2imgtype(type)) == IMGTYPE_NONE) {
-                if (*type == '\0')
+            const char *ext  = file_ext(config->output_path);
+            Imgtype     type = ext2imgtype(ext);
+            if (type == IMGTYPE_NONE) {
+                if (*ext == '\0')
                     eprintf("-f: Unspecified file extension. Add extension to the file name\n");
                 else
-                    eprintf("-f: Invalid file extension: %s\n", type);
+                    eprintf("-f: Invalid file extension: %s\n", ext);
                 eprintf("Valid file types/extensions: ");
                 print_valid_imgtypes(stderr, true);
                 return FAILED;
             }
+            // Keep profiles such as `-t png-fast` that share the extension
+            if (!streq(imgtype2ext(config->imgtype), ext)) config->imgtype = type;
         } else if (streq(arg, "-s")) {
             const char *scale_str = next_arg(&it);
             if (scale_str == NULL) {
@@ -298,6 +612,11 @@ ParseArgsResult parse_args(int argc, char *argv[], Config *config) {
             } else {
                 config->wait_time = (uint32_t)wait_time;
             }
+        } else if (streq(arg, "--trace")) {
+            if ((config->trace_file = next_arg(&it)) == NULL) {
+                eprintf("--trace: Unspecified path\n");
+                return FAILED;
+            }
         } else if (streq(arg, "--format")) {
             if ((config->output_format = next_arg(&it)) == NULL) {
                 eprintf("--foramt: Unspecified format\n");
@@ -312,6 +631,25 @@ ParseArgsResult parse_args(int argc, char *argv[], Config *config) {
 #ifndef DEBUG
     if (config->mode == MODE_TEST) return FAILED;
 #endif
+    if (config->raw_interval_ms > 0 && config->raw_socket == -1) {
+        eprintf("--raw-interval: Only works with --raw\n");
+        return FAILED;
+    }
+    if (config->mode == MODE_DIFF) {
+        if (config->diff_reference == NULL && config->slot == NULL) {
+            eprintf("diff: Unspecified reference, give one with --against\n");
+            return FAILED;
+        }
+        // The capture is only compared, it is never saved
+        post_args |= POST_ARG_NO_SAVE;
+    } else if (config->diff_reference != NULL || config->diff_image != NULL ||
+               config->diff_tolerance > 0 || config->diff_threshold > 0) {
+        eprintf("--against, --tolerance, --threshold, --diff-image: Only work with mode `diff`\n");
+        return FAILED;
+    }
+
+    // Each request of `batch` says where its image goes
+    if (config->mode == MODE_BATCH) post_args |= POST_ARG_NO_SAVE;
 
     post_parse_args(config, post_args);
     return OK;
@@ -320,14 +658,3 @@ ParseArgsResult parse_args(int argc, char *argv[], Config *config) {
 #undef TERMINATE
 #undef OK
 }
-
-void config_init(Config *config) {
-    config->compositor    = str2compositor(getenv("XDG_CURRENT_DESKTOP"));
-    config->output_format = "Screenshot_%Y%M%d_%h%m%s";
-    config->imgtype       = IMGTYPE_PNG;
-    config->png_level     = DEFAULT_PNG_LEVEL;
-    config->jpeg_quality  = DEFAULT_JPEG_QUALITY;
-    config->save_mode     = SAVEMODE_DISK | SAVEMODE_CLIPBOARD;
-    config->scale         = 1.0;
-    config->wait_time     = 0;
-}
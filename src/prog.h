@@ -15,7 +15,12 @@ typedef enum {
     MODE_LAST_REGION,
     MODE_ACTIVE_WINDOW,
     MODE_CUSTOM,
+    MODE_HISTORY,
+    MODE_WINDOW,
+    MODE_DIFF,
+    MODE_BATCH,
     MODE_TEST,
+    MODE_COUNT,
 } Mode;
 
 typedef enum {
@@ -24,6 +29,8 @@ typedef enum {
     IMGTYPE_PPM,
     IMGTYPE_JPEG,
     IMGTYPE_JPG,
+    IMGTYPE_QOI,
+    IMGTYPE_PNG_FAST,    // Encoded by gripper, see `png_encode_fast()`
     IMGTYPE_COUNT,
 } Imgtype;
 
@@ -31,15 +38,25 @@ typedef enum {
     SAVEMODE_NONE      = 0,
     SAVEMODE_DISK      = 1 << 0,
     SAVEMODE_CLIPBOARD = 1 << 1,
+    SAVEMODE_FD        = 1 << 2,    // `Config.output_fd`
 } SaveMode;
 
+typedef enum {
+    REDACT_PIXELATE,
+    REDACT_BLUR,
+    REDACT_COUNT,
+} RedactStyle;
+
+// Amount of `--redact` and `--redact-window` flags each
+#define REDACT_MAX 16
+
 typedef struct {
     const char *prog_name;
     const char *prog_version;
     const char *path;
     const char *screenshot_dir;
     const char *cache_dir;
-    const char *last_region_file;
+    const char *regions_file;
     const char *region;
     Compositor  compositor;
     Mode        mode;
@@ -48,19 +65,45 @@ typedef struct {
     bool        verbose;
     bool        cursor;
     bool        no_cache_region;
+    bool        dedup;
+    bool        recompress;    // Queue the saved PNG to be recompressed in the background
+    bool        thumbnails;    // Write freedesktop thumbnails of the saved image
+    bool        freeze;        // Capture before the region is selected, and crop that frame
     double      scale;
     uint32_t    wait_time;
     const char *output_name;
     Imgtype     imgtype;
     int         png_level;
     int         jpeg_quality;
+    uint32_t    budget_ms;    // How long a screenshot may take with `--budget`, 0 for no limit
     const char *output_path;
     const char *output_format;
     bool        all_outputs;
+    const char *trace_file;
+    const char *slot;             // Name of the region slot to save to or load from
+    uint32_t    history_index;    // Which previous region to capture, 0 being the last one
+    const char *window;           // App ID or part of the title of the window to capture
+    bool        toplevel;         // Capture windows directly instead of their region
+    int         output_fd;        // Where SAVEMODE_FD writes the image
+    bool        output_stdout;    // `output_fd` is gripper's original stdout
+    int         memfd_socket;     // Gets `output_fd`, a memfd, once it is written, -1 if unused
+    int         raw_socket;       // Gets the unencoded frames with `--raw`, -1 if unused
+    uint32_t    raw_interval_ms;  // Time between the frames of a `--raw` stream, 0 for one frame
+    const char *redact[REDACT_MAX];           // Regions to redact, in layout coordinates
+    uint32_t    redact_count;
+    const char *redact_window[REDACT_MAX];    // Windows to redact, by app ID or part of the title
+    uint32_t    redact_window_count;
+    RedactStyle redact_style;
+    const char *diff_reference;    // The image `diff` compares with, NULL for the one of `slot`
+    const char *diff_image;        // Where `diff` draws the changed pixels, NULL for nowhere
+    uint32_t    diff_tolerance;    // How much a channel can change before its pixel has changed
+    uint32_t    diff_threshold;    // How many changed pixels `diff` accepts
+    const char *batch_file;        // The requests of `batch`, NULL for stdin
 } Config;
 
-extern mp_Allocator *g_alloc;
-extern const Config *g_config;
+// Set by the CLI for the whole run, and by libgripper for each call on the calling thread
+extern _Thread_local mp_Allocator *g_alloc;
+extern _Thread_local const Config *g_config;
 
 typedef enum {
     PARSE_ARGS_RESULT_FAILED,
@@ -0,0 +1,187 @@
+#include "qoi.h"
+#include "utils.h"
+#include <string.h>
+
+#define QOI_OP_INDEX 0x00
+#define QOI_OP_DIFF  0x40
+#define QOI_OP_LUMA  0x80
+#define QOI_OP_RUN   0xC0
+#define QOI_OP_RGB   0xFE
+#define QOI_OP_RGBA  0xFF
+#define QOI_MAX_RUN  62
+
+typedef union {
+    struct {
+        uint8_t r, g, b, a;
+    };
+    uint32_t v;
+} Pixel;
+
+static uint8_t *put_u32_be(uint8_t *p, uint32_t v) {
+    *p++ = (uint8_t)(v >> 24);
+    *p++ = (uint8_t)(v >> 16);
+    *p++ = (uint8_t)(v >> 8);
+    *p++ = (uint8_t)v;
+    return p;
+}
+
+static uint32_t get_u32_be(const uint8_t *p) {
+    return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+}
+
+void qoi_encode(const PixelBuffer *frame, EncodeOutput *output) {
+    static const uint8_t padding[8] = { 0, 0, 0, 0, 0, 0, 0, 1 };
+    mp_StringBuilder    *out        = &output->buffer;
+
+    mp_string_builder_reserve(out, 14);
+    uint8_t *p = (uint8_t *)out->data + out->size;
+    memcpy(p, "qoif", 4);
+    p    = put_u32_be(p + 4, frame->width);
+    p    = put_u32_be(p, frame->height);
+    *p++ = pixfmt_has_alpha(frame->format) ? 4 : 3;
+    *p++ = 0;    // sRGB with linear alpha
+    out->size += 14;
+
+    // One row is converted at a time, it stays in the cache while it is encoded
+    uint8_t *row  = mp_allocator_alloc(out->alloc, (size_t)frame->width * 4);
+    Pixel    index[64];
+    Pixel    prev = { .a = 255 };
+    uint32_t run  = 0;
+    memset(index, 0, sizeof(index));
+
+    for (uint32_t y = 0; y < frame->height; ++y) {
+        pixfmt_convert_rows(frame, y, 1, row, (size_t)frame->width * 4, PIXFMT_RGBA);
+        // No pixel takes more than 5 bytes
+        mp_string_builder_reserve(out, (size_t)frame->width * 5 + 1);
+        p = (uint8_t *)out->data + out->size;
+
+        for (uint32_t x = 0; x < frame->width; ++x) {
+            Pixel px;
+            memcpy(&px, row + x * 4, sizeof(px));
+            if (px.v == prev.v) {
+                if (++run == QOI_MAX_RUN) {
+                    *p++ = (uint8_t)(QOI_OP_RUN | (run - 1));
+                    run  = 0;
+                }
+                continue;
+            }
+            if (run > 0) {
+                *p++ = (uint8_t)(QOI_OP_RUN | (run - 1));
+                run  = 0;
+            }
+
+            uint32_t hash = (px.r * 3u + px.g * 5u + px.b * 7u + px.a * 11u) % 64;
+            if (index[hash].v == px.v) {
+                *p++ = (uint8_t)(QOI_OP_INDEX | hash);
+            } else if (px.a != prev.a) {
+                index[hash] = px;
+                *p++        = QOI_OP_RGBA;
+                memcpy(p, &px, 4);
+                p += 4;
+            } else {
+                index[hash] = px;
+                int8_t vr   = (int8_t)(px.r - prev.r);
+                int8_t vg   = (int8_t)(px.g - prev.g);
+                int8_t vb   = (int8_t)(px.b - prev.b);
+                int8_t vg_r = (int8_t)(vr - vg);
+                int8_t vg_b = (int8_t)(vb - vg);
+                if (vr >= -2 && vr <= 1 && vg >= -2 && vg <= 1 && vb >= -2 && vb <= 1) {
+                    *p++ = (uint8_t)(QOI_OP_DIFF | (vr + 2) << 4 | (vg + 2) << 2 | (vb + 2));
+                } else if (vg_r >= -8 && vg_r <= 7 && vg >= -32 && vg <= 31 && vg_b >= -8 &&
+                           vg_b <= 7) {
+                    *p++ = (uint8_t)(QOI_OP_LUMA | (vg + 32));
+                    *p++ = (uint8_t)((vg_r + 8) << 4 | (vg_b + 8));
+                } else {
+                    *p++ = QOI_OP_RGB;
+                    *p++ = px.r;
+                    *p++ = px.g;
+                    *p++ = px.b;
+                }
+            }
+            prev = px;
+        }
+        out->size = (size_t)((char *)p - out->data);
+        encode_output_flush(output, false);
+    }
+
+    if (run > 0) {
+        char op = (char)(QOI_OP_RUN | (run - 1));
+        mp_string_builder_append_n(out, &op, 1);
+    }
+    mp_string_builder_append_n(out, (const char *)padding, sizeof(padding));
+}
+
+bool qoi_decode(const void *data, size_t size, mp_Allocator *alloc, PixelBuffer *frame) {
+    const uint8_t *p   = data;
+    const uint8_t *end = p + size;
+    if (size < 14 + 8 || memcmp(p, "qoif", 4) != 0) {
+        eprintf("Expected a QOI image\n");
+        return false;
+    }
+    uint32_t width  = get_u32_be(p + 4);
+    uint32_t height = get_u32_be(p + 8);
+    // A byte holds 62 pixels at most, a bigger size can only be a corrupted header
+    if (width == 0 || height == 0 || (uint64_t)width * height / QOI_MAX_RUN > size) {
+        eprintf("Invalid QOI header\n");
+        return false;
+    }
+    end -= 8;    // The padding
+    p += 14;
+
+    size_t   pixels = (size_t)width * height;
+    uint8_t *out    = mp_allocator_alloc(alloc, pixels * 3);
+    Pixel    index[64];
+    Pixel    px  = { .a = 255 };
+    uint32_t run = 0;
+    memset(index, 0, sizeof(index));
+
+    for (size_t i = 0; i < pixels; ++i) {
+        if (run > 0) {
+            --run;
+        } else {
+            if (p >= end) {
+                eprintf("Truncated QOI image\n");
+                return false;
+            }
+            uint8_t op = *p++;
+            if (op == QOI_OP_RGB || op == QOI_OP_RGBA) {
+                size_t channels = op == QOI_OP_RGB ? 3 : 4;
+                if ((size_t)(end - p) < channels) {
+                    eprintf("Truncated QOI image\n");
+                    return false;
+                }
+                memcpy(&px, p, channels);
+                p += channels;
+            } else if ((op & 0xC0) == QOI_OP_INDEX) {
+                px = index[op];
+            } else if ((op & 0xC0) == QOI_OP_DIFF) {
+                px.r = (uint8_t)(px.r + ((op >> 4) & 3) - 2);
+                px.g = (uint8_t)(px.g + ((op >> 2) & 3) - 2);
+                px.b = (uint8_t)(px.b + (op & 3) - 2);
+            } else if ((op & 0xC0) == QOI_OP_LUMA) {
+                if (p >= end) {
+                    eprintf("Truncated QOI image\n");
+                    return false;
+                }
+                int vg = (op & 0x3F) - 32;
+                px.r   = (uint8_t)(px.r + vg - 8 + (*p >> 4));
+                px.g   = (uint8_t)(px.g + vg);
+                px.b   = (uint8_t)(px.b + vg - 8 + (*p & 0x0F));
+                ++p;
+            } else {
+                run = op & 0x3F;    // This pixel is the first of the run
+            }
+            index[(px.r * 3u + px.g * 5u + px.b * 7u + px.a * 11u) % 64] = px;
+        }
+        memcpy(out + i * 3, &px, 3);
+    }
+
+    *frame = (PixelBuffer){
+        .data   = out,
+        .width  = width,
+        .height = height,
+        .stride = (size_t)width * 3,
+        .format = PIXFMT_RGB,
+    };
+    return true;
+}
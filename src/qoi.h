@@ -0,0 +1,13 @@
+#ifndef QOI_H
+#define QOI_H
+
+#include "encode.h"
+#include "pixfmt.h"
+
+// Writes `frame` to `out` as a QOI image (https://qoiformat.org/qoi-specification.pdf)
+void qoi_encode(const PixelBuffer *frame, EncodeOutput *out);
+// Decodes the QOI image in `data` into `frame`, a PIXFMT_RGB buffer allocated with `alloc`.
+// Alpha is dropped.
+bool qoi_decode(const void *data, size_t size, mp_Allocator *alloc, PixelBuffer *frame);
+
+#endif /* ifndef QOI_H */
@@ -0,0 +1,98 @@
+#define _GNU_SOURCE
+
+#include "rawframe.h"
+#include "encode.h"
+#include "prog.h"
+#include "trace.h"
+#include "utils.h"
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+// Describes the frame in `memfd` and sends both to the client
+static bool frame_send(int memfd, uint64_t sequence, int64_t timestamp_ns) {
+    struct stat s;
+    if (fstat(memfd, &s) != 0 || s.st_size == 0) {
+        eprintf("grim did not write a frame\n");
+        return false;
+    }
+    size_t size = (size_t)s.st_size;
+    // Only the header is read, the pixels stay where grim wrote them
+    void *map = mmap(NULL, size, PROT_READ, MAP_SHARED, memfd, 0);
+    if (map == MAP_FAILED) {
+        eprintf("Failed to map the frame: %s\n", strerror(errno));
+        return false;
+    }
+    PixelBuffer frame;
+    bool        parsed = ppm_parse(map, size, &frame);
+    size_t      offset = parsed ? (size_t)(frame.data - (uint8_t *)map) : 0;
+    munmap(map, size);
+    if (!parsed) return false;
+
+    RawFrameHeader header = {
+        .magic        = RAWFRAME_MAGIC,
+        .version      = RAWFRAME_VERSION,
+        .width        = frame.width,
+        .height       = frame.height,
+        .stride       = (uint32_t)frame.stride,
+        .format       = frame.format,
+        .offset       = offset,
+        .size         = size,
+        .timestamp_ns = timestamp_ns,
+        .sequence     = sequence,
+    };
+    if (g_config->output_name != NULL)
+        snprintf(header.output, sizeof(header.output), "%s", g_config->output_name);
+
+    return memfd_send(g_config->raw_socket, memfd, &header, sizeof(header));
+}
+
+bool rawframe_export(const char *grim_cmd) {
+    size_t cmd_size = strlen(grim_cmd) + 32;
+    char  *cmd      = mp_allocator_alloc(g_alloc, cmd_size);
+
+    // Frames are spaced from when the stream started, so slow captures don't make it drift
+    struct timespec next;
+    clock_gettime(CLOCK_MONOTONIC, &next);
+    for (uint64_t sequence = 0;; ++sequence) {
+        int memfd = memfd_output();
+        if (memfd == -1) return false;
+        snprintf(cmd, cmd_size, "%s - >&%d", grim_cmd, memfd);
+#ifdef DEBUG
+        if (g_config->verbose && sequence == 0) printf("$ %s\n", cmd);
+#endif
+
+        struct timespec now;
+        clock_gettime(CLOCK_REALTIME, &now);
+        size_t span_capture = trace_begin("capture");
+        if (run_cmd_fd(cmd, NULL, 0, memfd) == -1) {
+            eprintf("Failed to run grim\n");
+            close(memfd);
+            return false;
+        }
+        trace_end(span_capture);
+
+        bool sent = frame_send(memfd, sequence, (int64_t)now.tv_sec * 1000000000 + now.tv_nsec);
+        int  error = errno;
+        close(memfd);
+        if (!sent) {
+            // The client ends a stream by closing its end of the socket
+            if (g_config->raw_interval_ms > 0 && (error == EPIPE || error == ECONNRESET))
+                return true;
+            eprintf("Failed to send the frame: %s\n", strerror(error));
+            return false;
+        }
+        if (g_config->raw_interval_ms == 0) return true;
+
+        next.tv_nsec += (long)(g_config->raw_interval_ms % 1000) * 1000000;
+        next.tv_sec += g_config->raw_interval_ms / 1000 + next.tv_nsec / 1000000000;
+        next.tv_nsec %= 1000000000;
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL) == EINTR) {
+            continue;
+        }
+    }
+}
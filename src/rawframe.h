@@ -0,0 +1,31 @@
+#ifndef RAWFRAME_H
+#define RAWFRAME_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define RAWFRAME_MAGIC       0x46525247u    // "GRRF" in memory
+#define RAWFRAME_VERSION     1
+#define RAWFRAME_OUTPUT_SIZE 32
+
+// Sent with every frame of `--raw`, as the data of the message that carries the memfd.
+// The memfd is sealed and holds the frame as grim wrote it, the pixels start at `offset`.
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t width, height;
+    uint32_t stride;          // Bytes from the start of a row to the start of the next one
+    uint32_t format;          // A `PixelFormat` from pixfmt.h
+    uint64_t offset;          // Where the first row starts in the memfd
+    uint64_t size;            // Size of the memfd
+    int64_t  timestamp_ns;    // Unix time the capture started at
+    uint64_t sequence;        // Counts the frames of a stream from 0
+    char     output[RAWFRAME_OUTPUT_SIZE];    // Name of the captured output, empty if unknown
+} RawFrameHeader;
+
+// Runs `grim_cmd`, a grim command that writes a PPM to its stdout once a redirect is appended,
+// into a memfd and sends it to the `--raw` socket without encoding it.
+// With `--raw-interval`, a frame is sent at every interval until the client closes the socket.
+bool rawframe_export(const char *grim_cmd);
+
+#endif /* ifndef RAWFRAME_H */
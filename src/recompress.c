@@ -0,0 +1,230 @@
+#define _GNU_SOURCE
+
+#include "recompress.h"
+#include "dedup.h"
+#include "prog.h"
+#include "utils.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#define QUEUE_FNAME "recompress-queue"
+#define LOCK_FNAME  "recompress.lock"
+
+// From linux/ioprio.h, which is not always installed
+#define IOPRIO_CLASS_IDLE   3
+#define IOPRIO_CLASS_SHIFT  13
+#define IOPRIO_WHO_PROCESS  1
+
+// A queued file, it is skipped if it changed since it was queued
+typedef struct {
+    long long size;
+    long long mtime;
+    char      path[PATH_MAX];
+} QueueEntry;
+
+const char *recompress_tool(void) {
+    if (command_found("oxipng")) return "oxipng";
+    if (command_found("optipng")) return "optipng";
+    return NULL;
+}
+
+bool recompress_enqueue(const char *path) {
+    char *abs_path = realpath(path, NULL);
+    if (abs_path == NULL) {
+        eprintf("Failed to resolve %s: %s\n", path, strerror(errno));
+        return false;
+    }
+    // The queue holds one path per line
+    if (strchr(abs_path, '\n') != NULL) {
+        eprintf("Can't queue %s for recompression, its path has a newline\n", path);
+        free(abs_path);
+        return false;
+    }
+    struct stat s;
+    if (stat(abs_path, &s) != 0) {
+        free(abs_path);
+        return false;
+    }
+
+    const char *queue_path = state_path(QUEUE_FNAME);
+    if (queue_path == NULL || !make_parent_dirs(queue_path)) {
+        free(abs_path);
+        return false;
+    }
+    int fd = open(queue_path, O_WRONLY | O_APPEND | O_CREAT, 0644);
+    if (fd == -1) {
+        eprintf("Failed to open %s: %s\n", queue_path, strerror(errno));
+        free(abs_path);
+        return false;
+    }
+    // The worker rewrites the queue while holding the lock
+    flock(fd, LOCK_EX);
+    int written =
+        dprintf(fd, "%lld %lld %s\n", (long long)s.st_size, (long long)s.st_mtime, abs_path);
+    close(fd);
+    free(abs_path);
+    return written > 0;
+}
+
+// Takes the first entry out of the queue. Returns false if the queue is empty.
+static bool queue_pop(QueueEntry *entry) {
+    bool        result     = true;
+    const char *queue_path = state_path(QUEUE_FNAME);
+    char       *data       = NULL;
+    if (queue_path == NULL) return false;
+
+    int fd = open(queue_path, O_RDWR);
+    if (fd == -1) return false;
+    if (flock(fd, LOCK_EX) != 0) return_defer(false);
+
+    struct stat s;
+    if (fstat(fd, &s) != 0 || s.st_size == 0) return_defer(false);
+    size_t size = (size_t)s.st_size;
+    data        = malloc(size + 1);
+    if (data == NULL || pread(fd, data, size, 0) != (ssize_t)size) return_defer(false);
+    data[size] = '\0';
+
+    char  *newline = strchr(data, '\n');
+    size_t line    = newline != NULL ? (size_t)(newline - data) + 1 : size;
+    int    offset  = 0;
+    int    parsed  = sscanf(data, "%lld %lld %n", &entry->size, &entry->mtime, &offset);
+    // The path without the newline, a last line may not have one
+    size_t path_len = line - (size_t)offset - (newline != NULL);
+    if (parsed != 2 || offset == 0 || (size_t)offset > line || path_len >= sizeof(entry->path)) {
+        entry->path[0] = '\0';    // A corrupted line is dropped
+    } else {
+        memcpy(entry->path, data + offset, path_len);
+        entry->path[path_len] = '\0';
+    }
+
+    // Shift the rest of the queue to the front
+    if (pwrite(fd, data + line, size - line, 0) != (ssize_t)(size - line) ||
+        ftruncate(fd, (off_t)(size - line)) != 0) {
+        eprintf("Failed to update %s: %s\n", queue_path, strerror(errno));
+        return_defer(false);
+    }
+
+defer:
+    free(data);
+    close(fd);
+    return result;
+}
+
+static bool queue_empty(void) {
+    const char *queue_path = state_path(QUEUE_FNAME);
+    struct stat s;
+    return queue_path == NULL || stat(queue_path, &s) != 0 || s.st_size == 0;
+}
+
+// Only runs when nothing else wants the CPU or the disk
+static void lower_priority(void) {
+    struct sched_param param = { .sched_priority = 0 };
+    if (sched_setscheduler(0, SCHED_IDLE, &param) != 0 && nice(19) == -1) {
+        eprintf("Failed to lower the priority: %s\n", strerror(errno));
+    }
+    // ioprio_set() has no glibc wrapper
+    long ioprio = IOPRIO_CLASS_IDLE << IOPRIO_CLASS_SHIFT;
+    if (syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, ioprio) != 0)
+        eprintf("Failed to lower the I/O priority: %s\n", strerror(errno));
+}
+
+static bool unchanged(const QueueEntry *entry) {
+    struct stat s;
+    return stat(entry->path, &s) == 0 && S_ISREG(s.st_mode) && s.st_size == entry->size &&
+           s.st_mtime == entry->mtime;
+}
+
+static void recompress_file(const QueueEntry *entry, const char *tool) {
+    if (entry->path[0] == '\0' || !unchanged(entry)) return;
+
+    char tmp_path[PATH_MAX + 16];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.gripper-tmp", entry->path);
+    unlink(tmp_path);
+    // Both try every filter strategy and the slowest deflate settings they have
+    const char *fmt = streq(tool, "oxipng") ? "oxipng -q -o max --zopfli --out %s %s"
+                                            : "optipng -quiet -o7 -zm1-9 -out %s %s";
+    char       *cmd = alloc_strf(fmt, shell_quote(tmp_path), shell_quote(entry->path)).cstr;
+    if (run_cmd(cmd, NULL, 0) == -1) {
+        eprintf("Failed to recompress %s\n", entry->path);
+        unlink(tmp_path);
+        return;
+    }
+
+    // The file may have been edited while it was being recompressed
+    struct stat s;
+    if (stat(tmp_path, &s) != 0 || s.st_size >= entry->size || !unchanged(entry)) {
+        unlink(tmp_path);
+        return;
+    }
+    // Keep the time the screenshot was taken
+    struct timespec times[2] = { { .tv_nsec = UTIME_OMIT }, { .tv_sec = entry->mtime } };
+    utimensat(AT_FDCWD, tmp_path, times, 0);
+    if (rename(tmp_path, entry->path) != 0) {
+        eprintf("Failed to replace %s: %s\n", entry->path, strerror(errno));
+        unlink(tmp_path);
+        return;
+    }
+    dedup_update(entry->path);
+}
+
+bool recompress_run(void) {
+    const char *tool = recompress_tool();
+    if (tool == NULL) {
+        eprintf("Recompressing needs oxipng or optipng\n");
+        return false;
+    }
+    const char *lock_path = state_path(LOCK_FNAME);
+    if (lock_path == NULL || !make_parent_dirs(lock_path)) return false;
+
+    lower_priority();
+    // A file queued while the queue was found empty but the lock was still held would be missed
+    // by both workers, so the queue is checked again once the lock is released
+    while (!queue_empty()) {
+        int lock = open(lock_path, O_RDWR | O_CREAT, 0644);
+        if (lock == -1) {
+            eprintf("Failed to open %s: %s\n", lock_path, strerror(errno));
+            return false;
+        }
+        if (flock(lock, LOCK_EX | LOCK_NB) != 0) {
+            close(lock);
+            return errno == EWOULDBLOCK;    // The running worker will take care of the queue
+        }
+        QueueEntry entry;
+        size_t     popped = 0;
+        for (; queue_pop(&entry); ++popped) recompress_file(&entry, tool);
+        close(lock);
+        if (popped == 0) return false;    // The queue could not be read or updated
+    }
+    return true;
+}
+
+bool recompress_spawn(void) {
+    pid_t pid = fork();
+    if (pid == -1) {
+        eprintf("Failed to start the recompression: %s\n", strerror(errno));
+        return false;
+    } else if (pid == 0) {
+        // Fork twice so the worker is not a child of this process and outlives it quietly
+        setsid();
+        if (fork() != 0) _exit(EXIT_SUCCESS);
+        int dev_null = open("/dev/null", O_RDWR);
+        dup2(dev_null, STDIN_FILENO);
+        dup2(dev_null, STDOUT_FILENO);
+        dup2(dev_null, STDERR_FILENO);
+        close(dev_null);
+        execl("/proc/self/exe", g_config->prog_name, "recompress", (char *)NULL);
+        _exit(EXIT_FAILURE);
+    }
+    waitpid(pid, NULL, 0);
+    return true;
+}
@@ -0,0 +1,16 @@
+#ifndef RECOMPRESS_H
+#define RECOMPRESS_H
+
+#include <stdbool.h>
+
+// Adds the PNG at `path` to the queue of files to recompress
+bool recompress_enqueue(const char *path);
+// Starts `gripper recompress` in the background, detached from this process
+bool recompress_spawn(void);
+// Recompresses every queued file at idle priority, unless another worker is already running.
+// The queue is kept in the state directory so files queued before a reboot are still processed.
+bool recompress_run(void);
+// The optimizer that will be used, NULL if neither oxipng nor optipng is installed
+const char *recompress_tool(void);
+
+#endif /* ifndef RECOMPRESS_H */
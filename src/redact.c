@@ -0,0 +1,492 @@
+#define _DEFAULT_SOURCE
+
+#include "redact.h"
+#include "compositors.h"
+#include "encode.h"
+#include "prog.h"
+#include "regions.h"
+#include "trace.h"
+#include "utils.h"
+#include <errno.h>
+#include <string.h>
+#include <sys/param.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
+// The size of the blocks and the blur radius in layout pixels, enough to hide text of usual sizes
+#define BLOCK_SIZE  16
+#define BLUR_RADIUS 16
+// The blur is this many box blurs in a row, which is close to a Gaussian blur
+#define BLUR_PASSES 3
+// Keeps the sums of a box in 16 bits, see `box_div()`
+#define BLUR_RADIUS_MAX 127
+
+// Rectangles smaller than this are redacted by the calling thread alone
+#define THREAD_MIN_PIXELS (256 * 256)
+
+// A rectangle being redacted. Each tile is a share of its rows or columns, and is worked on by one
+// thread of the pool. Everything is allocated beforehand, `g_alloc` is only usable in the main
+// thread.
+typedef struct {
+    PixelBuffer *frame;
+    Rect         rect;
+    uint32_t     width, height;
+    uint32_t     size;           // Size of the blocks or radius of the blur, in frame pixels
+    uint32_t     recip;          // 2^16 / (2 * radius + 1) for the blur
+    uint32_t     tiles;
+    uint8_t     *tmp[2];         // The rectangle between the blur passes, `width * 3` bytes per row
+    uint8_t     *rows;           // 2 padded rows of scratch per tile for the horizontal passes
+    uint16_t    *column_sums;    // `width * 3` sums of the vertical passes, split between the tiles
+    uint32_t    *block_sums;     // The sums of a row of blocks for each tile
+} RedactJob;
+
+typedef void (*TileFn)(const RedactJob *job, uint32_t tile);
+
+typedef struct {
+    const RedactJob *job;
+    TileFn           fn;
+} TileRun;
+
+bool redact_enabled(void) {
+    return g_config->redact_count > 0 || g_config->redact_window_count > 0;
+}
+
+bool redact_check(void) {
+    if (!redact_enabled()) return true;
+
+    // Mode `diff` compares the raw frame and never encodes it, `batch` checks each image's type
+    bool encoded = g_config->mode != MODE_DIFF && g_config->mode != MODE_BATCH;
+    if (encoded && !encode_in_tree(g_config->imgtype) && g_config->imgtype != IMGTYPE_PPM) {
+        eprintf("Redacting only works with -t png-fast, qoi and ppm\n");
+        return false;
+    }
+    if (g_config->raw_socket != -1) {
+        eprintf("Frames sent with --raw can't be redacted\n");
+        return false;
+    }
+    // The window list is in layout coordinates, which a toplevel capture has nothing to do with
+    if (g_config->mode == MODE_WINDOW ||
+        (g_config->mode == MODE_ACTIVE_WINDOW && g_config->toplevel)) {
+        eprintf("Windows captured with --toplevel or mode `window` can't be redacted\n");
+        return false;
+    }
+    // So is the position of the outputs
+    if (!comp_supported(g_config->compositor) &&
+        (g_config->redact_window_count > 0 || g_config->mode == MODE_FULL ||
+         (g_config->mode == MODE_DIFF && g_config->slot == NULL))) {
+        eprintf("Redacting %s needs a supported compositor\n",
+                g_config->redact_window_count > 0 ? "windows" : "a full screenshot");
+        _comp_print_support(g_config->compositor, stderr);
+        return false;
+    }
+    return true;
+}
+
+bool redact_start(RedactQuery *query, const char *region) {
+    Compositor compositor = g_config->compositor;
+    query->region         = region;
+    if (region == NULL && !cmd_pipe_open(&query->outputs, comp_output_list_cmds[compositor],
+                                         CMD_PIPE_STDOUT)) {
+        return false;
+    }
+    if (g_config->redact_window_count > 0 &&
+        !cmd_pipe_open(&query->windows, comp_window_list_cmds[compositor], CMD_PIPE_STDOUT)) {
+        if (region == NULL) cmd_pipe_close(&query->outputs);
+        return false;
+    }
+    return true;
+}
+
+// The area grim captured: the region, the output named `-o`, or the bounding box of every output
+static bool captured_area(const char *region, const char *outputs, Region *area) {
+    if (region != NULL) {
+        if (region_parse(region, area)) return true;
+        eprintf("Invalid region format `%s`\n", region);
+        return false;
+    }
+    return outputs_area(outputs, g_config->output_name, area);
+}
+
+// Adds the windows matching `--redact-window` to `rects`. `windows` has an
+// "X,Y WxH<tab>app ID<tab>title" line per visible window.
+static void window_rects(char              *windows,
+                         const Region      *area,
+                         const PixelBuffer *frame,
+                         Rect             **rects,
+                         size_t            *count) {
+    size_t lines = 0;
+    for (const char *c = windows; *c != '\0'; ++c) lines += *c == '\n';
+    Rect *grown = mp_allocator_alloc(g_alloc, (*count + lines + 1) * sizeof(*grown));
+    memcpy(grown, *rects, *count * sizeof(*grown));
+    *rects = grown;
+
+    char *save = NULL;
+    for (char *line = strtok_r(windows, "\n", &save); line != NULL;
+         line       = strtok_r(NULL, "\n", &save)) {
+        char *app_id = strchr(line, '\t');
+        if (app_id == NULL) continue;
+        *app_id++   = '\0';
+        char *title = strchr(app_id, '\t');
+        if (title == NULL) continue;
+        *title++ = '\0';
+
+        bool matched = false;
+        for (size_t i = 0; i < g_config->redact_window_count && !matched; ++i) {
+            const char *match = g_config->redact_window[i];
+            matched           = streq(app_id, match) || strstr(title, match) != NULL;
+        }
+        Region region;
+        if (!matched || !region_parse(line, &region)) continue;
+        if (g_config->verbose) printf("Redacting window %s (%s)\n", line, app_id);
+        if (region_rect(&region, area, frame, &grown[*count])) ++*count;
+    }
+}
+
+// Rounded `sum / (2 * radius + 1)`, with `recip` from the job. Exact enough for a blur, and the
+// same as `_mm_mulhi_epu16()` so the SIMD rows match the others.
+static inline uint8_t box_div(uint32_t sum, uint32_t radius, uint32_t recip) {
+    return (uint8_t)(((sum + radius) * recip) >> 16);
+}
+
+// Repeats the edge pixels of the row of `width` pixels at `padded + radius * 3` into the `radius`
+// pixels before it and the `radius + 1` after it, so `box_row()` never checks for the edges
+static void pad_row(uint8_t *padded, uint32_t width, uint32_t radius) {
+    const uint8_t *first = padded + (size_t)radius * 3;
+    uint8_t       *last  = padded + (size_t)(radius + width - 1) * 3;
+    for (uint32_t i = 0; i < radius; ++i) memcpy(padded + (size_t)i * 3, first, 3);
+    for (uint32_t i = 0; i <= radius; ++i) memcpy(last + (size_t)(i + 1) * 3, last, 3);
+}
+
+// Box blurs a row of `width` RGB pixels, padded by `pad_row()`
+static void box_row(const uint8_t *padded,
+                    uint8_t       *dst,
+                    uint32_t       width,
+                    uint32_t       radius,
+                    uint32_t       recip) {
+    uint32_t sum[3] = { 0 };
+    for (uint32_t i = 0; i < 2 * radius + 1; ++i) {
+        for (size_t c = 0; c < 3; ++c) sum[c] += padded[(size_t)i * 3 + c];
+    }
+    const uint8_t *in = padded + (size_t)(2 * radius + 1) * 3;
+    for (size_t i = 0; i < (size_t)width * 3; i += 3) {
+        for (size_t c = 0; c < 3; ++c) {
+            dst[i + c] = box_div(sum[c], radius, recip);
+            sum[c] += (uint32_t)in[i + c] - padded[i + c];
+        }
+    }
+}
+
+#if defined(__aarch64__)
+static inline uint16x8_t neon_mulhi(uint16x8_t a, uint16x8_t b) {
+    return vcombine_u16(vshrn_n_u32(vmull_u16(vget_low_u16(a), vget_low_u16(b)), 16),
+                        vshrn_n_u32(vmull_high_u16(a, b), 16));
+}
+#endif
+
+// Writes a row of the vertical blur from `sums`, then moves the boxes a row down: `in` is the row
+// that enters them and `out` the one that leaves
+static void box_step(uint16_t      *sums,
+                     const uint8_t *in,
+                     const uint8_t *out,
+                     uint8_t       *row,
+                     size_t         bytes,
+                     uint32_t       radius,
+                     uint32_t       recip) {
+    size_t i = 0;
+#if defined(__SSE2__)
+    __m128i zero = _mm_setzero_si128();
+    __m128i r    = _mm_set1_epi16((short)radius);
+    __m128i m    = _mm_set1_epi16((short)recip);
+    for (; i + 16 <= bytes; i += 16) {
+        __m128i *s      = (__m128i *)(sums + i);
+        __m128i  lo     = _mm_loadu_si128(s);
+        __m128i  hi     = _mm_loadu_si128(s + 1);
+        __m128i  avg_lo = _mm_mulhi_epu16(_mm_add_epi16(lo, r), m);
+        __m128i  avg_hi = _mm_mulhi_epu16(_mm_add_epi16(hi, r), m);
+        _mm_storeu_si128((__m128i *)(row + i), _mm_packus_epi16(avg_lo, avg_hi));
+
+        __m128i entering = _mm_loadu_si128((const __m128i *)(in + i));
+        __m128i leaving  = _mm_loadu_si128((const __m128i *)(out + i));
+        lo = _mm_sub_epi16(_mm_add_epi16(lo, _mm_unpacklo_epi8(entering, zero)),
+                           _mm_unpacklo_epi8(leaving, zero));
+        hi = _mm_sub_epi16(_mm_add_epi16(hi, _mm_unpackhi_epi8(entering, zero)),
+                           _mm_unpackhi_epi8(leaving, zero));
+        _mm_storeu_si128(s, lo);
+        _mm_storeu_si128(s + 1, hi);
+    }
+#elif defined(__aarch64__)
+    uint16x8_t r = vdupq_n_u16((uint16_t)radius);
+    uint16x8_t m = vdupq_n_u16((uint16_t)recip);
+    for (; i + 16 <= bytes; i += 16) {
+        uint16x8_t lo     = vld1q_u16(sums + i);
+        uint16x8_t hi     = vld1q_u16(sums + i + 8);
+        uint16x8_t avg_lo = neon_mulhi(vaddq_u16(lo, r), m);
+        uint16x8_t avg_hi = neon_mulhi(vaddq_u16(hi, r), m);
+        vst1q_u8(row + i, vcombine_u8(vqmovn_u16(avg_lo), vqmovn_u16(avg_hi)));
+
+        uint8x16_t entering = vld1q_u8(in + i);
+        uint8x16_t leaving  = vld1q_u8(out + i);
+        lo = vsubw_u8(vaddw_u8(lo, vget_low_u8(entering)), vget_low_u8(leaving));
+        hi = vsubw_u8(vaddw_u8(hi, vget_high_u8(entering)), vget_high_u8(leaving));
+        vst1q_u16(sums + i, lo);
+        vst1q_u16(sums + i + 8, hi);
+    }
+#endif
+    for (; i < bytes; ++i) {
+        row[i]  = box_div(sums[i], radius, recip);
+        sums[i] = (uint16_t)(sums[i] + in[i] - out[i]);
+    }
+}
+
+// Box blurs `bytes` bytes of `height` rows vertically, a whole row at a time on SIMD
+static void box_columns(const uint8_t *src,
+                        size_t         src_stride,
+                        uint8_t       *dst,
+                        size_t         dst_stride,
+                        size_t         bytes,
+                        uint32_t       height,
+                        uint32_t       radius,
+                        uint32_t       recip,
+                        uint16_t      *sums) {
+    uint32_t last = height - 1;
+    for (size_t i = 0; i < bytes; ++i) sums[i] = (uint16_t)((radius + 1) * src[i]);
+    for (uint32_t y = 1; y <= radius; ++y) {
+        const uint8_t *row = src + MIN(y, last) * src_stride;
+        for (size_t i = 0; i < bytes; ++i) sums[i] = (uint16_t)(sums[i] + row[i]);
+    }
+    for (uint32_t y = 0; y < height; ++y) {
+        const uint8_t *in  = src + MIN(y + radius + 1, last) * src_stride;
+        const uint8_t *out = src + (y >= radius ? y - radius : 0) * src_stride;
+        box_step(sums, in, out, dst + y * dst_stride, bytes, radius, recip);
+    }
+}
+
+// The first and last row, column or block row of `tile` out of `units`
+static void tile_range(const RedactJob *job,
+                       uint32_t         tile,
+                       uint32_t         units,
+                       uint32_t        *first,
+                       uint32_t        *end) {
+    *first = (uint32_t)((uint64_t)units * tile / job->tiles);
+    *end   = (uint32_t)((uint64_t)units * (tile + 1) / job->tiles);
+}
+
+// Blurs the rows of the tile horizontally into `tmp[0]`
+static void blur_rows(const RedactJob *job, uint32_t tile) {
+    size_t   row_size    = (size_t)job->width * 3;
+    size_t   padded_size = (size_t)(job->width + 2 * job->size + 1) * 3;
+    uint8_t *padded[2]   = { job->rows + tile * 2 * padded_size,
+                             job->rows + (tile * 2 + 1) * padded_size };
+    uint32_t first, end;
+    tile_range(job, tile, job->height, &first, &end);
+    for (uint32_t y = first; y < end; ++y) {
+        const uint8_t *src = job->frame->data + (job->rect.y0 + y) * job->frame->stride +
+                             (size_t)job->rect.x0 * 3;
+        memcpy(padded[0] + (size_t)job->size * 3, src, row_size);
+        for (size_t pass = 0; pass < BLUR_PASSES; ++pass) {
+            pad_row(padded[pass % 2], job->width, job->size);
+            uint8_t *dst = pass == BLUR_PASSES - 1 ? job->tmp[0] + y * row_size
+                                                   : padded[(pass + 1) % 2] + (size_t)job->size * 3;
+            box_row(padded[pass % 2], dst, job->width, job->size, job->recip);
+        }
+    }
+}
+
+// Blurs the columns of the tile vertically, from `tmp[0]` back into the frame
+static void blur_columns(const RedactJob *job, uint32_t tile) {
+    size_t   row_size = (size_t)job->width * 3;
+    uint32_t first, end;
+    tile_range(job, tile, job->width, &first, &end);
+    size_t offset = (size_t)first * 3, bytes = (size_t)(end - first) * 3;
+
+    const uint8_t *src        = job->tmp[0] + offset;
+    size_t         src_stride = row_size;
+    for (size_t pass = 0; pass < BLUR_PASSES; ++pass) {
+        uint8_t *dst        = job->tmp[(pass + 1) % 2] + offset;
+        size_t   dst_stride = row_size;
+        if (pass == BLUR_PASSES - 1) {
+            dst = job->frame->data + job->rect.y0 * job->frame->stride +
+                  (size_t)job->rect.x0 * 3 + offset;
+            dst_stride = job->frame->stride;
+        }
+        box_columns(src,
+                    src_stride,
+                    dst,
+                    dst_stride,
+                    bytes,
+                    job->height,
+                    job->size,
+                    job->recip,
+                    job->column_sums + offset);
+        src = dst;
+    }
+}
+
+// Replaces each block of the tile's block rows with its average colour
+static void pixelate_rows(const RedactJob *job, uint32_t tile) {
+    uint32_t block   = job->size;
+    uint32_t columns = (job->width + block - 1) / block;
+    uint32_t rows    = (job->height + block - 1) / block;
+    uint32_t first, end;
+    tile_range(job, tile, rows, &first, &end);
+    uint32_t *sums = job->block_sums + (size_t)tile * columns * 3;
+
+    for (uint32_t block_row = first; block_row < end; ++block_row) {
+        uint32_t y0 = job->rect.y0 + block_row * block;
+        uint32_t y1 = MIN(y0 + block, job->rect.y1);
+        memset(sums, 0, (size_t)columns * 3 * sizeof(*sums));
+        for (uint32_t y = y0; y < y1; ++y) {
+            const uint8_t *row = job->frame->data + y * job->frame->stride;
+            for (uint32_t x = job->rect.x0; x < job->rect.x1; ++x) {
+                uint32_t *sum = sums + (size_t)((x - job->rect.x0) / block) * 3;
+                sum[0] += row[(size_t)x * 3 + 0];
+                sum[1] += row[(size_t)x * 3 + 1];
+                sum[2] += row[(size_t)x * 3 + 2];
+            }
+        }
+        for (uint32_t column = 0; column < columns; ++column) {
+            uint32_t x0    = job->rect.x0 + column * block;
+            uint32_t x1    = MIN(x0 + block, job->rect.x1);
+            uint32_t count = (x1 - x0) * (y1 - y0);
+            uint8_t  colour[3];
+            for (size_t c = 0; c < 3; ++c) {
+                colour[c] = (uint8_t)((sums[column * 3 + c] + count / 2) / count);
+            }
+            for (uint32_t y = y0; y < y1; ++y) {
+                uint8_t *pixel = job->frame->data + y * job->frame->stride + (size_t)x0 * 3;
+                for (uint32_t x = x0; x < x1; ++x, pixel += 3) memcpy(pixel, colour, 3);
+            }
+        }
+    }
+}
+
+static void tiles_range(void *ctx, size_t begin, size_t end) {
+    const TileRun *run = ctx;
+    for (size_t tile = begin; tile < end; ++tile) run->fn(run->job, (uint32_t)tile);
+}
+
+// Runs `fn` on every tile on the threads of the pool, and waits for all of them
+static void tiles_run(const RedactJob *job, TileFn fn) {
+    if (job->tiles == 1) {
+        fn(job, 0);
+        return;
+    }
+    TileRun run = { .job = job, .fn = fn };
+    tp_parallel_for(thread_pool(), 0, job->tiles, 1, tiles_range, &run);
+}
+
+// Redacts `rect` with up to `threads` threads
+static void redact_rect(RedactJob *job, Rect rect, uint32_t threads) {
+    job->rect   = rect;
+    job->width  = rect.x1 - rect.x0;
+    job->height = rect.y1 - rect.y0;
+
+    // Each tile needs at least a row, a column or a block row of its own
+    uint32_t units = MIN(job->width, job->height);
+    if (g_config->redact_style == REDACT_PIXELATE) {
+        units = (job->height + job->size - 1) / job->size;
+    }
+    job->tiles = (uint64_t)job->width * job->height < THREAD_MIN_PIXELS ? 1 : MIN(threads, units);
+
+    switch (g_config->redact_style) {
+        case REDACT_PIXELATE : {
+            tiles_run(job, pixelate_rows);
+        } break;
+        case REDACT_BLUR : {
+            // The horizontal passes must be done on every row before the vertical ones start
+            tiles_run(job, blur_rows);
+            tiles_run(job, blur_columns);
+        } break;
+        case REDACT_COUNT : {
+            unreachable();
+        }
+    }
+}
+
+bool redact_finish(RedactQuery *query, PixelBuffer *frame) {
+    int    result      = true;
+    size_t span_redact = trace_begin("redact");
+
+    mp_StringBuilder outputs    = mp_string_builder_new(g_alloc);
+    mp_StringBuilder windows    = mp_string_builder_new(g_alloc);
+    bool             listed     = true;
+    size_t           span_query = trace_begin("compositor_query");
+    if (g_config->redact_window_count > 0) {
+        listed = cmd_pipe_read(&query->windows, frame == NULL ? NULL : &windows) && listed;
+    }
+    if (query->region == NULL) {
+        listed = cmd_pipe_read(&query->outputs, frame == NULL ? NULL : &outputs) && listed;
+    }
+    trace_end(span_query);
+    if (frame == NULL) return_defer(true);
+    if (!listed) {
+        eprintf("Failed to get the outputs and windows from the compositor\n");
+        return_defer(false);
+    }
+
+    Region area;
+    if (!captured_area(query->region, outputs.data, &area) || area.width <= 0 ||
+        area.height <= 0) {
+        return_defer(false);
+    }
+
+    Rect  *rects = mp_allocator_alloc(g_alloc, (g_config->redact_count + 1) * sizeof(*rects));
+    size_t count = 0;
+    for (size_t i = 0; i < g_config->redact_count; ++i) {
+        Region redacted;
+        region_parse(g_config->redact[i], &redacted);    // Validated with the arguments
+        if (region_rect(&redacted, &area, frame, &rects[count])) ++count;
+    }
+    if (g_config->redact_window_count > 0) {
+        window_rects(windows.data, &area, frame, &rects, &count);
+    }
+    if (count == 0) return_defer(true);
+
+    // The scratch memory fits the biggest rectangle and is reused for the others
+    uint32_t width = 0, height = 0;
+    for (size_t i = 0; i < count; ++i) {
+        width  = MAX(width, rects[i].x1 - rects[i].x0);
+        height = MAX(height, rects[i].y1 - rects[i].y0);
+    }
+    uint32_t threads = (uint32_t)tp_pool_threads(thread_pool());
+    uint32_t size    = g_config->redact_style == REDACT_BLUR ? BLUR_RADIUS : BLOCK_SIZE;
+    // The blocks and the radius are in layout pixels, so a scaled frame looks the same
+    size = (uint32_t)(((uint64_t)size * frame->width + (uint32_t)area.width / 2) /
+                      (uint32_t)area.width);
+    size = MAX(size, 1);
+
+    RedactJob job = {
+        .frame = frame,
+        .size  = size,
+    };
+    size_t row_size = (size_t)width * 3;
+    if (g_config->redact_style == REDACT_BLUR) {
+        job.size           = MIN(job.size, BLUR_RADIUS_MAX);
+        job.recip          = ((1 << 16) + job.size) / (2 * job.size + 1);
+        size_t padded_size = row_size + (size_t)(2 * job.size + 1) * 3;
+        job.tmp[0]         = mp_allocator_alloc(g_alloc, row_size * height);
+        job.tmp[1]         = mp_allocator_alloc(g_alloc, row_size * height);
+        job.rows           = mp_allocator_alloc(g_alloc, padded_size * 2 * threads);
+        job.column_sums    = mp_allocator_alloc(g_alloc, row_size * sizeof(*job.column_sums));
+    } else {
+        size_t columns = (width + job.size - 1) / job.size;
+        job.block_sums =
+            mp_allocator_alloc(g_alloc, columns * 3 * threads * sizeof(*job.block_sums));
+    }
+
+    for (size_t i = 0; i < count; ++i) redact_rect(&job, rects[i], threads);
+    if (g_config->verbose) {
+        printf("Redacted %zu region%s (%s)\n",
+               count,
+               count == 1 ? "" : "s",
+               redactstyle2str(g_config->redact_style));
+    }
+
+defer:
+    trace_end(span_redact);
+    return result;
+}
@@ -0,0 +1,28 @@
+#ifndef REDACT_H
+#define REDACT_H
+
+#include "pixfmt.h"
+#include "utils.h"
+#include <stdbool.h>
+
+// The compositor lists the outputs and windows while grim captures the frame, so the windows are
+// redacted where they were when it was taken
+typedef struct {
+    const char *region;     // What grim captures, NULL for the outputs
+    CmdPipe     outputs;    // Only without a region
+    CmdPipe     windows;    // Only with `--redact-window`
+} RedactQuery;
+
+// Whether `--redact` or `--redact-window` were given
+bool redact_enabled(void);
+// Checks that the capture can be redacted. Nothing is captured if it can't, so an image is never
+// saved with the regions it should have hidden.
+bool redact_check(void);
+// Starts listing what `redact_finish()` needs to redact a capture of `region`, or of the outputs
+// grim captures if it is NULL
+bool redact_start(RedactQuery *query, const char *region);
+// Pixelates or blurs the redacted regions and windows in `frame`, the PIXFMT_RGB frame of the
+// capture. The work is split over a few threads. With a NULL `frame`, only waits for the query.
+bool redact_finish(RedactQuery *query, PixelBuffer *frame);
+
+#endif /* ifndef REDACT_H */
@@ -0,0 +1,264 @@
+#define _DEFAULT_SOURCE
+
+#include "regions.h"
+#include "prog.h"
+#include "utils.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/param.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define REGIONS_MAGIC   0x52505247u    // "GRPR"
+#define REGIONS_VERSION 1u
+// A reader gives up on an entry that is still being written after this many tries, its writer may
+// have been killed halfway
+#define ENTRY_READ_TRIES 1000
+
+// Each entry is guarded by a seqlock: the writer makes `seq` odd while it writes and even when
+// it's done, readers retry if `seq` was odd or changed while they copied the entry.
+typedef struct {
+    _Atomic uint32_t seq;
+    uint32_t         used;
+    char             name[REGIONS_NAME_SIZE];    // Only used by slots
+    Region           region;
+} RegionEntry;
+
+typedef struct {
+    uint32_t         magic;
+    uint32_t         version;
+    _Atomic uint64_t pushed;    // Amount of regions ever pushed to `history`
+    RegionEntry      history[REGIONS_HISTORY];
+    RegionEntry      slots[REGIONS_SLOTS];
+} RegionStore;
+
+bool region_parse(const char *geometry, Region *region) {
+    int x, y, width, height;
+    int consumed = 0;
+    if (sscanf(geometry, "%d,%d %dx%d%n", &x, &y, &width, &height, &consumed) != 4) return false;
+    if (geometry[consumed] != '\0' && geometry[consumed] != '\n') return false;
+    if (width <= 0 || height <= 0) return false;
+    *region = (Region){ .x = x, .y = y, .width = width, .height = height };
+    return true;
+}
+
+char *region_format(const Region *region) {
+    return alloc_strf("%d,%d %dx%d", region->x, region->y, region->width, region->height).cstr;
+}
+
+// `value * num / den`, rounded towards negative infinity
+static int64_t scale_floor(int64_t value, int64_t num, int64_t den) {
+    int64_t product = value * num;
+    int64_t result  = product / den;
+    if (product % den != 0 && product < 0) --result;
+    return result;
+}
+
+static uint32_t clamp_u32(int64_t value, uint32_t max) {
+    if (value < 0) return 0;
+    if (value > max) return max;
+    return (uint32_t)value;
+}
+
+bool region_rect(const Region *region, const Region *area, const PixelBuffer *frame, Rect *rect) {
+    int64_t x0 = region->x - area->x, x1 = x0 + region->width;
+    int64_t y0 = region->y - area->y, y1 = y0 + region->height;
+    // Partly covered pixels are included
+    rect->x0   = clamp_u32(scale_floor(x0, frame->width, area->width), frame->width);
+    rect->x1   = clamp_u32(-scale_floor(-x1, frame->width, area->width), frame->width);
+    rect->y0   = clamp_u32(scale_floor(y0, frame->height, area->height), frame->height);
+    rect->y1   = clamp_u32(-scale_floor(-y1, frame->height, area->height), frame->height);
+    return rect->x0 < rect->x1 && rect->y0 < rect->y1;
+}
+
+void rect_crop(const PixelBuffer *frame, const Rect *rect, PixelBuffer *crop) {
+    *crop        = *frame;
+    crop->data   = frame->data + rect->y0 * frame->stride + rect->x0 * pixfmt_bpp(frame->format);
+    crop->width  = rect->x1 - rect->x0;
+    crop->height = rect->y1 - rect->y0;
+}
+
+bool outputs_area(const char *outputs, const char *name, Region *area) {
+    bool found = false;
+    for (const char *line = outputs; line != NULL && *line != '\0';) {
+        const char *end = strchr(line, '\n');
+        const char *tab = strchr(line, '\t');
+        Region      output;
+        if (tab != NULL && (end == NULL || tab < end) && region_parse(tab + 1, &output)) {
+            size_t length = (size_t)(tab - line);
+            if (name != NULL) {
+                if (strlen(name) == length && strncmp(line, name, length) == 0) {
+                    *area = output;
+                    return true;
+                }
+            } else if (!found) {
+                *area = output;
+                found = true;
+            } else {
+                int32_t x1   = MAX(area->x + area->width, output.x + output.width);
+                int32_t y1   = MAX(area->y + area->height, output.y + output.height);
+                area->x      = MIN(area->x, output.x);
+                area->y      = MIN(area->y, output.y);
+                area->width  = x1 - area->x;
+                area->height = y1 - area->y;
+            }
+        }
+        line = end == NULL ? NULL : end + 1;
+    }
+    if (!found) {
+        eprintf("Failed to find the position of output `%s`\n", name == NULL ? "any" : name);
+    }
+    return found;
+}
+
+static bool store_valid(const RegionStore *store) {
+    return store->magic == REGIONS_MAGIC && store->version == REGIONS_VERSION;
+}
+
+// Maps the store read-only. Returns NULL if it doesn't exist yet.
+static const RegionStore *store_map_read(void) {
+    int fd = open(g_config->regions_file, O_RDONLY);
+    if (fd == -1) {
+        if (errno != ENOENT)
+            eprintf("Failed to open %s: %s\n", g_config->regions_file, strerror(errno));
+        return NULL;
+    }
+    struct stat s;
+    void       *map = MAP_FAILED;
+    if (fstat(fd, &s) == 0 && (size_t)s.st_size == sizeof(RegionStore))
+        map = mmap(NULL, sizeof(RegionStore), PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) return NULL;
+    if (!store_valid(map)) {
+        munmap(map, sizeof(RegionStore));
+        return NULL;
+    }
+    return map;
+}
+
+static bool entry_read(const RegionEntry *entry, Region *region) {
+    RegionEntry *e = (RegionEntry *)entry;
+    for (size_t tries = 0; tries < ENTRY_READ_TRIES; ++tries) {
+        uint32_t seq = atomic_load_explicit(&e->seq, memory_order_acquire);
+        if (seq & 1) {
+            sched_yield();
+            continue;
+        }
+        bool used = e->used;
+        memcpy(region, &e->region, sizeof(Region));
+        atomic_thread_fence(memory_order_acquire);
+        if (atomic_load_explicit(&e->seq, memory_order_relaxed) == seq) return used;
+    }
+    return false;
+}
+
+// Only called with the store locked. A writer killed between its two stores left `seq` odd, so it
+// is rounded up to even first.
+static void entry_write(RegionEntry *entry, const char *name, const Region *region) {
+    uint32_t seq = (atomic_load_explicit(&entry->seq, memory_order_relaxed) + 1) & ~1u;
+    atomic_store_explicit(&entry->seq, seq + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    entry->used = 1;
+    if (name != NULL) snprintf(entry->name, REGIONS_NAME_SIZE, "%s", name);
+    memcpy(&entry->region, region, sizeof(Region));
+    atomic_store_explicit(&entry->seq, seq + 2, memory_order_release);
+}
+
+bool regions_push(const Region *region, const char *slot, bool history) {
+    bool         result = true;
+    int          fd     = -1;
+    RegionStore *store  = MAP_FAILED;
+
+    if (!history && slot == NULL) return true;
+
+    fd = open(g_config->regions_file, O_RDWR | O_CREAT, 0644);
+    if (fd == -1) {
+        eprintf("Failed to open %s: %s\n", g_config->regions_file, strerror(errno));
+        return_defer(false);
+    }
+    // The seqlock only allows one writer at a time
+    if (flock(fd, LOCK_EX) != 0) {
+        eprintf("Failed to lock %s: %s\n", g_config->regions_file, strerror(errno));
+        return_defer(false);
+    }
+
+    struct stat s;
+    if (fstat(fd, &s) != 0) return_defer(false);
+    bool fresh = (size_t)s.st_size != sizeof(RegionStore);
+    if (fresh && (ftruncate(fd, 0) != 0 || ftruncate(fd, sizeof(RegionStore)) != 0)) {
+        eprintf("Failed to initialise %s: %s\n", g_config->regions_file, strerror(errno));
+        return_defer(false);
+    }
+
+    store = mmap(NULL, sizeof(RegionStore), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (store == MAP_FAILED) {
+        eprintf("Failed to map %s: %s\n", g_config->regions_file, strerror(errno));
+        return_defer(false);
+    }
+    if (fresh || !store_valid(store)) {
+        memset(store, 0, sizeof(RegionStore));
+        store->magic   = REGIONS_MAGIC;
+        store->version = REGIONS_VERSION;
+    }
+
+    if (history) {
+        uint64_t pushed = atomic_load_explicit(&store->pushed, memory_order_relaxed);
+        entry_write(&store->history[pushed % REGIONS_HISTORY], NULL, region);
+        atomic_store_explicit(&store->pushed, pushed + 1, memory_order_release);
+    }
+
+    if (slot != NULL) {
+        RegionEntry *entry = NULL;
+        for (size_t i = 0; i < REGIONS_SLOTS && entry == NULL; ++i) {
+            if (store->slots[i].used && streq(store->slots[i].name, slot)) entry = &store->slots[i];
+        }
+        for (size_t i = 0; i < REGIONS_SLOTS && entry == NULL; ++i) {
+            if (!store->slots[i].used) entry = &store->slots[i];
+        }
+        if (entry == NULL) {
+            eprintf("All %d slots are used, reuse one of their names\n", REGIONS_SLOTS);
+            return_defer(false);
+        }
+        entry_write(entry, slot, region);
+    }
+
+defer:
+    if (store != MAP_FAILED) munmap(store, sizeof(RegionStore));
+    if (fd != -1) close(fd);
+    return result;
+}
+
+bool regions_last(size_t nth, Region *region) {
+    if (nth >= REGIONS_HISTORY) return false;
+    const RegionStore *store = store_map_read();
+    if (store == NULL) return false;
+
+    bool     found  = false;
+    uint64_t pushed = atomic_load_explicit(&((RegionStore *)store)->pushed, memory_order_acquire);
+    if (nth < pushed)
+        found = entry_read(&store->history[(pushed - 1 - nth) % REGIONS_HISTORY], region);
+
+    munmap((void *)store, sizeof(RegionStore));
+    return found;
+}
+
+bool regions_slot(const char *slot, Region *region) {
+    const RegionStore *store = store_map_read();
+    if (store == NULL) return false;
+
+    bool found = false;
+    for (size_t i = 0; i < REGIONS_SLOTS && !found; ++i) {
+        // Slots are only ever renamed while the writer holds the lock, a torn name just won't match
+        if (store->slots[i].used && streq(store->slots[i].name, slot))
+            found = entry_read(&store->slots[i], region);
+    }
+
+    munmap((void *)store, sizeof(RegionStore));
+    return found;
+}
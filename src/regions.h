@@ -0,0 +1,51 @@
+#ifndef REGIONS_H
+#define REGIONS_H
+
+#include "pixfmt.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Regions remembered by `last-region` and `history`
+#define REGIONS_HISTORY   32
+// Regions saved by name with `--slot`
+#define REGIONS_SLOTS     16
+// Maximum length of slot and output names, including the null-terminator
+#define REGIONS_NAME_SIZE 32
+
+// A captured region, in the same global coordinates that grim's `-g` takes
+typedef struct {
+    int32_t x, y;
+    int32_t width, height;
+    double  scale;                        // The `-s` factor it was captured with
+    int64_t timestamp;                    // Unix time of the capture
+    char    output[REGIONS_NAME_SIZE];    // The output it was captured on, empty if unknown
+} Region;
+
+// A rectangle in the pixels of a frame, `x1` and `y1` excluded
+typedef struct {
+    uint32_t x0, y0;
+    uint32_t x1, y1;
+} Rect;
+
+// Parses 'X,Y WxH'
+bool region_parse(const char *geometry, Region *region);
+// Formats `region` as 'X,Y WxH'
+char *region_format(const Region *region);
+// Converts `region` to the pixels of `frame`, a capture of `area`, which may be scaled.
+// Returns false if they don't overlap.
+bool region_rect(const Region *region, const Region *area, const PixelBuffer *frame, Rect *rect);
+// Points `crop` at the pixels of `rect` in `frame`, nothing is copied
+void rect_crop(const PixelBuffer *frame, const Rect *rect, PixelBuffer *crop);
+// Finds the area of the output `name`, or the bounding box of every output if it is NULL, in
+// `outputs`, which has a "name<tab>X,Y WxH" line per output like `comp_output_list_cmds` print
+bool outputs_area(const char *outputs, const char *name, Region *area);
+
+// Remembers `region` as the last region, and in `slot` too if it is not NULL
+bool regions_push(const Region *region, const char *slot, bool history);
+// Loads the `nth` last region, 0 being the most recent one
+bool regions_last(size_t nth, Region *region);
+// Loads the region saved in `slot`
+bool regions_slot(const char *slot, Region *region);
+
+#endif /* ifndef REGIONS_H */
@@ -0,0 +1,194 @@
+#include "snap.h"
+#include "prog.h"
+#include "utils.h"
+#include <string.h>
+#include <sys/param.h>
+
+// The grid the windows are sorted into is made of cells this big in layout pixels, or bigger if it
+// would be more than SNAP_GRID_MAX cells wide or high
+#define SNAP_CELL     256
+#define SNAP_GRID_MAX 64
+// A window cut into more visible pieces than this is kept as it is, most of it is visible anyway
+#define SNAP_PIECES_MAX 256
+
+// A rectangle in layout coordinates, `x1` and `y1` excluded
+typedef struct {
+    int32_t x0, y0;
+    int32_t x1, y1;
+} Box;
+
+// The windows that overlap each cell, from the top one to the bottom one, one cell after another
+typedef struct {
+    int32_t  x, y;    // Where the first cell starts
+    int32_t  cell;
+    uint32_t columns, rows;
+    size_t  *first;    // Where the windows of each cell start in `windows`, plus one at the end
+    size_t  *windows;
+} Grid;
+
+static Box window_box(const Region *window) {
+    return (Box){ window->x, window->y, window->x + window->width, window->y + window->height };
+}
+
+// The cells `box` overlaps, `x1` and `y1` included
+static void grid_cells(const Grid *grid, const Box *box, uint32_t cells[4]) {
+    cells[0] = (uint32_t)((box->x0 - grid->x) / grid->cell);
+    cells[1] = (uint32_t)((box->y0 - grid->y) / grid->cell);
+    cells[2] = (uint32_t)((box->x1 - 1 - grid->x) / grid->cell);
+    cells[3] = (uint32_t)((box->y1 - 1 - grid->y) / grid->cell);
+}
+
+// Sorts the `count` boxes into `grid`. `boxes` are from the top window to the bottom one.
+static void grid_build(Grid *grid, const Box *boxes, size_t count) {
+    Box bounds = boxes[0];
+    for (size_t i = 1; i < count; ++i) {
+        bounds.x0 = MIN(bounds.x0, boxes[i].x0);
+        bounds.y0 = MIN(bounds.y0, boxes[i].y0);
+        bounds.x1 = MAX(bounds.x1, boxes[i].x1);
+        bounds.y1 = MAX(bounds.y1, boxes[i].y1);
+    }
+    int32_t extent = MAX(bounds.x1 - bounds.x0, bounds.y1 - bounds.y0);
+    grid->x        = bounds.x0;
+    grid->y        = bounds.y0;
+    grid->cell     = MAX(SNAP_CELL, (extent + SNAP_GRID_MAX - 1) / SNAP_GRID_MAX);
+    grid->columns  = (uint32_t)((bounds.x1 - bounds.x0 + grid->cell - 1) / grid->cell);
+    grid->rows     = (uint32_t)((bounds.y1 - bounds.y0 + grid->cell - 1) / grid->cell);
+
+    // Counted first, so every cell gets exactly the room it needs
+    size_t cells = (size_t)grid->columns * grid->rows;
+    grid->first  = mp_allocator_alloc(g_alloc, (cells + 1) * sizeof(*grid->first));
+    memset(grid->first, 0, (cells + 1) * sizeof(*grid->first));
+    for (size_t i = 0; i < count; ++i) {
+        uint32_t c[4];
+        grid_cells(grid, &boxes[i], c);
+        for (uint32_t y = c[1]; y <= c[3]; ++y) {
+            for (uint32_t x = c[0]; x <= c[2]; ++x) {
+                ++grid->first[(size_t)y * grid->columns + x + 1];
+            }
+        }
+    }
+    for (size_t i = 0; i < cells; ++i) grid->first[i + 1] += grid->first[i];
+
+    size_t *next  = mp_allocator_dup(g_alloc, grid->first, cells * sizeof(*next));
+    grid->windows = mp_allocator_alloc(g_alloc, MAX(grid->first[cells], 1) * sizeof(size_t));
+    for (size_t i = 0; i < count; ++i) {
+        uint32_t c[4];
+        grid_cells(grid, &boxes[i], c);
+        for (uint32_t y = c[1]; y <= c[3]; ++y) {
+            for (uint32_t x = c[0]; x <= c[2]; ++x) {
+                grid->windows[next[(size_t)y * grid->columns + x]++] = i;
+            }
+        }
+    }
+}
+
+// Writes what is left of the `count` boxes of `pieces` once `cut` is taken away to `out`, which
+// has room for four times as many. Returns how many there are.
+static size_t box_subtract(const Box *pieces, size_t count, const Box *cut, Box *out) {
+    size_t left = 0;
+    for (size_t i = 0; i < count; ++i) {
+        Box piece = pieces[i];
+        if (cut->x0 >= piece.x1 || cut->x1 <= piece.x0 || cut->y0 >= piece.y1 ||
+            cut->y1 <= piece.y0) {
+            out[left++] = piece;
+            continue;
+        }
+        // The bands above and below the cut span the whole piece, the sides only its height
+        int32_t y0 = MAX(piece.y0, cut->y0);
+        int32_t y1 = MIN(piece.y1, cut->y1);
+        if (piece.y0 < y0) out[left++] = (Box){ piece.x0, piece.y0, piece.x1, y0 };
+        if (y1 < piece.y1) out[left++] = (Box){ piece.x0, y1, piece.x1, piece.y1 };
+        if (piece.x0 < cut->x0) out[left++] = (Box){ piece.x0, y0, cut->x0, y1 };
+        if (cut->x1 < piece.x1) out[left++] = (Box){ cut->x1, y0, piece.x1, y1 };
+    }
+    return left;
+}
+
+// Whether any part of the window `z` is not covered by the windows above it, those before it in
+// `boxes`. `seen` has a slot per window, the ones already taken away are marked with `z + 1`.
+// `pieces` is scratch memory for two sets of SNAP_PIECES_MAX * 4 boxes.
+static bool window_visible(const Grid *grid,
+                           const Box  *boxes,
+                           size_t      z,
+                           size_t     *seen,
+                           Box        *pieces[2]) {
+    size_t count       = 1;
+    size_t current     = 0;
+    pieces[current][0] = boxes[z];
+
+    uint32_t c[4];
+    grid_cells(grid, &boxes[z], c);
+    for (uint32_t y = c[1]; y <= c[3]; ++y) {
+        for (uint32_t x = c[0]; x <= c[2]; ++x) {
+            size_t cell = (size_t)y * grid->columns + x;
+            // The windows of a cell are in stacking order, the ones below `z` don't cover it
+            for (size_t i = grid->first[cell]; i < grid->first[cell + 1]; ++i) {
+                size_t above = grid->windows[i];
+                if (above >= z) break;
+                if (seen[above] == z + 1) continue;
+                seen[above] = z + 1;
+
+                count   = box_subtract(pieces[current], count, &boxes[above], pieces[!current]);
+                current = !current;
+                if (count == 0) return false;
+                if (count > SNAP_PIECES_MAX) return true;
+            }
+        }
+    }
+    return true;
+}
+
+void snap_parse(const char *windows, SnapTargets *targets) {
+    size_t lines = 1;
+    for (const char *c = windows; *c != '\0'; ++c) lines += *c == '\n';
+    targets->windows = mp_allocator_alloc(g_alloc, lines * sizeof(*targets->windows));
+    targets->count   = 0;
+    targets->hidden  = 0;
+
+    Region *all   = mp_allocator_alloc(g_alloc, lines * sizeof(*all));
+    size_t  count = 0;
+    for (const char *line = windows; line != NULL && *line != '\0';) {
+        const char *end = strchr(line, '\n');
+        if (region_parse(line, &all[count])) ++count;
+        line = end == NULL ? NULL : end + 1;
+    }
+    if (count == 0) return;
+
+    // The windows are listed from the bottom one to the top one, they are culled from the top
+    Box *boxes = mp_allocator_alloc(g_alloc, count * sizeof(*boxes));
+    for (size_t z = 0; z < count; ++z) boxes[z] = window_box(&all[count - 1 - z]);
+    Grid grid;
+    grid_build(&grid, boxes, count);
+
+    size_t *seen    = mp_allocator_alloc(g_alloc, count * sizeof(*seen));
+    bool   *visible = mp_allocator_alloc(g_alloc, count * sizeof(*visible));
+    Box    *pieces[2];
+    for (size_t i = 0; i < 2; ++i) {
+        pieces[i] = mp_allocator_alloc(g_alloc, SNAP_PIECES_MAX * 4 * sizeof(Box));
+    }
+    memset(seen, 0, count * sizeof(*seen));
+    for (size_t z = 0; z < count; ++z) visible[z] = window_visible(&grid, boxes, z, seen, pieces);
+
+    // In the order they were listed
+    for (size_t i = 0; i < count; ++i) {
+        if (visible[count - 1 - i]) {
+            targets->windows[targets->count++] = all[i];
+        } else {
+            ++targets->hidden;
+        }
+    }
+}
+
+char *snap_format(const SnapTargets *targets) {
+    mp_StringBuilder builder = mp_string_builder_new(g_alloc);
+    for (size_t i = 0; i < targets->count; ++i) {
+        const Region *window = &targets->windows[i];
+        mp_string_builder_appendf(&builder,
+                                  "%d,%d %dx%d\n",
+                                  window->x,
+                                  window->y,
+                                  window->width,
+                                  window->height);
+    }
+    return mp_string_builder_to_string(&builder).cstr;
+}
@@ -0,0 +1,22 @@
+#ifndef SNAP_H
+#define SNAP_H
+
+#include "regions.h"
+#include <stdbool.h>
+#include <stddef.h>
+
+// The windows the selection of mode `region` snaps to, in layout coordinates
+typedef struct {
+    Region *windows;
+    size_t  count;
+    size_t  hidden;    // Windows dropped because the ones above them cover them entirely
+} SnapTargets;
+
+// Reads the "X,Y WxH" lines `comp_windows_cmds` print, from the bottom window to the top one.
+// The windows covered by the ones above them are dropped, which are found in a grid of the layout
+// so that each window is only compared with those around it.
+void snap_parse(const char *windows, SnapTargets *targets);
+// Formats the targets one per line, like slurp reads its predefined boxes
+char *snap_format(const SnapTargets *targets);
+
+#endif /* ifndef SNAP_H */
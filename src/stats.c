@@ -0,0 +1,430 @@
+#define _DEFAULT_SOURCE
+
+#include "stats.h"
+#include "compositors.h"
+#include "prog.h"
+#include "trace.h"
+#include "utils.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// The histograms are log-linear like HdrHistogram: every power of two of microseconds is split
+// into `1 << STATS_SUB_BITS` buckets, which keeps the error of any reported value under 12.5%.
+#define STATS_SUB_BITS  3
+#define STATS_SUB_COUNT (1 << STATS_SUB_BITS)
+#define STATS_MAX_EXP   32    // Durations from 2^32 us (~71 minutes) land in the last bucket
+#define STATS_BUCKETS   ((STATS_MAX_EXP - STATS_SUB_BITS + 1) * STATS_SUB_COUNT)
+
+#define STATS_MAGIC   0x53505247u    // "GRPS"
+#define STATS_VERSION 2u
+
+// The file has room for more phases than there are, so adding one keeps the recorded history
+#define STATS_MAX_PHASES      32
+#define STATS_PHASE_NAME_SIZE 32
+
+typedef struct {
+    _Atomic uint64_t count;
+    _Atomic uint64_t sum_us;
+    _Atomic uint64_t max_us;
+    _Atomic uint64_t buckets[STATS_BUCKETS];
+} Histogram;
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    // The file is recreated if these don't match the ones this binary was built with
+    uint32_t modes, compositors, imgtypes, phases, buckets;
+    uint32_t _pad;
+    // The phase of each slot of histograms, in the order they were first recorded. Slots are only
+    // added, while the file is locked.
+    char phase_names[STATS_MAX_PHASES][STATS_PHASE_NAME_SIZE];
+} StatsHeader;
+
+// The phases are the names of the spans recorded by `trace_begin()`, every one must be listed
+static const char *phases[] = {
+    "start",            "parse_args",       "output_detection", "make_dir",         "output_format",
+    "compositor_query", "selection",        "wait",             "capture",          "dedup",
+    "encode",           "clipboard",        "notify",           "prewarm",          "budget",
+    "freeze",           "thumbnails",       "redact",           "reference",        "compare",
+    "diff_boxes",       "batch_parse",
+};
+
+#define STATS_PHASES array_len(phases)
+
+// `mode2str()` is meant for humans, these match the names of the subcommands
+static const char *mode_slug[MODE_COUNT] = {
+    [MODE_FULL]          = "full",
+    [MODE_REGION]        = "region",
+    [MODE_LAST_REGION]   = "last-region",
+    [MODE_ACTIVE_WINDOW] = "active-window",
+    [MODE_CUSTOM]        = "custom",
+    [MODE_HISTORY]       = "history",
+    [MODE_WINDOW]        = "window",
+    [MODE_DIFF]          = "diff",
+    [MODE_BATCH]         = "batch",
+    [MODE_TEST]          = "test",
+};
+
+#define STATS_HISTOGRAMS ((size_t)MODE_COUNT * COMP_COUNT * IMGTYPE_COUNT * STATS_MAX_PHASES)
+#define STATS_FILE_SIZE  (sizeof(StatsHeader) + STATS_HISTOGRAMS * sizeof(Histogram))
+
+typedef struct {
+    StatsHeader *header;
+    Histogram   *histograms;
+} Stats;
+
+static size_t histogram_index(Mode mode, Compositor compositor, Imgtype imgtype, size_t slot) {
+    return (((size_t)mode * COMP_COUNT + compositor) * IMGTYPE_COUNT + imgtype) * STATS_MAX_PHASES +
+           slot;
+}
+
+static size_t bucket_index(uint64_t us) {
+    if (us < STATS_SUB_COUNT) return (size_t)us;
+    size_t exp = 63 - (size_t)__builtin_clzll(us);
+    if (exp >= STATS_MAX_EXP) return STATS_BUCKETS - 1;
+    size_t sub = (size_t)(us >> (exp - STATS_SUB_BITS)) & (STATS_SUB_COUNT - 1);
+    return (exp - STATS_SUB_BITS + 1) * STATS_SUB_COUNT + sub;
+}
+
+// The middle of the range of values that fall into `bucket`
+static double bucket_value(size_t bucket) {
+    if (bucket < STATS_SUB_COUNT) return (double)bucket;
+    size_t   exp   = bucket / STATS_SUB_COUNT + STATS_SUB_BITS - 1;
+    size_t   sub   = bucket % STATS_SUB_COUNT;
+    uint64_t width = (uint64_t)1 << (exp - STATS_SUB_BITS);
+    uint64_t low   = (STATS_SUB_COUNT + sub) * width;
+    return (double)low + (double)(width - 1) / 2.0;
+}
+
+static bool stats_header_valid(const StatsHeader *header) {
+    return header->magic == STATS_MAGIC && header->version == STATS_VERSION &&
+           header->modes == MODE_COUNT && header->compositors == COMP_COUNT &&
+           header->imgtypes == IMGTYPE_COUNT && header->phases == STATS_MAX_PHASES &&
+           header->buckets == STATS_BUCKETS;
+}
+
+// Returns the slot of `phase` in the file, STATS_MAX_PHASES if it has none
+static size_t stats_phase_slot(const Stats *stats, const char *phase) {
+    for (size_t slot = 0; slot < STATS_MAX_PHASES; ++slot) {
+        const char *name = stats->header->phase_names[slot];
+        if (name[0] == '\0') break;
+        if (strncmp(name, phase, STATS_PHASE_NAME_SIZE) == 0) return slot;
+    }
+    return STATS_MAX_PHASES;
+}
+
+// Gives a slot to every phase the file doesn't have yet, the file must be locked
+static void stats_register_phases(Stats *stats) {
+    size_t used = 0;
+    while (used < STATS_MAX_PHASES && stats->header->phase_names[used][0] != '\0') ++used;
+    for (size_t p = 0; p < STATS_PHASES && used < STATS_MAX_PHASES; ++p) {
+        if (stats_phase_slot(stats, phases[p]) != STATS_MAX_PHASES) continue;
+        snprintf(stats->header->phase_names[used++], STATS_PHASE_NAME_SIZE, "%s", phases[p]);
+    }
+}
+
+// True if `path` is no longer the file `fd` is open on
+static bool stats_replaced(int fd, const char *path) {
+    struct stat opened, current;
+    return fstat(fd, &opened) != 0 || stat(path, &current) != 0 ||
+           opened.st_dev != current.st_dev || opened.st_ino != current.st_ino;
+}
+
+// Replaces the file at `path` with an empty one, returns it opened and locked or -1.
+// Other processes may have the old file mapped, so it is never truncated in place.
+static int stats_create(const char *path) {
+    char *tmp_path = alloc_strf("%s.tmp", path).cstr;
+    int   fd       = open(tmp_path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1) {
+        eprintf("Failed to open %s: %s\n", tmp_path, strerror(errno));
+        return -1;
+    }
+    StatsHeader header = {
+        .magic       = STATS_MAGIC,
+        .version     = STATS_VERSION,
+        .modes       = MODE_COUNT,
+        .compositors = COMP_COUNT,
+        .imgtypes    = IMGTYPE_COUNT,
+        .phases      = STATS_MAX_PHASES,
+        .buckets     = STATS_BUCKETS,
+    };
+    if (flock(fd, LOCK_EX) != 0 || ftruncate(fd, (off_t)STATS_FILE_SIZE) != 0 ||
+        pwrite(fd, &header, sizeof(header), 0) != sizeof(header) || rename(tmp_path, path) != 0) {
+        eprintf("Failed to initialise %s: %s\n", path, strerror(errno));
+        close(fd);
+        unlink(tmp_path);
+        return -1;
+    }
+    return fd;
+}
+
+// Maps the stats file, creating it if `create` is set
+static bool stats_open(Stats *stats, bool create) {
+    bool result = true;
+    int  fd     = -1;
+
+    char *path = state_path(STATS_FNAME);
+    if (path == NULL) return false;
+    if (create && !make_parent_dirs(path)) return false;
+
+    // Only the initialisation is locked, the histograms themselves are updated with atomics.
+    // The file may have been replaced while waiting for the lock, then the new one is locked.
+    while (true) {
+        fd = open(path, create ? O_RDWR | O_CREAT : O_RDWR, 0644);
+        if (fd == -1) {
+            if (create || errno != ENOENT) {
+                eprintf("Failed to open %s: %s\n", path, strerror(errno));
+            }
+            return_defer(false);
+        }
+        if (flock(fd, LOCK_EX) != 0) return_defer(false);
+        if (!stats_replaced(fd, path)) break;
+        close(fd);
+    }
+    struct stat s;
+    if (fstat(fd, &s) != 0) return_defer(false);
+
+    StatsHeader header = { 0 };
+    if ((size_t)s.st_size == STATS_FILE_SIZE) {
+        if (pread(fd, &header, sizeof(header), 0) != sizeof(header)) return_defer(false);
+    }
+    if (!stats_header_valid(&header)) {
+        if (!create) return_defer(false);
+        // Start over if the file is from an incompatible version
+        int new_fd = stats_create(path);
+        if (new_fd == -1) return_defer(false);
+        close(fd);
+        fd = new_fd;
+    }
+
+    void *map = mmap(NULL, STATS_FILE_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+        eprintf("Failed to map %s: %s\n", path, strerror(errno));
+        return_defer(false);
+    }
+    stats->header     = map;
+    stats->histograms = (Histogram *)((char *)map + sizeof(StatsHeader));
+    if (create) stats_register_phases(stats);
+
+defer:
+    if (fd != -1) close(fd);    // Also releases the lock
+    return result;
+}
+
+static void stats_close(Stats *stats) {
+    munmap(stats->header, STATS_FILE_SIZE);
+}
+
+static void histogram_add(Histogram *h, uint64_t us) {
+    atomic_fetch_add_explicit(&h->buckets[bucket_index(us)], 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&h->sum_us, us, memory_order_relaxed);
+    uint64_t max = atomic_load_explicit(&h->max_us, memory_order_relaxed);
+    while (us > max && !atomic_compare_exchange_weak_explicit(
+                           &h->max_us, &max, us, memory_order_relaxed, memory_order_relaxed)) {}
+    atomic_fetch_add_explicit(&h->count, 1, memory_order_release);
+}
+
+// Returns the value at `quantile` (0-1) in microseconds
+static double histogram_quantile(const Histogram *h, uint64_t count, double quantile) {
+    uint64_t rank = (uint64_t)(quantile * (double)count + 0.5);
+    if (rank == 0) rank = 1;
+    double   max  = (double)atomic_load_explicit(&h->max_us, memory_order_relaxed);
+    uint64_t seen = 0;
+    for (size_t i = 0; i < STATS_BUCKETS; ++i) {
+        seen += atomic_load_explicit(&h->buckets[i], memory_order_relaxed);
+        if (seen >= rank) return bucket_value(i) < max ? bucket_value(i) : max;
+    }
+    return max;
+}
+
+static size_t phase_index(const char *name) {
+    for (size_t p = 0; p < STATS_PHASES; ++p) {
+        if (streq(name, phases[p])) return p;
+    }
+    return STATS_PHASES;
+}
+
+bool stats_record(void) {
+    bool  result = true;
+    Stats stats;
+    if (!stats_open(&stats, true)) return false;
+
+    // A phase can be entered more than once (e.g. `make_dir`), those are added up
+    uint64_t durations[STATS_PHASES] = { 0 };
+    bool     seen[STATS_PHASES]      = { 0 };
+    for (size_t i = 0; i < trace_span_count(); ++i) {
+        const TraceSpan *span = trace_span(i);
+        if (!streq(span->cat, "phase") || span->end_us == 0) continue;
+        size_t p = phase_index(span->name);
+        if (p == STATS_PHASES) {
+            eprintf("Phase `%s` is missing from the stats, it is not recorded\n", span->name);
+            result = false;
+            continue;
+        }
+        durations[p] += span->end_us - span->begin_us;
+        seen[p] = true;
+    }
+
+    for (size_t p = 0; p < STATS_PHASES; ++p) {
+        if (!seen[p]) continue;
+        size_t slot = stats_phase_slot(&stats, phases[p]);
+        if (slot == STATS_MAX_PHASES) {
+            eprintf("No room left for phase `%s` in the stats file\n", phases[p]);
+            result = false;
+            continue;
+        }
+        size_t i = histogram_index(g_config->mode, g_config->compositor, g_config->imgtype, slot);
+        histogram_add(&stats.histograms[i], durations[p]);
+    }
+
+    stats_close(&stats);
+    return result;
+}
+
+// Calls `fn` for every histogram that has something in it
+#define stats_foreach(stats, fn, ...)                                                              \
+    do {                                                                                           \
+        for (size_t m = 0; m < MODE_COUNT; ++m)                                                    \
+            for (size_t c = 0; c < COMP_COUNT; ++c)                                                \
+                for (size_t t = 1; t < IMGTYPE_COUNT; ++t)                                         \
+                    for (size_t p = 0; p < STATS_MAX_PHASES; ++p) {                                \
+                        const Histogram *h = &(stats)->histograms[histogram_index(                 \
+                            (Mode)m, (Compositor)c, (Imgtype)t, p)];                               \
+                        uint64_t count = atomic_load_explicit(&h->count, memory_order_acquire);    \
+                        if (count == 0) continue;                                                  \
+                        const char *phase = (stats)->header->phase_names[p];                       \
+                        fn(h, count, (Mode)m, (Compositor)c, (Imgtype)t, phase, __VA_ARGS__);      \
+                    }                                                                              \
+    } while (0)
+
+static void print_histogram(const Histogram *h,
+                            uint64_t         count,
+                            Mode             mode,
+                            Compositor       compositor,
+                            Imgtype          imgtype,
+                            const char      *phase,
+                            FILE            *stream) {
+    fprintf(stream,
+            "%-14s %-14s %-8s %-17s %8llu %10.2f %10.2f %10.2f %10.2f\n",
+            mode_slug[mode],
+            compositor2str(compositor),
+            imgtype2str(imgtype),
+            phase,
+            (unsigned long long)count,
+            histogram_quantile(h, count, 0.50) / 1e3,
+            histogram_quantile(h, count, 0.95) / 1e3,
+            histogram_quantile(h, count, 0.99) / 1e3,
+            (double)atomic_load_explicit(&h->max_us, memory_order_relaxed) / 1e3);
+}
+
+bool stats_print(void) {
+    Stats stats;
+    if (!stats_open(&stats, false)) {
+        printf("No stats recorded yet\n");
+        return true;
+    }
+
+    printf("%-14s %-14s %-8s %-17s %8s %10s %10s %10s %10s\n",
+           "mode",
+           "compositor",
+           "type",
+           "phase",
+           "count",
+           "p50 ms",
+           "p95 ms",
+           "p99 ms",
+           "max ms");
+    stats_foreach(&stats, print_histogram, stdout);
+
+    stats_close(&stats);
+    return true;
+}
+
+static void write_openmetrics_histogram(const Histogram *h,
+                                        uint64_t         count,
+                                        Mode             mode,
+                                        Compositor       compositor,
+                                        Imgtype          imgtype,
+                                        const char      *phase,
+                                        FILE            *file) {
+    static const double quantiles[] = { 0.5, 0.95, 0.99 };
+    char                labels[256];
+    snprintf(labels,
+             sizeof(labels),
+             "mode=\"%s\",compositor=\"%s\",imgtype=\"%s\",phase=\"%s\"",
+             mode_slug[mode],
+             compositor2str(compositor),
+             imgtype2str(imgtype),
+             phase);
+
+    for (size_t i = 0; i < array_len(quantiles); ++i) {
+        fprintf(file,
+                "gripper_phase_duration_seconds{%s,quantile=\"%g\"} %.6f\n",
+                labels,
+                quantiles[i],
+                histogram_quantile(h, count, quantiles[i]) / 1e6);
+    }
+    fprintf(file,
+            "gripper_phase_duration_seconds_sum{%s} %.6f\n",
+            labels,
+            (double)atomic_load_explicit(&h->sum_us, memory_order_relaxed) / 1e6);
+    fprintf(file,
+            "gripper_phase_duration_seconds_count{%s} %llu\n",
+            labels,
+            (unsigned long long)count);
+}
+
+bool stats_write_openmetrics(const char *path) {
+    bool  result = true;
+    FILE *file   = NULL;
+    Stats stats  = { 0 };
+
+    if (!stats_open(&stats, false)) {
+        eprintf("No stats recorded yet\n");
+        return false;
+    }
+
+    // The collector may read the file at any moment, so it is replaced in one go
+    char *tmp_path = alloc_strf("%s.tmp", path).cstr;
+    file           = fopen(tmp_path, "w");
+    if (file == NULL) {
+        eprintf("Failed to open %s: %s\n", tmp_path, strerror(errno));
+        return_defer(false);
+    }
+
+    fprintf(file, "# TYPE gripper_phase_duration_seconds summary\n");
+    fprintf(file, "# UNIT gripper_phase_duration_seconds seconds\n");
+    fprintf(file,
+            "# HELP gripper_phase_duration_seconds Time spent in each phase of a screenshot.\n");
+    stats_foreach(&stats, write_openmetrics_histogram, file);
+    fprintf(file, "# EOF\n");
+
+    if (ferror(file) != 0) {
+        eprintf("Failed to write %s\n", tmp_path);
+        return_defer(false);
+    }
+    if (fclose(file) != 0) {
+        file = NULL;
+        eprintf("Failed to write %s\n", tmp_path);
+        return_defer(false);
+    }
+    file = NULL;
+    if (rename(tmp_path, path) != 0) {
+        eprintf("Failed to rename %s to %s: %s\n", tmp_path, path, strerror(errno));
+        return_defer(false);
+    }
+
+defer:
+    if (file != NULL) fclose(file);
+    stats_close(&stats);
+    return result;
+}
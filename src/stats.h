@@ -0,0 +1,17 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdbool.h>
+
+#define STATS_FNAME "stats"
+
+// Adds the duration of each phase traced in this run to the persistent histograms
+bool stats_record(void);
+
+// Prints p50/p95/p99 of every phase that has been recorded
+bool stats_print(void);
+
+// Writes the histograms in OpenMetrics text format for the node_exporter textfile collector
+bool stats_write_openmetrics(const char *path);
+
+#endif /* ifndef STATS_H */
@@ -0,0 +1,543 @@
+/* Copyright 2024 Bintang Adiputra Pratama <bintangadiputrapratama@gmail.com>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of this software and
+associated documentation files (the “Software”), to deal in the Software without restriction,
+including without limitation the rights to use, copy, modify, merge, publish, distribute,
+sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all copies or substantial
+portions of the Software.
+
+THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT
+NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES
+OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#ifndef TASKPLUS_H__
+#define TASKPLUS_H__
+
+/* #define TASKPLUS_IMPLEMENTATION */
+/* The implementation uses POSIX threads and sysconf(), the file that defines
+ * TASKPLUS_IMPLEMENTATION needs `_DEFAULT_SOURCE` or `_POSIX_C_SOURCE` before any include. */
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#ifndef _TASKPLUS_ASSERT
+#include <assert.h>
+#define _TASKPLUS_ASSERT assert
+#endif
+
+/***********
+ * POOL
+ ***********/
+
+/* Tasks a worker can queue for itself, a power of two. A task spawned into a full queue is run
+ * right away by the thread spawning it. */
+#ifndef TP_DEQUE_SIZE
+#define TP_DEQUE_SIZE 1024
+#endif
+
+/* Tasks other threads can queue for a worker, the same goes when it is full. */
+#ifndef TP_INBOX_SIZE
+#define TP_INBOX_SIZE 256
+#endif
+
+/* Upper bound of the threads of a pool. */
+#ifndef TP_THREADS_MAX
+#define TP_THREADS_MAX 64
+#endif
+
+/* Lets `tp_spawn_on` queue a task for whichever thread gets to it first. */
+#define TP_ANY_WORKER ((size_t)-1)
+
+typedef struct tp_Pool tp_Pool;
+
+typedef void (*tp_TaskFn)(void *arg);
+/* Works on the items in [begin, end) of a `tp_parallel_for`. */
+typedef void (*tp_RangeFn)(void *ctx, size_t begin, size_t end);
+
+/* Tasks that are waited for together. */
+typedef struct {
+    _Atomic size_t pending;    // Tasks spawned in the group that did not finish yet
+} tp_Group;
+
+/* Describes the pool `tp_pool_new` creates. */
+typedef struct {
+    // Threads that run the tasks, counting the one waiting for them. 0 for one per core.
+    size_t threads;
+    // Called by each worker thread when it starts and before it exits, with its index and `ctx`.
+    // This is where the state of a thread, like its arena, is set up and freed.
+    void (*on_start)(size_t worker, void *ctx);
+    void (*on_exit)(size_t worker, void *ctx);
+    void *ctx;
+} tp_PoolDesc;
+
+/* Creates a new group with no tasks. */
+#define tp_group_new()                                                                             \
+    (tp_Group) {                                                                                   \
+        0                                                                                          \
+    }
+
+/* Starts the worker threads of a new pool. The workers block every signal, so the handlers keep
+ * running in the threads of the program. Returns NULL if the pool could not be allocated. A pool
+ * whose threads could not all be started works with the ones that did. */
+tp_Pool *tp_pool_new(const tp_PoolDesc *desc);
+/* Runs the tasks left, then stops the workers and frees the pool. */
+void tp_pool_free(tp_Pool *pool);
+/* The threads that run the tasks of `pool`, counting the one waiting for them. */
+size_t tp_pool_threads(const tp_Pool *pool);
+/* The index of the calling thread in `pool`, from 1 to `tp_pool_threads() - 1` in its workers.
+ * Every other thread is 0, a thread that waits for a group helps as worker 0.
+ * Per-thread state of the tasks, like their scratch arenas, can be looked up with it. */
+size_t tp_worker_index(const tp_Pool *pool);
+
+/* Queues `fn(arg)` in `group`. A worker queues it for itself, where the other threads can steal it
+ * from, and any other thread queues it for whichever worker is free. */
+void tp_spawn(tp_Pool *pool, tp_Group *group, tp_TaskFn fn, void *arg);
+/* Queues `fn(arg)` in `group` for the worker `worker` of `pool`, modulo its threads, or for any
+ * of them with TP_ANY_WORKER. The worker is only a hint: a task that waits too long is stolen. */
+void tp_spawn_on(tp_Pool *pool, tp_Group *group, size_t worker, tp_TaskFn fn, void *arg);
+/* Waits until the tasks of `group` are done. The calling thread runs queued tasks meanwhile, so
+ * tasks can wait for the groups they spawn. */
+void tp_group_wait(tp_Pool *pool, tp_Group *group);
+
+/* Calls `fn` on ranges of at most `grain` items that cover [begin, end), on every thread of `pool`
+ * including the calling one, and waits for all of them. With a `grain` of 0, each thread gets a
+ * few ranges so the ones that start late still get their share. */
+void tp_parallel_for(tp_Pool   *pool,
+                     size_t     begin,
+                     size_t     end,
+                     size_t     grain,
+                     tp_RangeFn fn,
+                     void      *ctx);
+
+/* Every function takes a NULL pool too, which runs the tasks in the calling thread right away. */
+
+/***********
+ * END OF POOL
+ ***********/
+
+/***********
+ * IMPLEMENTATION
+ ***********/
+#ifdef TASKPLUS_IMPLEMENTATION
+
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+_Static_assert((TP_DEQUE_SIZE & (TP_DEQUE_SIZE - 1)) == 0, "TP_DEQUE_SIZE is a power of two");
+
+/* Idle workers look for tasks this many times before they sleep. */
+#define TP_SPINS 32
+
+typedef struct {
+    tp_TaskFn fn;
+    void     *arg;
+    tp_Group *group;
+} tp_Task;
+
+/* A task in a deque. A thief may read it while the owner writes it, so every field is atomic. */
+typedef struct {
+    _Atomic(tp_TaskFn) fn;
+    _Atomic(void *) arg;
+    _Atomic(tp_Group *) group;
+} tp_Slot;
+
+/* Chase-Lev deque: its owner pushes and pops tasks at the bottom, thieves steal them at the top. */
+typedef struct {
+    _Alignas(64) _Atomic int64_t top;
+    _Alignas(64) _Atomic int64_t bottom;
+    tp_Slot slots[TP_DEQUE_SIZE];
+} tp_Deque;
+
+/* Tasks other threads queued for a worker, oldest first. */
+typedef struct {
+    pthread_mutex_t lock;
+    _Atomic size_t  count;    // Read without the lock to skip empty inboxes
+    size_t          head;
+    tp_Task         tasks[TP_INBOX_SIZE];
+} tp_Inbox;
+
+typedef struct {
+    tp_Pool  *pool;
+    size_t    index;
+    pthread_t thread;
+    tp_Deque  deque;
+    tp_Inbox  inbox;
+} tp_Worker;
+
+struct tp_Pool {
+    tp_PoolDesc     desc;
+    _Atomic size_t  threads;
+    tp_Worker      *workers;     // workers[0] stands for the other threads, it only has an inbox
+    _Atomic size_t  queued;      // Tasks in the deques and inboxes
+    _Atomic size_t  sleepers;    // Workers sleeping until a task is queued
+    _Atomic size_t  waiters;     // Threads sleeping until a group is done
+    _Atomic bool    stop;
+    pthread_mutex_t lock;
+    pthread_cond_t  wake;        // Signalled when a task is queued and workers sleep
+    pthread_cond_t  done;        // Broadcast when a group is done and threads wait for one
+};
+
+static _Thread_local tp_Worker *tp_self_;    // The worker the calling thread is, if any
+static _Thread_local uint64_t   tp_seed_;    // Picks the workers to steal from
+
+static bool tp_deque_push_(tp_Deque *self, const tp_Task *task) {
+    int64_t bottom = atomic_load_explicit(&self->bottom, memory_order_relaxed);
+    int64_t top    = atomic_load_explicit(&self->top, memory_order_acquire);
+    if (bottom - top >= TP_DEQUE_SIZE) return false;
+
+    tp_Slot *slot = &self->slots[(uint64_t)bottom & (TP_DEQUE_SIZE - 1)];
+    atomic_store_explicit(&slot->fn, task->fn, memory_order_relaxed);
+    atomic_store_explicit(&slot->arg, task->arg, memory_order_relaxed);
+    atomic_store_explicit(&slot->group, task->group, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    atomic_store_explicit(&self->bottom, bottom + 1, memory_order_relaxed);
+    return true;
+}
+
+static void tp_slot_read_(tp_Slot *slot, tp_Task *task) {
+    task->fn    = atomic_load_explicit(&slot->fn, memory_order_relaxed);
+    task->arg   = atomic_load_explicit(&slot->arg, memory_order_relaxed);
+    task->group = atomic_load_explicit(&slot->group, memory_order_relaxed);
+}
+
+static bool tp_deque_pop_(tp_Deque *self, tp_Task *task) {
+    int64_t bottom = atomic_load_explicit(&self->bottom, memory_order_relaxed) - 1;
+    atomic_store_explicit(&self->bottom, bottom, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+    int64_t top = atomic_load_explicit(&self->top, memory_order_relaxed);
+    if (top > bottom) {
+        atomic_store_explicit(&self->bottom, bottom + 1, memory_order_relaxed);
+        return false;
+    }
+
+    tp_slot_read_(&self->slots[(uint64_t)bottom & (TP_DEQUE_SIZE - 1)], task);
+    if (top < bottom) return true;
+    // The last task, a thief may be taking it too
+    bool won = atomic_compare_exchange_strong_explicit(&self->top,
+                                                       &top,
+                                                       top + 1,
+                                                       memory_order_seq_cst,
+                                                       memory_order_relaxed);
+    atomic_store_explicit(&self->bottom, bottom + 1, memory_order_relaxed);
+    return won;
+}
+
+static bool tp_deque_steal_(tp_Deque *self, tp_Task *task) {
+    int64_t top = atomic_load_explicit(&self->top, memory_order_acquire);
+    atomic_thread_fence(memory_order_seq_cst);
+    int64_t bottom = atomic_load_explicit(&self->bottom, memory_order_acquire);
+    if (top >= bottom) return false;
+
+    // Only used if no other thread took it meanwhile, the owner can't overwrite it before that
+    tp_slot_read_(&self->slots[(uint64_t)top & (TP_DEQUE_SIZE - 1)], task);
+    return atomic_compare_exchange_strong_explicit(&self->top,
+                                                   &top,
+                                                   top + 1,
+                                                   memory_order_seq_cst,
+                                                   memory_order_relaxed);
+}
+
+static bool tp_inbox_push_(tp_Inbox *self, const tp_Task *task) {
+    pthread_mutex_lock(&self->lock);
+    size_t count = atomic_load_explicit(&self->count, memory_order_relaxed);
+    bool   room  = count < TP_INBOX_SIZE;
+    if (room) {
+        self->tasks[(self->head + count) % TP_INBOX_SIZE] = *task;
+        atomic_store_explicit(&self->count, count + 1, memory_order_relaxed);
+    }
+    pthread_mutex_unlock(&self->lock);
+    return room;
+}
+
+static bool tp_inbox_pop_(tp_Inbox *self, tp_Task *task) {
+    if (atomic_load_explicit(&self->count, memory_order_relaxed) == 0) return false;
+    pthread_mutex_lock(&self->lock);
+    size_t count = atomic_load_explicit(&self->count, memory_order_relaxed);
+    if (count > 0) {
+        *task      = self->tasks[self->head];
+        self->head = (self->head + 1) % TP_INBOX_SIZE;
+        atomic_store_explicit(&self->count, count - 1, memory_order_relaxed);
+    }
+    pthread_mutex_unlock(&self->lock);
+    return count > 0;
+}
+
+static uint64_t tp_random_(void) {
+    if (tp_seed_ == 0) tp_seed_ = (uint64_t)(uintptr_t)&tp_seed_ | 1;
+    // xorshift64
+    tp_seed_ ^= tp_seed_ << 13;
+    tp_seed_ ^= tp_seed_ >> 7;
+    tp_seed_ ^= tp_seed_ << 17;
+    return tp_seed_;
+}
+
+/* The worker the calling thread is in `pool`, NULL if it is not one of them. */
+static tp_Worker *tp_self_in_(const tp_Pool *pool) {
+    return tp_self_ != NULL && tp_self_->pool == pool ? tp_self_ : NULL;
+}
+
+/* Takes a task for `self`, or for a thread outside the pool if it is NULL: its own newest one
+ * first, which is likely still in the cache, then the oldest ones of the others. */
+static bool tp_take_(tp_Pool *pool, tp_Worker *self, tp_Task *task) {
+    size_t threads = atomic_load_explicit(&pool->threads, memory_order_relaxed);
+    bool   found   = self != NULL && (tp_deque_pop_(&self->deque, task) ||
+                                    tp_inbox_pop_(&self->inbox, task));
+    // The victims are tried from a random one, so the thieves don't all rob the same worker
+    size_t start = (size_t)(tp_random_() % threads);
+    for (size_t i = 0; !found && i < threads; ++i) {
+        tp_Worker *victim = &pool->workers[(start + i) % threads];
+        found             = victim != self && tp_deque_steal_(&victim->deque, task);
+    }
+    for (size_t i = 0; !found && i < threads; ++i) {
+        tp_Worker *victim = &pool->workers[(start + i) % threads];
+        found             = victim != self && tp_inbox_pop_(&victim->inbox, task);
+    }
+    if (found) atomic_fetch_sub(&pool->queued, 1);
+    return found;
+}
+
+static void tp_run_(tp_Pool *pool, const tp_Task *task) {
+    task->fn(task->arg);
+    // The group may be gone as soon as it is done, it is not touched after that
+    if (atomic_fetch_sub(&task->group->pending, 1) == 1 && atomic_load(&pool->waiters) > 0) {
+        pthread_mutex_lock(&pool->lock);
+        pthread_cond_broadcast(&pool->done);
+        pthread_mutex_unlock(&pool->lock);
+    }
+}
+
+static void *tp_worker_run_(void *arg) {
+    tp_Worker *self = arg;
+    tp_Pool   *pool = self->pool;
+    tp_self_        = self;
+    if (pool->desc.on_start != NULL) pool->desc.on_start(self->index, pool->desc.ctx);
+
+    tp_Task task;
+    size_t  spins = 0;
+    while (true) {
+        if (tp_take_(pool, self, &task)) {
+            tp_run_(pool, &task);
+            spins = 0;
+            continue;
+        }
+        if (++spins < TP_SPINS) {
+            sched_yield();
+            continue;
+        }
+
+        // Whoever queues a task sees this one sleeping, or this one sees the task
+        pthread_mutex_lock(&pool->lock);
+        atomic_fetch_add(&pool->sleepers, 1);
+        while (atomic_load(&pool->queued) == 0 && !atomic_load(&pool->stop)) {
+            pthread_cond_wait(&pool->wake, &pool->lock);
+        }
+        atomic_fetch_sub(&pool->sleepers, 1);
+        bool stop = atomic_load(&pool->queued) == 0 && atomic_load(&pool->stop);
+        pthread_mutex_unlock(&pool->lock);
+        if (stop) break;
+        spins = 0;
+    }
+
+    if (pool->desc.on_exit != NULL) pool->desc.on_exit(self->index, pool->desc.ctx);
+    return NULL;
+}
+
+tp_Pool *tp_pool_new(const tp_PoolDesc *desc) {
+    size_t threads = desc->threads;
+    if (threads == 0) {
+        long cores = sysconf(_SC_NPROCESSORS_ONLN);
+        threads    = cores < 1 ? 1 : (size_t)cores;
+    }
+    threads = threads < TP_THREADS_MAX ? threads : TP_THREADS_MAX;
+
+    tp_Pool *pool = calloc(1, sizeof(*pool));
+    if (pool == NULL) return NULL;
+    pool->workers = aligned_alloc(_Alignof(tp_Worker), threads * sizeof(tp_Worker));
+    if (pool->workers == NULL) {
+        free(pool);
+        return NULL;
+    }
+    pool->desc = *desc;
+    atomic_init(&pool->threads, 1);
+    atomic_init(&pool->queued, 0);
+    atomic_init(&pool->sleepers, 0);
+    atomic_init(&pool->waiters, 0);
+    atomic_init(&pool->stop, false);
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->wake, NULL);
+    pthread_cond_init(&pool->done, NULL);
+    for (size_t i = 0; i < threads; ++i) {
+        tp_Worker *worker = &pool->workers[i];
+        memset(worker, 0, sizeof(*worker));
+        worker->pool  = pool;
+        worker->index = i;
+        atomic_init(&worker->deque.top, 0);
+        atomic_init(&worker->deque.bottom, 0);
+        atomic_init(&worker->inbox.count, 0);
+        pthread_mutex_init(&worker->inbox.lock, NULL);
+    }
+
+    // The workers inherit the signal mask of the thread that starts them
+    sigset_t all, old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    for (size_t i = 1; i < threads; ++i) {
+        tp_Worker *worker = &pool->workers[i];
+        if (pthread_create(&worker->thread, NULL, tp_worker_run_, worker) != 0) break;
+        atomic_store(&pool->threads, i + 1);
+    }
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    return pool;
+}
+
+void tp_pool_free(tp_Pool *pool) {
+    if (pool == NULL) return;
+    pthread_mutex_lock(&pool->lock);
+    atomic_store(&pool->stop, true);
+    pthread_cond_broadcast(&pool->wake);
+    pthread_mutex_unlock(&pool->lock);
+
+    size_t threads = atomic_load(&pool->threads);
+    for (size_t i = 1; i < threads; ++i) pthread_join(pool->workers[i].thread, NULL);
+    for (size_t i = 0; i < threads; ++i) pthread_mutex_destroy(&pool->workers[i].inbox.lock);
+    pthread_cond_destroy(&pool->done);
+    pthread_cond_destroy(&pool->wake);
+    pthread_mutex_destroy(&pool->lock);
+    free(pool->workers);
+    free(pool);
+}
+
+size_t tp_pool_threads(const tp_Pool *pool) {
+    return pool == NULL ? 1 : atomic_load_explicit(&pool->threads, memory_order_relaxed);
+}
+
+size_t tp_worker_index(const tp_Pool *pool) {
+    tp_Worker *self = tp_self_in_(pool);
+    return self == NULL ? 0 : self->index;
+}
+
+void tp_spawn(tp_Pool *pool, tp_Group *group, tp_TaskFn fn, void *arg) {
+    tp_spawn_on(pool, group, TP_ANY_WORKER, fn, arg);
+}
+
+void tp_spawn_on(tp_Pool *pool, tp_Group *group, size_t worker, tp_TaskFn fn, void *arg) {
+    _TASKPLUS_ASSERT(group != NULL && "tasks are spawned in a group");
+    size_t threads = tp_pool_threads(pool);
+    if (threads == 1) {
+        fn(arg);
+        return;
+    }
+
+    tp_Task    task = { fn, arg, group };
+    tp_Worker *self = tp_self_in_(pool);
+    if (worker == TP_ANY_WORKER) worker = self == NULL ? 0 : self->index;
+    worker %= threads;
+
+    // Counted first, so it is never taken before it is counted
+    atomic_fetch_add(&group->pending, 1);
+    atomic_fetch_add(&pool->queued, 1);
+    bool queued = self != NULL && worker == self->index
+                      ? tp_deque_push_(&self->deque, &task)
+                      : tp_inbox_push_(&pool->workers[worker].inbox, &task);
+    if (!queued) {
+        atomic_fetch_sub(&pool->queued, 1);
+        tp_run_(pool, &task);
+        return;
+    }
+    if (atomic_load(&pool->sleepers) > 0) {
+        pthread_mutex_lock(&pool->lock);
+        pthread_cond_signal(&pool->wake);
+        pthread_mutex_unlock(&pool->lock);
+    }
+}
+
+void tp_group_wait(tp_Pool *pool, tp_Group *group) {
+    if (pool == NULL) return;
+    tp_Worker *self = tp_self_in_(pool);
+    tp_Task    task;
+    while (atomic_load(&group->pending) > 0) {
+        if (tp_take_(pool, self, &task)) {
+            tp_run_(pool, &task);
+            continue;
+        }
+        // Nothing to run: the last tasks of the group are running in other threads
+        pthread_mutex_lock(&pool->lock);
+        atomic_fetch_add(&pool->waiters, 1);
+        while (atomic_load(&group->pending) > 0 && atomic_load(&pool->queued) == 0) {
+            pthread_cond_wait(&pool->done, &pool->lock);
+        }
+        atomic_fetch_sub(&pool->waiters, 1);
+        pthread_mutex_unlock(&pool->lock);
+    }
+}
+
+typedef struct {
+    tp_RangeFn     fn;
+    void          *ctx;
+    size_t         begin, end;
+    size_t         grain;
+    size_t         chunks;
+    _Atomic size_t next;    // The next chunk to take
+} tp_Range_;
+
+static void tp_range_run_(void *arg) {
+    tp_Range_ *range = arg;
+    for (size_t i = atomic_fetch_add(&range->next, 1); i < range->chunks;
+         i        = atomic_fetch_add(&range->next, 1)) {
+        size_t begin = range->begin + i * range->grain;
+        size_t end   = range->end - begin < range->grain ? range->end : begin + range->grain;
+        range->fn(range->ctx, begin, end);
+    }
+}
+
+void tp_parallel_for(tp_Pool   *pool,
+                     size_t     begin,
+                     size_t     end,
+                     size_t     grain,
+                     tp_RangeFn fn,
+                     void      *ctx) {
+    if (begin >= end) return;
+    size_t count   = end - begin;
+    size_t threads = tp_pool_threads(pool);
+    if (grain == 0) grain = (count + threads * 4 - 1) / (threads * 4);
+
+    tp_Range_ range = {
+        .fn     = fn,
+        .ctx    = ctx,
+        .begin  = begin,
+        .end    = end,
+        .grain  = grain,
+        .chunks = (count - 1) / grain + 1,
+    };
+    atomic_init(&range.next, 0);
+
+    // A task per other thread takes chunks until none is left, so a thread that is busy with
+    // something else leaves its share to the others
+    tp_Group group   = tp_group_new();
+    size_t   self    = tp_worker_index(pool);
+    size_t   helpers = (range.chunks < threads ? range.chunks : threads) - 1;
+    for (size_t i = 1; i <= helpers; ++i) {
+        tp_spawn_on(pool, &group, (self + i) % threads, tp_range_run_, &range);
+    }
+    tp_range_run_(&range);
+    tp_group_wait(pool, &group);
+}
+
+#endif /* ifdef TASKPLUS_IMPLEMENTATION */
+/***********
+ * END OF IMPLEMENTATION
+ ***********/
+
+#endif /* ifndef TASKPLUS_H__ */
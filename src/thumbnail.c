@@ -0,0 +1,166 @@
+#define _DEFAULT_SOURCE
+
+#include "thumbnail.h"
+#include "encode.h"
+#include "hash.h"
+#include "png.h"
+#include "prog.h"
+#include "trace.h"
+#include "utils.h"
+#include <ctype.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static const struct {
+    const char *dir;
+    uint32_t    size;
+} sizes[THUMBNAIL_COUNT] = {
+    [THUMBNAIL_NORMAL]  = { "normal", 128 },
+    [THUMBNAIL_LARGE]   = { "large", 256 },
+    [THUMBNAIL_X_LARGE] = { "x-large", 512 },
+};
+
+// Fits `width`x`height` in a square of `size` with the same aspect ratio, images are never enlarged
+static void fit(uint32_t width, uint32_t height, uint32_t size, uint32_t *w, uint32_t *h) {
+    if (width <= size && height <= size) {
+        *w = width;
+        *h = height;
+    } else if (width >= height) {
+        *w = size;
+        *h = (uint32_t)(((uint64_t)height * size + width / 2) / width);
+    } else {
+        *h = size;
+        *w = (uint32_t)(((uint64_t)width * size + height / 2) / height);
+    }
+    if (*w == 0) *w = 1;
+    if (*h == 0) *h = 1;
+}
+
+static void downscale(void *arg) {
+    ThumbnailJob *job = arg;
+    // Each size is made from the next bigger one, so the whole frame is only read once
+    const PixelBuffer *src = &job->frame;
+    for (size_t i = THUMBNAIL_COUNT; i-- > 0;) {
+        pixfmt_downscale(src, &job->scaled[i], job->sums);
+        src = &job->scaled[i];
+    }
+}
+
+void thumbnail_start(ThumbnailJob *job, const PixelBuffer *frame) {
+    job->frame = *frame;
+    job->sums  = mp_allocator_alloc(g_alloc, (size_t)frame->width * 3 * sizeof(*job->sums));
+    for (size_t i = 0; i < THUMBNAIL_COUNT; ++i) {
+        uint32_t width, height;
+        fit(frame->width, frame->height, sizes[i].size, &width, &height);
+        job->scaled[i] = (PixelBuffer){
+            .data   = mp_allocator_alloc(g_alloc, (size_t)width * 3 * height),
+            .width  = width,
+            .height = height,
+            .stride = (size_t)width * 3,
+            .format = PIXFMT_RGB,
+        };
+    }
+
+    job->group = tp_group_new();
+    tp_spawn(thread_pool(), &job->group, downscale, job);
+}
+
+// The URI the spec names thumbnails after. Only the characters GLib escapes are escaped, so the
+// names are the ones file managers look for.
+static char *file_uri(const char *path) {
+    mp_StringBuilder uri = mp_string_builder_new(g_alloc);
+    mp_string_builder_append(&uri, "file://");
+    for (const unsigned char *c = (const unsigned char *)path; *c != '\0'; ++c) {
+        if (isalnum(*c) || strchr("!$&'()*+,-./:=@_~", *c) != NULL) {
+            mp_string_builder_append_n(&uri, (const char *)c, 1);
+        } else {
+            mp_string_builder_appendf(&uri, "%%%02X", *c);
+        }
+    }
+    return mp_string_builder_to_string(&uri).cstr;
+}
+
+// Writes `image` to a temporary file next to `path` and renames it, so a file manager never reads
+// half a thumbnail. mkstemp() creates it readable only by the user, as the spec asks.
+static bool thumbnail_write(const PixelBuffer *image,
+                            const char        *path,
+                            const PngText     *text,
+                            size_t             text_count) {
+    char *tmp_path = alloc_strf("%s.XXXXXX", path).cstr;
+    int   fd       = mkstemp(tmp_path);
+    if (fd == -1) {
+        eprintf("Failed to create %s: %s\n", tmp_path, strerror(errno));
+        return false;
+    }
+    EncodeOutput output = encode_output_new(g_alloc, fd);
+    png_encode_fast(image, DEFLATE_LEVEL_FAST, text, text_count, &output);
+    encode_output_flush(&output, true);
+    bool ok = !output.failed;
+    ok      = close(fd) == 0 && ok;
+    if (ok && rename(tmp_path, path) != 0) ok = false;
+    if (!ok) {
+        eprintf("Failed to write %s: %s\n", path, strerror(errno));
+        unlink(tmp_path);
+    }
+    return ok;
+}
+
+bool thumbnail_finish(ThumbnailJob *job, const char *path) {
+    tp_group_wait(thread_pool(), &job->group);
+    if (path == NULL) return true;
+
+    int    result     = true;
+    char  *abs_path   = NULL;
+    size_t span_thumb = trace_begin("thumbnails");
+
+    abs_path = realpath(path, NULL);
+    struct stat s;
+    if (abs_path == NULL || stat(abs_path, &s) != 0) {
+        eprintf("Failed to stat %s: %s\n", path, strerror(errno));
+        return_defer(false);
+    }
+
+    const char *uri = file_uri(abs_path);
+    uint8_t     digest[MD5_SIZE];
+    md5(uri, strlen(uri), digest);
+    char name[MD5_SIZE * 2 + 1];
+    for (size_t i = 0; i < MD5_SIZE; ++i) snprintf(name + i * 2, 3, "%02x", digest[i]);
+
+    PngText text[] = {
+        { "Thumb::URI", uri },
+        { "Thumb::MTime", alloc_strf("%lld", (long long)s.st_mtime).cstr },
+        { "Thumb::Size", alloc_strf("%lld", (long long)s.st_size).cstr },
+        { "Thumb::Image::Width", alloc_strf("%u", job->frame.width).cstr },
+        { "Thumb::Image::Height", alloc_strf("%u", job->frame.height).cstr },
+        { "Software", alloc_strf("%s %s", g_config->prog_name, g_config->prog_version).cstr },
+    };
+
+    // The spec wants the directories private, the parents are created like any other
+    char *thumbnails_dir = alloc_strf("%s/thumbnails", g_config->cache_dir).cstr;
+    if (!make_parent_dirs(thumbnails_dir)) return_defer(false);
+    if (mkdir(thumbnails_dir, 0700) != 0 && errno != EEXIST) {
+        eprintf("Failed to create directory \"%s\": %s\n", thumbnails_dir, strerror(errno));
+        return_defer(false);
+    }
+    for (size_t i = 0; i < THUMBNAIL_COUNT; ++i) {
+        char *dir = alloc_strf("%s/%s", thumbnails_dir, sizes[i].dir).cstr;
+        if (mkdir(dir, 0700) != 0 && errno != EEXIST) {
+            eprintf("Failed to create directory \"%s\": %s\n", dir, strerror(errno));
+            return_defer(false);
+        }
+        char *thumbnail_path = alloc_strf("%s/%s.png", dir, name).cstr;
+        if (!thumbnail_write(&job->scaled[i], thumbnail_path, text, array_len(text))) {
+            return_defer(false);
+        }
+    }
+    if (g_config->verbose) printf("Thumbnails saved as %s.png\n", name);
+
+defer:
+    trace_end(span_thumb);
+    free(abs_path);
+    return result;
+}
@@ -0,0 +1,32 @@
+#ifndef THUMBNAIL_H
+#define THUMBNAIL_H
+
+#include "pixfmt.h"
+#include "taskplus.h"
+#include <stdbool.h>
+
+// The sizes of the freedesktop thumbnail spec, named after their directory
+typedef enum {
+    THUMBNAIL_NORMAL,     // 128x128
+    THUMBNAIL_LARGE,      // 256x256
+    THUMBNAIL_X_LARGE,    // 512x512
+    THUMBNAIL_COUNT,
+} ThumbnailSize;
+
+// Downscales a frame into every thumbnail size in a task of the pool
+typedef struct {
+    PixelBuffer frame;                       // In the caller's memory, until `thumbnail_finish()`
+    PixelBuffer scaled[THUMBNAIL_COUNT];
+    uint32_t   *sums;                        // Scratch memory of the box filter
+    tp_Group    group;
+} ThumbnailJob;
+
+// Starts downscaling `frame`, which must be PIXFMT_RGB and stay valid until `thumbnail_finish()`.
+// All the memory is allocated here, the task only reads `frame` and writes the thumbnails.
+void thumbnail_start(ThumbnailJob *job, const PixelBuffer *frame);
+// Waits for the task, then writes the thumbnails of `path` to `$XDG_CACHE_HOME/thumbnails`.
+// `path` is the image the frame was saved to, with its final modification time. With a NULL
+// `path`, only waits.
+bool thumbnail_finish(ThumbnailJob *job, const char *path);
+
+#endif /* ifndef THUMBNAIL_H */
@@ -0,0 +1,146 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "trace.h"
+#include "utils.h"
+#include <assert.h>
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+// Per thread, so that libgripper contexts on different threads don't share spans
+static _Thread_local TraceSpan spans[TRACE_MAX_SPANS];
+static _Thread_local size_t    span_count;
+static _Thread_local uint64_t  epoch_us;
+static _Thread_local pid_t     self_pid;
+// The names and commands of the process spans. The callers' memory may be reset or reused before
+// the trace is written, as the arena of each group of `batch` is.
+static _Thread_local mp_Arena  strings;
+
+static uint64_t clock_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000u + (uint64_t)ts.tv_nsec / 1000u;
+}
+
+void trace_init(void) {
+    span_count = 0;
+    epoch_us   = clock_us();
+    self_pid   = getpid();
+    mp_arena_restore(&strings, (mp_ArenaMark){ NULL, 0 });
+}
+
+uint64_t trace_now_us(void) {
+    return clock_us() - epoch_us;
+}
+
+static size_t trace_push(TraceSpan span) {
+    if (span_count == TRACE_MAX_SPANS) return TRACE_MAX_SPANS;
+    spans[span_count] = span;
+    return span_count++;
+}
+
+size_t trace_begin(const char *name) {
+    return trace_push((TraceSpan){
+        .name     = name,
+        .cat      = "phase",
+        .begin_us = trace_now_us(),
+        .tid      = self_pid,
+    });
+}
+
+void trace_end(size_t id) {
+    if (id >= span_count) return;
+    uint64_t now = trace_now_us();
+    // Spans are nested, so the ones started after `id` and left open by an early return end too
+    for (size_t i = id; i < span_count; ++i) {
+        if (spans[i].end_us == 0) spans[i].end_us = now;
+    }
+}
+
+void trace_proc(const char *cmd, pid_t pid, uint64_t begin_us, uint64_t end_us) {
+    if (span_count == TRACE_MAX_SPANS) return;
+    // Name the span after the program being run, the full command goes to `detail`
+    mp_Allocator alloc = mp_arena_new_allocator(&strings);
+    size_t       len   = strcspn(cmd, " ");
+    char        *name  = mp_allocator_alloc(&alloc, len + 1);
+    memcpy(name, cmd, len);
+    name[len] = '\0';
+    trace_push((TraceSpan){
+        .name     = name,
+        .cat      = "process",
+        .detail   = mp_allocator_dup(&alloc, (void *)cmd, strlen(cmd) + 1),
+        .begin_us = begin_us,
+        .end_us   = end_us,
+        .tid      = pid,
+    });
+}
+
+size_t trace_span_count(void) {
+    return span_count;
+}
+
+const TraceSpan *trace_span(size_t id) {
+    assert(id < span_count);
+    return &spans[id];
+}
+
+static void write_json_str(FILE *file, const char *str) {
+    fputc('"', file);
+    for (const char *c = str; *c != '\0'; ++c) {
+        switch (*c) {
+            case '"' :  fputs("\\\"", file); break;
+            case '\\' : fputs("\\\\", file); break;
+            case '\n' : fputs("\\n", file); break;
+            case '\t' : fputs("\\t", file); break;
+            default : {
+                if ((unsigned char)*c < 0x20)
+                    fprintf(file, "\\u%04x", *c);
+                else
+                    fputc(*c, file);
+            }
+        }
+    }
+    fputc('"', file);
+}
+
+bool trace_write(const char *path) {
+    FILE *file = fopen(path, "w");
+    if (file == NULL) {
+        eprintf("Failed to open %s: %s\n", path, strerror(errno));
+        return false;
+    }
+
+    uint64_t now = trace_now_us();
+    fprintf(file, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+    fprintf(file,
+            "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,\"args\":{\"name\":\"%s\"}}",
+            (int)self_pid,
+            g_config->prog_name);
+    for (size_t i = 0; i < span_count; ++i) {
+        const TraceSpan *span = &spans[i];
+        uint64_t         end  = (span->end_us == 0) ? now : span->end_us;
+        fprintf(file, ",\n{\"name\":");
+        write_json_str(file, span->name);
+        fprintf(file,
+                ",\"cat\":\"%s\",\"ph\":\"X\",\"ts\":%llu,\"dur\":%llu,\"pid\":%d,\"tid\":%d",
+                span->cat,
+                (unsigned long long)span->begin_us,
+                (unsigned long long)(end - span->begin_us),
+                (int)self_pid,
+                (int)span->tid);
+        if (span->detail != NULL) {
+            fprintf(file, ",\"args\":{\"cmd\":");
+            write_json_str(file, span->detail);
+            fprintf(file, "}");
+        }
+        fprintf(file, "}");
+    }
+    fprintf(file, "\n]}\n");
+
+    bool ok = !ferror(file);
+    if (fclose(file) != 0) ok = false;
+    if (!ok) eprintf("Failed to write %s\n", path);
+    return ok;
+}
@@ -0,0 +1,40 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+// Maximum amount of spans recorded in a single run, the rest are dropped
+#define TRACE_MAX_SPANS 256
+
+typedef struct {
+    const char *name;
+    const char *cat;
+    const char *detail;      // Extra information shown in the trace viewer, may be NULL
+    uint64_t    begin_us;    // Microseconds since `trace_init()`
+    uint64_t    end_us;      // 0 if the span has not ended yet
+    pid_t       tid;         // The track the span is drawn on, child pid for processes
+} TraceSpan;
+
+// Starts the clock. Spans are recorded relative to this moment.
+void trace_init(void);
+
+uint64_t trace_now_us(void);
+
+// Returns an id to pass to `trace_end()`
+size_t trace_begin(const char *name);
+// Also ends the spans that began after `id` and have not ended yet
+void trace_end(size_t id);
+
+// Records the lifetime of a child process
+void trace_proc(const char *cmd, pid_t pid, uint64_t begin_us, uint64_t end_us);
+
+size_t           trace_span_count(void);
+const TraceSpan *trace_span(size_t id);
+
+// Writes the spans in Chrome trace-event format, viewable in Perfetto or chrome://tracing
+bool trace_write(const char *path);
+
+#endif /* ifndef TRACE_H */
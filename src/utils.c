@@ -1,16 +1,24 @@
+#define _GNU_SOURCE
+
 #include "utils.h"
 #include "compositors.h"
 #include "memplus.h"
 #include "prog.h"
+#include "trace.h"
 #include <assert.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
 #include <stdarg.h>
 #include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/wait.h>
 #include <time.h>
@@ -28,22 +36,47 @@ static const char *mode_name[] = {
     [MODE_LAST_REGION]   = "Last Region",
     [MODE_ACTIVE_WINDOW] = "Active Window",
     [MODE_CUSTOM]        = "Custom",
+    [MODE_HISTORY]       = "History",
+    [MODE_WINDOW]        = "Window",
+    [MODE_DIFF]          = "Diff",
+    [MODE_BATCH]         = "Batch",
     [MODE_TEST]          = "Test",
 };
 
 static const char *imgtype_name[IMGTYPE_COUNT] = {
-    [IMGTYPE_NONE] = NULL,      //
-    [IMGTYPE_PNG]  = "png",     //
-    [IMGTYPE_PPM]  = "ppm",     //
-    [IMGTYPE_JPEG] = "jpeg",    //
-    [IMGTYPE_JPG]  = "jpg",     //
+    [IMGTYPE_NONE]     = NULL,          //
+    [IMGTYPE_PNG]      = "png",         //
+    [IMGTYPE_PPM]      = "ppm",         //
+    [IMGTYPE_JPEG]     = "jpeg",        //
+    [IMGTYPE_JPG]      = "jpg",         //
+    [IMGTYPE_QOI]      = "qoi",         //
+    [IMGTYPE_PNG_FAST] = "png-fast",    //
+};
+
+static const char *imgtype_ext[IMGTYPE_COUNT] = {
+    [IMGTYPE_NONE]     = NULL,      //
+    [IMGTYPE_PNG]      = "png",     //
+    [IMGTYPE_PPM]      = "ppm",     //
+    [IMGTYPE_JPEG]     = "jpeg",    //
+    [IMGTYPE_JPG]      = "jpg",     //
+    [IMGTYPE_QOI]      = "qoi",     //
+    [IMGTYPE_PNG_FAST] = "png",     //
+};
+
+static const char *redact_style_name[REDACT_COUNT] = {
+    [REDACT_PIXELATE] = "pixelate",
+    [REDACT_BLUR]     = "blur",
 };
 
 static const char *savemode_name[] = {
-    [SAVEMODE_NONE]                      = "None",
-    [SAVEMODE_DISK]                      = "Disk",
-    [SAVEMODE_CLIPBOARD]                 = "Clipboard",
-    [SAVEMODE_DISK | SAVEMODE_CLIPBOARD] = "Disk & Clipboard",
+    [SAVEMODE_NONE]                                    = "None",
+    [SAVEMODE_DISK]                                    = "Disk",
+    [SAVEMODE_CLIPBOARD]                               = "Clipboard",
+    [SAVEMODE_DISK | SAVEMODE_CLIPBOARD]               = "Disk & Clipboard",
+    [SAVEMODE_FD]                                      = "File descriptor",
+    [SAVEMODE_DISK | SAVEMODE_FD]                      = "Disk & File descriptor",
+    [SAVEMODE_CLIPBOARD | SAVEMODE_FD]                 = "Clipboard & File descriptor",
+    [SAVEMODE_DISK | SAVEMODE_CLIPBOARD | SAVEMODE_FD] = "Disk, Clipboard & File descriptor",
 };
 
 bool command_found(const char *command) {
@@ -53,6 +86,20 @@ bool command_found(const char *command) {
     return !ret;
 }
 
+char *shell_quote(const char *str) {
+    mp_StringBuilder builder = mp_string_builder_new(g_alloc);
+    mp_string_builder_append(&builder, "'");
+    for (const char *p = str; *p != '\0'; ++p) {
+        if (*p == '\'') {
+            mp_string_builder_append(&builder, "'\\''");
+        } else {
+            mp_string_builder_append_n(&builder, p, 1);
+        }
+    }
+    mp_string_builder_append(&builder, "'");
+    return mp_string_builder_to_string(&builder).cstr;
+}
+
 const char *compositor2str(Compositor compositor) {
     assert(compositor != COMP_COUNT);
     return compositor_name[compositor];
@@ -64,6 +111,11 @@ const char *imgtype2str(Imgtype imgtype) {
     return imgtype_name[imgtype];
 }
 
+const char *imgtype2ext(Imgtype imgtype) {
+    assert(!(imgtype == IMGTYPE_COUNT || imgtype == IMGTYPE_NONE));
+    return imgtype_ext[imgtype];
+}
+
 void imgtype_remap(Config *config) {
     // grim only accepts `jpeg`
     if (config->imgtype == IMGTYPE_JPG) config->imgtype = IMGTYPE_JPEG;
@@ -73,7 +125,52 @@ const char *mode2str(Mode mode) {
     return mode_name[mode];
 }
 
+// SIGPIPE is blocked on a thread while it has a command pipe open: a command that exits early
+// closes the pipe, and that is reported by its exit status instead. The handler is process-wide
+// and belongs to whatever embeds libgripper, so it is never changed.
+static _Thread_local size_t   sigpipe_depth;
+static _Thread_local bool     sigpipe_was_blocked;
+static _Thread_local bool     sigpipe_was_pending;
+
+static void sigpipe_block(void) {
+    if (sigpipe_depth++ > 0) return;
+    sigset_t set, old, pending;
+    sigemptyset(&set);
+    sigaddset(&set, SIGPIPE);
+    pthread_sigmask(SIG_BLOCK, &set, &old);
+    sigpending(&pending);
+    sigpipe_was_blocked = sigismember(&old, SIGPIPE) == 1;
+    sigpipe_was_pending = sigismember(&pending, SIGPIPE) == 1;
+}
+
+static void sigpipe_unblock(void) {
+    assert(sigpipe_depth > 0);
+    if (--sigpipe_depth > 0) return;
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGPIPE);
+    // Drop the SIGPIPEs raised by writes to the pipes, one that was pending already isn't ours
+    if (!sigpipe_was_pending) {
+        struct timespec zero = { 0 };
+        while (sigtimedwait(&set, NULL, &zero) == SIGPIPE) {}
+    }
+    if (!sigpipe_was_blocked) pthread_sigmask(SIG_UNBLOCK, &set, NULL);
+}
+
+// The commands are started with SIGPIPE as it was before any pipe was opened
+static void sigpipe_reset_child(void) {
+    if (sigpipe_depth == 0 || sigpipe_was_blocked) return;
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGPIPE);
+    pthread_sigmask(SIG_UNBLOCK, &set, NULL);
+}
+
 ssize_t run_cmd(const char *cmd, char *buf, size_t nbytes) {
+    return run_cmd_fd(cmd, buf, nbytes, -1);
+}
+
+ssize_t run_cmd_fd(const char *cmd, char *buf, size_t nbytes, int fd) {
     ssize_t result = -1;
 
     int pipe_fd[2];
@@ -92,11 +189,15 @@ ssize_t run_cmd(const char *cmd, char *buf, size_t nbytes) {
         write_pipe = pipe_fd[1];
     }
 
-    pid_t pid = fork();
+    uint64_t begin_us = trace_now_us();
+    pid_t    pid      = fork();
     if (pid == -1) {
         eprintf("run_cmd: Failed to fork child process: %s\n", strerror(errno));
         return_defer(-1);
     } else if (pid == 0) {
+        sigpipe_reset_child();
+        // Only changes the file descriptor of this child
+        if (fd != -1) fcntl(fd, F_SETFD, 0);
         if (buf != NULL) {
             close(read_pipe);
             dup2(write_pipe, STDOUT_FILENO);
@@ -108,14 +209,20 @@ ssize_t run_cmd(const char *cmd, char *buf, size_t nbytes) {
         }
         close(dev_null);
         execl("/bin/sh", "sh", "-c", cmd, (char *)NULL);
-        eprintf("run_cmd: Failed not run `%s`: %s\n", cmd, strerror(errno));
-        exit(EXIT_FAILURE);
+        // stderr is /dev/null already, and the atexit handlers and stdio buffers are the parent's
+        _exit(127);
     } else {
+        // Otherwise reading a command that wrote nothing would wait for this end to be closed
+        if (write_pipe != -1) {
+            close(write_pipe);
+            write_pipe = -1;
+        }
         int status;
         if (waitpid(pid, &status, 0) == -1) {
             eprintf("run_cmd: `%s` could not terminate: %s\n", cmd, strerror(errno));
             return_defer(-1);
         }
+        trace_proc(cmd, pid, begin_us, trace_now_us());
 
         if (WIFEXITED(status) && WEXITSTATUS(status) != 0) return_defer(-1);
 
@@ -142,6 +249,8 @@ const char *savemode2str(SaveMode save_mode) {
 }
 
 Compositor str2compositor(const char *str) {
+    // `XDG_CURRENT_DESKTOP` is not set outside of a graphical session (e.g. cron jobs)
+    if (str == NULL) return COMP_NONE;
     for (uint32_t i = 0; i < COMP_COUNT; ++i) {
         if (streq(str, compositor_name[i])) return i;
     }
@@ -155,6 +264,25 @@ Imgtype str2imgtype(const char *str) {
     return IMGTYPE_NONE;
 }
 
+RedactStyle str2redactstyle(const char *str) {
+    for (uint32_t i = 0; i < REDACT_COUNT; ++i) {
+        if (streq(str, redact_style_name[i])) return i;
+    }
+    return REDACT_COUNT;
+}
+
+const char *redactstyle2str(RedactStyle style) {
+    assert(style != REDACT_COUNT);
+    return redact_style_name[style];
+}
+
+Imgtype ext2imgtype(const char *ext) {
+    for (uint32_t i = 1; i < IMGTYPE_COUNT; ++i) {
+        if (streq(ext, imgtype_ext[i])) return i;
+    }
+    return IMGTYPE_NONE;
+}
+
 bool verify_geometry(const char *geometry) {
     char *cmd = alloc_strf("grim -t jpeg -q 0 -g '%s' - >/dev/null", geometry).cstr;
     if (run_cmd(cmd, NULL, 0) == -1) {
@@ -273,7 +401,7 @@ bool parse_output_format(Config *config) {
     time_t     now_time = time(NULL);
     struct tm *now      = localtime(&now_time);
 
-    const char *ext = imgtype2str(g_config->imgtype);
+    const char *ext = imgtype2ext(g_config->imgtype);
 
     char  *buf     = mp_allocator_alloc(g_alloc, BUF_SIZE);
     size_t written = 0;
@@ -363,3 +491,301 @@ bool parse_output_format(Config *config) {
 
 #undef BUF_SIZE
 }
+
+char *state_path(const char *name) {
+    const char *state_dir = getenv("XDG_STATE_HOME");
+    if (state_dir != NULL) return alloc_strf("%s/gripper/%s", state_dir, name).cstr;
+    const char *home_dir = getenv("HOME");
+    if (home_dir == NULL) return NULL;
+    return alloc_strf("%s/.local/state/gripper/%s", home_dir, name).cstr;
+}
+
+bool make_parent_dirs(const char *path) {
+    char *buf = mp_string_new(g_alloc, path).cstr;
+    for (char *slash = strchr(buf + 1, '/'); slash != NULL; slash = strchr(slash + 1, '/')) {
+        *slash = '\0';
+        if (mkdir(buf, 0755) != 0 && errno != EEXIST) {
+            eprintf("Failed to create directory \"%s\": %s\n", buf, strerror(errno));
+            return false;
+        }
+        *slash = '/';
+    }
+    return true;
+}
+
+bool run_cmd_capture(const char *cmd, mp_StringBuilder *out) {
+    bool result   = true;
+    int  pipe_fd[2];
+    int  dev_null = open("/dev/null", O_WRONLY);
+    assert(dev_null != -1);
+
+    if (pipe(pipe_fd) == -1) {
+        eprintf("run_cmd: Failed to create pipes: %s\n", strerror(errno));
+        close(dev_null);
+        return false;
+    }
+
+    uint64_t begin_us = trace_now_us();
+    pid_t    pid      = fork();
+    if (pid == -1) {
+        eprintf("run_cmd: Failed to fork child process: %s\n", strerror(errno));
+        close(pipe_fd[0]);
+        close(pipe_fd[1]);
+        return_defer(false);
+    } else if (pid == 0) {
+        sigpipe_reset_child();
+        close(pipe_fd[0]);
+        dup2(pipe_fd[1], STDOUT_FILENO);
+        dup2(dev_null, STDERR_FILENO);
+        close(pipe_fd[1]);
+        close(dev_null);
+        execl("/bin/sh", "sh", "-c", cmd, (char *)NULL);
+        _exit(127);
+    }
+
+    // Read while the command runs, it would block forever once the pipe is full otherwise
+    close(pipe_fd[1]);
+    ssize_t bytes;
+    do {
+        mp_string_builder_reserve(out, 64 * 1024);
+        bytes = read(pipe_fd[0], out->data + out->size, out->capacity - out->size - 1);
+        if (bytes > 0) out->size += (size_t)bytes;
+    } while (bytes > 0 || (bytes == -1 && errno == EINTR));
+    close(pipe_fd[0]);
+
+    int status;
+    if (waitpid(pid, &status, 0) == -1) {
+        eprintf("run_cmd: `%s` could not terminate: %s\n", cmd, strerror(errno));
+        return_defer(false);
+    }
+    trace_proc(cmd, pid, begin_us, trace_now_us());
+    if (bytes == -1 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) return_defer(false);
+
+defer:
+    close(dev_null);
+    return result;
+}
+
+bool cmd_pipe_open(CmdPipe *self, const char *cmd, CmdPipeEnd end) {
+    int pipe_fd[2];
+    int dev_null = open("/dev/null", O_WRONLY);
+    assert(dev_null != -1);
+
+    if (pipe(pipe_fd) == -1) {
+        eprintf("run_cmd: Failed to create pipes: %s\n", strerror(errno));
+        close(dev_null);
+        return false;
+    }
+
+    self->cmd      = cmd;
+    self->begin_us = trace_now_us();
+    self->pid      = fork();
+    if (self->pid == -1) {
+        eprintf("run_cmd: Failed to fork child process: %s\n", strerror(errno));
+        close(pipe_fd[0]);
+        close(pipe_fd[1]);
+        close(dev_null);
+        return false;
+    } else if (self->pid == 0) {
+        sigpipe_reset_child();
+        bool stdin_end = end == CMD_PIPE_STDIN;
+        close(pipe_fd[stdin_end ? 1 : 0]);
+        dup2(pipe_fd[stdin_end ? 0 : 1], stdin_end ? STDIN_FILENO : STDOUT_FILENO);
+        if (stdin_end) dup2(dev_null, STDOUT_FILENO);
+        dup2(dev_null, STDERR_FILENO);
+        close(pipe_fd[stdin_end ? 0 : 1]);
+        close(dev_null);
+        execl("/bin/sh", "sh", "-c", cmd, (char *)NULL);
+        _exit(127);
+    }
+
+    close(pipe_fd[end == CMD_PIPE_STDIN ? 0 : 1]);
+    close(dev_null);
+    self->fd = pipe_fd[end == CMD_PIPE_STDIN ? 1 : 0];
+    sigpipe_block();
+    return true;
+}
+
+bool cmd_pipe_close(CmdPipe *self) {
+    close(self->fd);
+    sigpipe_unblock();
+
+    int status;
+    if (waitpid(self->pid, &status, 0) == -1) {
+        eprintf("run_cmd: `%s` could not terminate: %s\n", self->cmd, strerror(errno));
+        return false;
+    }
+    trace_proc(self->cmd, self->pid, self->begin_us, trace_now_us());
+    return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+bool cmd_pipe_read(CmdPipe *self, mp_StringBuilder *out) {
+    ssize_t bytes = 0;
+    while (out != NULL) {
+        mp_string_builder_reserve(out, 4096);
+        bytes = read(self->fd, out->data + out->size, out->capacity - out->size - 1);
+        if (bytes > 0) {
+            out->size += (size_t)bytes;
+        } else if (bytes == 0 || errno != EINTR) {
+            break;
+        }
+    }
+    bool ok = cmd_pipe_close(self);
+    if (out != NULL) out->data[out->size] = '\0';
+    return ok && bytes == 0;
+}
+
+bool run_cmd_input(const char *cmd, const void *data, size_t size) {
+    CmdPipe pipe;
+    if (!cmd_pipe_open(&pipe, cmd, CMD_PIPE_STDIN)) return false;
+    bool written = write_all(pipe.fd, data, size);
+    return cmd_pipe_close(&pipe) && written;
+}
+
+bool write_all(int fd, const void *data, size_t size) {
+    const char *p = data;
+    while (size > 0) {
+        ssize_t written = write(fd, p, size);
+        if (written == -1) {
+            if (errno == EINTR) continue;
+            return false;
+        }
+        p += written;
+        size -= (size_t)written;
+    }
+    return true;
+}
+
+bool write_file(const char *path, const void *data, size_t size) {
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (fd == -1) {
+        eprintf("Failed to open %s: %s\n", path, strerror(errno));
+        return false;
+    }
+    if (!write_all(fd, data, size)) {
+        eprintf("Failed to write to %s: %s\n", path, strerror(errno));
+        close(fd);
+        return false;
+    }
+    if (close(fd) != 0) {
+        eprintf("Failed to write to %s: %s\n", path, strerror(errno));
+        return false;
+    }
+    return true;
+}
+
+char *save_destination(bool quote_path) {
+    const char *parts[3];
+    size_t      count = 0;
+    if (g_config->save_mode & SAVEMODE_DISK) {
+        parts[count++] = quote_path ? alloc_strf("\"%s\"", g_config->output_path).cstr
+                                    : g_config->output_path;
+    }
+    if (g_config->save_mode & SAVEMODE_CLIPBOARD) parts[count++] = "clipboard";
+    if (g_config->save_mode & SAVEMODE_FD) {
+        if (g_config->output_stdout) {
+            parts[count++] = "stdout";
+        } else if (g_config->memfd_socket != -1) {
+            parts[count++] = "memfd";
+        } else {
+            parts[count++] = alloc_strf("file descriptor %d", g_config->output_fd).cstr;
+        }
+    }
+
+    mp_StringBuilder builder = mp_string_builder_new(g_alloc);
+    for (size_t i = 0; i < count; ++i) {
+        if (i > 0) mp_string_builder_append(&builder, i + 1 == count ? " and " : ", ");
+        mp_string_builder_append(&builder, parts[i]);
+    }
+    return mp_string_builder_to_string(&builder).cstr;
+}
+
+bool copy_file_to_fd(const char *path, int fd) {
+    int file = open(path, O_RDONLY);
+    if (file == -1) {
+        eprintf("Failed to open %s: %s\n", path, strerror(errno));
+        return false;
+    }
+    // The kernel copies the file straight from the page cache
+    ssize_t copied;
+    do {
+        copied = sendfile(fd, file, NULL, 1 << 30);
+    } while (copied > 0 || (copied == -1 && errno == EINTR));
+    if (copied == -1) eprintf("Failed to copy %s: %s\n", path, strerror(errno));
+    close(file);
+    return copied == 0;
+}
+
+int memfd_output(void) {
+    // Close-on-exec, a wl-copy that daemonises would keep the screenshot alive otherwise
+    int fd = memfd_create("gripper-screenshot", MFD_ALLOW_SEALING | MFD_CLOEXEC);
+    if (fd == -1) eprintf("Failed to create a memfd: %s\n", strerror(errno));
+    return fd;
+}
+
+int memfd_input(const void *data, size_t size) {
+    int fd = memfd_create("gripper-input", MFD_CLOEXEC);
+    if (fd == -1) return -1;
+    if (!write_all(fd, data, size) || lseek(fd, 0, SEEK_SET) == -1) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+bool memfd_send(int socket, int memfd, const void *data, size_t size) {
+    // The receiver gets a file that can only be read, from the start
+    int seals = F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL;
+    if (fcntl(memfd, F_ADD_SEALS, seals) == -1 || lseek(memfd, 0, SEEK_SET) == -1) return false;
+
+    char byte = 0;    // At least one byte of data has to carry the file descriptor
+    union {
+        char           buf[CMSG_SPACE(sizeof(int))];
+        struct cmsghdr align;
+    } control;
+    struct iovec iov = {
+        .iov_base = size > 0 ? (void *)data : &byte,
+        .iov_len  = size > 0 ? size : 1,
+    };
+    struct msghdr msg = {
+        .msg_iov        = &iov,
+        .msg_iovlen     = 1,
+        .msg_control    = control.buf,
+        .msg_controllen = sizeof(control.buf),
+    };
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level     = SOL_SOCKET;
+    cmsg->cmsg_type      = SCM_RIGHTS;
+    cmsg->cmsg_len       = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &memfd, sizeof(int));
+
+    ssize_t sent;
+    do {
+        sent = sendmsg(socket, &msg, MSG_NOSIGNAL);
+    } while (sent == -1 && errno == EINTR);
+    return sent != -1;
+}
+
+static tp_Pool       *pool;
+static pthread_once_t pool_once = PTHREAD_ONCE_INIT;
+
+// The tasks keep their scratch memory in the arena of their thread
+static void pool_thread_exit(size_t worker, void *ctx) {
+    (void)worker;
+    (void)ctx;
+    mp_thread_arena_free();
+}
+
+static void pool_free(void) {
+    tp_pool_free(pool);
+}
+
+static void pool_init(void) {
+    pool = tp_pool_new(&(tp_PoolDesc){ .on_exit = pool_thread_exit });
+    if (pool != NULL) atexit(pool_free);
+}
+
+tp_Pool *thread_pool(void) {
+    pthread_once(&pool_once, pool_init);
+    return pool;
+}
@@ -2,7 +2,9 @@
 #define UTILS_H
 
 #include "prog.h"
+#include "taskplus.h"
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <string.h>
 #include <sys/types.h>
@@ -30,10 +32,16 @@
 
 bool command_found(const char *command);
 
+// Quotes `str` to be passed to the shell as a single word
+char *shell_quote(const char *str);
+
 const char *compositor2str(Compositor compositor);
 
 const char *imgtype2str(Imgtype imgtype);
 
+// The file extension of `imgtype`, which is not its name for profiles like `png-fast`
+const char *imgtype2ext(Imgtype imgtype);
+
 void imgtype_remap(Config *config);
 
 bool set_current_output_name(Config *config);
@@ -45,6 +53,9 @@ const char *mode2str(Mode mode);
 // Sets `buf` to NULL to discard the output altogether
 //    In this case it returns 0 on success, returns -1 on failure
 ssize_t run_cmd(const char *cmd, char *buf, size_t nbytes);
+// Like `run_cmd()`, but the command inherits `fd` even if it is close-on-exec, so it can redirect
+// from or to it. No other command does. -1 is the same as `run_cmd()`.
+ssize_t run_cmd_fd(const char *cmd, char *buf, size_t nbytes, int fd);
 
 const char *savemode2str(SaveMode save_mode);
 
@@ -52,6 +63,13 @@ Compositor str2compositor(const char *str);
 
 Imgtype str2imgtype(const char *str);
 
+Imgtype ext2imgtype(const char *ext);
+
+// Returns REDACT_COUNT if `str` is not a style
+RedactStyle str2redactstyle(const char *str);
+
+const char *redactstyle2str(RedactStyle style);
+
 void usage(void);
 
 bool verify_geometry(const char *geometry);
@@ -66,4 +84,65 @@ bool containing_dir_exists(const char *path);
 
 bool parse_output_format(Config *config);
 
+// Returns the path to `name` in gripper's directory under `$XDG_STATE_HOME`
+// Returns NULL if neither `$XDG_STATE_HOME` nor `$HOME` is set
+char *state_path(const char *name);
+
+// Creates every missing directory leading up to the file at `path`
+bool make_parent_dirs(const char *path);
+
+// Runs `cmd` and appends everything it writes to stdout to `out`
+// Returns false if the command could not be run or exited with an error
+bool run_cmd_capture(const char *cmd, mp_StringBuilder *out);
+
+typedef enum {
+    CMD_PIPE_STDIN,     // Gripper writes what the command reads
+    CMD_PIPE_STDOUT,    // Gripper reads what the command writes
+} CmdPipeEnd;
+
+// A command started with a pipe to its stdin or stdout, for data that is produced or consumed
+// while it runs
+typedef struct {
+    const char *cmd;
+    pid_t       pid;
+    int         fd;    // Gripper's end of the pipe
+    uint64_t    begin_us;
+} CmdPipe;
+
+bool cmd_pipe_open(CmdPipe *self, const char *cmd, CmdPipeEnd end);
+// Closes the pipe and waits for the command, returns false if it exited with an error
+bool cmd_pipe_close(CmdPipe *self);
+// Reads everything a CMD_PIPE_STDOUT command writes into `out`, then closes it like
+// `cmd_pipe_close()`. With a NULL `out`, only closes it.
+bool cmd_pipe_read(CmdPipe *self, mp_StringBuilder *out);
+
+// Runs `cmd` with `size` bytes of `data` as its stdin
+bool run_cmd_input(const char *cmd, const void *data, size_t size);
+
+// Writes all `size` bytes of `data` to `fd`, returns false with `errno` set if it failed
+bool write_all(int fd, const void *data, size_t size);
+
+// Where the image is saved, like `"path", clipboard and stdout`
+char *save_destination(bool quote_path);
+
+// Copies the whole file at `path` to the end of `fd`
+bool copy_file_to_fd(const char *path, int fd);
+
+// Creates the memfd that `--memfd` sends, returns -1 if it failed. Like `memfd_input()`, it is
+// close-on-exec, a command gets it with `run_cmd_fd()`.
+int  memfd_output(void);
+// Creates a memfd holding `size` bytes of `data`, which a command can read from the start.
+// Returns -1 with `errno` set if it failed.
+int  memfd_input(const void *data, size_t size);
+// Seals `memfd` against any change and sends it over the Unix socket `socket` along with `size`
+// bytes of `data`. Returns false with `errno` set if it failed.
+bool memfd_send(int socket, int memfd, const void *data, size_t size);
+
+// Writes `size` bytes of `data` to `path`, replacing its content
+bool write_file(const char *path, const void *data, size_t size);
+
+// The pool every parallel part of gripper runs its tasks on, with a thread per core. It is started
+// the first time it is needed, and is NULL if it could not be, the tasks then run one at a time.
+tp_Pool *thread_pool(void);
+
 #endif /* ifndef UTILS_H */